@@ -3,6 +3,7 @@
  */
 
 #include "appledouble.h"
+#include "throttle.h"
 #include <fcntl.h>
 #include <stdio.h>
 #include <string.h>
@@ -12,6 +13,7 @@
 #include <limits.h>
 
 #define AS_MAGIC_AD 0x00051607  /* AppleDouble magic number */
+#define AS_VERSION_2 0x00020000
 #define RESOURCE_FORK_ID 2
 #define FINDER_INFO_ID 9
 
@@ -147,12 +149,14 @@ size_t read_appledouble_rsrc_with_crc(const char *filename, int out_fd,
         size_t to_read = remaining < sizeof(buf) ? remaining : sizeof(buf);
         n = read(fd, buf, to_read);
         if (n <= 0) break;
+        throttle_read(n);
 
         /* Calculate CRC if requested */
         if (crc_out && updcrc_fn) {
             crc = updcrc_fn(crc, buf, n);
         }
 
+        throttle_write(n);
         if (write(out_fd, buf, n) != n) {
             close(fd);
             return 0;
@@ -242,3 +246,49 @@ int read_appledouble_metadata(const char *filename, AppleDoubleMetadata *metadat
     close(fd);
     return 0;
 }
+
+static void write_uint32_be(unsigned char *buf, uint32_t value) {
+    buf[0] = value >> 24;
+    buf[1] = value >> 16;
+    buf[2] = value >> 8;
+    buf[3] = value;
+}
+
+int create_appledouble_file(const char *filename, const AppleDoubleMetadata *metadata,
+                            uint32_t rsrcLen, off_t *rsrcOffset) {
+    char path[PATH_MAX];
+    char *fname_copy = strdup(filename);
+    char *dir = dirname(fname_copy);
+    char *fname_copy2 = strdup(filename);
+    char *base = basename(fname_copy2);
+    unsigned char header[26 + 2 * 12 + 32];
+    int fd;
+
+    snprintf(path, sizeof(path), "%s/._%s", dir, base);
+    free(fname_copy);
+    free(fname_copy2);
+
+    /* header, then entries for Finder Info and the resource fork, then Finder Info */
+    memset(header, 0, sizeof(header));
+    write_uint32_be(header, AS_MAGIC_AD);
+    write_uint32_be(header + 4, AS_VERSION_2);
+    header[25] = 2;                                 /* number of entries */
+    write_uint32_be(header + 26, FINDER_INFO_ID);
+    write_uint32_be(header + 30, 50);
+    write_uint32_be(header + 34, 32);
+    write_uint32_be(header + 38, RESOURCE_FORK_ID);
+    write_uint32_be(header + 42, sizeof(header));
+    write_uint32_be(header + 46, rsrcLen);
+    memcpy(header + 50, metadata->type, 4);
+    memcpy(header + 54, metadata->creator, 4);
+    memcpy(header + 58, metadata->flags, 2);
+
+    fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) return -1;
+    if (write(fd, header, sizeof(header)) != sizeof(header)) {
+        close(fd);
+        return -1;
+    }
+    *rsrcOffset = sizeof(header);
+    return fd;
+}
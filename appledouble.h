@@ -8,6 +8,7 @@
 #pragma once
 
 #include <stdint.h>
+#include <sys/types.h>
 #include <stdlib.h>
 
 /* AppleDouble metadata structure - matches Finder info */
@@ -59,3 +60,14 @@ int has_appledouble_sidecar(const char *filename);
  * Returns: size of resource fork, or 0 if not found
  */
 size_t get_appledouble_rsrc_size(const char *filename);
+
+/*
+ * Create an AppleDouble sidecar file (._basename) for the given filename,
+ * holding Finder Info from the metadata (type, creator and flags) and a
+ * resource fork of rsrcLen bytes. The resource fork is left for the caller
+ * to write, starting at *rsrcOffset.
+ *
+ * Returns: a file descriptor open for writing, or -1 on error
+ */
+int create_appledouble_file(const char *filename, const AppleDoubleMetadata *metadata,
+                            uint32_t rsrcLen, off_t *rsrcOffset);
@@ -0,0 +1,293 @@
+/*
+ * binhex.c - BinHex 4.0 (.hqx) decoding support
+ */
+
+#include "binhex.h"
+#include "throttle.h"
+#include "util.h"
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/stat.h>
+
+#define RUNCHAR 0x90    /* run-length encoding marker */
+
+/* the 64 characters used by BinHex 4.0, in order of their 6-bit values */
+static const char hqxChars[] =
+    "!\"#$%&'()*+,-012345689@ABCDEFGHIJKLMNPQRSTUVXYZ[`abcdefhijklmpqr";
+
+/* Decoder state for one BinHex stream */
+struct HqxState {
+    FILE *fs;
+    char *line;             /* line being decoded */
+    size_t cap;
+    const unsigned char *p; /* next character of the line, or NULL for the next line */
+    int started;            /* the opening ':' has been seen */
+    int finished;           /* the closing ':', or the end of the file, has been reached */
+    unsigned int bits;      /* 6-bit accumulator */
+    int nbits;
+    int last;               /* last byte output, for run-length expansion */
+    int repeat;             /* copies of it still to come */
+    size_t hdrLen;
+    int fork;               /* fork being decoded: -1 none yet, 0 data, 1 resource */
+    uint32_t remaining;     /* bytes of it still to come */
+    unsigned short crc;
+    int checked;            /* its CRC has been read: 1 if it matched, -1 if not */
+};
+
+static signed char hqxValue[256];
+static unsigned short ccittTab[256];
+
+static void init_tables(void) {
+    static int initialized;
+    int i, j;
+
+    if (initialized) return;
+    memset(hqxValue, -1, sizeof(hqxValue));
+    for (i = 0; hqxChars[i]; i++) {
+        hqxValue[(unsigned char)hqxChars[i]] = i;
+    }
+    /* CRC-16/XMODEM (polynomial 0x1021), as used by BinHex */
+    for (i = 0; i < 256; i++) {
+        unsigned short c = i << 8;
+        for (j = 0; j < 8; j++) {
+            c = (c & 0x8000) ? (c << 1) ^ 0x1021 : (c << 1);
+        }
+        ccittTab[i] = c;
+    }
+    initialized = 1;
+}
+
+static unsigned short crc_ccitt(unsigned short crc, const unsigned char *p, size_t n) {
+    while (n--) {
+        crc = (crc << 8) ^ ccittTab[((crc >> 8) ^ *p++) & 0xff];
+    }
+    return crc;
+}
+
+/* Strip the line ending and decide whether the line holds encoded data.
+ * Like macbinfilt, a line is considered valid if it has only BinHex
+ * characters and is either longer than 60 characters or contains the
+ * closing ':'. Anything else is Usenet noise.
+ */
+static int valid_line(char *line) {
+    size_t len = strcspn(line, "\r\n");
+    char *p;
+
+    line[len] = 0;
+    if (len == 0) return 0;
+    for (p = line; *p; p++) {
+        if (*p == ':') {
+            if (p == line) continue;    /* opening ':' */
+            return (p[1] == 0);         /* closing ':' */
+        }
+        if (hqxValue[(unsigned char)*p] < 0) return 0;
+    }
+    return (len > 60);
+}
+
+int is_binhex_name(const char *filename) {
+    size_t len = strlen(filename);
+    return (len > 4 && strcasecmp(filename + len - 4, ".hqx") == 0);
+}
+
+
+/* Returns: the next 8-bit value of the encoded data, or -1 at its end */
+static int next_code(struct HqxState *st) {
+    ssize_t len;
+
+    for (;;) {
+        if (st->finished) return -1;
+        if (st->p && *st->p) {
+            if (*st->p == ':') {
+                st->finished = 1;
+                return -1;
+            }
+            st->bits = (st->bits << 6) | hqxValue[*st->p++];
+            st->nbits += 6;
+            if (st->nbits >= 8) {
+                st->nbits -= 8;
+                return (st->bits >> st->nbits) & 0xff;
+            }
+            continue;
+        }
+        if ((len = getline(&st->line, &st->cap, st->fs)) <= 0) {
+            st->finished = 1;
+            return -1;
+        }
+        throttle_read(len);
+        st->p = NULL;
+        if (!valid_line(st->line)) continue;
+        if (!st->started) {
+            /* encoded data begins with a line starting with ':' */
+            if (st->line[0] != ':' || st->line[1] == 0) continue;
+            st->started = 1;
+            st->p = (const unsigned char *)st->line + 1;
+        } else {
+            st->p = (const unsigned char *)st->line;
+        }
+    }
+}
+
+/* Returns: the next byte of the decoded stream, with run-length encoding
+ * expanded, or -1 at its end */
+static int next_byte(struct HqxState *st) {
+    int c, n;
+
+    if (st->repeat > 0) {
+        st->repeat--;
+        return st->last;
+    }
+    for (;;) {
+        if ((c = next_code(st)) < 0) return -1;
+        if (c != RUNCHAR) return st->last = c;
+        if ((n = next_code(st)) < 0) return -1;
+        if (n == 0) return st->last = RUNCHAR;
+        if (n > 1) {
+            st->repeat = n - 2;
+            return st->last;
+        }
+        /* a run of one repeats nothing */
+    }
+}
+
+static void begin_fork(struct HqxState *st, int fork, uint32_t length) {
+    st->fork = fork;
+    st->remaining = length;
+    st->crc = 0;
+    st->checked = 0;
+}
+
+/* Go back to the start of the data fork. Returns: 0, or -1 on error */
+static int rewind_hqx(struct HqxState *st) {
+    size_t i;
+
+    if (fseek(st->fs, 0, SEEK_SET) != 0) return -1;
+    st->p = NULL;
+    st->started = st->finished = 0;
+    st->bits = st->nbits = 0;
+    st->last = st->repeat = 0;
+    st->fork = -1;
+    for (i = 0; i < st->hdrLen; i++) {
+        if (next_byte(st) < 0) return -1;
+    }
+    return 0;
+}
+
+int open_binhex_file(const char *filename, BinHexFile *bh) {
+    struct HqxState *st;
+    unsigned char hdr[1 + 63 + 1 + 4 + 4 + 2 + 4 + 4 + 2];
+    const unsigned char *p;
+    struct stat sb;
+    uint64_t limit;
+    size_t i;
+    int c;
+
+    init_tables();
+    memset(bh, 0, sizeof(*bh));
+    if ((st = calloc(1, sizeof(*st))) == NULL) return -1;
+    bh->st = st;
+    st->fork = -1;
+    if ((st->fs = fopen(filename, "r")) == NULL || fstat(fileno(st->fs), &sb) != 0) {
+        close_binhex_file(bh);
+        return -1;
+    }
+    if ((c = next_byte(st)) < 1 || c > 63) {
+        close_binhex_file(bh);
+        return -1;
+    }
+    hdr[0] = c;
+    st->hdrLen = 1 + c + 1 + 4 + 4 + 2 + 4 + 4 + 2;
+    for (i = 1; i < st->hdrLen; i++) {
+        if ((c = next_byte(st)) < 0) {
+            close_binhex_file(bh);
+            return -1;
+        }
+        hdr[i] = c;
+    }
+    if (crc_ccitt(0, hdr, st->hdrLen-2) != ((hdr[st->hdrLen-2] << 8) | hdr[st->hdrLen-1])) {
+        close_binhex_file(bh);
+        return -1;
+    }
+    p = hdr + 1 + hdr[0];
+    memcpy(bh->name, hdr, 1 + hdr[0]);
+    p++; /* skip version byte */
+    memcpy(bh->type, p, 4);
+    memcpy(bh->creator, p + 4, 4);
+    memcpy(bh->flags, p + 8, 2);
+    bh->dataLen = get4(p + 10);
+    bh->rsrcLen = get4(p + 14);
+
+    /* four characters give three bytes, and two of those a run of up to 254 */
+    limit = (uint64_t)sb.st_size * 3 / 4 * 127 + 1;
+    if (st->hdrLen + (uint64_t)bh->dataLen + 2 + bh->rsrcLen + 2 > limit) {
+        close_binhex_file(bh);
+        return -1;
+    }
+    return 0;
+}
+
+int start_binhex_fork(BinHexFile *bh, int rsrc) {
+    struct HqxState *st = bh->st;
+
+    if (st->fork == 1 || (st->fork == 0 && !rsrc)) {
+        if (rewind_hqx(st) < 0) return -1;
+    }
+    if (rsrc) {
+        if (st->fork < 0) begin_fork(st, 0, bh->dataLen);
+        if (skip_binhex_fork(bh) < 0) return -1;
+    }
+    begin_fork(st, rsrc, rsrc ? bh->rsrcLen : bh->dataLen);
+    return 0;
+}
+
+ssize_t read_binhex_fork(void *ctx, char *buf, size_t len) {
+    struct HqxState *st = ((BinHexFile *)ctx)->st;
+    size_t n = 0;
+    int c, hi, lo;
+
+    while (n < len && st->remaining > 0) {
+        if ((c = next_byte(st)) < 0) {
+            errno = EIO;    /* the encoded data ends early */
+            return -1;
+        }
+        buf[n++] = c;
+        st->remaining--;
+    }
+    if (n > 0) {
+        st->crc = crc_ccitt(st->crc, (unsigned char *)buf, n);
+        return n;
+    }
+    if (st->remaining > 0) return 0;
+    if (!st->checked) {
+        hi = next_byte(st);
+        lo = next_byte(st);
+        st->checked = (hi >= 0 && lo >= 0 && ((hi << 8) | lo) == st->crc) ? 1 : -1;
+    }
+    if (st->checked < 0) {
+        errno = EIO;
+        return -1;
+    }
+    return 0;
+}
+
+int skip_binhex_fork(BinHexFile *bh) {
+    char buf[4096];
+    ssize_t n;
+
+    while ((n = read_binhex_fork(bh, buf, sizeof(buf))) > 0)
+        ;
+    return n;
+}
+
+void close_binhex_file(BinHexFile *bh) {
+    struct HqxState *st = bh->st;
+
+    if (st) {
+        if (st->fs) fclose(st->fs);
+        free(st->line);
+        free(st);
+    }
+    bh->st = NULL;
+}
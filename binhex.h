@@ -0,0 +1,76 @@
+/*
+ * binhex.h - BinHex 4.0 (.hqx) decoding support
+ *
+ * Decodes a BinHex 4.0 file into its Finder metadata, data fork and
+ * resource fork, so that the forks can be archived directly without
+ * writing any decoded files to disk. The forks are decoded as they are
+ * read, so neither is ever held in memory whole.
+ */
+
+#pragma once
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <sys/types.h>
+
+/* A BinHex 4.0 file being decoded */
+typedef struct {
+    unsigned char name[64];  /* File name (a Pascal string, MacRoman) */
+    char type[4];            /* File type (e.g., "TEXT", "APPL") */
+    char creator[4];         /* Creator code (e.g., "KAHL") */
+    char flags[2];           /* Finder flags */
+    uint32_t dataLen;
+    uint32_t rsrcLen;
+    struct HqxState *st;     /* decoder state, private to binhex.c */
+} BinHexFile;
+
+/*
+ * Check whether a file name has the ".hqx" extension.
+ *
+ * Returns: 1 if it does, 0 otherwise
+ */
+int is_binhex_name(const char *filename);
+
+/*
+ * Open a BinHex 4.0 file and decode its header. Lines which are not part
+ * of the encoded data (Usenet headers, signatures, "part N of M" markers
+ * and so on) are skipped, as long as the encoded parts are in order.
+ * The header's CRC is verified, and fork lengths larger than the file
+ * could decode to are refused.
+ *
+ * Returns: 0 on success, -1 if the file is not valid BinHex 4.0
+ * On success, close_binhex_file() must be called.
+ */
+int open_binhex_file(const char *filename, BinHexFile *bh);
+
+/*
+ * Start decoding the data fork, or with rsrc the resource fork. The
+ * resource fork follows the data fork, which is decoded on the way and
+ * its CRC verified; the data fork after the resource fork means decoding
+ * the file again from the start.
+ *
+ * Returns: 0, or -1 if the file is damaged
+ */
+int start_binhex_fork(BinHexFile *bh, int rsrc);
+
+/*
+ * Decode the next part of the fork started; a fork_reader for
+ * encode_fork(), with the BinHexFile as its context.
+ *
+ * Returns: the number of bytes placed in buf, 0 at the end of the fork
+ * once its CRC has been verified, or -1 if the encoded data ends early
+ * or the CRC doesn't match
+ */
+ssize_t read_binhex_fork(void *ctx, char *buf, size_t len);
+
+/*
+ * Decode whatever is left of the fork started, and verify its CRC.
+ *
+ * Returns: 0, or -1 if the file is damaged
+ */
+int skip_binhex_fork(BinHexFile *bh);
+
+/*
+ * Close a file opened by open_binhex_file().
+ */
+void close_binhex_file(BinHexFile *bh);
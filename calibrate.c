@@ -0,0 +1,480 @@
+/*
+ * calibrate.c - fitting the work to the host
+ *
+ * The settings are chosen so that the reader can keep the encoder busy:
+ * while one read waits, the encoder gets through encoderRate * readLatency
+ * bytes, so each buffer holds four times that, and the queue is deep
+ * enough to ride out a read taking eight times as long as usual. Neither
+ * goes below the defaults, which suit local disks. If the buffers of all
+ * the jobs would then take more than the memory budget (an eighth of the
+ * memory sit may use), the depth and then the buffer size are cut back.
+ */
+
+#if defined(__linux__) && !defined(_GNU_SOURCE)
+#define _GNU_SOURCE     /* for sched_getaffinity */
+#endif
+
+#include "calibrate.h"
+#include <sys/stat.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <math.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <limits.h>
+#include <unistd.h>
+#ifdef __linux__
+#include <sched.h>
+#endif
+#include "pipeline.h"
+#include "zopen.h"
+
+#define CACHE_MAX_AGE   (30 * 86400)    /* seconds before measuring again */
+#define ENCODER_SAMPLE  1048576         /* bytes compressed each round */
+#define ENCODER_TIME    0.1             /* seconds spent measuring, at least */
+#define LATENCY_FILES   8               /* files read to measure the latency */
+#define LATENCY_ENTRIES 256             /* folder entries looked at to find them */
+#define MAX_BUFFER      4194304         /* largest buffer chosen */
+#define MAX_DEPTH       64              /* deepest queue chosen */
+
+#define HAVE_ENCODER    1               /* measurements found in the cache */
+#define HAVE_LATENCY    2
+
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* Returns: the first number in a file, or -1 if it has none (e.g. "max") */
+static double read_number(const char *dir, const char *file) {
+    char path[PATH_MAX];
+    double value;
+    FILE *f;
+    int ok;
+
+    snprintf(path, sizeof(path), "%s/%s", dir, file);
+    if ((f = fopen(path, "r")) == NULL) return -1;
+    ok = fscanf(f, "%lf", &value) == 1;
+    fclose(f);
+    return ok ? value : -1;
+}
+
+/*
+ * Find this process's cgroup, for a v1 controller or, if controller is
+ * NULL, in the v2 hierarchy.
+ *
+ * Returns: 0, or -1 if it isn't in one
+ */
+static int own_cgroup(const char *controller, char *path, size_t size) {
+    char line[PATH_MAX + 64], *ids, *list, *p;
+    FILE *f;
+    int found = 0;
+
+    if ((f = fopen("/proc/self/cgroup", "r")) == NULL) return -1;
+    while (!found && fgets(line, sizeof(line), f)) {
+        line[strcspn(line, "\n")] = '\0';
+        if ((ids = strchr(line, ':')) == NULL || (p = strchr(ids + 1, ':')) == NULL) continue;
+        *p++ = '\0';
+        list = ids + 1;
+        if (controller == NULL) {
+            found = strcmp(line, "0") == 0 && *list == '\0';
+        } else {
+            char *c, *save;
+            for (c = strtok_r(list, ",", &save); c && !found; c = strtok_r(NULL, ",", &save)) {
+                found = strcmp(c, controller) == 0;
+            }
+        }
+        if (found) snprintf(path, size, "%s", p);
+    }
+    fclose(f);
+    return found ? 0 : -1;
+}
+
+/*
+ * Read a limit from a cgroup and each of its parents, since a limit on
+ * any of them applies. In a container, the cgroup's own folder may not be
+ * visible, and only those above it are read.
+ *
+ * Returns: the lowest limit, or 0 if there is none
+ */
+static double cgroup_limit(const char *root, const char *cgroup, double (*limit)(const char *dir)) {
+    char dir[PATH_MAX], *slash;
+    double lowest = 0, l;
+
+    snprintf(dir, sizeof(dir), "%s%s", root, strcmp(cgroup, "/") ? cgroup : "");
+    for (;;) {
+        if ((l = limit(dir)) > 0 && (lowest == 0 || l < lowest)) lowest = l;
+        if (strlen(dir) <= strlen(root) || (slash = strrchr(dir, '/')) == NULL) break;
+        *slash = '\0';
+    }
+    return lowest;
+}
+
+static double cpu_max(const char *dir) {            /* v2: "quota period" or "max period" */
+    char path[PATH_MAX];
+    double quota, period;
+    FILE *f;
+    int n;
+
+    snprintf(path, sizeof(path), "%s/cpu.max", dir);
+    if ((f = fopen(path, "r")) == NULL) return 0;
+    n = fscanf(f, "%lf %lf", &quota, &period);
+    fclose(f);
+    return (n == 2 && period > 0) ? quota / period : 0;
+}
+
+static double cfs_quota(const char *dir) {          /* v1: -1 if unlimited */
+    double quota = read_number(dir, "cpu.cfs_quota_us");
+    double period = read_number(dir, "cpu.cfs_period_us");
+    return (quota > 0 && period > 0) ? quota / period : 0;
+}
+
+static double memory_max(const char *dir) {         /* v2: "max" if unlimited */
+    return read_number(dir, "memory.max");
+}
+
+static double memory_limit(const char *dir) {       /* v1: a huge number if unlimited */
+    double l = read_number(dir, "memory.limit_in_bytes");
+    return (l > 0 && l < 4.6e18) ? l : 0;
+}
+
+/* the cgroup limits, 0 where there are none */
+static void cgroup_limits(double *cpus, double *memory) {
+    static const char *cpuRoots[] = {
+        "/sys/fs/cgroup/cpu", "/sys/fs/cgroup/cpu,cpuacct", "/sys/fs/cgroup/cpuacct,cpu"
+    };
+    char cgroup[PATH_MAX];
+    size_t i;
+
+    *cpus = *memory = 0;
+    if (own_cgroup(NULL, cgroup, sizeof(cgroup)) == 0) {
+        *cpus = cgroup_limit("/sys/fs/cgroup", cgroup, cpu_max);
+        *memory = cgroup_limit("/sys/fs/cgroup", cgroup, memory_max);
+    }
+    if (!*cpus && own_cgroup("cpu", cgroup, sizeof(cgroup)) == 0) {
+        for (i = 0; i < sizeof(cpuRoots)/sizeof(cpuRoots[0]) && !*cpus; i++) {
+            *cpus = cgroup_limit(cpuRoots[i], cgroup, cfs_quota);
+        }
+    }
+    if (!*memory && own_cgroup("memory", cgroup, sizeof(cgroup)) == 0) {
+        *memory = cgroup_limit("/sys/fs/cgroup/memory", cgroup, memory_limit);
+    }
+}
+
+static int online_cpus(void) {
+    int n = 0;
+#ifdef __linux__
+    cpu_set_t set;
+    if (sched_getaffinity(0, sizeof(set), &set) == 0) n = CPU_COUNT(&set);
+#endif
+    if (n < 1) n = sysconf(_SC_NPROCESSORS_ONLN);
+    return n < 1 ? 1 : n;
+}
+
+/* CPUs and memory, without measuring anything */
+static void host_limits(HostProfile *hp) {
+    double quota, memory;
+    off_t physical = (off_t)sysconf(_SC_PHYS_PAGES) * sysconf(_SC_PAGESIZE);
+
+    memset(hp, 0, sizeof(*hp));
+    cgroup_limits(&quota, &memory);
+    hp->onlineCpus = online_cpus();
+    hp->cpuQuota = quota;
+    hp->cpus = hp->onlineCpus;
+    if (quota > 0 && ceil(quota) < hp->cpus) hp->cpus = ceil(quota);
+    hp->cgroupMemory = memory;
+    hp->memory = physical > 0 ? physical : 0;
+    if (memory > 0 && (hp->memory == 0 || memory < hp->memory)) hp->memory = memory;
+}
+
+int calibrate_cpus(void) {
+    HostProfile hp;
+    host_limits(&hp);
+    return hp.cpus;
+}
+
+/* Returns: bytes per second compressed by one core */
+static double measure_encoder(void) {
+    static const char *words[] = {
+        "the ", "archive ", "of ", "resource ", "fork ", "data ", "and ", "file ",
+        "Macintosh ", "folder ", "to ", "a ", "in ", "is ", "StuffIt ", "\n"
+    };
+    unsigned char *sample;
+    unsigned long seed = 88172645UL;
+    size_t len = 0, n;
+    double start;
+    long rounds = 0;
+
+    if ((sample = malloc(ENCODER_SAMPLE)) == NULL) return 0;
+    while (len < ENCODER_SAMPLE) {      /* text-like, from a fixed seed */
+        const char *w;
+        seed ^= seed << 13;
+        seed ^= seed >> 17;
+        seed ^= seed << 5;
+        w = words[(seed >> 7) % 16];
+        n = strlen(w);
+        if (n > ENCODER_SAMPLE - len) n = ENCODER_SAMPLE - len;
+        memcpy(sample + len, w, n);
+        len += n;
+    }
+    start = now();
+    do {
+        char *out = NULL;
+        size_t outlen = 0;
+        FILE *ms, *zfs;
+        if ((ms = open_memstream(&out, &outlen)) == NULL) break;
+        if ((zfs = zopen_stream(ms, "w", 14, 1)) == NULL) {
+            fclose(ms);
+            free(out);
+            break;
+        }
+        fwrite(sample, 1, ENCODER_SAMPLE, zfs);
+        fclose(zfs);
+        free(out);
+        rounds++;
+    } while (now() - start < ENCODER_TIME);
+    free(sample);
+    return rounds ? rounds * (double)ENCODER_SAMPLE / (now() - start) : 0;
+}
+
+/* add the regular files under path to files, up to LATENCY_FILES */
+static void find_files(const char *path, char **files, int *nfiles, int *entries) {
+    char child[PATH_MAX];
+    struct dirent *e;
+    struct stat st;
+    DIR *dir;
+
+    if (*nfiles >= LATENCY_FILES || ++*entries > LATENCY_ENTRIES || stat(path, &st) != 0) return;
+    if (S_ISREG(st.st_mode)) {
+        if (st.st_size > 0) files[(*nfiles)++] = strdup(path);
+        return;
+    }
+    if (!S_ISDIR(st.st_mode) || (dir = opendir(path)) == NULL) return;
+    while ((e = readdir(dir)) != NULL && *nfiles < LATENCY_FILES && *entries <= LATENCY_ENTRIES) {
+        if (strcmp(e->d_name, ".") == 0 || strcmp(e->d_name, "..") == 0) continue;
+        if (snprintf(child, sizeof(child), "%s/%s", path, e->d_name) >= (int)sizeof(child)) continue;
+        find_files(child, files, nfiles, entries);
+    }
+    closedir(dir);
+}
+
+static int compare_doubles(const void *a, const void *b) {
+    double x = *(const double *)a, y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+/*
+ * Time opening and reading the start of a few of the inputs, after asking
+ * for them to be dropped from the page cache where that can be done.
+ *
+ * Returns: the median time in seconds
+ */
+static double measure_latency(char **inputs, int ninputs) {
+    char *files[LATENCY_FILES], buf[4096];
+    double times[LATENCY_FILES], start;
+    struct stat st;
+    int i, n = 0, entries = 0, fd;
+
+    for (i = 0; i < ninputs; i++) find_files(inputs[i], files, &n, &entries);
+    if (n == 0) {
+        start = now();
+        stat(ninputs ? inputs[0] : ".", &st);
+        return now() - start;
+    }
+    for (i = 0; i < n; i++) {
+#ifdef POSIX_FADV_DONTNEED
+        if ((fd = open(files[i], O_RDONLY)) >= 0) {
+            posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+            close(fd);
+        }
+#endif
+        start = now();
+        if ((fd = open(files[i], O_RDONLY)) >= 0) {
+            if (pread(fd, buf, sizeof(buf), 0) < 0) { /* timed all the same */ }
+            close(fd);
+        }
+        times[i] = now() - start;
+        free(files[i]);
+    }
+    qsort(times, n, sizeof(double), compare_doubles);
+    return times[n / 2];
+}
+
+/* Returns: the path of this host's cache file, or NULL if there's nowhere to keep it
+   or its path is too long */
+static char *cache_path(char *path, size_t size, int create) {
+    char host[256];
+    const char *base = getenv("XDG_CACHE_HOME");
+    char dir[PATH_MAX];
+
+    if (gethostname(host, sizeof(host)) != 0) return NULL;
+    host[sizeof(host) - 1] = '\0';
+    if (base && *base) {
+        if (snprintf(dir, sizeof(dir), "%s/sit", base) >= (int)sizeof(dir)) return NULL;
+    } else if ((base = getenv("HOME")) && *base) {
+        if (snprintf(dir, sizeof(dir), "%s/.cache/sit", base) >= (int)sizeof(dir)) return NULL;
+        if (create) {
+            snprintf(dir, sizeof(dir), "%s/.cache", base);
+            mkdir(dir, 0755);
+            snprintf(dir, sizeof(dir), "%s/.cache/sit", base);
+        }
+    } else {
+        return NULL;
+    }
+    if (create) mkdir(dir, 0755);
+    if (snprintf(path, size, "%s/%s", dir, host) >= (int)size) return NULL; /* too long to use */
+    return path;
+}
+
+/*
+ * Look up the measurements in the cache. Lines are "encoder rate time"
+ * and "latency device seconds time".
+ *
+ * Returns: HAVE_ENCODER and HAVE_LATENCY for those found, fresh enough
+ */
+static int load_cache(dev_t dev, double *rate, double *latency) {
+    char path[PATH_MAX], line[256];
+    double value, when, t = time(NULL);
+    unsigned long long d;
+    int have = 0;
+    FILE *f;
+
+    if (!cache_path(path, sizeof(path), 0) || (f = fopen(path, "r")) == NULL) return 0;
+    while (fgets(line, sizeof(line), f)) {
+        if (sscanf(line, "encoder %lf %lf", &value, &when) == 2 &&
+            value > 0 && t - when < CACHE_MAX_AGE) {
+            *rate = value;
+            have |= HAVE_ENCODER;
+        } else if (sscanf(line, "latency %llu %lf %lf", &d, &value, &when) == 3 &&
+                   d == (unsigned long long)dev && value >= 0 && t - when < CACHE_MAX_AGE) {
+            *latency = value;
+            have |= HAVE_LATENCY;
+        }
+    }
+    fclose(f);
+    return have;
+}
+
+/* record the measurements, keeping those for other filesystems, and those
+   not taken this time (a rate of 0 or a negative latency) */
+static void save_cache(dev_t dev, double rate, double latency) {
+    char path[PATH_MAX], tmp[PATH_MAX + 16], line[256];
+    unsigned long long d;
+    double value, when;
+    long t = time(NULL);
+    FILE *in, *out;
+    int fd;
+
+    if (!cache_path(path, sizeof(path), 1)) return;
+    snprintf(tmp, sizeof(tmp), "%s.XXXXXX", path);
+    if ((fd = mkstemp(tmp)) < 0 || (out = fdopen(fd, "w")) == NULL) {
+        if (fd >= 0) {
+            close(fd);
+            unlink(tmp);
+        }
+        return;
+    }
+    if (rate > 0) fprintf(out, "encoder %.0f %ld\n", rate, t);
+    if (latency >= 0) fprintf(out, "latency %llu %.9f %ld\n", (unsigned long long)dev, latency, t);
+    if ((in = fopen(path, "r")) != NULL) {
+        while (fgets(line, sizeof(line), in)) {
+            if (sscanf(line, "encoder %lf %lf", &value, &when) == 2) {
+                if (rate <= 0 && t - when < CACHE_MAX_AGE) fputs(line, out);
+            } else if (sscanf(line, "latency %llu %lf %lf", &d, &value, &when) == 3 &&
+                       (d != (unsigned long long)dev || latency < 0) && t - when < CACHE_MAX_AGE) {
+                fputs(line, out);
+            }
+        }
+        fclose(in);
+    }
+    if (fclose(out) != 0 || rename(tmp, path) != 0) unlink(tmp);
+}
+
+void calibrate_host(HostProfile *hp, char **inputs, int ninputs, int force) {
+    struct stat st;
+    dev_t dev = 0;
+    int have;
+
+    host_limits(hp);
+    hp->readLatency = -1;
+    if (stat(ninputs ? inputs[0] : ".", &st) == 0) dev = st.st_dev;
+    have = force ? 0 : load_cache(dev, &hp->encoderRate, &hp->readLatency);
+    if (have == (HAVE_ENCODER | HAVE_LATENCY)) {
+        hp->cached = 1;
+        return;
+    }
+    /* the latency is only measured when asked, since it evicts the inputs
+       from the page cache */
+    if (force) hp->readLatency = measure_latency(inputs, ninputs);
+    if (!(have & HAVE_ENCODER) && (hp->encoderRate = measure_encoder()) > 0) {
+        save_cache(dev, hp->encoderRate, force ? hp->readLatency : -1);
+    }
+    hp->cached = !force && (have & HAVE_ENCODER);
+}
+
+void calibrate_tune(const HostProfile *hp, Tuning *t) {
+    /* bytes encoded while a read waits; without a latency, the defaults */
+    double ahead = hp->readLatency > 0 ? hp->encoderRate * hp->readLatency : 0;
+    size_t buffer = t->buffer;
+    int depth = t->depth, jobs;
+
+    if (!t->jobs) t->jobs = hp->cpus;
+    if (!t->memory) t->memory = hp->memory / 8;
+    jobs = t->jobs;
+    if (!buffer) {
+        buffer = PIPELINE_DEFAULT_BLOCK;
+        while (buffer < MAX_BUFFER && buffer < 4 * ahead) buffer *= 2;
+    }
+    if (!depth) {
+        depth = 2 + (int)ceil(8 * ahead / buffer);
+        if (depth < PIPELINE_DEFAULT_DEPTH) depth = PIPELINE_DEFAULT_DEPTH;
+        if (depth > MAX_DEPTH) depth = MAX_DEPTH;
+    }
+    /* cut back what wasn't given until the buffers fit the budget */
+    while ((off_t)2 * depth * (off_t)buffer * jobs > t->memory) {
+        if (!t->depth && depth > 2) {
+            depth--;
+        } else if (!t->buffer && buffer > PIPELINE_MIN_BLOCK) {
+            buffer /= 2;
+        } else {
+            break;
+        }
+    }
+    t->buffer = buffer;
+    t->depth = depth;
+}
+
+static const char *show_size(double size, char *buf, size_t len) {
+    const char *units = "KMGT";
+    int u = -1;
+
+    while (size >= 1024 && u < 3) {
+        size /= 1024;
+        u++;
+    }
+    if (u < 0) {
+        snprintf(buf, len, "%.0f", size);
+    } else {
+        snprintf(buf, len, size < 10 && size != floor(size) ? "%.1f%c" : "%.0f%c", size, units[u]);
+    }
+    return buf;
+}
+
+void calibrate_report(FILE *out, const HostProfile *hp, const Tuning *t) {
+    char a[32], b[32];
+
+    fprintf(out, "CPUs: %d of %d online", hp->cpus, hp->onlineCpus);
+    if (hp->cpuQuota > 0) fprintf(out, " (cgroup quota %.1f)", hp->cpuQuota);
+    fprintf(out, "\nMemory: %s", show_size(hp->memory, a, sizeof(a)));
+    if (hp->cgroupMemory > 0) fprintf(out, " (cgroup limit %s)", show_size(hp->cgroupMemory, b, sizeof(b)));
+    fprintf(out, "\nEncoder: %.1f MB/s per core\n", hp->encoderRate / 1e6);
+    if (hp->readLatency < 0) {
+        fprintf(out, "Read latency: not measured (see --calibrate)\n");
+    } else {
+        fprintf(out, "Read latency: %.3f ms%s\n", hp->readLatency * 1e3, hp->cached ? " (cached)" : "");
+    }
+    fprintf(out, "Settings: -j %d --queue-depth %d --buffer-size %s --max-memory %s\n",
+            t->jobs, t->depth, show_size(t->buffer, a, sizeof(a)), show_size(t->memory, b, sizeof(b)));
+}
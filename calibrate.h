@@ -0,0 +1,62 @@
+/*
+ * calibrate.h - fitting the work to the host
+ *
+ * The CPUs and memory sit may use are those of the machine, less any
+ * limits set on its cgroup (v1 or v2) and, for CPUs, its affinity mask.
+ * Before building an archive, sit also measures how fast one core runs
+ * the encoder, and --calibrate how long it takes to open and read the
+ * start of a file on the filesystem holding the inputs. From these it picks the number of
+ * jobs, the pipeline's buffer size and queue depth, and a memory budget
+ * for the buffers. The measurements are cached per host, and per
+ * filesystem for the latency, in ~/.cache/sit (or $XDG_CACHE_HOME/sit),
+ * and taken again once they are a month old.
+ */
+
+#pragma once
+
+#include <stdio.h>
+#include <sys/types.h>
+
+typedef struct {
+    int cpus;                   /* usable, after affinity and cgroup limits */
+    int onlineCpus;
+    double cpuQuota;            /* CPUs' worth allowed by the cgroup, 0 if unlimited */
+    off_t memory;               /* usable, after cgroup limits */
+    off_t cgroupMemory;         /* the cgroup's limit, 0 if unlimited */
+    double encoderRate;         /* bytes per second compressed by one core */
+    double readLatency;         /* seconds to open and read the start of a file,
+                                   -1 if not measured */
+    int cached;                 /* the measurements came from the cache */
+} HostProfile;
+
+/* Settings chosen from a HostProfile; those already set (non-zero) are kept */
+typedef struct {
+    int jobs;
+    int depth;                  /* pipeline queue depth */
+    size_t buffer;              /* pipeline buffer size */
+    off_t memory;               /* budget for the pipeline buffers of all jobs */
+} Tuning;
+
+/*
+ * Returns: the number of CPUs sit may use, at least 1
+ */
+int calibrate_cpus(void);
+
+/*
+ * Find the host's CPUs and memory, and load from the cache, or measure,
+ * the encoder's speed and the read latency of the filesystem holding the
+ * first of the inputs. The latency is measured only if force is set,
+ * since that drops some of the inputs from the page cache; force also
+ * measures the encoder again instead of loading it.
+ */
+void calibrate_host(HostProfile *hp, char **inputs, int ninputs, int force);
+
+/*
+ * Fill in the settings in t which aren't already set.
+ */
+void calibrate_tune(const HostProfile *hp, Tuning *t);
+
+/*
+ * Describe the host and the settings chosen.
+ */
+void calibrate_report(FILE *out, const HostProfile *hp, const Tuning *t);
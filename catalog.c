@@ -0,0 +1,361 @@
+/*
+ * catalog.c - a searchable catalog of the files in many archives
+ *
+ * The catalog file is a header followed by four tables, all numbers being
+ * big-endian as in the archives themselves:
+ *   archives  one CatArchive per archive catalogued
+ *   members   one CatMember per file or folder, in archive order
+ *   index     member numbers (4 bytes each), sorted by name ignoring case
+ *   strings   the archive names and member paths, NUL-terminated
+ * Lookups map the file and binary search the index, touching only a few
+ * pages, so they take about the same time however many archives there are.
+ */
+
+#include "catalog.h"
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "scan.h"
+#include "sitread.h"
+#include "util.h"
+
+#define CATALOG_MAGIC   "SITCAT1"
+
+typedef struct {
+    u_char magic[8];
+    u_char narchives[4];
+    u_char nmembers[4];
+    u_char archives[8];         /* offsets of the tables */
+    u_char members[8];
+    u_char index[8];
+    u_char strings[8];
+    u_char stringsLen[8];
+} CatHeader;
+
+typedef struct {
+    u_char name[8];             /* offset of its file name in the strings */
+    u_char size[8];
+    u_char mtime[8];
+} CatArchive;
+
+typedef struct {
+    u_char path[8];             /* offset of its path in the strings */
+    u_char name[2];             /* offset of its last component within the path */
+    u_char archive[4];          /* number in the archive table */
+    u_char offset[4];           /* of its header in the archive */
+    u_char rLen[4], dLen[4], cRLen[4], cDLen[4];
+    char fType[4], fCreator[4];
+    u_char rsrcCRC[2], dataCRC[2];
+    u_char compRMethod, compDMethod; /* startFolder for a folder */
+} CatMember;
+
+typedef struct {
+    CatArchive *archives;
+    int narchives, archiveCap;
+    CatMember *members;
+    long nmembers, memberCap;
+    char *strings;
+    size_t stringsLen, stringsCap;
+    int verbose;
+    int errors;
+} Builder;
+
+static void put2(u_char *p, uint16_t x) {
+    p[0] = x >> 8;
+    p[1] = x;
+}
+
+static void put4(u_char *p, uint32_t x) {
+    p[0] = x >> 24;
+    p[1] = x >> 16;
+    p[2] = x >> 8;
+    p[3] = x;
+}
+
+static void put8(u_char *p, uint64_t x) {
+    put4(p, x >> 32);
+    put4(p + 4, x);
+}
+
+static uint64_t get8(const u_char *p) {
+    return (uint64_t)get4(p) << 32 | get4(p + 4);
+}
+
+static size_t add_string(Builder *b, const char *s) {
+    size_t len = strlen(s) + 1, offset = b->stringsLen;
+
+    if (b->stringsLen + len > b->stringsCap) {
+        b->stringsCap = (b->stringsCap + len) * 2;
+        b->strings = realloc(b->strings, b->stringsCap);
+    }
+    memcpy(b->strings + b->stringsLen, s, len);
+    b->stringsLen += len;
+    return offset;
+}
+
+static void add_member(Builder *b, const SitEntry *e) {
+    CatMember *m;
+
+    if (b->nmembers == b->memberCap) {
+        b->memberCap = b->memberCap ? b->memberCap * 2 : 1024;
+        b->members = realloc(b->members, b->memberCap * sizeof(CatMember));
+    }
+    m = &b->members[b->nmembers++];
+    memset(m, 0, sizeof(*m));
+    put8(m->path, add_string(b, e->path));
+    put2(m->name, e->name - e->path);
+    put4(m->archive, b->narchives - 1);
+    put4(m->offset, e->offset);
+    if (e->isFolder) {
+        m->compRMethod = m->compDMethod = startFolder;
+    } else {
+        memcpy(m->rLen, e->hdr->rLen, 4);
+        memcpy(m->dLen, e->hdr->dLen, 4);
+        memcpy(m->cRLen, e->hdr->cRLen, 4);
+        memcpy(m->cDLen, e->hdr->cDLen, 4);
+        memcpy(m->fType, e->hdr->fType, 4);
+        memcpy(m->fCreator, e->hdr->fCreator, 4);
+        memcpy(m->rsrcCRC, e->hdr->rsrcCRC, 2);
+        memcpy(m->dataCRC, e->hdr->dataCRC, 2);
+        m->compRMethod = e->hdr->compRMethod;
+        m->compDMethod = e->hdr->compDMethod;
+    }
+}
+
+/* catalogue one archive, reading only its headers */
+static void add_archive(void *ctx, const char *archive) {
+    Builder *b = ctx;
+    SitArchive arc;
+    CatArchive *a;
+    struct stat st;
+    int i;
+
+    if (stat(archive, &st) < 0 || sit_open(archive, &arc) < 0) {
+        fprintf(stderr, "%s: not catalogued\n", archive);
+        b->errors++;
+        return;
+    }
+    if (b->narchives == b->archiveCap) {
+        b->archiveCap = b->archiveCap ? b->archiveCap * 2 : 256;
+        b->archives = realloc(b->archives, b->archiveCap * sizeof(CatArchive));
+    }
+    a = &b->archives[b->narchives++];
+    put8(a->name, add_string(b, archive));
+    put8(a->size, st.st_size);
+    put8(a->mtime, st.st_mtime);
+    for (i = 0; i < arc.nentries; i++) {
+        add_member(b, &arc.entries[i]);
+    }
+    if (b->verbose > 1) {
+        fprintf(stdout, "+ %s (%d items)\n", archive, arc.nentries);
+    }
+    sit_close(&arc);
+}
+
+static const Builder *sortBuilder;
+
+static const char *member_name(const char *strings, const CatMember *m) {
+    return strings + get8(m->path) + get2(m->name);
+}
+
+static int compare_members(const void *a, const void *b) {
+    const CatMember *ma = &sortBuilder->members[*(const uint32_t *)a];
+    const CatMember *mb = &sortBuilder->members[*(const uint32_t *)b];
+    int c = strcasecmp(member_name(sortBuilder->strings, ma),
+                       member_name(sortBuilder->strings, mb));
+    return c ? c : strcmp(sortBuilder->strings + get8(ma->path),
+                          sortBuilder->strings + get8(mb->path));
+}
+
+int catalog_build(const char *catalog, char **paths, int npaths, int verbose) {
+    Builder b;
+    CatHeader h;
+    uint32_t *order;
+    u_char *index;
+    char tmp[PATH_MAX];
+    uint64_t offset;
+    FILE *fs;
+    int i, fd, failed;
+
+    memset(&b, 0, sizeof(b));
+    b.verbose = verbose;
+    for (i = 0; i < npaths; i++) {
+        scan_find_archives(paths[i], add_archive, &b);
+    }
+
+    /* sort the members by name for lookups */
+    order = malloc((b.nmembers + 1) * sizeof(uint32_t));
+    index = malloc((b.nmembers + 1) * 4);
+    for (i = 0; i < b.nmembers; i++) order[i] = i;
+    sortBuilder = &b;
+    qsort(order, b.nmembers, sizeof(uint32_t), compare_members);
+    for (i = 0; i < b.nmembers; i++) put4(index + 4 * i, order[i]);
+
+    memset(&h, 0, sizeof(h));
+    memcpy(h.magic, CATALOG_MAGIC, 8);
+    put4(h.narchives, b.narchives);
+    put4(h.nmembers, b.nmembers);
+    offset = sizeof(h);
+    put8(h.archives, offset);
+    offset += (uint64_t)b.narchives * sizeof(CatArchive);
+    put8(h.members, offset);
+    offset += (uint64_t)b.nmembers * sizeof(CatMember);
+    put8(h.index, offset);
+    offset += (uint64_t)b.nmembers * 4;
+    put8(h.strings, offset);
+    put8(h.stringsLen, b.stringsLen);
+
+    if (snprintf(tmp, sizeof(tmp), "%s.XXXXXX", catalog) >= sizeof(tmp) ||
+        (fd = mkstemp(tmp)) < 0 || (fs = fdopen(fd, "w")) == NULL) {
+        perror(catalog);
+        return 1;
+    }
+    fchmod(fd, 0644);
+    fwrite(&h, sizeof(h), 1, fs);
+    fwrite(b.archives, sizeof(CatArchive), b.narchives, fs);
+    fwrite(b.members, sizeof(CatMember), b.nmembers, fs);
+    fwrite(index, 4, b.nmembers, fs);
+    fwrite(b.strings, 1, b.stringsLen, fs);
+    failed = ferror(fs) | (fclose(fs) != 0);
+    if (failed || rename(tmp, catalog) < 0) {
+        perror(catalog);
+        unlink(tmp);
+    } else if (verbose) {
+        fprintf(stdout, "Catalogued %ld items in %d archives to \"%s\"\n", b.nmembers,
+                b.narchives, catalog);
+    }
+    free(order);
+    free(index);
+    free(b.archives);
+    free(b.members);
+    free(b.strings);
+    return (failed || b.errors) ? 1 : 0;
+}
+
+/* does a path end with the given path, at a component boundary? */
+static int path_matches(const char *path, const char *query) {
+    size_t plen = strlen(path), qlen = strlen(query);
+
+    if (qlen > plen || strcasecmp(path + plen - qlen, query) != 0) return 0;
+    return plen == qlen || path[plen - qlen - 1] == '/';
+}
+
+/* a catalog mapped for lookups */
+typedef struct {
+    const u_char *map;
+    uint64_t size;
+    const CatArchive *archives;
+    const CatMember *members;
+    const u_char *index;
+    const char *strings;
+    uint64_t narchives, nmembers, stringsLen;
+} Catalog;
+
+/* does a table of n entries of the given size at offset fit in the catalog? */
+static int fits(const Catalog *c, uint64_t offset, uint64_t n, uint64_t size) {
+    return offset <= c->size && n <= (c->size - offset) / size;
+}
+
+/* Returns: the member at position i in the index, or NULL if it's damaged */
+static const CatMember *indexed_member(const Catalog *c, uint64_t i) {
+    uint32_t n = get4(c->index + 4 * i);
+    const CatMember *m;
+
+    if (n >= c->nmembers) {
+        return NULL;
+    }
+    m = &c->members[n];
+    if (get8(m->path) >= c->stringsLen ||
+        get2(m->name) >= c->stringsLen - get8(m->path) || get4(m->archive) >= c->narchives ||
+        get8(c->archives[get4(m->archive)].name) >= c->stringsLen) {
+        return NULL;
+    }
+    return m;
+}
+
+int catalog_lookup(const char *catalog, const char *query, FILE *out) {
+    struct stat st;
+    Catalog c;
+    const CatHeader *h;
+    const CatMember *m = NULL;
+    const char *name;
+    uint64_t lo, hi, found = 0;
+    int fd;
+
+    if ((fd = open(catalog, O_RDONLY)) < 0 || fstat(fd, &st) < 0) {
+        perror(catalog);
+        return 1;
+    }
+    c.size = st.st_size;
+    c.map = st.st_size >= (off_t)sizeof(CatHeader) ?
+        mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0) : MAP_FAILED;
+    close(fd);
+    h = (const CatHeader *)c.map;
+    if (c.map == MAP_FAILED || memcmp(h->magic, CATALOG_MAGIC, 8) != 0) {
+        fprintf(stderr, "%s: not a sit catalog\n", catalog);
+        if (c.map != MAP_FAILED) munmap((void *)c.map, c.size);
+        return 1;
+    }
+    c.narchives = get4(h->narchives);
+    c.nmembers = get4(h->nmembers);
+    c.stringsLen = get8(h->stringsLen);
+    if (!fits(&c, get8(h->archives), c.narchives, sizeof(CatArchive)) ||
+        !fits(&c, get8(h->members), c.nmembers, sizeof(CatMember)) ||
+        !fits(&c, get8(h->index), c.nmembers, 4) ||
+        !fits(&c, get8(h->strings), c.stringsLen, 1) ||
+        get8(h->strings) + c.stringsLen != c.size ||
+        (c.stringsLen && c.map[c.size - 1] != 0)) {
+        fprintf(stderr, "%s: catalog is damaged\n", catalog);
+        munmap((void *)c.map, c.size);
+        return 1;
+    }
+    c.archives = (const CatArchive *)(c.map + get8(h->archives));
+    c.members = (const CatMember *)(c.map + get8(h->members));
+    c.index = c.map + get8(h->index);
+    c.strings = (const char *)c.map + get8(h->strings);
+
+    /* find the first member with the name, then list them all */
+    name = strrchr(query, '/') ? strrchr(query, '/') + 1 : query;
+    lo = 0;
+    hi = c.nmembers;
+    while (lo < hi) {
+        uint64_t mid = lo + (hi - lo) / 2;
+        if ((m = indexed_member(&c, mid)) == NULL) {
+            break;
+        }
+        if (strcasecmp(member_name(c.strings, m), name) < 0) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    for (; m && lo < c.nmembers; lo++) {
+        const char *path;
+        if ((m = indexed_member(&c, lo)) == NULL ||
+            strcasecmp(member_name(c.strings, m), name) != 0) {
+            break;
+        }
+        path = c.strings + get8(m->path);
+        if (name != query && !path_matches(path, query)) {
+            continue;
+        }
+        fprintf(out, "%s: %s", c.strings + get8(c.archives[get4(m->archive)].name), path);
+        if (m->compRMethod == startFolder) {
+            fprintf(out, "/\n");
+        } else {
+            fprintf(out, " Data:%lu Rsrc:%lu [%.4s/%.4s]\n", (unsigned long)get4(m->dLen),
+                    (unsigned long)get4(m->rLen), m->fType, m->fCreator);
+        }
+        found++;
+    }
+    if (c.nmembers && !m) {
+        fprintf(stderr, "%s: catalog is damaged\n", catalog);
+    }
+    munmap((void *)c.map, c.size);
+    return found ? 0 : 1;
+}
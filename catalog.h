@@ -0,0 +1,30 @@
+/*
+ * catalog.h - a searchable catalog of the files in many archives
+ *
+ * A catalog is built by reading only the headers of each archive, and
+ * records every file and folder in them: its path, fork lengths and CRCs,
+ * type and creator, and where its header is in its archive. The catalog
+ * file is laid out to be mapped into memory and searched in place, with
+ * the members sorted by name, so a lookup is a binary search rather than
+ * a scan of the archives.
+ */
+
+#pragma once
+
+#include <stdio.h>
+
+/*
+ * Build a catalog of the archives given, found as by scan_find_archives().
+ * Archives which can't be read are reported and left out.
+ *
+ * Returns: 0 on success, 1 on error
+ */
+int catalog_build(const char *catalog, char **paths, int npaths, int verbose);
+
+/*
+ * Write a line to out for each member of the catalogued archives named
+ * name (ignoring case), or whose path ends with name if it contains '/'.
+ *
+ * Returns: 0 if any were found, 1 if none were or on error
+ */
+int catalog_lookup(const char *catalog, const char *name, FILE *out);
@@ -0,0 +1,462 @@
+/*
+ * daemon.c - building archives for other processes
+ *
+ * A job is sent as a 4-byte length, in network order, carrying the
+ * client's working folder, archive, stdout and stderr as SCM_RIGHTS, then
+ * that many bytes of NUL-terminated "key=value" strings: "sit=1" first,
+ * then archive, convert, type, creator and verbose, and an input for each
+ * file or folder. The worker replies with a line holding the exit status
+ * and the milliseconds the job took.
+ */
+
+#include "daemon.h"
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <arpa/inet.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdint.h>
+#include <time.h>
+#include <unistd.h>
+
+#define JOB_FDS     4           /* working folder, archive, stdout and stderr */
+#define MAX_JOB     16777216    /* bytes of strings in a job, at most */
+#define BACKLOG     64
+
+static volatile sig_atomic_t stopping;
+
+static void stop(int sig) {
+    (void)sig;
+    stopping = 1;
+}
+
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* Returns: 0, or -1 if the path is too long for a socket */
+static int socket_address(const char *path, struct sockaddr_un *sa) {
+    memset(sa, 0, sizeof(*sa));
+    sa->sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(sa->sun_path)) {
+        fprintf(stderr, "%s: socket path is too long\n", path);
+        return -1;
+    }
+    strcpy(sa->sun_path, path);
+    return 0;
+}
+
+/* Returns: 0, or -1 if the connection was lost */
+static int read_all(int fd, void *buf, size_t len) {
+    size_t got = 0;
+    ssize_t n;
+
+    while (got < len) {
+        n = read(fd, (char *)buf + got, len - got);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return -1;
+        got += n;
+    }
+    return 0;
+}
+
+static int write_all(int fd, const void *buf, size_t len) {
+    size_t done = 0;
+    ssize_t n;
+
+    while (done < len) {
+        n = write(fd, (const char *)buf + done, len - done);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return -1;
+        done += n;
+    }
+    return 0;
+}
+
+/*
+ * Read a job's length and descriptors, then its strings into *strings.
+ *
+ * Returns: the length of the strings, 0 if the connection was closed
+ * without sending anything, or -1 if the job is incomplete
+ */
+static ssize_t receive_job(int c, int fds[JOB_FDS], char **strings) {
+    union {
+        char buf[CMSG_SPACE(JOB_FDS * sizeof(int))];
+        struct cmsghdr align;
+    } control;
+    struct msghdr msg;
+    struct cmsghdr *cm;
+    struct iovec iov;
+    uint32_t len;
+    ssize_t n;
+    int i, nfds = 0;
+
+    for (i = 0; i < JOB_FDS; i++) fds[i] = -1;
+    memset(&msg, 0, sizeof(msg));
+    iov.iov_base = &len;
+    iov.iov_len = sizeof(len);
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.buf;
+    msg.msg_controllen = sizeof(control.buf);
+    while ((n = recvmsg(c, &msg, 0)) < 0 && errno == EINTR)
+        ;
+    if (n <= 0) return n;
+    for (cm = CMSG_FIRSTHDR(&msg); cm; cm = CMSG_NXTHDR(&msg, cm)) {
+        if (cm->cmsg_level == SOL_SOCKET && cm->cmsg_type == SCM_RIGHTS) {
+            int *received = (int *)CMSG_DATA(cm);
+            int count = (cm->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+            for (i = 0; i < count; i++) {
+                /* one left open would leak into the build's child processes */
+                if (nfds < JOB_FDS && fcntl(received[i], F_SETFD, FD_CLOEXEC) == 0) {
+                    fds[nfds++] = received[i];
+                } else {
+                    close(received[i]);
+                }
+            }
+        }
+    }
+    if (nfds != JOB_FDS || (n < (ssize_t)sizeof(len) &&
+                            read_all(c, (char *)&len + n, sizeof(len) - n) != 0)) {
+        return -1;
+    }
+    len = ntohl(len);
+    if (len == 0 || len > MAX_JOB || (*strings = malloc(len)) == NULL) return -1;
+    if (read_all(c, *strings, len) != 0 || (*strings)[len - 1] != '\0') {
+        free(*strings);
+        return -1;
+    }
+    return len;
+}
+
+/* Returns: 0, or -1 if the strings aren't a job */
+static int parse_job(char *strings, size_t len, DaemonJob *job) {
+    char *s, *next, *value;
+    int n = 0;
+
+    memset(job, 0, sizeof(*job));
+    for (s = strings; s < strings + len; s += strlen(s) + 1) n++;
+    if ((job->inputs = malloc(n * sizeof(char *))) == NULL) return -1;
+    if (strcmp(strings, "sit=1") != 0) return -1;
+    for (s = strings + strlen(strings) + 1; s < strings + len; s = next) {
+        next = s + strlen(s) + 1;
+        if ((value = strchr(s, '=')) == NULL) return -1;
+        *value++ = '\0';
+        if (strcmp(s, "input") == 0) {
+            job->inputs[job->ninputs++] = value;
+        } else if (strcmp(s, "archive") == 0) {
+            job->archive = value;
+        } else if (strcmp(s, "convert") == 0) {
+            job->convert = atoi(value);
+        } else if (strcmp(s, "type") == 0) {
+            job->type = value;
+        } else if (strcmp(s, "creator") == 0) {
+            job->creator = value;
+        } else if (strcmp(s, "verbose") == 0) {
+            job->verbose = atoi(value);
+        } else {
+            return -1;
+        }
+    }
+    return (job->archive && job->ninputs > 0) ? 0 : -1;
+}
+
+/* Run one job from the connection c, in a worker */
+static void serve_job(int c, daemon_build_fn build, int verbose, long serial) {
+    int fds[JOB_FDS], savedOut, savedErr, status = 1, i;
+    double start = now(), ms;
+    char *strings = NULL, reply[64];
+    DaemonJob job;
+    ssize_t len;
+
+    memset(&job, 0, sizeof(job));
+    if ((len = receive_job(c, fds, &strings)) <= 0 || parse_job(strings, len, &job) != 0) {
+        if (verbose && len != 0) fprintf(stderr, "[%d] job %ld: not a valid job\n", (int)getpid(), serial);
+        status = -1;
+    } else if (fchdir(fds[0]) != 0) {
+        status = 1;
+    } else {
+        /* the job's messages go to the client */
+        fflush(stdout);
+        fflush(stderr);
+        savedOut = dup(1);
+        savedErr = dup(2);
+        dup2(fds[2], 1);
+        dup2(fds[3], 2);
+        job.fd = fds[1];
+        status = build(&job);
+        fflush(stdout);
+        fflush(stderr);
+        dup2(savedOut, 1);
+        dup2(savedErr, 2);
+        close(savedOut);
+        close(savedErr);
+    }
+    ms = (now() - start) * 1e3;
+    if (status >= 0) {
+        snprintf(reply, sizeof(reply), "%d %.3f\n", status, ms);
+        if (write_all(c, reply, strlen(reply)) != 0 && verbose) {
+            fprintf(stderr, "[%d] job %ld: client went away\n", (int)getpid(), serial);
+        }
+        if (verbose) {
+            fprintf(stderr, "[%d] job %ld: %s, %d input%s, status %d, %.1f ms\n", (int)getpid(),
+                    serial, job.archive, job.ninputs, job.ninputs == 1 ? "" : "s", status, ms);
+        }
+    }
+    for (i = 0; i < JOB_FDS; i++) {
+        if (fds[i] >= 0) close(fds[i]);
+    }
+    free(job.inputs);
+    free(strings);
+}
+
+static void worker(int listener, daemon_build_fn build, int verbose) {
+    struct sigaction sa;
+    long serial = 0;
+    int c;
+
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = SIG_DFL;
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+    sa.sa_handler = SIG_IGN;
+    sigaction(SIGPIPE, &sa, NULL);  /* a client that goes away ends its job with an error */
+    for (;;) {
+        if ((c = accept(listener, NULL, NULL)) < 0) {
+            if (errno != EINTR && errno != ECONNABORTED) {
+                perror("accept");
+                _exit(1);
+            }
+            continue;
+        }
+        serve_job(c, build, verbose, ++serial);
+        close(c);
+    }
+}
+
+/* Returns: the worker's pid, or -1 if it couldn't be started */
+static pid_t start_worker(int listener, daemon_build_fn build, int verbose) {
+    pid_t pid;
+
+    fflush(stdout);
+    fflush(stderr);
+    if ((pid = fork()) < 0) {
+        perror("fork");
+    } else if (pid == 0) {
+        worker(listener, build, verbose);
+    }
+    return pid;
+}
+
+/*
+ * Bind the socket, replacing one left behind by a daemon that has gone.
+ *
+ * Returns: the listening socket, or -1
+ */
+static int listen_on(const char *path) {
+    struct sockaddr_un sa;
+    mode_t mask;
+    int s, r;
+
+    if (socket_address(path, &sa) != 0) return -1;
+    if ((s = socket(AF_UNIX, SOCK_STREAM, 0)) < 0) {
+        perror("socket");
+        return -1;
+    }
+    if (connect(s, (struct sockaddr *)&sa, sizeof(sa)) == 0) {
+        fprintf(stderr, "%s: a daemon is already listening\n", path);
+        close(s);
+        return -1;
+    }
+    if (errno == ECONNREFUSED) unlink(path);
+    close(s);
+    if ((s = socket(AF_UNIX, SOCK_STREAM, 0)) < 0) {
+        perror("socket");
+        return -1;
+    }
+    if (fcntl(s, F_SETFD, FD_CLOEXEC) != 0) {  /* not SOCK_CLOEXEC, which macOS lacks */
+        perror("fcntl");
+        close(s);
+        return -1;
+    }
+    mask = umask(077);
+    r = bind(s, (struct sockaddr *)&sa, sizeof(sa));
+    umask(mask);
+    if (r != 0 || listen(s, BACKLOG) != 0) {
+        perror(path);
+        close(s);
+        return -1;
+    }
+    return s;
+}
+
+int daemon_serve(const char *path, int workers, daemon_build_fn build, int verbose) {
+    struct sigaction sa;
+    pid_t *pids, pid;
+    int listener, i, status;
+
+    if ((listener = listen_on(path)) < 0) return 1;
+    if ((pids = calloc(workers, sizeof(pid_t))) == NULL) {
+        perror("daemon");
+        close(listener);
+        unlink(path);
+        return 1;
+    }
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = stop;
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+
+    for (i = 0; i < workers; i++) {
+        if ((pids[i] = start_worker(listener, build, verbose)) < 0) stopping = 1;
+    }
+    if (verbose && !stopping) {
+        fprintf(stderr, "Listening on %s with %d worker%s\n", path, workers, workers == 1 ? "" : "s");
+    }
+    while (!stopping) {
+        if ((pid = waitpid(-1, &status, 0)) < 0) {
+            if (errno == EINTR) continue;
+            perror("waitpid");
+            break;
+        }
+        for (i = 0; i < workers && pids[i] != pid; i++)
+            ;
+        if (i == workers) continue;
+        if (verbose) fprintf(stderr, "[%d] worker died; starting another\n", (int)pid);
+        sleep(1);       /* in case it died at once */
+        if (!stopping && (pids[i] = start_worker(listener, build, verbose)) < 0) break;
+    }
+
+    for (i = 0; i < workers; i++) {
+        if (pids[i] > 0) kill(pids[i], SIGTERM);
+    }
+    for (i = 0; i < workers; i++) {
+        if (pids[i] > 0) waitpid(pids[i], &status, 0);
+    }
+    close(listener);
+    unlink(path);
+    free(pids);
+    return 0;
+}
+
+/* Append "key=value" and its NUL to *buf, growing it */
+static int add_string(char **buf, size_t *len, size_t *cap, const char *key, const char *value) {
+    size_t n = strlen(key) + strlen(value) + 2;
+
+    if (*len + n > *cap) {
+        char *grown;
+        while (*len + n > *cap) *cap = *cap ? *cap * 2 : 4096;
+        if ((grown = realloc(*buf, *cap)) == NULL) return -1;
+        *buf = grown;
+    }
+    snprintf(*buf + *len, n, "%s=%s", key, value);
+    *len += n;
+    return 0;
+}
+
+int daemon_submit(const char *path, const DaemonJob *job) {
+    union {
+        char buf[CMSG_SPACE(JOB_FDS * sizeof(int))];
+        struct cmsghdr align;
+    } control;
+    char *strings = NULL, number[16], reply[64];
+    size_t len = 0, cap = 0, got = 0;
+    int fds[JOB_FDS], s, i, status, failed = 0;
+    struct sockaddr_un sa;
+    struct cmsghdr *cm;
+    struct msghdr msg;
+    struct iovec iov;
+    uint32_t netlen;
+    double ms;
+    ssize_t n;
+
+    if (socket_address(path, &sa) != 0) return 1;
+    failed |= add_string(&strings, &len, &cap, "sit", "1");
+    failed |= add_string(&strings, &len, &cap, "archive", job->archive);
+    snprintf(number, sizeof(number), "%d", job->convert);
+    failed |= add_string(&strings, &len, &cap, "convert", number);
+    if (job->type) failed |= add_string(&strings, &len, &cap, "type", job->type);
+    if (job->creator) failed |= add_string(&strings, &len, &cap, "creator", job->creator);
+    snprintf(number, sizeof(number), "%d", job->verbose);
+    failed |= add_string(&strings, &len, &cap, "verbose", number);
+    for (i = 0; i < job->ninputs; i++) {
+        failed |= add_string(&strings, &len, &cap, "input", job->inputs[i]);
+    }
+    if (failed || len > MAX_JOB) {
+        fprintf(stderr, "Too many files for one job\n");
+        free(strings);
+        return 1;
+    }
+
+    if ((fds[0] = open(".", O_RDONLY | O_DIRECTORY)) < 0) {
+        perror(".");
+        free(strings);
+        return 1;
+    }
+    fds[1] = job->fd;
+    fds[2] = 1;
+    fds[3] = 2;
+    if ((s = socket(AF_UNIX, SOCK_STREAM, 0)) < 0 ||
+        connect(s, (struct sockaddr *)&sa, sizeof(sa)) != 0) {
+        fprintf(stderr, "Can't reach the daemon at %s: %s\n", path, strerror(errno));
+        if (s >= 0) close(s);
+        close(fds[0]);
+        free(strings);
+        return 1;
+    }
+
+    memset(&msg, 0, sizeof(msg));
+    memset(&control, 0, sizeof(control));
+    netlen = htonl(len);
+    iov.iov_base = &netlen;
+    iov.iov_len = sizeof(netlen);
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.buf;
+    msg.msg_controllen = sizeof(control.buf);
+    cm = CMSG_FIRSTHDR(&msg);
+    cm->cmsg_level = SOL_SOCKET;
+    cm->cmsg_type = SCM_RIGHTS;
+    cm->cmsg_len = CMSG_LEN(JOB_FDS * sizeof(int));
+    memcpy(CMSG_DATA(cm), fds, sizeof(fds));
+    signal(SIGPIPE, SIG_IGN);
+    while ((n = sendmsg(s, &msg, 0)) < 0 && errno == EINTR)
+        ;
+    close(fds[0]);
+    if (n != (ssize_t)sizeof(netlen) || write_all(s, strings, len) != 0) {
+        fprintf(stderr, "Can't send the job to the daemon: %s\n", strerror(errno));
+        close(s);
+        free(strings);
+        return 1;
+    }
+    free(strings);
+
+    /* wait for the reply */
+    while (got < sizeof(reply) - 1 && (n = read(s, reply + got, sizeof(reply) - 1 - got)) != 0) {
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            break;
+        }
+        got += n;
+        if (memchr(reply, '\n', got)) break;
+    }
+    close(s);
+    reply[got] = '\0';
+    if (sscanf(reply, "%d %lf", &status, &ms) != 2) {
+        fprintf(stderr, "The daemon didn't finish the job\n");
+        return 1;
+    }
+    if (job->verbose) fprintf(stderr, "Built by the daemon in %.1f ms\n", ms);
+    return status;
+}
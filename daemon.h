@@ -0,0 +1,49 @@
+/*
+ * daemon.h - building archives for other processes
+ *
+ * With --daemon, sit listens on a Unix domain socket and builds archives
+ * for clients started with --submit, sparing them the cost of starting up
+ * and calibrating. A pool of worker processes, started once, each take
+ * jobs from the socket in turn; the encoder's code tables and the
+ * compressed forks of files already archived (see forkcache.h) are kept by
+ * each worker from one job to the next. The client passes its working
+ * folder, the archive it has opened, and its stdout and stderr with the
+ * job, so relative paths and messages work as if it had built the archive
+ * itself. The files are read with the daemon's permissions, so the socket
+ * is made accessible to its owner only.
+ */
+
+#pragma once
+
+#include <sys/types.h>
+
+typedef struct {
+    char **inputs;
+    int ninputs;
+    char *archive;              /* its name, for messages */
+    int fd;                     /* the archive, open for reading and writing */
+    int convert;                /* -u */
+    char *type, *creator;       /* -T and -C, or NULL */
+    int verbose;
+} DaemonJob;
+
+/* Builds the archive for a job; returns the exit status */
+typedef int (*daemon_build_fn)(const DaemonJob *job);
+
+/*
+ * Listen on the socket at path and build archives with workers processes,
+ * restarting any which die. A worker's time for each job is reported on
+ * stderr if verbose is set. Runs until interrupted or terminated, and then
+ * removes the socket.
+ *
+ * Returns: the exit status
+ */
+int daemon_serve(const char *path, int workers, daemon_build_fn build, int verbose);
+
+/*
+ * Send a job to the daemon listening on the socket at path, and wait for
+ * it to be done. Its time is reported on stderr if job->verbose is set.
+ *
+ * Returns: the job's exit status
+ */
+int daemon_submit(const char *path, const DaemonJob *job);
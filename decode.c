@@ -0,0 +1,511 @@
+/*
+ * decode.c - decoders for StuffIt's other compression methods
+ *
+ * Huffman codes are decoded a table lookup at a time rather than a bit at
+ * a time: the next TABLE_BITS bits of input index a table giving either
+ * the byte they start with and the length of its code, or, for the few
+ * codes which are longer, the node of the tree to carry on from.
+ */
+
+#include "decode.h"
+#include <stdlib.h>
+#include <string.h>
+
+#define OUT_BUFSIZE     65536
+#define TABLE_BITS      9
+#define MAX_NODES       511     /* 256 leaves and the nodes joining them */
+
+/* decoded data waiting for the sink */
+typedef struct {
+    unsigned char *buf;
+    size_t n;
+    sit_sink sink;
+    void *ctx;
+} Output;
+
+static int out_flush(Output *o) {
+    int failed = o->n && o->sink(o->ctx, o->buf, o->n) < 0;
+    o->n = 0;
+    return failed ? SIT_ABORTED : SIT_OK;
+}
+
+static int out_byte(Output *o, unsigned char c) {
+    o->buf[o->n++] = c;
+    return o->n == OUT_BUFSIZE ? out_flush(o) : SIT_OK;
+}
+
+static int out_finish(Output *o, int result) {
+    if (result == SIT_OK) result = out_flush(o);
+    free(o->buf);
+    return result;
+}
+
+int decode_rle(const unsigned char *in, size_t inlen, uint32_t length, sit_sink sink,
+               void *ctx) {
+    Output o = { malloc(OUT_BUFSIZE), 0, sink, ctx };
+    const unsigned char *end = in + inlen;
+    unsigned char last = 0;
+    uint32_t total = 0;
+    int result = SIT_OK;
+
+    while (total < length && result == SIT_OK) {
+        if (in == end) {
+            result = SIT_BADDATA;
+        } else if (*in != 0x90) {
+            last = *in++;
+            result = out_byte(&o, last);
+            total++;
+        } else if (in + 1 == end) {
+            result = SIT_BADDATA;
+        } else if (in[1] == 0) {
+            in += 2;
+            last = 0x90;
+            result = out_byte(&o, last);
+            total++;
+        } else {
+            uint32_t count = in[1] - 1;
+            in += 2;
+            if (count > length - total) {
+                result = SIT_BADDATA;
+            }
+            for (; count > 0 && result == SIT_OK; count--, total++) {
+                result = out_byte(&o, last);
+            }
+        }
+    }
+    return out_finish(&o, result);
+}
+
+/* bits of input, most significant first */
+typedef struct {
+    const unsigned char *in, *end;
+    uint64_t bits;              /* the next nbits bits, in the low end */
+    int nbits;
+    int pad;                    /* how many of them are padding past the end */
+    int overrun;                /* padding was used */
+} Bits;
+
+/* make sure there are at least n (up to 57) bits, padding with zeros at the end */
+static void bits_fill(Bits *b, int n) {
+    while (b->nbits < n) {
+        if (b->in < b->end) {
+            b->bits = b->bits << 8 | *b->in++;
+        } else {
+            b->bits <<= 8;
+            b->pad += 8;
+        }
+        b->nbits += 8;
+    }
+}
+
+static unsigned bits_peek(Bits *b, int n) {
+    bits_fill(b, n);
+    return (b->bits >> (b->nbits - n)) & ((1u << n) - 1);
+}
+
+static void bits_skip(Bits *b, int n) {
+    b->nbits -= n;
+    if (b->nbits < b->pad) b->overrun = 1;
+}
+
+static unsigned bits_get(Bits *b, int n) {
+    unsigned x = bits_peek(b, n);
+    bits_skip(b, n);
+    return x;
+}
+
+/* A node of the code tree: a leaf if child[0] < 0, when symbol is its byte */
+typedef struct {
+    short child[2];
+    short symbol;
+} Node;
+
+typedef struct {
+    short node;                 /* the leaf reached, or the node to carry on from */
+    unsigned char nbits;        /* bits used to get there */
+} TableEntry;
+
+typedef struct {
+    Node nodes[MAX_NODES];
+    int nnodes;
+    TableEntry table[1 << TABLE_BITS];
+} Code;
+
+/* read a subtree depth first: 1 and a byte for a leaf, 0 and two subtrees otherwise */
+static int read_tree(Code *c, Bits *b, int depth) {
+    int n = c->nnodes;
+
+    if (n == MAX_NODES || depth > MAX_NODES / 2 || b->overrun) {
+        return -1;
+    }
+    c->nnodes++;
+    if (bits_get(b, 1)) {
+        c->nodes[n].child[0] = c->nodes[n].child[1] = -1;
+        c->nodes[n].symbol = bits_get(b, 8);
+        return n;
+    }
+    if ((c->nodes[n].child[0] = read_tree(c, b, depth + 1)) < 0 ||
+        (c->nodes[n].child[1] = read_tree(c, b, depth + 1)) < 0) {
+        return -1;
+    }
+    return n;
+}
+
+/* for each TABLE_BITS bits of input, follow them from the root as far as they go */
+static void build_table(Code *c) {
+    unsigned i;
+    int k, n;
+
+    for (i = 0; i < (1u << TABLE_BITS); i++) {
+        n = 0;
+        for (k = 0; k < TABLE_BITS && c->nodes[n].child[0] >= 0; k++) {
+            n = c->nodes[n].child[(i >> (TABLE_BITS - 1 - k)) & 1];
+        }
+        c->table[i].node = n;
+        c->table[i].nbits = k;
+    }
+}
+
+int decode_huffman(const unsigned char *in, size_t inlen, uint32_t length, sit_sink sink,
+                   void *ctx) {
+    Output o = { malloc(OUT_BUFSIZE), 0, sink, ctx };
+    Code *c = malloc(sizeof(Code));
+    Bits b = { in, in + inlen, 0, 0, 0, 0 };
+    uint32_t total;
+    int result = SIT_OK;
+
+    c->nnodes = 0;
+    if (read_tree(c, &b, 0) < 0) {
+        result = SIT_BADDATA;
+    } else if (c->nodes[0].child[0] < 0) {
+        /* just one byte, which takes no bits at all */
+        memset(o.buf, c->nodes[0].symbol, OUT_BUFSIZE);
+        for (total = 0; total < length && result == SIT_OK; ) {
+            o.n = length - total < OUT_BUFSIZE ? length - total : OUT_BUFSIZE;
+            total += o.n;
+            result = out_flush(&o);
+        }
+        free(c);
+        return out_finish(&o, result);
+    } else if (length / 8 > inlen) {
+        result = SIT_BADDATA;   /* every code is at least a bit */
+    } else {
+        build_table(c);
+    }
+    for (total = 0; total < length && result == SIT_OK; total++) {
+        const TableEntry *t = &c->table[bits_peek(&b, TABLE_BITS)];
+        int n = t->node;
+        bits_skip(&b, t->nbits);
+        while (c->nodes[n].child[0] >= 0) {
+            n = c->nodes[n].child[bits_get(&b, 1)];
+        }
+        if (b.overrun) {
+            result = SIT_BADDATA;
+            break;
+        }
+        result = out_byte(&o, c->nodes[n].symbol);
+    }
+    free(c);
+    return out_finish(&o, result);
+}
+
+/*
+ * Method 13: LZ77 with a 64K window, with literals, match lengths and
+ * match distances Huffman coded. Bits are read least significant first,
+ * and the fork starts with a byte choosing the codes: in the high four
+ * bits 0 if they're given next, or 1-5 for one of StuffIt's built-in
+ * sets. The code lengths making up the built-in sets aren't published
+ * with the format, so forks using them aren't supported here; any other
+ * value means the fork is damaged.
+ */
+
+#define WINDOW_SIZE     65536
+#define LZ_TABLE_BITS   10
+#define LZ_SYMBOLS      321     /* 256 literals, 64 lengths and the end of the fork */
+#define LZ_END          0x140
+#define MAX_CODE_LEN    32
+#define LZ_BUILTIN_SETS 5       /* code sets StuffIt has built in */
+
+/* the code for the code lengths of the others, least significant bit first */
+static const uint16_t metaCodes[37] = {
+    0x5d8, 0x058, 0x040, 0x0c0, 0x000, 0x078, 0x02b, 0x014,
+    0x00c, 0x01c, 0x01b, 0x00b, 0x010, 0x020, 0x038, 0x018,
+    0x0d8, 0xbd8, 0x180, 0x680, 0x380, 0xf80, 0x780, 0x480,
+    0x080, 0x280, 0x3d8, 0xfd8, 0x7d8, 0x9d8, 0x1d8, 0x004,
+    0x001, 0x002, 0x007, 0x003, 0x008
+};
+static const unsigned char metaLengths[37] = {
+    11, 8, 8, 8, 8, 7, 6, 5, 5, 5, 5, 6, 5, 6, 7, 7, 9, 12, 10, 11, 11, 12,
+    12, 11, 11, 11, 12, 12, 12, 12, 12, 5, 2, 2, 3, 4, 5
+};
+
+/* bits of input, least significant first */
+typedef struct {
+    const unsigned char *in, *end;
+    uint64_t bits;              /* the next nbits bits, in the low end */
+    int nbits;
+    int overrun;                /* bits past the end of the input were used */
+} LEBits;
+
+static void lebits_fill(LEBits *b) {
+    while (b->nbits <= 56) {
+        if (b->in < b->end) {
+            b->bits |= (uint64_t)*b->in++ << b->nbits;
+        } else if (b->nbits > 0) {
+            break;              /* padding would only be zeros */
+        } else {
+            b->overrun = 1;
+            break;
+        }
+        b->nbits += 8;
+    }
+}
+
+static unsigned lebits_peek(LEBits *b, int n) {
+    if (b->nbits < n) lebits_fill(b);
+    return b->bits & ((1u << n) - 1);
+}
+
+static void lebits_skip(LEBits *b, int n) {
+    if (n > b->nbits) {
+        b->overrun = 1;
+        n = b->nbits;
+    }
+    b->bits >>= n;
+    b->nbits -= n;
+}
+
+static unsigned lebits_get(LEBits *b, int n) {
+    unsigned x = lebits_peek(b, n);
+    lebits_skip(b, n);
+    return x;
+}
+
+/*
+ * A prefix code as a tree, a node being a leaf if its symbol is >= 0, and
+ * a table of where each LZ_TABLE_BITS bits of input lead from the root.
+ */
+typedef struct {
+    int child[2];               /* -1 where there's no code */
+    int symbol;
+} LZNode;
+
+typedef struct {
+    LZNode nodes[2 * LZ_SYMBOLS];
+    int nnodes;
+    struct {
+        short node;             /* the node reached, or -1 for no code */
+        unsigned char nbits;
+    } table[1 << LZ_TABLE_BITS];
+} LZCode;
+
+static int new_node(LZCode *c) {
+    LZNode *n = &c->nodes[c->nnodes];
+    n->child[0] = n->child[1] = n->symbol = -1;
+    return c->nnodes++;
+}
+
+/* add a code, given with the first bit read in its least significant bit */
+static int add_code(LZCode *c, uint32_t code, int len, int symbol) {
+    int n = 0, i;
+
+    for (i = 0; i < len; i++) {
+        int bit = (code >> i) & 1;
+        if (c->nodes[n].symbol >= 0) return -1;
+        if (c->nodes[n].child[bit] < 0) {
+            if (c->nnodes == 2 * LZ_SYMBOLS) return -1;
+            c->nodes[n].child[bit] = new_node(c);
+        }
+        n = c->nodes[n].child[bit];
+    }
+    if (c->nodes[n].symbol >= 0 || c->nodes[n].child[0] >= 0 || c->nodes[n].child[1] >= 0) {
+        return -1;
+    }
+    c->nodes[n].symbol = symbol;
+    return 0;
+}
+
+static void build_lz_table(LZCode *c) {
+    unsigned i;
+    int k, n;
+
+    for (i = 0; i < (1u << LZ_TABLE_BITS); i++) {
+        n = 0;
+        for (k = 0; k < LZ_TABLE_BITS && n >= 0 && c->nodes[n].symbol < 0; k++) {
+            n = c->nodes[n].child[(i >> k) & 1];
+        }
+        c->table[i].node = n;
+        c->table[i].nbits = k;
+    }
+}
+
+/* canonical codes from their lengths, shortest first, as in deflate */
+static int make_code(LZCode *c, const int *lengths, int nsymbols) {
+    int count[MAX_CODE_LEN + 1] = { 0 };
+    uint32_t next[MAX_CODE_LEN + 1], code = 0;
+    int i, len;
+
+    c->nnodes = 0;
+    new_node(c);
+    for (i = 0; i < nsymbols; i++) {
+        if (lengths[i] > MAX_CODE_LEN) return -1;
+        if (lengths[i] > 0) count[lengths[i]]++;
+    }
+    for (len = 1; len <= MAX_CODE_LEN; len++) {
+        code = (code + count[len - 1]) << 1;
+        next[len] = code;
+    }
+    for (i = 0; i < nsymbols; i++) {
+        uint32_t reversed = 0, x;
+        int k;
+        if ((len = lengths[i]) <= 0) continue;
+        /* codes are read most significant bit first, so reverse them */
+        for (x = next[len]++, k = 0; k < len; k++, x >>= 1) {
+            reversed = reversed << 1 | (x & 1);
+        }
+        if (add_code(c, reversed, len, i) < 0) return -1;
+    }
+    build_lz_table(c);
+    return 0;
+}
+
+/* Returns: the next symbol, or -1 if the input isn't a code */
+static int read_symbol(const LZCode *c, LEBits *b) {
+    unsigned i = lebits_peek(b, LZ_TABLE_BITS);
+    int n = c->table[i].node;
+
+    lebits_skip(b, c->table[i].nbits);
+    while (n >= 0 && c->nodes[n].symbol < 0) {
+        n = c->nodes[n].child[lebits_get(b, 1)];
+    }
+    return n < 0 || b->overrun ? -1 : c->nodes[n].symbol;
+}
+
+/* read nsymbols code lengths, coded with the meta code, and make a code of them */
+static int read_code(LZCode *c, const LZCode *meta, LEBits *b, int nsymbols) {
+    int lengths[LZ_SYMBOLS];
+    int i, n, len = 0;
+
+    for (i = 0; i < nsymbols; i++) {
+        int sym = read_symbol(meta, b);
+        n = 0;
+        switch (sym) {
+        case -1:
+            return -1;
+        case 31: len = -1; break;
+        case 32: len++; break;
+        case 33: len--; break;
+        case 34: n = lebits_get(b, 1); break;
+        case 35: n = lebits_get(b, 3) + 2; break;
+        case 36: n = lebits_get(b, 6) + 10; break;
+        default: len = sym + 1; break;
+        }
+        /* 34-36 repeat the current length n times, then once more */
+        if (i + n >= nsymbols) return -1;
+        while (n-- > 0) lengths[i++] = len;
+        lengths[i] = len;
+    }
+    return make_code(c, lengths, nsymbols);
+}
+
+int decode_lzhuf(const unsigned char *in, size_t inlen, uint32_t length, sit_sink sink,
+                 void *ctx) {
+    LEBits b = { in, in + inlen, 0, 0, 0 };
+    LZCode *codes = malloc(4 * sizeof(LZCode));
+    LZCode *meta = &codes[0], *first = &codes[1], *second = &codes[2], *dist = &codes[3];
+    const LZCode *cur;
+    unsigned char *window = malloc(WINDOW_SIZE);
+    uint32_t pos = 0, total = 0;
+    int i, set, result = SIT_OK;
+
+    set = lebits_get(&b, 8);
+    if (b.overrun || set >> 4 > LZ_BUILTIN_SETS) {
+        result = SIT_BADDATA;
+        goto done;
+    }
+    if (set >> 4 != 0) {
+        result = SIT_BADMETHOD;
+        goto done;
+    }
+    meta->nnodes = 0;
+    new_node(meta);
+    for (i = 0; i < 37; i++) {
+        add_code(meta, metaCodes[i], metaLengths[i], i);
+    }
+    build_lz_table(meta);
+    if (read_code(first, meta, &b, LZ_SYMBOLS) < 0 ||
+        (!(set & 0x08) && read_code(second, meta, &b, LZ_SYMBOLS) < 0) ||
+        read_code(dist, meta, &b, (set & 0x07) + 10) < 0) {
+        result = SIT_BADDATA;
+        goto done;
+    }
+    if (set & 0x08) second = first;
+
+    cur = first;
+    while (total < length && result == SIT_OK) {
+        uint32_t len, offset;
+        int sym = read_symbol(cur, &b);
+        if (sym < 0 || sym == LZ_END) {
+            result = SIT_BADDATA;
+            break;
+        }
+        if (sym < 0x100) {
+            window[pos++] = sym;
+            total++;
+            cur = first;
+        } else {
+            cur = second;
+            if (sym < 0x13e) {
+                len = sym - 0x100 + 3;
+            } else if (sym == 0x13e) {
+                len = lebits_get(&b, 10) + 65;
+            } else {
+                len = lebits_get(&b, 15) + 65;
+            }
+            if ((sym = read_symbol(dist, &b)) < 0) {
+                result = SIT_BADDATA;
+                break;
+            }
+            offset = sym < 2 ? sym + 1 : (1u << (sym - 1)) + lebits_get(&b, sym - 1) + 1;
+            if (offset > total || offset > WINDOW_SIZE || len > length - total) {
+                result = SIT_BADDATA;
+                break;
+            }
+            total += len;
+            /* copy in runs which don't wrap around the window */
+            while (len > 0) {
+                uint32_t from = (pos - offset) & (WINDOW_SIZE - 1);
+                uint32_t n = len;
+                if (n > WINDOW_SIZE - pos) n = WINDOW_SIZE - pos;
+                if (n > WINDOW_SIZE - from) n = WINDOW_SIZE - from;
+                len -= n;
+                if (offset >= n) {
+                    /* when from has wrapped, the runs can still overlap */
+                    memmove(window + pos, window + from, n);
+                    pos += n;
+                } else {
+                    while (n-- > 0) window[pos++] = window[from++];
+                }
+                if (pos == WINDOW_SIZE) {
+                    if (sink(ctx, window, pos) < 0) result = SIT_ABORTED;
+                    pos = 0;
+                }
+            }
+            continue;
+        }
+        if (pos == WINDOW_SIZE) {
+            if (sink(ctx, window, pos) < 0) result = SIT_ABORTED;
+            pos = 0;
+        }
+    }
+    if (result == SIT_OK && b.overrun) {
+        result = SIT_BADDATA;
+    }
+    if (result == SIT_OK && pos > 0 && sink(ctx, window, pos) < 0) {
+        result = SIT_ABORTED;
+    }
+done:
+    free(window);
+    free(codes);
+    return result;
+}
@@ -0,0 +1,46 @@
+/*
+ * decode.h - decoders for StuffIt's other compression methods
+ *
+ * The archives sit writes use only LZW, which is decoded through zopen,
+ * but archives made by StuffIt itself may also use its run-length and
+ * Huffman methods, or, from later versions, method 13. These decoders
+ * work on a whole compressed fork in memory, as it is in a mapped
+ * archive, and pass the decoded data to a sink in blocks.
+ */
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include "sitread.h"
+
+/*
+ * Decode a repComp (RLE) fork of length bytes. 0x90 is the escape byte:
+ * 0x90 0x00 is a literal 0x90, and 0x90 n repeats the previous byte so
+ * that there are n in all.
+ *
+ * Returns: SIT_OK, SIT_BADDATA, or SIT_ABORTED if the sink stopped
+ */
+int decode_rle(const unsigned char *in, size_t inlen, uint32_t length, sit_sink sink,
+               void *ctx);
+
+/*
+ * Decode a hufComp (Huffman) fork of length bytes. The fork starts with
+ * its code tree, written depth first, then the codes, most significant
+ * bit first.
+ *
+ * Returns: SIT_OK, SIT_BADDATA, or SIT_ABORTED if the sink stopped
+ */
+int decode_huffman(const unsigned char *in, size_t inlen, uint32_t length, sit_sink sink,
+                   void *ctx);
+
+/*
+ * Decode a lzhufComp (method 13) fork of length bytes. Only forks which
+ * carry their own Huffman codes can be decoded; those using one of
+ * StuffIt's five built-in code sets give SIT_BADMETHOD, and any other
+ * code set SIT_BADDATA.
+ *
+ * Returns: SIT_OK, SIT_BADDATA, SIT_BADMETHOD, or SIT_ABORTED if the sink stopped
+ */
+int decode_lzhuf(const unsigned char *in, size_t inlen, uint32_t length, sit_sink sink,
+                 void *ctx);
@@ -0,0 +1,255 @@
+/*
+ * diff.c - comparing two archives
+ *
+ * The entries of each archive are sorted by path and the two lists are
+ * walked together. For a byte-by-byte comparison, the old fork is decoded
+ * to a temporary file and the new one compared against it as it's
+ * decoded, so that memory use doesn't depend on the size of the forks.
+ */
+
+#include "diff.h"
+#include <stdarg.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "sitread.h"
+#include "util.h"
+
+#define MACEPOCH    2082844800UL    /* seconds from 1904 to 1970 */
+
+typedef struct {
+    const char *path;
+    const SitEntry *e;
+} Member;
+
+typedef struct {
+    FILE *old;                  /* the old fork, decoded */
+    off_t pos;
+    off_t differs;              /* first differing byte, or -1 */
+    unsigned char buf[65536];
+} ByteCompare;
+
+static int compare_members(const void *a, const void *b) {
+    return strcmp(((const Member *)a)->path, ((const Member *)b)->path);
+}
+
+/* Returns: the archive's members, sorted by path, or NULL */
+static Member *sorted_members(const SitArchive *arc) {
+    Member *m = malloc((arc->nentries ? arc->nentries : 1) * sizeof(Member));
+    int i;
+
+    if (!m) return NULL;
+    for (i = 0; i < arc->nentries; i++) {
+        m[i].path = arc->entries[i].path;
+        m[i].e = &arc->entries[i];
+    }
+    qsort(m, arc->nentries, sizeof(Member), compare_members);
+    return m;
+}
+
+/* Mac dates are local times, shown as they are */
+static const char *show_date(const char *mac, char *buf, size_t len) {
+    time_t t = (time_t)get4(mac) - (time_t)MACEPOCH;
+    struct tm tm;
+
+    if (gmtime_r(&t, &tm) == NULL || strftime(buf, len, "%Y-%m-%d %H:%M:%S", &tm) == 0) {
+        snprintf(buf, len, "%lu", (unsigned long)get4(mac));
+    }
+    return buf;
+}
+
+/* add a change to the comma-separated list in line */
+static void add_change(char *line, size_t len, const char *fmt, ...) {
+    size_t used = strlen(line);
+    va_list ap;
+
+    if (used && used < len) used += snprintf(line + used, len - used, ", ");
+    if (used >= len) return;
+    va_start(ap, fmt);
+    vsnprintf(line + used, len - used, fmt, ap);
+    va_end(ap);
+}
+
+static int save_sink(void *ctx, const unsigned char *buf, size_t len) {
+    return fwrite(buf, 1, len, (FILE *)ctx) == len ? 0 : -1;
+}
+
+static int compare_sink(void *ctx, const unsigned char *buf, size_t len) {
+    ByteCompare *bc = ctx;
+    size_t n, got, i;
+
+    while (len > 0 && bc->differs < 0) {
+        n = len < sizeof(bc->buf) ? len : sizeof(bc->buf);
+        got = fread(bc->buf, 1, n, bc->old);
+        for (i = 0; i < got && bc->buf[i] == buf[i]; i++)
+            ;
+        if (i < n) {
+            bc->differs = bc->pos + i;
+            break;
+        }
+        bc->pos += n;
+        buf += n;
+        len -= n;
+    }
+    return 0;
+}
+
+/*
+ * Decode a fork from each archive and compare them.
+ *
+ * Returns: the first byte at which they differ, -1 if they're the same,
+ * or -2 if either can't be decoded (with a line in the report)
+ */
+static off_t compare_forks(const SitArchive *a, const SitFork *fa, const SitArchive *b,
+                           const SitFork *fb, const char *path, const char *which, FILE *report) {
+    ByteCompare *bc;
+    off_t differs;
+    int r;
+
+    if ((bc = calloc(1, sizeof(ByteCompare))) == NULL || (bc->old = tmpfile()) == NULL) {
+        fprintf(report, "E %s: can't compare the %s fork: out of memory or temporary space\n",
+                path, which);
+        free(bc);
+        return -2;
+    }
+    bc->differs = -1;
+    if ((r = sit_decode_fork(a, fa, save_sink, bc->old)) != SIT_OK || fflush(bc->old) != 0) {
+        fprintf(report, "E %s: %s fork in the old archive: %s\n", path, which,
+                r != SIT_OK ? sit_strerror(r) : "can't be saved");
+        differs = -2;
+    } else {
+        rewind(bc->old);
+        if ((r = sit_decode_fork(b, fb, compare_sink, bc)) != SIT_OK) {
+            fprintf(report, "E %s: %s fork in the new archive: %s\n", path, which,
+                    sit_strerror(r));
+            differs = -2;
+        } else if (bc->differs < 0 && fa->length != fb->length) {
+            differs = fa->length < fb->length ? fa->length : fb->length;
+        } else {
+            differs = bc->differs;
+        }
+    }
+    fclose(bc->old);
+    free(bc);
+    return differs;
+}
+
+/*
+ * List the differences between two files' headers, and with --bytes their
+ * forks, in line.
+ *
+ * Returns: 0, or -1 if a fork couldn't be decoded
+ */
+static int compare_files(const SitArchive *a, const SitEntry *ea, const SitArchive *b,
+                         const SitEntry *eb, const DiffOptions *opts, char *line, size_t len) {
+    const fileHdr *ha = ea->hdr, *hb = eb->hdr;
+    char da[32], db[32];
+    const char *which[2] = { "data", "resource" };
+    const SitFork *fa[2], *fb[2];
+    int k, failed = 0;
+
+    fa[0] = &ea->data;
+    fa[1] = &ea->rsrc;
+    fb[0] = &eb->data;
+    fb[1] = &eb->rsrc;
+    for (k = 0; k < 2; k++) {
+        if (fa[k]->length != fb[k]->length) {
+            add_change(line, len, "%s %lu -> %lu bytes", which[k], (unsigned long)fa[k]->length,
+                       (unsigned long)fb[k]->length);
+        } else if (fa[k]->crc != fb[k]->crc) {
+            add_change(line, len, "%s CRC %04x -> %04x", which[k], fa[k]->crc, fb[k]->crc);
+        }
+    }
+    if (memcmp(ha->fType, hb->fType, 4) != 0 || memcmp(ha->fCreator, hb->fCreator, 4) != 0) {
+        add_change(line, len, "[%.4s/%.4s] -> [%.4s/%.4s]", ha->fType, ha->fCreator,
+                   hb->fType, hb->fCreator);
+    }
+    if (get2(ha->FndrFlags) != get2(hb->FndrFlags)) {
+        add_change(line, len, "Finder flags %04x -> %04x", get2(ha->FndrFlags),
+                   get2(hb->FndrFlags));
+    }
+    if (get4(ha->cDate) != get4(hb->cDate)) {
+        add_change(line, len, "created %s -> %s", show_date(ha->cDate, da, sizeof(da)),
+                   show_date(hb->cDate, db, sizeof(db)));
+    }
+    if (get4(ha->mDate) != get4(hb->mDate)) {
+        add_change(line, len, "modified %s -> %s", show_date(ha->mDate, da, sizeof(da)),
+                   show_date(hb->mDate, db, sizeof(db)));
+    }
+    if (opts->bytes) {
+        for (k = 0; k < 2; k++) {
+            off_t at = compare_forks(a, fa[k], b, fb[k], ea->path, which[k], opts->report);
+            if (at == -2) {
+                failed = 1;
+            } else if (at >= 0) {
+                add_change(line, len, "%s differs from byte %lld%s", which[k], (long long)at,
+                           (fa[k]->length == fb[k]->length && fa[k]->crc == fb[k]->crc) ?
+                           " despite the same CRC" : "");
+            }
+        }
+    }
+    return failed ? -1 : 0;
+}
+
+int diff_archives(const char *old, const char *new, const DiffOptions *opts) {
+    SitArchive a, b;
+    Member *ma = NULL, *mb = NULL;
+    long added = 0, removed = 0, changed = 0, same = 0;
+    char line[1024];
+    int i = 0, j = 0, c, status = 0;
+
+    if (sit_open(old, &a) < 0) return 2;
+    if (sit_open(new, &b) < 0) {
+        sit_close(&a);
+        return 2;
+    }
+    if ((ma = sorted_members(&a)) == NULL || (mb = sorted_members(&b)) == NULL) {
+        fprintf(stderr, "Out of memory\n");
+        status = 2;
+        goto done;
+    }
+    while (i < a.nentries || j < b.nentries) {
+        c = (i == a.nentries) ? 1 : (j == b.nentries) ? -1 : strcmp(ma[i].path, mb[j].path);
+        if (c < 0) {
+            fprintf(opts->report, "- %s%s\n", ma[i].path, ma[i].e->isFolder ? "/" : "");
+            removed++;
+            i++;
+            continue;
+        }
+        if (c > 0) {
+            fprintf(opts->report, "+ %s%s\n", mb[j].path, mb[j].e->isFolder ? "/" : "");
+            added++;
+            j++;
+            continue;
+        }
+        line[0] = '\0';
+        if (ma[i].e->isFolder != mb[j].e->isFolder) {
+            add_change(line, sizeof(line), "%s -> %s", ma[i].e->isFolder ? "folder" : "file",
+                       mb[j].e->isFolder ? "folder" : "file");
+        } else if (!ma[i].e->isFolder &&
+                   compare_files(&a, ma[i].e, &b, mb[j].e, opts, line, sizeof(line)) != 0) {
+            status = 2;
+        }
+        if (line[0]) {
+            fprintf(opts->report, "M %s%s: %s\n", mb[j].path, mb[j].e->isFolder ? "/" : "", line);
+            changed++;
+        } else {
+            if (opts->verbose) {
+                fprintf(opts->report, "= %s%s\n", mb[j].path, mb[j].e->isFolder ? "/" : "");
+            }
+            same++;
+        }
+        i++;
+        j++;
+    }
+    fprintf(opts->report, "%ld changed, %ld added, %ld removed, %ld the same%s\n", changed, added,
+            removed, same, opts->bytes ? " (forks compared byte by byte)" : "");
+    if (status == 0 && (changed || added || removed)) status = 1;
+
+done:
+    free(ma);
+    free(mb);
+    sit_close(&a);
+    sit_close(&b);
+    return status;
+}
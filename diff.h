@@ -0,0 +1,29 @@
+/*
+ * diff.h - comparing two archives
+ *
+ * The members of two archives are matched up by their paths, and files
+ * are compared by what their headers record: the lengths and CRCs of
+ * their forks, their type and creator, Finder flags and dates. Nothing
+ * is decoded unless a byte-by-byte comparison is asked for, so only the
+ * headers of the archives are read. Folders are compared only by name,
+ * since the rest of a nested folder's header may not be filled in.
+ */
+
+#pragma once
+
+#include <stdio.h>
+
+typedef struct {
+    int bytes;                  /* also decode and compare the forks */
+    int verbose;                /* also list the members which are the same */
+    FILE *report;
+} DiffOptions;
+
+/*
+ * Compare the archive new with old, writing a line to the report for each
+ * member added ("+ path"), removed ("- path") or changed ("M path: what"),
+ * in order of path, followed by a summary.
+ *
+ * Returns: 0 if they're the same, 1 if they differ, 2 on error
+ */
+int diff_archives(const char *old, const char *new, const DiffOptions *opts);
@@ -0,0 +1,303 @@
+/*
+ * estimate.c - estimating an archive's size without building it
+ *
+ * Forks are put in strata by size, each stratum holding forks within a
+ * factor of four of each other. A systematic sample of each stratum, at
+ * least MIN_SAMPLES forks and about one in SAMPLE_SHARE of the rest, is
+ * compressed, and the stratum's compressed size is taken as its total
+ * length times the ratio of the sample. A stratum no bigger than its
+ * sample is counted exactly.
+ *
+ * A sampled fork of up to SMALL_FORK bytes is compressed whole. A larger
+ * one is itself sampled: it is cut into strata of equal length, one
+ * SAMPLE_BLOCK at a pseudo-random place in each is compressed, and the
+ * fork is taken to compress as well as its blocks did on average. Each
+ * block starts the encoder afresh, whereas deep in a long fork the code
+ * table fills and is cleared now and then, so the two don't compress
+ * quite alike. A block is about as much input as fills the table, which
+ * keeps the difference to a percent or so on typical data.
+ *
+ * The range given is the usual 95% confidence interval, from the
+ * variance of each stratum's ratio estimate with the finite population
+ * correction, plus that of the block samples. It only covers the error
+ * from sampling.
+ */
+
+#include "estimate.h"
+#include <sys/types.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <math.h>
+#include "zopen.h"
+
+#define SAMPLE_BLOCK    65536               /* bytes compressed from each stratum of a large fork */
+#define SMALL_FORK      (8 * SAMPLE_BLOCK)  /* forks up to this size are sampled whole */
+#define SAMPLE_SHARE    32                  /* sample about one part in this many */
+#define MIN_SAMPLES     8                   /* forks sampled from each stratum, at least */
+#define MIN_BLOCKS      4                   /* blocks sampled from a large fork, at least */
+#define MAX_BLOCKS      64                  /* and at most */
+#define NCLASSES        17                  /* strata of forks by size, up to 4 GB */
+
+typedef struct {
+    char *path;
+    off_t offset, length;
+    int convert;
+} Fork;
+
+typedef struct {
+    Fork *forks;
+    size_t count, cap;
+    off_t length;       /* of all the forks */
+} Stratum;
+
+static Stratum classes[NCLASSES];
+static off_t exact;                 /* bytes known exactly */
+static off_t sampled, compressible; /* bytes compressed, of those sampled from */
+static unsigned long seed = 2463534242UL;
+
+/* xorshift, so that the same inputs give the same estimate */
+static unsigned long next_random(void) {
+    seed ^= seed << 13;
+    seed ^= seed >> 17;
+    seed ^= seed << 5;
+    return seed & 0xFFFFFFFFUL;
+}
+
+/*
+ * Compress length bytes with the encoder a build uses.
+ *
+ * Returns: the compressed length, or -1 on error
+ */
+static off_t compressed_length(const unsigned char *data, size_t length) {
+    char *out = NULL;
+    size_t outlen = 0;
+    FILE *ms, *zfs;
+
+    if ((ms = open_memstream(&out, &outlen)) == NULL) return -1;
+    if ((zfs = zopen_stream(ms, "w", 14, 1)) == NULL) {
+        fclose(ms);
+        free(out);
+        return -1;
+    }
+    if (fwrite(data, 1, length, zfs) != length) {
+        fclose(zfs);
+        free(out);
+        return -1;
+    }
+    if (fclose(zfs) != 0) {
+        free(out);
+        return -1;
+    }
+    free(out);
+    return outlen;
+}
+
+/*
+ * Compress length bytes of a fork, starting offset bytes into it.
+ *
+ * Returns: the compressed length, or -1 on error
+ */
+static off_t compress_part(const Fork *f, off_t offset, size_t length) {
+    unsigned char *buf;
+    ssize_t n;
+    size_t i;
+    off_t clen = -1;
+    int fd;
+
+    if ((fd = open(f->path, O_RDONLY)) < 0) {
+        perror(f->path);
+        return -1;
+    }
+    if ((buf = malloc(length ? length : 1)) != NULL &&
+        (n = pread(fd, buf, length, f->offset + offset)) == (ssize_t)length) {
+        if (f->convert) {
+            for (i = 0; i < length; i++) {
+                if (buf[i] == '\n') buf[i] = '\r';
+            }
+        }
+        clen = compressed_length(buf, length);
+        if (clen >= 0) sampled += length;
+    } else {
+        fprintf(stderr, "%s: can't read fork\n", f->path);
+    }
+    free(buf);
+    close(fd);
+    return clen;
+}
+
+void estimate_exact(off_t bytes) {
+    exact += bytes;
+}
+
+void estimate_fork(const char *path, off_t offset, off_t length, int convert) {
+    Stratum *s;
+    Fork f;
+    int c = 0;
+
+    if (length <= 0) return;
+    f.path = strdup(path);
+    f.offset = offset;
+    f.length = length;
+    f.convert = convert;
+    compressible += length;
+    while (c < NCLASSES-1 && ((off_t)4 << (2*c)) <= length) c++;
+    s = &classes[c];
+    if (s->count == s->cap) {
+        s->cap = s->cap ? s->cap * 2 : 64;
+        s->forks = realloc(s->forks, s->cap * sizeof(Fork));
+    }
+    s->forks[s->count++] = f;
+    s->length += length;
+}
+
+off_t estimate_compress_stream(ssize_t (*reader)(void *ctx, char *buf, size_t len), void *ctx,
+                                off_t *length) {
+    char *buf;
+    size_t fill;
+    ssize_t n = 1;
+    off_t clen = 0, part = 0;
+
+    *length = 0;
+    if ((buf = malloc(SMALL_FORK)) == NULL) return -1;
+    while (n > 0) {
+        for (fill = 0; fill < SMALL_FORK && (n = reader(ctx, buf + fill, SMALL_FORK - fill)) > 0; ) {
+            fill += n;
+        }
+        if (n < 0 || (fill && (part = compressed_length((unsigned char *)buf, fill)) < 0)) {
+            free(buf);
+            return -1;
+        }
+        if (fill) clen += part;
+        *length += fill;
+    }
+    free(buf);
+    return clen;
+}
+
+void estimate_compressed(off_t length, off_t clen) {
+    compressible += length;
+    sampled += length;
+    exact += clen;
+}
+
+/*
+ * Estimate a large fork from a stratified sample of its blocks.
+ *
+ * Returns: the estimated compressed length, with its variance in *var,
+ * or -1 if it can't be read
+ */
+static double estimate_large(const Fork *f, double *var) {
+    off_t nblocks = f->length / SAMPLE_BLOCK, stratum;
+    size_t n = nblocks / SAMPLE_SHARE, i, k;
+    double sum = 0, sumSq = 0, mean, s2;
+
+    *var = 0;
+    if (n < MIN_BLOCKS) n = MIN_BLOCKS;
+    if (n > MAX_BLOCKS) n = MAX_BLOCKS;
+    stratum = f->length / n;
+    for (i = 0, k = 0; i < n; i++) {
+        off_t offset = i * stratum + (off_t)(next_random() % (stratum - SAMPLE_BLOCK + 1));
+        off_t clen = compress_part(f, offset, SAMPLE_BLOCK);
+        double r;
+        if (clen < 0) continue;
+        r = (double)clen / SAMPLE_BLOCK;
+        sum += r;
+        sumSq += r * r;
+        k++;
+    }
+    if (k == 0) return -1;
+    mean = sum / k;
+    if (k > 1) {
+        s2 = (sumSq - k * mean * mean) / (k - 1);
+        if (s2 < 0) s2 = 0;
+        *var = (double)f->length * f->length * (1 - (double)k * SAMPLE_BLOCK / f->length) * s2 / k;
+    }
+    return mean * f->length;
+}
+
+/*
+ * Estimate a stratum from a systematic sample of its forks.
+ *
+ * Returns: the estimated compressed length, with its variance in *var
+ */
+static double estimate_stratum(const Stratum *s, double *var) {
+    size_t n = s->count / SAMPLE_SHARE, step, start, i, k;
+    double *l, *c, sumL = 0, sumC = 0, r, ss = 0, within = 0;
+
+    *var = 0;
+    if (n < MIN_SAMPLES) n = MIN_SAMPLES;
+    if (n > s->count) n = s->count;
+    step = s->count / n;
+    start = next_random() % step;
+    l = malloc(n * sizeof(double));
+    c = malloc(n * sizeof(double));
+    for (i = 0, k = 0; i < n; i++) {
+        const Fork *f = &s->forks[start + i*step];
+        double clen, v = 0;
+        if (f->length > SMALL_FORK) {
+            clen = estimate_large(f, &v);
+        } else {
+            clen = compress_part(f, 0, f->length);
+        }
+        if (clen < 0) continue;
+        within += v;
+        l[k] = f->length;
+        c[k] = clen;
+        sumL += l[k];
+        sumC += c[k];
+        k++;
+    }
+    if (k == 0 || sumL == 0) {
+        /* nothing could be read: assume it doesn't compress */
+        free(l);
+        free(c);
+        return s->length;
+    }
+    r = sumC / sumL;
+    *var = within * (s->length / sumL) * (s->length / sumL);
+    if (k < s->count && k > 1) {
+        double N = s->count;
+        for (i = 0; i < k; i++) {
+            ss += (c[i] - r * l[i]) * (c[i] - r * l[i]);
+        }
+        *var += N * N * (1 - k / N) / k * ss / (k - 1);
+    }
+    free(l);
+    free(c);
+    return r * s->length;
+}
+
+int estimate_report(FILE *out, long files, long folders, off_t uncompressed, int verbose) {
+    double total = exact, var = 0, v, margin;
+    size_t i;
+    int c;
+
+    for (c = 0; c < NCLASSES; c++) {
+        Stratum *s = &classes[c];
+        double est;
+        if (!s->count) continue;
+        est = estimate_stratum(s, &v);
+        if (verbose) {
+            fprintf(out, "Forks under %lld bytes: %lu, %lld bytes, about %.0f compressed\n",
+                    (long long)4 << (2*c), (unsigned long)s->count, (long long)s->length, est);
+        }
+        total += est;
+        var += v;
+        for (i = 0; i < s->count; i++) free(s->forks[i].path);
+        free(s->forks);
+    }
+
+    margin = 1.96 * sqrt(var);
+    fprintf(out, "Estimated size: %.0f bytes (95%% range %.0f to %.0f)\n", total,
+            total - margin < exact ? (double)exact : total - margin, total + margin);
+    fprintf(out, "%ld files, %ld folders, %lld bytes uncompressed; sampled %lld of %lld bytes "
+            "(%.1f%%)\n", files, folders, (long long)uncompressed, (long long)sampled,
+            (long long)compressible, compressible ? 100.0 * sampled / compressible : 100.0);
+    if (total + margin > 0xFFFFFFFFLL) {
+        fprintf(out, "The archive may be over the 4 GB limit, and would then be split\n");
+    }
+    return 0;
+}
@@ -0,0 +1,57 @@
+/*
+ * estimate.h - estimating an archive's size without building it
+ *
+ * With --estimate, the inputs are walked as they would be for a build,
+ * and the sizes of the headers and of anything stored uncompressed are
+ * added up exactly. Forks that would be compressed are sampled instead:
+ * small forks are grouped into strata by size and a share of each is
+ * compressed whole, while each large fork is cut into strata and one
+ * block from each is compressed. The samples go through the same LZW
+ * encoder as a build, and the total is extrapolated from them with a 95%
+ * confidence range.
+ */
+
+#pragma once
+
+#include <stdio.h>
+#include <sys/types.h>
+
+/*
+ * Add bytes that will be in the archive exactly as counted: headers, and
+ * forks which are stored rather than compressed.
+ */
+void estimate_exact(off_t bytes);
+
+/*
+ * Add a fork of length bytes which will be compressed, read from path
+ * starting at offset. With convert, '\n' is changed to '\r' first, as
+ * with -u.
+ */
+void estimate_fork(const char *path, off_t offset, off_t length, int convert);
+
+/*
+ * Compress a fork which can only be read once, in order, from reader(),
+ * as for encode_fork(). It is compressed a block at a time as it is
+ * read, each block starting the encoder afresh, so it counts to within
+ * a percent or so. Nothing is added to the estimate, so that a file whose
+ * forks can't all be read can be counted some other way.
+ *
+ * Returns: the compressed length, with the fork's length in *length, or
+ * -1 if it can't all be read
+ */
+off_t estimate_compress_stream(ssize_t (*reader)(void *ctx, char *buf, size_t len), void *ctx,
+                               off_t *length);
+
+/*
+ * Add a fork of length bytes which compressed to clen bytes with
+ * estimate_compress_stream().
+ */
+void estimate_compressed(off_t length, off_t clen);
+
+/*
+ * Sample the forks added, and write the estimate to out, along with the
+ * number of files and folders and their uncompressed size.
+ *
+ * Returns: the exit status
+ */
+int estimate_report(FILE *out, long files, long folders, off_t uncompressed, int verbose);
@@ -0,0 +1,324 @@
+/*
+ * extract.c - extracting StuffIt archives
+ */
+
+#include "extract.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include "appledouble.h"
+#include "sitindex.h"
+#include "sitread.h"
+#include "util.h"
+
+typedef struct {
+    int entry;
+    int rsrc;                   /* resource fork, to the AppleDouble file */
+} Task;
+
+typedef struct {
+    const SitArchive *arc;
+    const ExtractOptions *opts;
+    Task *tasks;
+    int ntasks;
+    int next;                   /* next task to start */
+    int errors;
+    pthread_mutex_t lock;
+} Job;
+
+typedef struct {
+    int fd;
+    int convert;
+} Output;
+
+static int write_output(void *ctx, const unsigned char *buf, size_t len) {
+    Output *out = ctx;
+    unsigned char tmp[8192];
+
+    while (len > 0) {
+        const unsigned char *p = buf;
+        size_t n = len;
+        ssize_t w;
+        if (out->convert) {     /* convert '\r' to '\n' */
+            size_t i;
+            if (n > sizeof(tmp)) n = sizeof(tmp);
+            for (i = 0; i < n; i++) tmp[i] = (buf[i] == '\r') ? '\n' : buf[i];
+            p = tmp;
+        }
+        if ((w = write(out->fd, p, n)) <= 0) return -1;
+        buf += w;
+        len -= w;
+    }
+    return 0;
+}
+
+/* reserve space for the output up front, where the system allows */
+static void preallocate(int fd, off_t offset, off_t len) {
+#if defined(__linux__) || defined(__FreeBSD__)
+    if (len > 0) posix_fallocate(fd, offset, len);
+#endif
+}
+
+static void set_times(const char *path, uint32_t macDate, long tdiff) {
+    struct timeval tv[2];
+    tv[0].tv_sec = tv[1].tv_sec = (time_t)macDate - tdiff;
+    tv[0].tv_usec = tv[1].tv_usec = 0;
+    utimes(path, tv);
+}
+
+/* a plain text file needs no AppleDouble file */
+static int needs_appledouble(const SitEntry *e) {
+    return e->rsrc.length > 0 || memcmp(e->hdr->fType, "TEXT", 4) != 0;
+}
+
+static int run_task(Job *job, const Task *t, const char *path) {
+    const SitEntry *e = &job->arc->entries[t->entry];
+    Output out;
+    off_t offset = 0;
+    int result;
+
+    if (t->rsrc) {
+        AppleDoubleMetadata meta;
+        memcpy(meta.type, e->hdr->fType, 4);
+        memcpy(meta.creator, e->hdr->fCreator, 4);
+        memcpy(meta.flags, e->hdr->FndrFlags, 2);
+        out.fd = create_appledouble_file(path, &meta, e->rsrc.length, &offset);
+        out.convert = 0;
+    } else {
+        out.fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        out.convert = job->opts->convert;
+    }
+    if (out.fd < 0) {
+        fprintf(stderr, "%s: %s\n", path, strerror(errno));
+        return -1;
+    }
+    preallocate(out.fd, offset, t->rsrc ? e->rsrc.length : e->data.length);
+    result = sit_decode_fork(job->arc, t->rsrc ? &e->rsrc : &e->data, write_output, &out);
+    if (close(out.fd) < 0 && result == SIT_OK) {
+        result = SIT_ABORTED;
+    }
+    if (result != SIT_OK) {
+        fprintf(stderr, "%s%s: %s\n", path, t->rsrc ? " (resource fork)" : "",
+                sit_strerror(result));
+        return -1;
+    }
+    if (!t->rsrc) {
+        set_times(path, get4(e->hdr->mDate), job->opts->tdiff);
+        if (job->opts->verbose) {
+            fprintf(stdout, "%s (%lu bytes) Data:%lu Rsrc:%lu [%.4s/%.4s]\n", e->path,
+                    (unsigned long)e->data.length + e->rsrc.length,
+                    (unsigned long)e->data.length, (unsigned long)e->rsrc.length,
+                    e->hdr->fType, e->hdr->fCreator);
+        }
+    }
+    return 0;
+}
+
+static void *worker(void *arg) {
+    Job *job = arg;
+    char path[PATH_MAX];
+
+    for (;;) {
+        Task *t;
+        pthread_mutex_lock(&job->lock);
+        t = (job->next < job->ntasks) ? &job->tasks[job->next++] : NULL;
+        pthread_mutex_unlock(&job->lock);
+        if (!t) break;
+        snprintf(path, sizeof(path), "%s/%s", job->opts->destdir,
+                 job->arc->entries[t->entry].path);
+        if (run_task(job, t, path) < 0) {
+            pthread_mutex_lock(&job->lock);
+            job->errors++;
+            pthread_mutex_unlock(&job->lock);
+        }
+    }
+    return NULL;
+}
+
+static const SitArchive *sortArc;
+
+static uint32_t task_size(const Task *t) {
+    const SitEntry *e = &sortArc->entries[t->entry];
+    return t->rsrc ? e->rsrc.compLength : e->data.compLength;
+}
+
+/* largest first, so that a big fork doesn't start last */
+static int compare_tasks(const void *a, const void *b) {
+    uint32_t sa = task_size(a), sb = task_size(b);
+    return (sa < sb) - (sa > sb);
+}
+
+int extract_archive(const char *archive, const ExtractOptions *opts) {
+    SitArchive arc;
+    Job job;
+    pthread_t *threads;
+    char path[PATH_MAX];
+    int i, nthreads;
+
+    if (sit_open(archive, &arc) < 0) {
+        return 1;
+    }
+    memset(&job, 0, sizeof(job));
+    job.arc = &arc;
+    job.opts = opts;
+    job.tasks = malloc(2 * arc.nentries * sizeof(Task) + 1);
+    pthread_mutex_init(&job.lock, NULL);
+    if (mkdir(opts->destdir, 0755) < 0 && errno != EEXIST) {
+        perror(opts->destdir);
+        sit_close(&arc);
+        return 1;
+    }
+
+    /* create the folders in order, and list the forks to write */
+    for (i = 0; i < arc.nentries; i++) {
+        const SitEntry *e = &arc.entries[i];
+        if (snprintf(path, sizeof(path), "%s/%s", opts->destdir, e->path) >= sizeof(path)) {
+            fprintf(stderr, "%s: path too long\n", e->path);
+            job.errors++;
+            if (e->isFolder) i = e->next - 1;
+            continue;
+        }
+        if (e->isFolder) {
+            if (mkdir(path, 0755) < 0 && errno != EEXIST) {
+                perror(path);
+                job.errors++;
+                i = e->next - 1;    /* skip its contents */
+            } else if (opts->verbose > 1) {
+                fprintf(stdout, "+ %s (directory)\n", e->path);
+            }
+            continue;
+        }
+        job.tasks[job.ntasks].entry = i;
+        job.tasks[job.ntasks++].rsrc = 0;
+        if (needs_appledouble(e)) {
+            job.tasks[job.ntasks].entry = i;
+            job.tasks[job.ntasks++].rsrc = 1;
+        }
+    }
+    sortArc = &arc;
+    qsort(job.tasks, job.ntasks, sizeof(Task), compare_tasks);
+
+    nthreads = opts->jobs < job.ntasks ? opts->jobs : job.ntasks;
+    if (nthreads < 1) nthreads = 1;
+    threads = malloc(nthreads * sizeof(pthread_t));
+    for (i = 0; i < nthreads; i++) {
+        if (pthread_create(&threads[i], NULL, worker, &job) != 0) {
+            break;
+        }
+    }
+    if (i == 0) {
+        worker(&job);           /* no threads, so do it all here */
+    }
+    while (i-- > 0) {
+        pthread_join(threads[i], NULL);
+    }
+
+    /* folder dates last, innermost first, since writing their contents changes them */
+    for (i = arc.nentries - 1; i >= 0; i--) {
+        const SitEntry *e = &arc.entries[i];
+        if (e->isFolder &&
+            snprintf(path, sizeof(path), "%s/%s", opts->destdir, e->path) < sizeof(path)) {
+            set_times(path, get4(e->hdr->mDate), opts->tdiff);
+        }
+    }
+    if (opts->verbose) {
+        fprintf(stdout, "Extracted %d items from \"%s\"%s\n", arc.nentries, archive,
+                job.errors ? " with errors" : "");
+    }
+    free(threads);
+    free(job.tasks);
+    pthread_mutex_destroy(&job.lock);
+    sit_close(&arc);
+    return job.errors ? 1 : 0;
+}
+
+/* Look a member up in the archive's index, if it has one, attaching the
+ * fork checkpoints to its entry. Returns its index, or -1.
+ */
+static int find_indexed(SitArchive *arc, const char *archive, const char *path) {
+    SitFork rsrc, data;
+    off_t offset;
+    int i;
+
+    if (index_find(archive, arc->arcLen, path, &offset, &rsrc, &data) < 0) {
+        return -1;
+    }
+    if ((i = sit_add_entry(arc, offset, path)) < 0) {
+        index_free_checkpoints(&rsrc);
+        index_free_checkpoints(&data);
+        return -1;
+    }
+    arc->entries[i].rsrc.checkpoints = rsrc.checkpoints;
+    arc->entries[i].rsrc.ncheckpoints = rsrc.ncheckpoints;
+    arc->entries[i].data.checkpoints = data.checkpoints;
+    arc->entries[i].data.ncheckpoints = data.ncheckpoints;
+    return i;
+}
+
+int extract_member(const char *archive, const char *member, int convert, off_t start,
+                   off_t length) {
+    SitArchive arc;
+    Output out;
+    SitEntry *e;
+    char *path = strdup(member);
+    size_t len = strlen(path);
+    int i, rsrc = 0, indexed = 1, result;
+
+    if (sit_map(archive, &arc) < 0) {
+        free(path);
+        return 1;
+    }
+    if ((i = find_indexed(&arc, archive, path)) < 0 && len > 5 &&
+        strcmp(path + len - 5, ":rsrc") == 0) {
+        path[len - 5] = 0;
+        if ((i = find_indexed(&arc, archive, path)) >= 0) rsrc = 1;
+        path[len - 5] = ':';
+    }
+    if (i < 0) {
+        /* no usable index, so scan the headers */
+        indexed = 0;
+        sit_close(&arc);
+        if (sit_open(archive, &arc) < 0) {
+            free(path);
+            return 1;
+        }
+        if ((i = sit_find(&arc, path)) < 0 && len > 5 && strcmp(path + len - 5, ":rsrc") == 0) {
+            /* a name can contain ':', so only take this as the fork if it didn't match */
+            path[len - 5] = 0;
+            rsrc = 1;
+            i = sit_find(&arc, path);
+        }
+    }
+    if (i < 0 || arc.entries[i].isFolder) {
+        fprintf(stderr, "%s: no file \"%s\" in archive\n", archive, member);
+        free(path);
+        sit_close(&arc);
+        return 1;
+    }
+    e = &arc.entries[i];
+    out.fd = STDOUT_FILENO;
+    out.convert = convert && !rsrc;
+    if (start > 0 || length >= 0) {
+        result = sit_decode_range(&arc, rsrc ? &e->rsrc : &e->data, start, length,
+                                  write_output, &out);
+    } else {
+        result = sit_decode_fork(&arc, rsrc ? &e->rsrc : &e->data, write_output, &out);
+    }
+    if (result != SIT_OK) {
+        fprintf(stderr, "%s: %s\n", member, sit_strerror(result));
+    }
+    if (indexed) {
+        index_free_checkpoints(&e->rsrc);
+        index_free_checkpoints(&e->data);
+    }
+    free(path);
+    sit_close(&arc);
+    return result == SIT_OK ? 0 : 1;
+}
@@ -0,0 +1,41 @@
+/*
+ * extract.h - extracting StuffIt archives
+ *
+ * Folders are created in archive order by a single pass over the headers,
+ * and each fork is then decoded and written by a pool of worker threads,
+ * largest first. Data forks become plain files, and resource forks and
+ * Finder Info go in AppleDouble "._name" files, as read by sit when
+ * archiving. Folder dates are applied once everything inside them is done.
+ */
+
+#pragma once
+
+#include <sys/types.h>
+
+typedef struct {
+    const char *destdir;        /* folder to extract into */
+    int jobs;                   /* worker threads */
+    long tdiff;                 /* seconds from Mac to Unix time, as used by sit */
+    int convert;                /* convert '\r' to '\n' in data forks */
+    int verbose;
+} ExtractOptions;
+
+/*
+ * Extract an archive.
+ *
+ * Returns: 0 on success, 1 if anything couldn't be extracted
+ */
+int extract_archive(const char *archive, const ExtractOptions *opts);
+
+/*
+ * Write one fork of an archive member to stdout. The member is given by
+ * its path within the archive, as listed by -v, and its data fork is
+ * written unless the path ends in ":rsrc". If start is past the beginning
+ * or length isn't -1, only that range of the fork is written. The
+ * archive's index is used to find the member, and to start decoding near
+ * the range, if it has one.
+ *
+ * Returns: 0 on success, 1 on error
+ */
+int extract_member(const char *archive, const char *member, int convert, off_t start,
+                   off_t length);
@@ -0,0 +1,139 @@
+/*
+ * forkcache.c - keeping compressed forks for later archives
+ *
+ * Kept forks are in a hash table, chained, and on a list from the most to
+ * the least recently used. Copies are written with the limit set by
+ * --max-write-rate, like the forks they stand for.
+ */
+
+#include "forkcache.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include "throttle.h"
+#include "util.h"
+
+#define BUCKETS 4096
+
+typedef struct Kept {
+    dev_t dev;
+    ino_t ino;
+    off_t size;
+    struct stat st;             /* of the file when it was kept, for its times */
+    int convert;
+    unsigned short crc;
+    unsigned char *data;
+    size_t len;
+    struct Kept *next;          /* in its bucket */
+    struct Kept *newer, *older; /* in the list of uses */
+} Kept;
+
+static size_t budget, used;
+static Kept *buckets[BUCKETS];
+static Kept *newest, *oldest;
+
+void forkcache_set_budget(size_t b) {
+    budget = b;
+}
+
+int forkcache_enabled(void) {
+    return budget > 0;
+}
+
+static Kept **bucket(dev_t dev, ino_t ino) {
+    return &buckets[((size_t)dev * 31 + (size_t)ino) % BUCKETS];
+}
+
+static void unlink_use(Kept *k) {
+    if (k->newer) k->newer->older = k->older; else newest = k->older;
+    if (k->older) k->older->newer = k->newer; else oldest = k->newer;
+    k->newer = k->older = NULL;
+}
+
+static void link_use(Kept *k) {
+    k->older = newest;
+    k->newer = NULL;
+    if (newest) newest->newer = k; else oldest = k;
+    newest = k;
+}
+
+static void drop(Kept *k) {
+    Kept **p;
+
+    for (p = bucket(k->dev, k->ino); *p != k; p = &(*p)->next)
+        ;
+    *p = k->next;
+    unlink_use(k);
+    used -= k->len;
+    free(k->data);
+    free(k);
+}
+
+static Kept *find(const struct stat *st, int convert) {
+    Kept *k;
+
+    for (k = *bucket(st->st_dev, st->st_ino); k; k = k->next) {
+        if (k->dev == st->st_dev && k->ino == st->st_ino && k->convert == convert) return k;
+    }
+    return NULL;
+}
+
+off_t forkcache_take(const struct stat *st, int convert, int fd, unsigned short *crc) {
+    size_t done = 0;
+    ssize_t n;
+    Kept *k;
+
+    if (!budget || !S_ISREG(st->st_mode) || (k = find(st, convert)) == NULL) return -1;
+    if (k->size != st->st_size || !same_times(&k->st, st)) {
+        drop(k);        /* the file has changed */
+        return -1;
+    }
+    throttle_write(k->len);
+    while (done < k->len) {
+        n = write(fd, k->data + done, k->len - done);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) {
+            fprintf(stderr, "Error writing fork data: %s\n", strerror(n < 0 ? errno : EIO));
+            return -2;
+        }
+        done += n;
+    }
+    unlink_use(k);
+    link_use(k);
+    *crc = k->crc;
+    return k->len;
+}
+
+void forkcache_store(const struct stat *st, int infd, int convert, int fd, off_t offset,
+                     off_t length, unsigned short crc) {
+    struct stat now;
+    Kept *k, **b;
+
+    if (!budget || !S_ISREG(st->st_mode) || length <= 0 || (size_t)length > budget / 4) return;
+    if (fstat(infd, &now) != 0 || now.st_size != st->st_size || !same_times(&now, st)) {
+        return;         /* changed while it was read */
+    }
+    if ((k = find(st, convert)) != NULL) drop(k);
+    if ((k = calloc(1, sizeof(Kept))) == NULL) return;
+    if ((k->data = malloc(length)) == NULL ||
+        pread(fd, k->data, length, offset) != (ssize_t)length) {
+        free(k->data);
+        free(k);
+        return;
+    }
+    k->dev = st->st_dev;
+    k->ino = st->st_ino;
+    k->size = st->st_size;
+    k->st = *st;
+    k->convert = convert;
+    k->crc = crc;
+    k->len = length;
+    while (oldest && used + k->len > budget) drop(oldest);
+    b = bucket(k->dev, k->ino);
+    k->next = *b;
+    *b = k;
+    link_use(k);
+    used += k->len;
+}
@@ -0,0 +1,46 @@
+/*
+ * forkcache.h - keeping compressed forks for later archives
+ *
+ * A process which builds many archives, as the workers started by --daemon
+ * do, keeps the compressed data of the forks it has read, up to a budget,
+ * so that a file which turns up in another archive is copied instead of
+ * being compressed again. Forks are matched by the device and inode of
+ * the file they were read from, and used only if its size and times still
+ * match and it was converted the same way. The least recently used forks
+ * are dropped to stay within the budget.
+ */
+
+#pragma once
+
+#include <sys/types.h>
+#include <sys/stat.h>
+
+/*
+ * Set the bytes of compressed data kept. A budget of 0, the default,
+ * keeps nothing.
+ */
+void forkcache_set_budget(size_t budget);
+
+/*
+ * Returns: 1 if forks are being kept, 0 if not
+ */
+int forkcache_enabled(void);
+
+/*
+ * If the fork read from the file st describes was kept, with the same
+ * conversion, write its compressed data to fd and set its CRC in *crc.
+ *
+ * Returns: the compressed length, -1 if it wasn't kept, or -2 if it
+ * couldn't be written
+ */
+off_t forkcache_take(const struct stat *st, int convert, int fd, unsigned short *crc);
+
+/*
+ * Keep the fork read from the file open on infd, which st described
+ * before it was read, and which was compressed to length bytes at offset
+ * in the archive open on fd. Forks whose file has changed since st was
+ * taken, which are too big for the budget, or which can't be read back,
+ * aren't kept.
+ */
+void forkcache_store(const struct stat *st, int infd, int convert, int fd, off_t offset,
+                     off_t length, unsigned short crc);
@@ -0,0 +1,68 @@
+/*
+ * driver.c - running a fuzz target without libFuzzer
+ *
+ * Each file named is given to the target as one input, or, with none,
+ * stdin is, as AFL expects. Built with afl-clang-fast, the target is run
+ * in AFL's persistent mode, many inputs to a process.
+ */
+
+#include "fuzz.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#ifdef __AFL_FUZZ_TESTCASE_LEN
+__AFL_FUZZ_INIT();
+#endif
+
+/* Returns: the contents of a file, or of stdin for NULL, or NULL on error */
+static uint8_t *slurp(const char *path, size_t *size) {
+    FILE *f = path ? fopen(path, "rb") : stdin;
+    uint8_t *data = NULL;
+    size_t cap = 0, n;
+
+    if (!f) {
+        perror(path);
+        return NULL;
+    }
+    *size = 0;
+    do {
+        if (*size == cap) {
+            cap = cap ? cap * 2 : 65536;
+            data = realloc(data, cap);
+        }
+        n = fread(data + *size, 1, cap - *size, f);
+        *size += n;
+    } while (n > 0);
+    if (path) fclose(f);
+    return data;
+}
+
+int main(int argc, char **argv) {
+    uint8_t *data;
+    size_t size;
+    int i;
+
+#ifdef __AFL_FUZZ_TESTCASE_LEN
+    if (argc < 2) {
+        __AFL_INIT();
+        data = __AFL_FUZZ_TESTCASE_BUF;
+        while (__AFL_LOOP(10000)) {
+            LLVMFuzzerTestOneInput(data, __AFL_FUZZ_TESTCASE_LEN);
+        }
+        return 0;
+    }
+#endif
+    if (argc < 2) {
+        if ((data = slurp(NULL, &size)) == NULL) return 1;
+        LLVMFuzzerTestOneInput(data, size);
+        free(data);
+        return 0;
+    }
+    for (i = 1; i < argc; i++) {
+        if ((data = slurp(argv[i], &size)) == NULL) return 1;
+        LLVMFuzzerTestOneInput(data, size);
+        free(data);
+    }
+    return 0;
+}
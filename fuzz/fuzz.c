@@ -0,0 +1,84 @@
+/*
+ * fuzz.c - support shared by the fuzz targets
+ */
+
+#include "fuzz.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+static double started;
+static char scratch[] = "/tmp/sit-fuzz.XXXXXX";
+static int scratchFd = -1;
+
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+void fuzz_start(void) {
+    started = now();
+}
+
+void fuzz_finish(const char *target) {
+    static double budget;
+    double elapsed = now() - started;
+
+    if (budget == 0) {
+        const char *env = getenv("SIT_FUZZ_BUDGET_MS");
+        budget = (env && atof(env) > 0 ? atof(env) : FUZZ_BUDGET_MS) / 1e3;
+    }
+    if (elapsed > budget) {
+        fprintf(stderr, "%s: input took %.0f ms, over the budget of %.0f ms\n",
+                target, elapsed * 1e3, budget * 1e3);
+        abort();
+    }
+}
+
+static void remove_scratch(void) {
+    unlink(scratch);
+}
+
+const char *fuzz_file(const uint8_t *data, size_t size) {
+    size_t done = 0;
+    ssize_t n;
+
+    if (scratchFd < 0) {
+        if ((scratchFd = mkstemp(scratch)) < 0) {
+            perror(scratch);
+            exit(1);
+        }
+        atexit(remove_scratch);
+    }
+    if (ftruncate(scratchFd, 0) != 0) {
+        perror(scratch);
+        exit(1);
+    }
+    while (done < size) {
+        if ((n = pwrite(scratchFd, data + done, size - done, done)) <= 0) {
+            perror(scratch);
+            exit(1);
+        }
+        done += n;
+    }
+    return scratch;
+}
+
+int fuzz_sink(void *ctx, const unsigned char *buf, size_t len) {
+    FuzzSink *s = ctx;
+    volatile unsigned char touch = 0;
+    size_t i;
+
+    for (i = 0; i < len; i += 4096) touch ^= buf[i];   /* the data must be readable */
+    if (len) touch ^= buf[len - 1];
+    s->total += len;
+    if (s->total > s->limit) {
+        fprintf(stderr, "decoder passed on %llu bytes, more than the %llu asked for\n",
+                (unsigned long long)s->total, (unsigned long long)s->limit);
+        abort();
+    }
+    return 0;
+}
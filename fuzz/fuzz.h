@@ -0,0 +1,51 @@
+/*
+ * fuzz.h - support shared by the fuzz targets
+ *
+ * Each target is a libFuzzer entry point, LLVMFuzzerTestOneInput(), which
+ * driver.c can also run on files, for AFL or for replaying a corpus.
+ * Besides crashes and sanitizer reports, a target aborts when an input
+ * takes longer than its time budget, to catch pathological slow paths:
+ * FUZZ_BUDGET_MS milliseconds, or the number given in $SIT_FUZZ_BUDGET_MS.
+ * Forks are limited to FUZZ_MAX_LENGTH bytes, so that an input can't ask
+ * for more output than fits in the budget.
+ */
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include "../sitread.h"
+
+#define FUZZ_BUDGET_MS      250
+#define FUZZ_MAX_LENGTH     1048576
+
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size);
+
+/*
+ * Start timing an input against the budget.
+ */
+void fuzz_start(void);
+
+/*
+ * Abort, naming the target, if the input has taken longer than the budget.
+ */
+void fuzz_finish(const char *target);
+
+/*
+ * Write an input to a scratch file, for the readers which map an archive
+ * by its path. The file is removed when the target exits.
+ *
+ * Returns: its path
+ */
+const char *fuzz_file(const uint8_t *data, size_t size);
+
+/*
+ * A sink which checks that a decoder passes on no more than it was asked
+ * for, aborting otherwise. ctx points to a FuzzSink.
+ */
+typedef struct {
+    uint64_t limit;
+    uint64_t total;
+} FuzzSink;
+
+int fuzz_sink(void *ctx, const unsigned char *buf, size_t len);
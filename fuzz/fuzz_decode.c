@@ -0,0 +1,80 @@
+/*
+ * fuzz_decode.c - fuzz targets for the fork decoders
+ *
+ * Built once per method, with FUZZ_METHOD set to it and FUZZ_NAME to the
+ * target's name, each target decodes an input as a whole fork:
+ *
+ *   bytes 0-3   uncompressed length, big-endian, up to FUZZ_MAX_LENGTH
+ *   bytes 4-5   CRC of the uncompressed fork
+ *   bytes 6-    the compressed fork
+ *
+ * Built without FUZZ_METHOD, as fuzz_range, it decodes part of a fork, as
+ * --cat --range does, starting from a restart point for LZW:
+ *
+ *   byte 0      method: noComp, repComp, lzwComp, hufComp or lzhufComp,
+ *               by its value modulo 5
+ *   bytes 1-4   uncompressed length
+ *   bytes 5-6   CRC
+ *   bytes 7-10  start of the range
+ *   bytes 11-14 length of the range, or 0xffffffff for the rest
+ *   bytes 15-22 a restart point: compressed and uncompressed offsets,
+ *               unused if the uncompressed offset is 0xffffffff
+ *   bytes 23-   the compressed fork
+ */
+
+#include "fuzz.h"
+#include <string.h>
+#include "../util.h"
+
+#ifdef FUZZ_METHOD
+#define HEADER  6
+#else
+#define HEADER  23
+#define FUZZ_NAME "fuzz_range"
+#endif
+
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size) {
+    SitArchive arc;
+    SitFork fork;
+    FuzzSink s;
+#ifndef FUZZ_METHOD
+    static const int methods[] = { noComp, repComp, lzwComp, hufComp, lzhufComp };
+    SitCheckpoint cp;
+    uint32_t start, length;
+#endif
+
+    if (size < HEADER) return 0;
+    fuzz_start();
+    memset(&arc, 0, sizeof(arc));
+    memset(&fork, 0, sizeof(fork));
+    arc.map = data;
+    arc.size = size;
+    fork.offset = HEADER;
+    fork.compLength = size - HEADER;
+#ifdef FUZZ_METHOD
+    fork.method = FUZZ_METHOD;
+    fork.length = get4(data) % (FUZZ_MAX_LENGTH + 1);
+    fork.crc = get2(data + 4);
+    s.limit = fork.length;
+    s.total = 0;
+    sit_decode_fork(&arc, &fork, fuzz_sink, &s);
+#else
+    fork.method = methods[data[0] % 5];
+    fork.length = get4(data + 1) % (FUZZ_MAX_LENGTH + 1);
+    fork.crc = get2(data + 5);
+    start = get4(data + 7);
+    length = get4(data + 11);
+    cp.compressed = get4(data + 15);
+    cp.uncompressed = get4(data + 19);
+    if (cp.uncompressed != 0xffffffff) {
+        fork.checkpoints = &cp;
+        fork.ncheckpoints = 1;
+    }
+    s.limit = length == 0xffffffff ? fork.length : length;
+    s.total = 0;
+    sit_decode_range(&arc, &fork, start, length == 0xffffffff ? -1 : (off_t)length,
+                     fuzz_sink, &s);
+#endif
+    fuzz_finish(FUZZ_NAME);
+    return 0;
+}
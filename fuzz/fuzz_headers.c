@@ -0,0 +1,71 @@
+/*
+ * fuzz_headers.c - fuzz target for scanning an archive's headers
+ *
+ * The input is a whole archive. Its headers are scanned, checking folder
+ * nesting, as every reader does, then each file is looked up again by its
+ * offset, as with an index, and its forks are decoded. So that mutations
+ * get past the header CRCs, each header's CRC is recomputed first, along
+ * the chain of headers and forks, unless the last reserved byte of the
+ * archive header is set.
+ */
+
+#include "fuzz.h"
+#include <stdlib.h>
+#include <string.h>
+#include "../util.h"
+
+extern unsigned short updcrc(unsigned short icrc, unsigned char *icp, int icnt);
+
+static void resign(uint8_t *data, size_t size) {
+    size_t pos = sizeof(sitHdr);
+
+    while (pos + sizeof(fileHdr) <= size) {
+        fileHdr *h = (fileHdr *)(data + pos);
+        uint16_t crc = updcrc(0, (unsigned char *)h, sizeof(fileHdr) - 2);
+        h->hdrCRC[0] = crc >> 8;
+        h->hdrCRC[1] = crc;
+        pos += sizeof(fileHdr);
+        if (h->compRMethod != startFolder && h->compRMethod != endFolder &&
+            h->compDMethod != startFolder && h->compDMethod != endFolder) {
+            pos += (size_t)get4(h->cRLen) + get4(h->cDLen);
+        }
+    }
+}
+
+static void decode(const SitArchive *arc, const SitFork *fork) {
+    FuzzSink s = { fork->length, 0 };
+
+    if (fork->length <= FUZZ_MAX_LENGTH) sit_decode_fork(arc, fork, fuzz_sink, &s);
+}
+
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size) {
+    SitArchive arc, byOffset;
+    uint8_t *copy;
+    int i;
+
+    if (size < sizeof(sitHdr)) return 0;
+    fuzz_start();
+    copy = malloc(size);
+    memcpy(copy, data, size);
+    if (((const sitHdr *)copy)->reserved[6] == 0) resign(copy, size);
+    if (sit_open(fuzz_file(copy, size), &arc) == 0) {
+        if (sit_map(fuzz_file(copy, size), &byOffset) != 0) abort();
+        for (i = 0; i < arc.nentries; i++) {
+            const SitEntry *e = &arc.entries[i];
+            if (e->parent >= i || (e->parent >= 0 && !arc.entries[e->parent].isFolder) ||
+                e->depth != (e->parent >= 0 ? arc.entries[e->parent].depth + 1 : 0) ||
+                sit_find(&arc, e->path) < 0) {
+                abort();        /* the scan let through a broken tree */
+            }
+            if (e->isFolder) continue;
+            decode(&arc, &e->rsrc);
+            decode(&arc, &e->data);
+            if (sit_add_entry(&byOffset, e->offset, e->path) < 0) abort();
+        }
+        sit_close(&byOffset);
+        sit_close(&arc);
+    }
+    free(copy);
+    fuzz_finish("fuzz_headers");
+    return 0;
+}
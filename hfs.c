@@ -0,0 +1,441 @@
+/*
+ * hfs.c - reading files from HFS disk images
+ *
+ * The catalog's leaf nodes are read in order, collecting a record for
+ * every file and folder. Catalog keys sort by the ID of the folder an
+ * entry is in first, so each folder's contents come out consecutive.
+ * Extents beyond the three held in a catalog record are looked up in the
+ * extents B-tree, whose leaf records are collected the same way.
+ */
+
+#include "hfs.h"
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "throttle.h"
+#include "util.h"
+
+#define SECTOR          512
+#define NODE_SIZE       512         /* B-tree nodes are always this size on HFS */
+#define MDB_OFFSET      1024        /* of the master directory block */
+#define MDB_SIZE        162
+#define HFS_SIG         0x4244      /* 'BD' */
+#define HFS_PLUS_SIG    0x482B      /* 'H+', embedded in an HFS wrapper */
+#define DC42_HEADER     84          /* DiskCopy 4.2 header */
+
+#define ROOT_PARENT     1           /* parent ID of the root folder */
+#define ROOT_ID         2
+#define EXTENTS_FILE    3           /* file numbers of the B-trees */
+#define CATALOG_FILE    4
+
+#define LEAF_NODE       0xFF        /* ndType -1 */
+#define FOLDER_RECORD   1
+#define FILE_RECORD     2
+#define FOLDER_SIZE     70
+#define FILE_SIZE       102
+#define RSRC_FORK       0xFF        /* xkrFkType */
+
+/* an extents B-tree leaf record */
+typedef struct {
+    uint32_t file;
+    int rsrc;
+    uint16_t start;             /* first allocation block of the fork it maps */
+    unsigned char extents[12];
+} Overflow;
+
+struct HfsVolume {
+    char *path;
+    unsigned char *map;
+    size_t size;
+    off_t blocks;               /* offset of allocation block 0 */
+    uint32_t blockSize;
+    uint16_t nblocks;
+    HfsEntry *entries;          /* in catalog order */
+    int nentries;
+    const HfsEntry *root;
+    Overflow *overflow;
+    int noverflow;
+};
+
+typedef int (*leaf_fn)(HfsVolume *vol, const unsigned char *key, size_t keyLen,
+                       const unsigned char *data, size_t dataLen);
+
+int is_hfs_image_name(const char *filename) {
+    static const char *exts[] = { ".dsk", ".img", ".image", ".hfs" };
+    const char *dot = strrchr(filename, '.');
+    size_t i;
+
+    if (!dot) return 0;
+    for (i = 0; i < sizeof(exts) / sizeof(exts[0]); i++) {
+        if (strcasecmp(dot, exts[i]) == 0) return 1;
+    }
+    return 0;
+}
+
+static int damaged(const HfsVolume *vol, const char *why) {
+    fprintf(stderr, "%s: damaged HFS volume: %s\n", vol->path, why);
+    return -2;
+}
+
+static int has_signature(const HfsVolume *vol, off_t base) {
+    return base + MDB_OFFSET + MDB_SIZE <= (off_t)vol->size &&
+           get2(vol->map + base + MDB_OFFSET) == HFS_SIG;
+}
+
+/*
+ * Find where the volume starts: at the start of the image, after a
+ * DiskCopy 4.2 header, or in the first Apple_HFS partition.
+ *
+ * Returns: its offset, or -1 if there's no HFS volume
+ */
+static off_t find_volume(const HfsVolume *vol) {
+    const unsigned char *m = vol->map;
+    uint32_t i, count;
+
+    if (has_signature(vol, 0)) return 0;
+    if (vol->size > DC42_HEADER && m[0] < 64 && get2(m + 82) == 0x0100 &&
+        has_signature(vol, DC42_HEADER)) {
+        return DC42_HEADER;
+    }
+    if (vol->size < 2 * SECTOR || memcmp(m + SECTOR, "PM", 2) != 0) return -1;
+    count = get4(m + SECTOR + 4);
+    for (i = 0; i < count && (off_t)(i + 2) * SECTOR <= (off_t)vol->size; i++) {
+        const unsigned char *pm = m + (off_t)(i + 1) * SECTOR;
+        if (memcmp(pm, "PM", 2) == 0 && strncmp((const char *)pm + 48, "Apple_HFS", 32) == 0 &&
+            has_signature(vol, (off_t)get4(pm + 8) * SECTOR)) {
+            return (off_t)get4(pm + 8) * SECTOR;
+        }
+    }
+    return -1;
+}
+
+static const Overflow *find_overflow(const HfsVolume *vol, uint32_t file, int rsrc,
+                                     uint32_t start) {
+    int i;
+
+    for (i = 0; i < vol->noverflow; i++) {
+        const Overflow *o = &vol->overflow[i];
+        if (o->file == file && o->rsrc == rsrc && o->start == start) return o;
+    }
+    return NULL;
+}
+
+/*
+ * Find the ranges of the image holding length bytes of a fork, starting
+ * with the three extents in first and going on to those in the extents
+ * B-tree.
+ *
+ * Returns: the number of ranges, or -1 if the extents are damaged
+ */
+static int map_fork(const HfsVolume *vol, uint32_t file, int rsrc, const unsigned char *first,
+                    off_t length, HfsRange **ranges) {
+    const unsigned char *ext = first;
+    uint32_t blocks = 0;
+    off_t left = length;
+    int n = 0, k;
+
+    *ranges = NULL;
+    while (left > 0) {
+        HfsRange *more = realloc(*ranges, (n + 3) * sizeof(HfsRange));
+        if (!more) goto fail;
+        *ranges = more;
+        for (k = 0; k < 3 && left > 0; k++) {
+            uint16_t start = get2(ext + 4 * k), count = get2(ext + 4 * k + 2);
+            HfsRange *r = &(*ranges)[n++];
+            if (count == 0 || (uint32_t)start + count > vol->nblocks) goto fail;
+            r->offset = vol->blocks + (off_t)start * vol->blockSize;
+            r->length = (off_t)count * vol->blockSize;
+            if (r->length > left) r->length = left;
+            if (r->offset + r->length > (off_t)vol->size) goto fail;
+            left -= r->length;
+            blocks += count;
+        }
+        if (left > 0) {
+            const Overflow *o = find_overflow(vol, file, rsrc, blocks);
+            if (!o) goto fail;
+            ext = o->extents;
+        }
+    }
+    return n;
+
+fail:
+    free(*ranges);
+    *ranges = NULL;
+    return -1;
+}
+
+/*
+ * Call fn for each record in the leaf nodes of the B-tree whose file
+ * occupies ranges, in order.
+ *
+ * Returns: 0, or -1 if the B-tree is damaged
+ */
+static int walk_leaves(HfsVolume *vol, const HfsRange *ranges, int nranges, leaf_fn fn) {
+    off_t fileLen = 0;
+    uint32_t node, nnodes, seen = 0;
+    const unsigned char *n, *hdr;
+    int i;
+
+    for (i = 0; i < nranges; i++) {
+        if (ranges[i].length % NODE_SIZE) return -1;
+        fileLen += ranges[i].length;
+    }
+    if (fileLen < NODE_SIZE) return -1;
+    hdr = vol->map + ranges[0].offset;
+    if (hdr[8] != 1 || get2(hdr + 14 + 18) != NODE_SIZE) return -1;
+    node = get4(hdr + 14 + 10);
+    nnodes = fileLen / NODE_SIZE;
+    while (node != 0) {
+        off_t pos = (off_t)node * NODE_SIZE;
+        uint16_t nrecs, r;
+        size_t limit;
+        if (node >= nnodes || ++seen > nnodes) return -1;
+        for (i = 0; pos >= ranges[i].length; i++) pos -= ranges[i].length;
+        n = vol->map + ranges[i].offset + pos;
+        nrecs = get2(n + 10);
+        if (n[8] != LEAF_NODE || 14 + 2 * (nrecs + 1) > NODE_SIZE) return -1;
+        limit = NODE_SIZE - 2 * (nrecs + 1);     /* where the record offsets start */
+        for (r = 0; r < nrecs; r++) {
+            size_t off = get2(n + NODE_SIZE - 2 * (r + 1));
+            size_t end = get2(n + NODE_SIZE - 2 * (r + 2));
+            size_t data;
+            if (off < 14 || end > limit || off >= end) return -1;
+            data = off + 1 + n[off];
+            data += data & 1;
+            if (data > end) return -1;
+            if (fn(vol, n + off + 1, n[off], n + data, end - data) < 0) return -1;
+        }
+        node = get4(n);
+    }
+    return 0;
+}
+
+static int add_overflow(HfsVolume *vol, const unsigned char *key, size_t keyLen,
+                        const unsigned char *data, size_t dataLen) {
+    Overflow *o;
+
+    if (keyLen < 7 || dataLen < 12) return -1;
+    if (vol->noverflow % 64 == 0) {
+        Overflow *more = realloc(vol->overflow, (vol->noverflow + 64) * sizeof(Overflow));
+        if (!more) return -1;
+        vol->overflow = more;
+    }
+    o = &vol->overflow[vol->noverflow++];
+    o->rsrc = key[0] == RSRC_FORK;
+    o->file = get4(key + 1);
+    o->start = get2(key + 5);
+    memcpy(o->extents, data, 12);
+    return 0;
+}
+
+static int add_entry(HfsVolume *vol, const unsigned char *key, size_t keyLen,
+                     const unsigned char *data, size_t dataLen) {
+    HfsEntry *e;
+
+    if (keyLen < 6 || key[5] > 31 || 6 + (size_t)key[5] > keyLen || dataLen < 1) return -1;
+    if (data[0] != FOLDER_RECORD && data[0] != FILE_RECORD) return 0;  /* a thread */
+    if (dataLen < (data[0] == FOLDER_RECORD ? FOLDER_SIZE : FILE_SIZE)) return -1;
+    if (vol->nentries % 256 == 0) {
+        HfsEntry *more = realloc(vol->entries, (vol->nentries + 256) * sizeof(HfsEntry));
+        if (!more) return -1;
+        vol->entries = more;
+    }
+    e = &vol->entries[vol->nentries++];
+    memset(e, 0, sizeof(HfsEntry));
+    memcpy(e->name, key + 5, key[5] + 1);
+    e->parent = get4(key + 1);
+    if (data[0] == FOLDER_RECORD) {
+        e->isFolder = 1;
+        e->id = get4(data + 6);
+        e->cDate = get4(data + 10);
+        e->mDate = get4(data + 14);
+    } else {
+        memcpy(e->type, data + 4, 4);
+        memcpy(e->creator, data + 8, 4);
+        memcpy(e->flags, data + 12, 2);
+        e->id = get4(data + 20);
+        e->dataLen = get4(data + 26);
+        e->rsrcLen = get4(data + 36);
+        e->cDate = get4(data + 44);
+        e->mDate = get4(data + 48);
+        memcpy(e->extents[0], data + 74, 12);
+        memcpy(e->extents[1], data + 86, 12);
+    }
+    return 0;
+}
+
+static int compare_ids(const void *a, const void *b) {
+    uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+    return x < y ? -1 : x > y;
+}
+
+/*
+ * Check that the entries are grouped into folders and find the root.
+ * Folder IDs must be unique, and no folder may be the root's parent, so
+ * that walking down from the root can't loop.
+ *
+ * Returns: 0, or -1 if the catalog is damaged
+ */
+static int arrange_entries(HfsVolume *vol) {
+    uint32_t *ids;
+    int i, nfolders = 0, status = 0;
+
+    if (vol->nentries == 0) return -1;
+    if ((ids = malloc(vol->nentries * sizeof(uint32_t))) == NULL) return -1;
+    for (i = 0; i < vol->nentries; i++) {
+        const HfsEntry *e = &vol->entries[i];
+        if (i > 0 && e->parent < e[-1].parent) status = -1;
+        if (!e->isFolder) continue;
+        if (e->id == ROOT_PARENT) status = -1;
+        if (e->parent == ROOT_PARENT) {
+            if (e->id != ROOT_ID || vol->root) status = -1;
+            vol->root = e;
+        }
+        ids[nfolders++] = e->id;
+    }
+    qsort(ids, nfolders, sizeof(uint32_t), compare_ids);
+    for (i = 1; i < nfolders; i++) {
+        if (ids[i] == ids[i - 1]) status = -1;
+    }
+    free(ids);
+    return vol->root ? status : -1;
+}
+
+/*
+ * Read the master directory block and both B-trees.
+ *
+ * Returns: 0, -1 if there's no HFS volume, or -2 if it's damaged
+ */
+static int read_volume(HfsVolume *vol) {
+    const unsigned char *mdb;
+    HfsRange *ranges;
+    off_t base;
+    int n, status;
+
+    if ((base = find_volume(vol)) < 0) return -1;
+    mdb = vol->map + base + MDB_OFFSET;
+    if (get2(mdb + 124) == HFS_PLUS_SIG) {
+        fprintf(stderr, "%s: HFS Plus volumes aren't supported\n", vol->path);
+        return -2;
+    }
+    vol->blockSize = get4(mdb + 20);
+    vol->nblocks = get2(mdb + 18);
+    vol->blocks = base + (off_t)get2(mdb + 28) * SECTOR;
+    if (vol->blockSize == 0 || vol->blockSize % SECTOR) {
+        return damaged(vol, "bad allocation block size");
+    }
+
+    n = map_fork(vol, EXTENTS_FILE, 0, mdb + 134, get4(mdb + 130), &ranges);
+    if (n <= 0) return damaged(vol, "can't find the extents B-tree");
+    status = walk_leaves(vol, ranges, n, add_overflow);
+    free(ranges);
+    if (status < 0) return damaged(vol, "bad extents B-tree");
+
+    n = map_fork(vol, CATALOG_FILE, 0, mdb + 150, get4(mdb + 146), &ranges);
+    if (n <= 0) return damaged(vol, "can't find the catalog B-tree");
+    status = walk_leaves(vol, ranges, n, add_entry);
+    free(ranges);
+    if (status < 0) return damaged(vol, "bad catalog B-tree");
+    if (arrange_entries(vol) < 0) return damaged(vol, "bad folder structure");
+    return 0;
+}
+
+int hfs_open(const char *path, HfsVolume **volp) {
+    HfsVolume *vol;
+    struct stat st;
+    int fd, status;
+
+    *volp = NULL;
+    if ((fd = open(path, O_RDONLY)) < 0) return -1;
+    if (fstat(fd, &st) < 0 || st.st_size < MDB_OFFSET + MDB_SIZE ||
+        (vol = calloc(1, sizeof(HfsVolume))) == NULL) {
+        close(fd);
+        return -1;
+    }
+    vol->size = st.st_size;
+    vol->map = mmap(NULL, vol->size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (vol->map == MAP_FAILED || (vol->path = strdup(path)) == NULL) {
+        if (vol->map != MAP_FAILED) munmap(vol->map, vol->size);
+        free(vol);
+        return -1;
+    }
+    if ((status = read_volume(vol)) < 0) {
+        hfs_close(vol);
+        return status;
+    }
+    *volp = vol;
+    return 0;
+}
+
+const HfsEntry *hfs_root(const HfsVolume *vol) {
+    return vol->root;
+}
+
+int hfs_children(const HfsVolume *vol, const HfsEntry *folder, const HfsEntry **first) {
+    int lo = 0, hi = vol->nentries, n = 0;
+
+    while (lo < hi) {   /* find the first whose parent is the folder */
+        int mid = (lo + hi) / 2;
+        if (vol->entries[mid].parent < folder->id) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    *first = &vol->entries[lo];
+    while (lo + n < vol->nentries && vol->entries[lo + n].parent == folder->id) n++;
+    return n;
+}
+
+int hfs_open_fork(const HfsVolume *vol, const HfsEntry *file, int rsrc, HfsFork *fork) {
+    memset(fork, 0, sizeof(HfsFork));
+    fork->map = vol->map;
+    fork->nranges = map_fork(vol, file->id, rsrc, file->extents[rsrc],
+                             rsrc ? file->rsrcLen : file->dataLen, &fork->ranges);
+    if (fork->nranges < 0) {
+        fprintf(stderr, "%s: damaged HFS volume: bad extents for the %s fork of %.*s\n",
+                vol->path, rsrc ? "resource" : "data", file->name[0], file->name + 1);
+        return -1;
+    }
+    return 0;
+}
+
+ssize_t hfs_read_fork(void *ctx, char *buf, size_t len) {
+    HfsFork *f = ctx;
+    size_t done = 0;
+
+    while (done < len && f->cur < f->nranges) {
+        const HfsRange *r = &f->ranges[f->cur];
+        size_t n = len - done;
+        if ((off_t)n > r->length - f->within) n = r->length - f->within;
+        memcpy(buf + done, f->map + r->offset + f->within, n);
+        done += n;
+        f->within += n;
+        if (f->within == r->length) {
+            f->cur++;
+            f->within = 0;
+        }
+    }
+    if (done) throttle_read(done);
+    return done;
+}
+
+void hfs_close_fork(HfsFork *fork) {
+    free(fork->ranges);
+    fork->ranges = NULL;
+}
+
+void hfs_close(HfsVolume *vol) {
+    if (!vol) return;
+    munmap(vol->map, vol->size);
+    free(vol->entries);
+    free(vol->overflow);
+    free(vol->path);
+    free(vol);
+}
@@ -0,0 +1,98 @@
+/*
+ * hfs.h - reading files from HFS disk images
+ *
+ * A disk image holding an HFS volume (a raw .dsk, .img, .image or .hfs
+ * file, a DiskCopy 4.2 image, or a disk with an Apple partition map) is
+ * archived as a folder holding the volume's files, without mounting it or
+ * unpacking it first. The image is mapped into memory, the catalog and
+ * extents B-trees are read to find each file's forks and Finder info, and
+ * the forks are read straight from the allocation blocks they occupy.
+ * HFS Plus volumes aren't supported.
+ */
+
+#pragma once
+
+#include <stdint.h>
+#include <sys/types.h>
+
+typedef struct HfsVolume HfsVolume;
+
+/* A file or folder on the volume, from its catalog record */
+typedef struct {
+    unsigned char name[32];     /* a Pascal string, MacRoman */
+    int isFolder;
+    uint32_t id;                /* folder ID or file number */
+    uint32_t parent;            /* ID of the folder holding it */
+    char type[4];               /* Finder info, for files */
+    char creator[4];
+    char flags[2];
+    uint32_t cDate, mDate;      /* Mac times, as stored */
+    uint32_t dataLen, rsrcLen;
+    unsigned char extents[2][12];   /* first data and resource extents */
+} HfsEntry;
+
+/* A stretch of a fork which is contiguous in the image */
+typedef struct {
+    off_t offset;
+    off_t length;
+} HfsRange;
+
+/* A fork being read, as a fork_reader context */
+typedef struct {
+    const unsigned char *map;
+    HfsRange *ranges;
+    int nranges;
+    int cur;                    /* range being read */
+    off_t within;               /* bytes of it read */
+} HfsFork;
+
+/*
+ * Check whether a file name has an extension used for disk images.
+ *
+ * Returns: 1 if it does, 0 otherwise
+ */
+int is_hfs_image_name(const char *filename);
+
+/*
+ * Map a disk image and read its catalog. A damaged volume is reported on
+ * stderr.
+ *
+ * Returns: 0 on success, -1 if the image doesn't hold an HFS volume, or
+ * -2 if the volume is damaged or unsupported.
+ * On success, hfs_close() must be called to unmap it.
+ */
+int hfs_open(const char *path, HfsVolume **vol);
+
+/*
+ * Returns: the volume's root folder, which has the volume's name
+ */
+const HfsEntry *hfs_root(const HfsVolume *vol);
+
+/*
+ * Find the files and folders in a folder, which are consecutive, in the
+ * catalog's order.
+ *
+ * Returns: the number of them, with the first in *first
+ */
+int hfs_children(const HfsVolume *vol, const HfsEntry *folder, const HfsEntry **first);
+
+/*
+ * Find where a file's data fork, or with rsrc its resource fork, lies in
+ * the image, and prepare to read it with hfs_read_fork(). A damaged fork
+ * is reported on stderr.
+ *
+ * Returns: 0 on success, -1 if the fork can't be found
+ * On success, hfs_close_fork() must be called to release it.
+ */
+int hfs_open_fork(const HfsVolume *vol, const HfsEntry *file, int rsrc, HfsFork *fork);
+
+/*
+ * Read the next part of a fork; a fork_reader for encode_fork().
+ *
+ * Returns: the number of bytes placed in buf, or 0 at the end of the fork
+ */
+ssize_t hfs_read_fork(void *ctx, char *buf, size_t len);
+
+void hfs_close_fork(HfsFork *fork);
+
+void hfs_close(HfsVolume *vol);
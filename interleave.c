@@ -0,0 +1,189 @@
+/*
+ * interleave.c - compressing small forks several at a time
+ *
+ * Each fork read ahead is kept with the device, inode, size and times of
+ * its file, and is only used if the file still matches when it's reached;
+ * otherwise the file is compressed afresh, as it would have been anyway.
+ * Reads and writes are accounted to the limits set with --max-read-rate
+ * and --max-write-rate.
+ */
+
+#include "interleave.h"
+#include <sys/stat.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include "binhex.h"
+#include "throttle.h"
+#include "util.h"
+#include "zopen.h"
+
+extern unsigned short updcrc(unsigned short icrc, unsigned char *icp, int icnt);
+
+typedef struct {
+    char *path;
+    int convert;
+    struct stat st;             /* of the file when it was read */
+    unsigned char *data;        /* the fork, then its compressed data */
+    size_t len;
+    unsigned short crc;
+} Ahead;
+
+static int width;
+static Ahead ahead[INTERLEAVE_MAX_FILES];
+static int nahead;
+
+void interleave_set_width(int w) {
+    width = w;
+}
+
+int interleave_enabled(void) {
+    return width > 1;
+}
+
+int interleave_candidate(const char *path) {
+    struct stat st;
+
+    return stat(path, &st) == 0 && S_ISREG(st.st_mode) && st.st_nlink == 1 &&
+           st.st_size > 0 && st.st_size <= INTERLEAVE_MAX_FORK && !is_binhex_name(path);
+}
+
+static void drop(Ahead *a) {
+    free(a->path);
+    free(a->data);
+    memset(a, 0, sizeof(*a));
+}
+
+static int same_file(const struct stat *a, const struct stat *b) {
+    return a->st_dev == b->st_dev && a->st_ino == b->st_ino && a->st_size == b->st_size &&
+           same_times(a, b);
+}
+
+/* Returns: 0, or -1 if the fork can't be read whole */
+static int read_fork(Ahead *a) {
+    size_t got = 0;
+    ssize_t n;
+    char *c;
+    int fd;
+
+    if ((fd = open(a->path, O_RDONLY)) < 0) return -1;
+    if (fstat(fd, &a->st) != 0 || !S_ISREG(a->st.st_mode) ||
+        a->st.st_size <= 0 || a->st.st_size > INTERLEAVE_MAX_FORK ||
+        (a->data = malloc(a->st.st_size)) == NULL) {
+        close(fd);
+        return -1;
+    }
+    while (got < (size_t)a->st.st_size &&
+           (n = read(fd, a->data + got, a->st.st_size - got)) > 0) {
+        throttle_read(n);
+        got += n;
+    }
+    close(fd);
+    if (got != (size_t)a->st.st_size) return -1;
+    a->len = got;
+    if (a->convert) {   /* convert '\n' to '\r' */
+        for (c = (char *)a->data; c < (char *)a->data + a->len; c++) {
+            if (*c == '\n') *c = '\r';
+        }
+    }
+    a->crc = updcrc(0, a->data, a->len);
+    return 0;
+}
+
+/* compress forks [first, first+n) of those read ahead, together */
+static void compress_run(int first, int n) {
+    const unsigned char *in[INTERLEAVE_MAX_WIDTH];
+    size_t len[INTERLEAVE_MAX_WIDTH];
+    FILE *out[INTERLEAVE_MAX_WIDTH];
+    char *cdata[INTERLEAVE_MAX_WIDTH];
+    size_t clen[INTERLEAVE_MAX_WIDTH];
+    int k, m = 0;
+
+    for (k = 0; k < n; k++) {
+        Ahead *a = &ahead[first + k];
+        cdata[m] = NULL;
+        if ((out[m] = open_memstream(&cdata[m], &clen[m])) == NULL) {
+            drop(a);
+            continue;
+        }
+        in[m] = a->data;
+        len[m] = a->len;
+        m++;
+    }
+    if (m == 0) return;
+    /* the streams are closed by zcompress_lockstep() whether it succeeds
+       or not, so cdata[] holds their final buffers either way */
+    if (zcompress_lockstep(in, len, out, m, 14) != 0) {
+        /* compressed one at a time when they're reached instead */
+        for (k = 0; k < n; k++) drop(&ahead[first + k]);
+        for (k = 0; k < m; k++) free(cdata[k]);
+        return;
+    }
+    for (k = 0, m = 0; k < n; k++) {
+        Ahead *a = &ahead[first + k];
+        if (!a->path) continue;
+        free(a->data);
+        a->data = (unsigned char *)cdata[m];
+        a->len = clen[m];
+        m++;
+    }
+}
+
+void interleave_prepare(char **paths, int npaths, int convert) {
+    int i, start;
+
+    for (i = 0; i < nahead; i++) drop(&ahead[i]);
+    nahead = 0;
+    if (npaths > INTERLEAVE_MAX_FILES) npaths = INTERLEAVE_MAX_FILES;
+    for (i = 0; i < npaths; i++) {
+        Ahead *a = &ahead[nahead];
+        a->path = strdup(paths[i]);
+        a->convert = convert;
+        if (!a->path || read_fork(a) != 0) {
+            drop(a);
+            continue;
+        }
+        nahead++;
+    }
+    for (start = 0; start < nahead; start += width) {
+        compress_run(start, nahead - start < width ? nahead - start : width);
+    }
+}
+
+off_t interleave_take(const char *path, int convert, int fd, unsigned short *crc) {
+    struct stat st;
+    size_t done = 0;
+    ssize_t n;
+    Ahead *a = NULL;
+    int i;
+
+    for (i = 0; i < nahead; i++) {
+        if (ahead[i].path && strcmp(ahead[i].path, path) == 0) {
+            a = &ahead[i];
+            break;
+        }
+    }
+    if (!a) return -1;
+    if (a->convert != convert || stat(path, &st) != 0 || !same_file(&st, &a->st)) {
+        drop(a);
+        return -1;
+    }
+    throttle_write(a->len);
+    while (done < a->len) {
+        n = write(fd, a->data + done, a->len - done);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) {
+            fprintf(stderr, "Error writing fork data: %s\n", strerror(n < 0 ? errno : EIO));
+            drop(a);
+            return -2;
+        }
+        done += n;
+    }
+    *crc = a->crc;
+    n = a->len;
+    drop(a);
+    return n;
+}
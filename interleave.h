@@ -0,0 +1,52 @@
+/*
+ * interleave.h - compressing small forks several at a time
+ *
+ * With --interleave, the data forks of runs of small files in a folder are
+ * read ahead and compressed together by zcompress_lockstep(), so that the
+ * encoder's hash table lookups for one fork overlap the cache misses of
+ * the others. The results are kept in memory until the files are reached,
+ * and written out as they would have been compressed one at a time, so
+ * the archive is the same either way.
+ */
+
+#pragma once
+
+#include <sys/types.h>
+
+#define INTERLEAVE_MAX_FORK     65536   /* forks up to this size are read ahead */
+#define INTERLEAVE_MAX_FILES    64      /* files read ahead at once, at most */
+#define INTERLEAVE_MAX_WIDTH    16
+
+/*
+ * Set the number of forks compressed at once. A width of 1 or less turns
+ * reading ahead off.
+ */
+void interleave_set_width(int width);
+
+/*
+ * Returns: 1 if forks are being read ahead, 0 if not
+ */
+int interleave_enabled(void);
+
+/*
+ * Worth reading ahead? A regular file with only one link, holding at most
+ * INTERLEAVE_MAX_FORK bytes, which isn't BinHex.
+ */
+int interleave_candidate(const char *path);
+
+/*
+ * Read ahead the data forks of the files given and compress them, after
+ * changing '\n' to '\r' if convert is set. Anything read ahead before and
+ * not yet taken is dropped.
+ */
+void interleave_prepare(char **paths, int npaths, int convert);
+
+/*
+ * If the fork at path was read ahead with the same conversion, and the
+ * file hasn't changed since, write its compressed data to fd and set its
+ * CRC in *crc.
+ *
+ * Returns: the compressed length, -1 if it wasn't read ahead (or can't be
+ * used), or -2 if it couldn't be written
+ */
+off_t interleave_take(const char *path, int convert, int fd, unsigned short *crc);
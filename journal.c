@@ -0,0 +1,297 @@
+/*
+ * journal.c - checkpoint journal for resumable archive builds
+ *
+ * The journal is a text file. The first line identifies the archive:
+ *   sit-journal 1 <archive>
+ * and each checkpoint after that is one line:
+ *   C <end> <items> <total> <uncompressed> <depth> <ndone>
+ *     followed by <startPos> <uncompressed> <path> for each open folder,
+ *     and then the <path> of each entry completed since the last line.
+ * Paths are escaped so that they contain no spaces or newlines. A line
+ * without its trailing newline was interrupted, and is ignored.
+ */
+
+#include "journal.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include "util.h"
+
+#define JOURNAL_MAGIC	"sit-journal 1"
+
+typedef struct {
+    char *path;
+    off_t startPos;
+    off_t uncompressed;     /* value at the last checkpoint, when resuming */
+    off_t *uncompressedp;   /* running total, while building */
+    int resumed;
+} Frame;
+
+static char *journalPath;
+static FILE *jfs;
+static int archiveFd = -1;
+static time_t lastCheckpoint;
+
+/* completed entries, in an open-addressed hash set */
+static char **doneSet;
+static size_t doneCap, doneCount;
+
+/* entries completed since the last checkpoint line */
+static char **pending;
+static size_t pendingCount, pendingCap;
+
+/* folders open now, and those open at the last checkpoint of an earlier run */
+static Frame *stack;
+static int depth, stackCap;
+static Frame *resumeFrames;
+static int resumeDepth;
+
+static void add_done(const char *path) {
+    size_t i;
+
+    if (doneCount * 2 >= doneCap) {
+        char **old = doneSet;
+        size_t oldCap = doneCap;
+        doneCap = doneCap ? doneCap * 2 : 1024;
+        doneSet = calloc(doneCap, sizeof(char *));
+        doneCount = 0;
+        for (i = 0; i < oldCap; i++) {
+            if (old[i]) {
+                add_done(old[i]);
+                free(old[i]);
+            }
+        }
+        free(old);
+    }
+    for (i = hash_string(path) & (doneCap-1); doneSet[i]; i = (i+1) & (doneCap-1)) {
+        if (strcmp(doneSet[i], path) == 0) return;
+    }
+    doneSet[i] = strdup(path);
+    doneCount++;
+}
+
+int journal_is_done(const char *path) {
+    size_t i;
+
+    if (!doneCount) return 0;
+    for (i = hash_string(path) & (doneCap-1); doneSet[i]; i = (i+1) & (doneCap-1)) {
+        if (strcmp(doneSet[i], path) == 0) return 1;
+    }
+    return 0;
+}
+
+/* write a path with '\' ' ' and newline escaped */
+static void put_escaped(FILE *fs, const char *s) {
+    for (; *s; s++) {
+        switch (*s) {
+        case '\\': fputs("\\\\", fs); break;
+        case ' ':  fputs("\\s", fs); break;
+        case '\n': fputs("\\n", fs); break;
+        default:   putc(*s, fs); break;
+        }
+    }
+}
+
+/* unescape a path in place */
+static char *unescape(char *s) {
+    char *p, *q;
+    for (p = q = s; *p; p++) {
+        if (*p == '\\' && p[1]) {
+            p++;
+            *q++ = (*p == 's') ? ' ' : (*p == 'n') ? '\n' : *p;
+        } else {
+            *q++ = *p;
+        }
+    }
+    *q = 0;
+    return s;
+}
+
+static void free_frames(Frame *frames, int n) {
+    int i;
+    for (i = 0; i < n; i++) free(frames[i].path);
+    free(frames);
+}
+
+/* parse one checkpoint line, returns 0 on success */
+static int parse_checkpoint(char *line, off_t *end, JournalTotals *totals) {
+    long long e, it, tot, unc;
+    int d, nd, i;
+    char *tok, *save = NULL;
+    Frame *frames;
+
+    if (line[0] != 'C' || line[1] != ' ') return -1;
+    if (sscanf(line + 2, "%lld %lld %lld %lld %d %d", &e, &it, &tot, &unc, &d, &nd) != 6 ||
+        d < 0 || nd < 0) {
+        return -1;
+    }
+    strtok_r(line, " ", &save);
+    for (i = 0; i < 6; i++) strtok_r(NULL, " ", &save);
+
+    frames = calloc(d + 1, sizeof(Frame));
+    for (i = 0; i < d; i++) {
+        char *sp = strtok_r(NULL, " ", &save);
+        char *up = strtok_r(NULL, " ", &save);
+        char *pp = strtok_r(NULL, " ", &save);
+        if (!sp || !up || !pp) { free_frames(frames, i); return -1; }
+        frames[i].startPos = strtoll(sp, NULL, 10);
+        frames[i].uncompressed = strtoll(up, NULL, 10);
+        frames[i].path = strdup(unescape(pp));
+    }
+    for (i = 0; i < nd && (tok = strtok_r(NULL, " ", &save)) != NULL; i++) {
+        add_done(unescape(tok));
+    }
+    free_frames(resumeFrames, resumeDepth);
+    resumeFrames = frames;
+    resumeDepth = d;
+    *end = e;
+    totals->items = it;
+    totals->total = tot;
+    totals->uncompressed = unc;
+    return 0;
+}
+
+int journal_open(const char *journal, char **archive, off_t *end, JournalTotals *totals) {
+    FILE *fs;
+    char *line = NULL;
+    size_t cap = 0;
+    ssize_t len;
+    int checkpoints = 0;
+
+    journalPath = strdup(journal);
+    if ((fs = fopen(journal, "r")) == NULL) {
+        return 0;   /* no journal yet */
+    }
+    if ((len = getline(&line, &cap, fs)) <= 0 || line[len-1] != '\n' ||
+        strncmp(line, JOURNAL_MAGIC " ", strlen(JOURNAL_MAGIC) + 1) != 0) {
+        fprintf(stderr, "%s: not a sit journal\n", journal);
+        free(line);
+        fclose(fs);
+        return -1;
+    }
+    line[len-1] = 0;
+    *archive = strdup(unescape(line + strlen(JOURNAL_MAGIC) + 1));
+    while ((len = getline(&line, &cap, fs)) > 0 && line[len-1] == '\n') {
+        line[len-1] = 0;
+        if (parse_checkpoint(line, end, totals) < 0) break;
+        checkpoints++;
+    }
+    free(line);
+    fclose(fs);
+    if (!checkpoints) {
+        return 0;   /* nothing was completed, so start *archive again from scratch */
+    }
+    if ((jfs = fopen(journal, "a")) == NULL) {
+        perror(journal);
+        return -1;
+    }
+    lastCheckpoint = time(NULL);
+    return 1;
+}
+
+int journal_start(const char *archive, int ofd) {
+    if ((jfs = fopen(journalPath, "w")) == NULL) {
+        perror(journalPath);
+        return -1;
+    }
+    archiveFd = ofd;
+    fputs(JOURNAL_MAGIC " ", jfs);
+    put_escaped(jfs, archive);
+    putc('\n', jfs);
+    if (fflush(jfs) != 0 || fsync(fileno(jfs)) != 0) {
+        perror(journalPath);
+        return -1;
+    }
+    lastCheckpoint = time(NULL);
+    return 0;
+}
+
+void journal_resume(int ofd) {
+    archiveFd = ofd;
+}
+
+const char *journal_resume_item(void) {
+    return resumeDepth ? resumeFrames[0].path : NULL;
+}
+
+int journal_resume_folder(const char *path, int d, off_t *startPos, off_t *uncompressed) {
+    if (d >= resumeDepth || resumeFrames[d].resumed || strcmp(resumeFrames[d].path, path) != 0) {
+        return 0;
+    }
+    /* the enclosing folders must have been resumed first */
+    if (d > 0 && !resumeFrames[d-1].resumed) {
+        return 0;
+    }
+    resumeFrames[d].resumed = 1;
+    *startPos = resumeFrames[d].startPos;
+    *uncompressed = resumeFrames[d].uncompressed;
+    return 1;
+}
+
+void journal_push_folder(const char *path, off_t startPos, off_t *uncompressed) {
+    if (!jfs) return;
+    if (depth == stackCap) {
+        stackCap = stackCap ? stackCap * 2 : 16;
+        stack = realloc(stack, stackCap * sizeof(Frame));
+    }
+    stack[depth].path = strdup(path);
+    stack[depth].startPos = startPos;
+    stack[depth].uncompressedp = uncompressed;
+    depth++;
+}
+
+void journal_pop_folder(void) {
+    if (!jfs || depth == 0) return;
+    free(stack[--depth].path);
+}
+
+void journal_entry_done(const char *path, const JournalTotals *totals, int force) {
+    off_t end;
+    size_t i;
+    int d;
+
+    if (!jfs) return;
+    if (pendingCount == pendingCap) {
+        pendingCap = pendingCap ? pendingCap * 2 : 64;
+        pending = realloc(pending, pendingCap * sizeof(char *));
+    }
+    pending[pendingCount++] = strdup(path);
+    if (!force && time(NULL) - lastCheckpoint < 1) {
+        return;
+    }
+
+    /* make sure everything up to this point is on disk before recording it */
+    if ((end = lseek(archiveFd, 0, SEEK_CUR)) < 0 || fsync(archiveFd) != 0) {
+        perror("archive sync");
+        return;
+    }
+    fprintf(jfs, "C %lld %lld %lld %lld %d %zu", (long long)end,
+            (long long)totals->items, (long long)totals->total,
+            (long long)totals->uncompressed, depth, pendingCount);
+    for (d = 0; d < depth; d++) {
+        fprintf(jfs, " %lld %lld ", (long long)stack[d].startPos,
+                (long long)*stack[d].uncompressedp);
+        put_escaped(jfs, stack[d].path);
+    }
+    for (i = 0; i < pendingCount; i++) {
+        putc(' ', jfs);
+        put_escaped(jfs, pending[i]);
+        free(pending[i]);
+    }
+    pendingCount = 0;
+    putc('\n', jfs);
+    if (fflush(jfs) != 0 || fsync(fileno(jfs)) != 0) {
+        perror(journalPath);
+    }
+    lastCheckpoint = time(NULL);
+}
+
+void journal_finish(void) {
+    if (!jfs) return;
+    fclose(jfs);
+    jfs = NULL;
+    unlink(journalPath);
+}
@@ -0,0 +1,93 @@
+/*
+ * journal.h - checkpoint journal for resumable archive builds
+ *
+ * When enabled, a line is appended to the journal each time an entry has
+ * been completely written to the archive. It records the archive's length
+ * at that point, the folders which are still open (with the position of
+ * each startFolder header and its running uncompressed total), the running
+ * totals for the archive header, and the paths of the entries completed
+ * since the previous line. The archive is synced before each line is
+ * written, so the journal never refers to data that isn't on disk.
+ *
+ * If the build is interrupted, running the same command again truncates the
+ * archive to the last checkpoint, skips the inputs that were completed,
+ * reopens the folders that were in progress and carries on from there.
+ */
+
+#pragma once
+
+#include <sys/types.h>
+
+/* Totals kept by main() for the archive header */
+typedef struct {
+    off_t items;
+    off_t total;
+    off_t uncompressed;
+} JournalTotals;
+
+/*
+ * Open a journal. If it exists and holds at least one checkpoint, the
+ * build is resumed: *archive is set to the archive named in the journal,
+ * *end to its length at the last checkpoint, and *totals to the totals
+ * at that point. If it exists but has no checkpoint, *archive is still set,
+ * and that archive should be truncated and built again from the start.
+ *
+ * Returns: 1 if resuming, 0 if a new journal should be started with
+ * journal_start(), or -1 on error
+ */
+int journal_open(const char *journal, char **archive, off_t *end, JournalTotals *totals);
+
+/*
+ * Start a new journal for the given archive. Checkpoints are written for
+ * the archive open on ofd.
+ *
+ * Returns: 0 on success, -1 on error
+ */
+int journal_start(const char *archive, int ofd);
+
+/*
+ * Set the archive descriptor when resuming.
+ */
+void journal_resume(int ofd);
+
+/*
+ * Check whether an entry was already completed by an earlier run.
+ *
+ * Returns: 1 if so, 0 otherwise (including when no journal is in use)
+ */
+int journal_is_done(const char *path);
+
+/*
+ * Get the top-level input which was in progress at the last checkpoint.
+ *
+ * Returns: its path, or NULL if no folder was open
+ */
+const char *journal_resume_item(void);
+
+/*
+ * Check whether a folder at the given depth was still open at the last
+ * checkpoint. If so, its startFolder position and uncompressed total are
+ * returned, and the caller should continue the folder rather than start it.
+ *
+ * Returns: 1 if the folder is being resumed, 0 otherwise
+ */
+int journal_resume_folder(const char *path, int depth, off_t *startPos, off_t *uncompressed);
+
+/*
+ * Track the folders that are currently open. The uncompressed total is
+ * read through the pointer whenever a checkpoint is written.
+ */
+void journal_push_folder(const char *path, off_t startPos, off_t *uncompressed);
+void journal_pop_folder(void);
+
+/*
+ * Record that an entry has been completely written, and write a checkpoint.
+ * Checkpoints within folders are written at most once per second unless
+ * force is set; completed entries are kept until the next one is written.
+ */
+void journal_entry_done(const char *path, const JournalTotals *totals, int force);
+
+/*
+ * Remove the journal once the archive has been finished.
+ */
+void journal_finish(void);
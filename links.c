@@ -0,0 +1,165 @@
+/*
+ * links.c - archiving hard-linked files once
+ *
+ * Files with more than one link are remembered by their key: the device,
+ * inode, size and modification time of the file, and the device and inode
+ * of each sidecar, or zeroes where there is none. Everything in an entry
+ * apart from its name comes from those, so an entry with the same key can
+ * be copied as it stands once its name and header CRC are updated.
+ */
+
+#include "links.h"
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <limits.h>
+#include <libgen.h>
+#include "sit.h"
+#include "macroman.h"
+#include "sitindex.h"
+#include "throttle.h"
+#include "util.h"
+
+extern unsigned short updcrc(unsigned short icrc, unsigned char *icp, int icnt);
+
+typedef struct {
+    dev_t dev[4];       /* the file, then its ._, .rsrc and .info files */
+    ino_t ino[4];
+    off_t size;
+    time_t mtime;
+} LinkKey;
+
+typedef struct {
+    LinkKey key;
+    char *name;         /* the link it was archived under */
+    off_t offset, length;
+} Link;
+
+/* archived files with more than one link, in an open-addressed hash table */
+static Link *links;
+static size_t linkCap, linkCount;
+
+/*
+ * Fill in the key for a file, zeroed first so keys can be compared with
+ * memcmp.
+ *
+ * Returns: 1 if the file has other links, 0 if not or it can't be read
+ */
+static int make_key(const char *name, LinkKey *k) {
+    char path[PATH_MAX], dir[PATH_MAX], base[PATH_MAX];
+    struct stat st;
+    int i;
+
+    memset(k, 0, sizeof(*k));
+    if (stat(name, &st) != 0 || !S_ISREG(st.st_mode) || st.st_nlink < 2) return 0;
+    k->dev[0] = st.st_dev;
+    k->ino[0] = st.st_ino;
+    k->size = st.st_size;
+    k->mtime = st.st_mtime;
+    for (i = 1; i < 4; i++) {
+        if (i == 1) {
+            snprintf(dir, sizeof(dir), "%s", name);
+            snprintf(base, sizeof(base), "%s", name);
+            snprintf(path, sizeof(path), "%s/._%s", dirname(dir), basename(base));
+        } else {
+            snprintf(path, sizeof(path), "%s%s", name, i == 2 ? ".rsrc" : ".info");
+        }
+        if (stat(path, &st) == 0) {
+            k->dev[i] = st.st_dev;
+            k->ino[i] = st.st_ino;
+        }
+    }
+    return 1;
+}
+
+static Link *find_link(const LinkKey *k) {
+    size_t i;
+
+    if (!linkCap) return NULL;
+    for (i = hash_bytes(k, sizeof(*k)) & (linkCap-1); links[i].name; i = (i+1) & (linkCap-1)) {
+        if (memcmp(&links[i].key, k, sizeof(*k)) == 0) return &links[i];
+    }
+    return NULL;
+}
+
+static void add_link(const LinkKey *k, char *name, off_t offset, off_t length) {
+    size_t i;
+
+    if (linkCount * 2 >= linkCap) {
+        Link *old = links;
+        size_t oldCap = linkCap;
+        linkCap = linkCap ? linkCap * 2 : 256;
+        links = calloc(linkCap, sizeof(Link));
+        linkCount = 0;
+        for (i = 0; i < oldCap; i++) {
+            if (old[i].name) add_link(&old[i].key, old[i].name, old[i].offset, old[i].length);
+        }
+        free(old);
+    }
+    for (i = hash_bytes(k, sizeof(*k)) & (linkCap-1); links[i].name; i = (i+1) & (linkCap-1))
+        ;
+    links[i].key = *k;
+    links[i].name = name;
+    links[i].offset = offset;
+    links[i].length = length;
+    linkCount++;
+}
+
+off_t links_reuse(const char *name, int fd, off_t *uncompressed, const char **first) {
+    char path[PATH_MAX], base[PATH_MAX];
+    struct stat st;
+    LinkKey key;
+    fileHdr fh;
+    Link *l;
+    off_t start;
+    uint16_t crc;
+
+    if (!make_key(name, &key) || (l = find_link(&key)) == NULL) return 0;
+    if (pread(fd, &fh, sizeof(fh), l->offset) != (ssize_t)sizeof(fh)) return 0;
+
+    /* the name comes from the .info file if there is one, and that's shared */
+    snprintf(path, sizeof(path), "%s.info", name);
+    if (stat(path, &st) != 0) {
+        snprintf(base, sizeof(base), "%s", name);
+        memset(fh.fName, 0, sizeof(fh.fName));
+        convertFilesystemNameToMacRoman(basename(base), (char *)&fh.fName[0], 63);
+    }
+    crc = updcrc(0, (unsigned char *)&fh, sizeof(fh) - 2);
+    fh.hdrCRC[0] = crc >> 8;
+    fh.hdrCRC[1] = crc;
+
+    throttle_write(l->length);
+    start = lseek(fd, 0, SEEK_CUR);
+    if (start < 0 || write(fd, &fh, sizeof(fh)) != (ssize_t)sizeof(fh) ||
+        copy_range(fd, fd, l->offset + sizeof(fh), l->length - sizeof(fh)) != 0) {
+        /* leave the archive as it was, and archive the file itself */
+        if (start < 0 || ftruncate(fd, start) != 0 || lseek(fd, start, SEEK_SET) != start) {
+            perror("link");
+        }
+        return 0;
+    }
+    index_add_file(fh.fName, start);
+    *uncompressed += get4(fh.rLen) + get4(fh.dLen) + sizeof(fh);
+    *first = l->name;
+    return l->length;
+}
+
+void links_record(const char *name, off_t offset, off_t length) {
+    LinkKey key;
+
+    if (length <= 0 || !make_key(name, &key) || find_link(&key)) return;
+    add_link(&key, strdup(name), offset, length);
+}
+
+void links_reset(void) {
+    size_t i;
+
+    for (i = 0; i < linkCap; i++) free(links[i].name);
+    free(links);
+    links = NULL;
+    linkCap = linkCount = 0;
+}
@@ -0,0 +1,36 @@
+/*
+ * links.h - archiving hard-linked files once
+ *
+ * When the same file is reached through several hard links, the entry
+ * written for the first link is copied for each of the others, with only
+ * the name in its header changed, instead of compressing the forks again.
+ * Links are matched by device and inode, along with the sidecar files
+ * (._, .rsrc and .info) that supply the rest of the entry, so links whose
+ * sidecars differ are archived separately.
+ */
+
+#pragma once
+
+#include <sys/types.h>
+
+/*
+ * If another link to this file has already been archived, copy its entry
+ * to the end of the archive open on fd, renamed for this link, adding its
+ * uncompressed length to *uncompressed. *first is set to the name it was
+ * archived under.
+ *
+ * Returns: the length of the entry written, or 0 if the file must be
+ * archived itself
+ */
+off_t links_reuse(const char *name, int fd, off_t *uncompressed, const char **first);
+
+/*
+ * Note that the entry for a file was written at offset in the archive,
+ * taking length bytes, so later links to it can reuse it.
+ */
+void links_record(const char *name, off_t offset, off_t length);
+
+/*
+ * Forget the files archived, before starting another archive.
+ */
+void links_reset(void);
@@ -0,0 +1,112 @@
+/*
+ * macroman.c - conversion of file names to and from the MacRoman encoding
+ *
+ * The lookup tables in romantab.h are generated at build time by mkromantab.
+ */
+
+#include <stdint.h>
+#include <string.h>
+#include "macroman.h"
+#include "romantab.h"
+
+/* Look up a code point, or a (combining mark << 16 | base) pair, in the
+ * perfect hash. Returns the MacRoman character, or -1 if there is none.
+ */
+static int lookup_roman(uint32_t key) {
+	uint32_t slot = ((key * ROMAN_MULT2) >> 24) + romanDisp[(key * ROMAN_MULT1) >> 26];
+	slot &= 0xff;
+	return (romanHash[slot].key == key) ? romanHash[slot].mac : -1;
+}
+
+/* Try to convert filesystem name (assumes UTF-8) to a MacRoman string for StuffIt.
+ * Also convert colon characters to slashes, since they are path delimiters and
+ * the item will not be extractable with StuffIt Expander unless we do.
+ * Input is a C string, in UTF-8 encoding.
+ * Output is a P string, in MacRoman encoding if possible.
+ * Note: this doesn't use CFString, since the characters we can convert are known
+ * and can be mapped to their MacRoman equivalent, and we want to remain portable.
+ * The name is converted in a single pass: a combining mark is composed with the
+ * character before it by replacing the last character output.
+ */
+void convertFilesystemNameToMacRoman(char *fsName, char *macName, int maxLength) {
+	unsigned char tmp[maxLength+1];
+	const unsigned char *p = (const unsigned char *)fsName;
+	uint32_t cp, prev = 0; /* previous code point, for composition */
+	int i, n, c, len = 0;
+
+	while (*p) {
+		n = romanLead[*p][0];
+		if (n == 1) {
+			c = romanLead[*p][1];
+			cp = *p++;
+		} else {
+			for (i = 1; i < n && (p[i] & 0xC0) == 0x80; i++)
+				;
+			if (n == 0 || i < n) {
+				/* not UTF-8: assume it's already MacRoman */
+				c = *p++;
+				cp = 0;
+			} else {
+				cp = *p & (0x7F >> n);
+				for (i = 1; i < n; i++) {
+					cp = (cp << 6) | (p[i] & 0x3F);
+				}
+				p += n;
+				if (cp >= 0x300 && cp <= 0x36F) {
+					/* combining mark: compose with the previous character,
+					 * or drop it if there's no precomposed equivalent */
+					if (len > 0 && prev && (c = lookup_roman((cp << 16) | prev)) >= 0) {
+						tmp[len] = c;
+						prev = 0;
+					}
+					continue;
+				}
+				if ((c = lookup_roman(cp)) < 0) {
+					c = '?';
+				}
+			}
+		}
+		if (len == maxLength) break;
+		tmp[++len] = c;
+		prev = cp;
+	}
+	tmp[0] = len;
+	memcpy(macName,tmp,len+1);
+}
+
+/* Convert a MacRoman P string from an archive to a UTF-8 filesystem name.
+ * Slashes become colons again, the reverse of the conversion above.
+ */
+void convertMacRomanToFilesystemName(const unsigned char *macName, char *fsName, int size) {
+	int i, len = 0;
+
+	for (i = 1; i <= macName[0]; i++) {
+		unsigned int c = macName[i];
+		if (c >= 0x80) {
+			c = romanUnicode[c - 0x80];
+		} else if (c == '/') {
+			c = ':';
+		} else if (c < 0x20 || c == 0x7F) {
+			c = '_';
+		}
+		if (c < 0x80) {
+			if (len + 1 >= size) break;
+			fsName[len++] = c;
+		} else if (c < 0x800) {
+			if (len + 2 >= size) break;
+			fsName[len++] = 0xC0 | (c >> 6);
+			fsName[len++] = 0x80 | (c & 0x3F);
+		} else {
+			if (len + 3 >= size) break;
+			fsName[len++] = 0xE0 | (c >> 12);
+			fsName[len++] = 0x80 | ((c >> 6) & 0x3F);
+			fsName[len++] = 0x80 | (c & 0x3F);
+		}
+	}
+	fsName[len] = 0;
+	if (len == 0 || strcmp(fsName, ".") == 0 || strcmp(fsName, "..") == 0) {
+		/* don't let a name refer to another directory */
+		for (i = 0; i < len; i++) fsName[i] = '_';
+		if (len == 0 && size > 1) strcpy(fsName, "_");
+	}
+}
@@ -0,0 +1,22 @@
+/*
+ * macroman.h - conversion of file names to and from the MacRoman encoding
+ */
+
+#pragma once
+
+/*
+ * Convert a filesystem name (a C string, assumed to be UTF-8) to a MacRoman
+ * P string of at most maxLength characters, for use in an archive entry.
+ * Decomposed (NFD) accented letters are composed, colons are converted to
+ * slashes, and characters with no MacRoman equivalent become '?'.
+ * Bytes which aren't valid UTF-8 are assumed to be MacRoman already.
+ */
+void convertFilesystemNameToMacRoman(char *fsName, char *macName, int maxLength);
+
+/*
+ * Convert a MacRoman P string from an archive entry to a filesystem name
+ * (a UTF-8 C string) of at most size-1 bytes. Slashes are converted to
+ * colons, and control characters to '_'. Names which would refer to
+ * another directory ("", "." or "..") have their dots replaced with '_'.
+ */
+void convertMacRomanToFilesystemName(const unsigned char *macName, char *fsName, int size);
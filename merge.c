@@ -0,0 +1,287 @@
+/*
+ * merge.c - combining StuffIt archives without recompressing them
+ *
+ * Entries are written in archive order. A file's header and forks are
+ * contiguous in both the old and new archives, so each file is a single
+ * copy, done in the kernel with copy_file_range() where the system has it.
+ * Folders are written as they are opened and closed, keeping a stack of
+ * their start offsets and uncompressed totals so that their startFolder
+ * and endFolder headers can be filled in as sit.c does when archiving.
+ */
+
+#if defined(__linux__) && !defined(_GNU_SOURCE)
+#define _GNU_SOURCE             /* for copy_file_range() */
+#endif
+
+#include "merge.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <libgen.h>
+#include <limits.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "macroman.h"
+#include "sitread.h"
+#include "split.h"
+
+#define MAX_DEPTH       256
+
+extern unsigned short updcrc(unsigned short icrc, unsigned char *icp, int icnt);
+
+typedef struct {
+    fileHdr start, end;         /* headers, to be filled in when the folder is closed */
+    off_t startPos;
+    off_t uncompressed;         /* as counted by sit.c: headers plus forks */
+} Folder;
+
+typedef struct {
+    int fd;
+    off_t pos;
+    long items;                 /* top-level entries */
+    Folder stack[MAX_DEPTH];
+    int depth;
+    int failed;
+} Writer;
+
+static void put4(u_char *p, uint32_t x) {
+    p[0] = x >> 24;
+    p[1] = x >> 16;
+    p[2] = x >> 8;
+    p[3] = x;
+}
+
+static void set_hdr_crc(fileHdr *h) {
+    uint16_t crc = updcrc(0, (unsigned char *)h, sizeof(fileHdr) - 2);
+    h->hdrCRC[0] = crc >> 8;
+    h->hdrCRC[1] = crc;
+}
+
+static void out_write(Writer *w, const void *buf, size_t len) {
+    const char *p = buf;
+
+    w->pos += len;
+    while (!w->failed && len > 0) {
+        ssize_t n = write(w->fd, p, len);
+        if (n <= 0) {
+            w->failed = 1;
+            break;
+        }
+        p += n;
+        len -= n;
+    }
+}
+
+/* copy part of an archive, in the kernel if possible */
+static void out_copy(Writer *w, int fd, const SitArchive *arc, off_t offset, size_t len) {
+#if defined(__linux__) || defined(__FreeBSD__)
+    while (!w->failed && len > 0) {
+        ssize_t n = copy_file_range(fd, &offset, w->fd, NULL, len, 0);
+        if (n <= 0) break;      /* not supported here, so write it ourselves */
+        w->pos += n;
+        len -= n;
+    }
+#endif
+    out_write(w, arc->map + offset, len);
+}
+
+static void count_uncompressed(Writer *w, off_t n) {
+    if (w->depth > 0) {
+        w->stack[w->depth-1].uncompressed += n;
+    }
+}
+
+static void open_folder(Writer *w, const fileHdr *start, const fileHdr *end) {
+    Folder *f;
+
+    if (w->depth == MAX_DEPTH) {
+        fprintf(stderr, "Folders nested too deeply\n");
+        w->failed = 1;
+        return;
+    }
+    if (w->depth == 0) w->items++;
+    f = &w->stack[w->depth++];
+    f->start = *start;
+    f->end = *end;
+    f->startPos = w->pos;
+    f->uncompressed = sizeof(fileHdr);
+    out_write(w, start, sizeof(fileHdr));
+}
+
+static void close_folder(Writer *w) {
+    Folder *f = &w->stack[--w->depth];
+
+    put4(f->end.cDLen, w->pos - f->startPos);
+    put4(f->end.dLen, f->uncompressed);
+    set_hdr_crc(&f->end);
+    put4(f->start.cDLen, w->pos - f->startPos);
+    put4(f->start.dLen, f->uncompressed);
+    set_hdr_crc(&f->start);
+    out_write(w, &f->end, sizeof(fileHdr));
+    if (!w->failed &&
+        pwrite(w->fd, &f->start, sizeof(fileHdr), f->startPos) != sizeof(fileHdr)) {
+        w->failed = 1;
+    }
+    count_uncompressed(w, f->uncompressed + sizeof(fileHdr));
+}
+
+/* headers for a new folder named after an archive */
+static void make_folder(const char *archive, long tdiff, fileHdr *start, fileHdr *end) {
+    char name[PATH_MAX], *base, *dot;
+    struct stat st;
+
+    snprintf(name, sizeof(name), "%s", archive);
+    base = basename(name);
+    if ((dot = strrchr(base, '.')) != NULL && dot != base && strcasecmp(dot, ".sit") == 0) {
+        *dot = 0;
+    }
+    memset(start, 0, sizeof(*start));
+    convertFilesystemNameToMacRoman(base, (char *)start->fName, 63);
+    if (stat(archive, &st) == 0) {
+        put4((u_char *)start->cDate, st.st_mtime + tdiff);
+        put4((u_char *)start->mDate, st.st_mtime + tdiff);
+    }
+    start->compRMethod = start->compDMethod = startFolder;
+    *end = *start;
+    end->compRMethod = end->compDMethod = endFolder;
+}
+
+/* Mark the entries to keep: the members given, everything inside them,
+ * and the folders enclosing them. Returns -1 if a member isn't found.
+ */
+static int select_members(const SitArchive *arc, const char *archive, char **members,
+                          int nmembers, char *keep) {
+    int i, j, k;
+
+    if (!members) {
+        memset(keep, 1, arc->nentries);
+        return 0;
+    }
+    memset(keep, 0, arc->nentries);
+    for (i = 0; i < nmembers; i++) {
+        size_t len = strlen(members[i]);
+        while (len > 1 && members[i][len-1] == '/') members[i][--len] = 0;
+        if ((j = sit_find(arc, members[i])) < 0) {
+            fprintf(stderr, "%s: no \"%s\" in archive\n", archive, members[i]);
+            return -1;
+        }
+        if (arc->entries[j].isFolder) {
+            for (k = j; k < arc->entries[j].next; k++) keep[k] = 1;
+        }
+        for (k = j; k >= 0; k = arc->entries[k].parent) keep[k] = 1;
+    }
+    return 0;
+}
+
+static int merge_one(Writer *w, const char *archive, const MergeOptions *opts) {
+    SitArchive arc;
+    fileHdr start, end;
+    char *keep;
+    int i, fd, base;
+
+    if (sit_open(archive, &arc) < 0) {
+        return -1;
+    }
+    if ((fd = open(archive, O_RDONLY)) < 0) {
+        perror(archive);
+        sit_close(&arc);
+        return -1;
+    }
+    keep = malloc(arc.nentries + 1);
+    if (select_members(&arc, archive, opts->members, opts->nmembers, keep) < 0) {
+        free(keep);
+        close(fd);
+        sit_close(&arc);
+        return -1;
+    }
+    if (opts->nest) {
+        make_folder(archive, opts->tdiff, &start, &end);
+        open_folder(w, &start, &end);
+    }
+    base = w->depth;
+    for (i = 0; i < arc.nentries && !w->failed; i++) {
+        const SitEntry *e = &arc.entries[i];
+        if (!keep[i]) {
+            continue;
+        }
+        while (w->depth > base + e->depth) {
+            close_folder(w);
+        }
+        if (e->isFolder) {
+            open_folder(w, e->hdr, (const fileHdr *)(arc.map + e->endOffset));
+            continue;
+        }
+        if (w->depth == 0) w->items++;
+        out_copy(w, fd, &arc, e->offset,
+                 sizeof(fileHdr) + e->rsrc.compLength + e->data.compLength);
+        count_uncompressed(w, sizeof(fileHdr) + e->rsrc.length + e->data.length);
+        if (opts->verbose > 1) {
+            fprintf(stdout, "+ %.*s%s%s\n", opts->nest ? start.fName[0] : 0,
+                    (char *)start.fName + 1, opts->nest ? "/" : "", e->path);
+        }
+    }
+    while (w->depth > 0) {
+        close_folder(w);
+    }
+    free(keep);
+    close(fd);
+    sit_close(&arc);
+    return 0;
+}
+
+int merge_archives(char **archives, int narchives, const MergeOptions *opts) {
+    Writer w;
+    sitHdr sh;
+    char tmp[PATH_MAX];
+    int i, failed = 0;
+
+    memset(&w, 0, sizeof(w));
+    if (snprintf(tmp, sizeof(tmp), "%s.XXXXXX", opts->dst) >= sizeof(tmp) ||
+        (w.fd = mkstemp(tmp)) < 0) {
+        perror(opts->dst);
+        return 1;
+    }
+    fchmod(w.fd, 0644);
+    memset(&sh, 0, sizeof(sh));
+    out_write(&w, &sh, sizeof(sh));
+    for (i = 0; i < narchives && !failed; i++) {
+        if (merge_one(&w, archives[i], opts) < 0) {
+            failed = 1;
+        }
+    }
+    if (!failed && (w.pos > SPLIT_MAX_ARCHIVE || w.items > SPLIT_MAX_ITEMS)) {
+        fprintf(stderr, "%s: merged archive exceeds the format's limits\n", opts->dst);
+        failed = 1;
+    }
+    if (!failed) {
+        memcpy(sh.sig1, "SIT!", 4);
+        memcpy(sh.sig2, "rLau", 4);
+        sh.numFiles[0] = w.items >> 8;
+        sh.numFiles[1] = w.items;
+        put4(sh.arcLen, w.pos);
+        sh.version = 1;
+        if (pwrite(w.fd, &sh, sizeof(sh), 0) != sizeof(sh) || fsync(w.fd) < 0) {
+            w.failed = 1;
+        }
+        if (w.failed) {
+            fprintf(stderr, "%s: error writing archive: %s\n", opts->dst, strerror(errno));
+            failed = 1;
+        }
+    }
+    if (close(w.fd) < 0 || failed) {
+        unlink(tmp);
+        return 1;
+    }
+    if (rename(tmp, opts->dst) < 0) {
+        perror(opts->dst);
+        unlink(tmp);
+        return 1;
+    }
+    if (opts->verbose) {
+        fprintf(stdout, "Wrote %ld items, %lld bytes, to \"%s\"\n", w.items, (long long)w.pos,
+                opts->dst);
+    }
+    return 0;
+}
@@ -0,0 +1,29 @@
+/*
+ * merge.h - combining StuffIt archives without recompressing them
+ *
+ * Several archives can be merged into one, optionally with each one's
+ * contents in a folder named after it, and an archive can be cut down to
+ * some of its files and folders. File headers and their compressed forks
+ * are copied byte for byte; only the folder headers and the archive
+ * header are rewritten, with the lengths of what they now contain.
+ */
+
+#pragma once
+
+typedef struct {
+    const char *dst;            /* archive to write */
+    int nest;                   /* put each archive's contents in a folder named after it */
+    char **members;             /* paths within the archive to keep, or NULL for all */
+    int nmembers;
+    long tdiff;                 /* Mac time minus Unix time, for new folder dates */
+    int verbose;
+} MergeOptions;
+
+/*
+ * Write the contents of the archives, in order, to a new archive. The new
+ * archive is written to a temporary file and renamed to opts->dst when
+ * done, so it may replace one of the archives being merged.
+ *
+ * Returns: 0 on success, 1 on error
+ */
+int merge_archives(char **archives, int narchives, const MergeOptions *opts);
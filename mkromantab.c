@@ -0,0 +1,225 @@
+/*
+ * mkromantab.c - generates romantab.h, the lookup tables used by macroman.c
+ *
+ * This is run at build time. It writes to stdout:
+ *   romanLead[256]   - direct index on the first byte of a UTF-8 sequence,
+ *                      giving the sequence length, and for ASCII bytes the
+ *                      MacRoman character to use (':' becomes '/').
+ *   romanDisp[64]    - displacements for the perfect hash.
+ *   romanHash[256]   - the perfect hash itself, mapping a Unicode code point,
+ *                      or a (base character, combining mark) pair found in
+ *                      decomposed (NFD) names, to its MacRoman character.
+ *   romanUnicode[128] - the Unicode equivalents of MacRoman 0x80-0xFF, for
+ *                      converting names back when extracting.
+ *
+ * The hash uses the "hash and displace" scheme: a key is first hashed
+ * into one of 64 buckets, and the bucket's displacement is added to a
+ * second hash of the key to give its slot. Buckets are placed largest
+ * first, trying displacements until every key in the bucket lands in
+ * an empty slot, and multipliers are varied until all buckets fit.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+
+#define NBUCKETS	64
+#define NSLOTS		256
+
+/* Unicode equivalents of MacRoman characters 0x80-0xFF (Mac OS 8.5 and later) */
+static const uint16_t macRoman[128] = {
+	0x00C4, 0x00C5, 0x00C7, 0x00C9, 0x00D1, 0x00D6, 0x00DC, 0x00E1,
+	0x00E0, 0x00E2, 0x00E4, 0x00E3, 0x00E5, 0x00E7, 0x00E9, 0x00E8,
+	0x00EA, 0x00EB, 0x00ED, 0x00EC, 0x00EE, 0x00EF, 0x00F1, 0x00F3,
+	0x00F2, 0x00F4, 0x00F6, 0x00F5, 0x00FA, 0x00F9, 0x00FB, 0x00FC,
+	0x2020, 0x00B0, 0x00A2, 0x00A3, 0x00A7, 0x2022, 0x00B6, 0x00DF,
+	0x00AE, 0x00A9, 0x2122, 0x00B4, 0x00A8, 0x2260, 0x00C6, 0x00D8,
+	0x221E, 0x00B1, 0x2264, 0x2265, 0x00A5, 0x00B5, 0x2202, 0x2211,
+	0x220F, 0x03C0, 0x222B, 0x00AA, 0x00BA, 0x03A9, 0x00E6, 0x00F8,
+	0x00BF, 0x00A1, 0x00AC, 0x221A, 0x0192, 0x2248, 0x2206, 0x00AB,
+	0x00BB, 0x2026, 0x00A0, 0x00C0, 0x00C3, 0x00D5, 0x0152, 0x0153,
+	0x2013, 0x2014, 0x201C, 0x201D, 0x2018, 0x2019, 0x00F7, 0x25CA,
+	0x00FF, 0x0178, 0x2044, 0x20AC, 0x2039, 0x203A, 0xFB01, 0xFB02,
+	0x2021, 0x00B7, 0x201A, 0x201E, 0x2030, 0x00C2, 0x00CA, 0x00C1,
+	0x00CB, 0x00C8, 0x00CD, 0x00CE, 0x00CF, 0x00CC, 0x00D3, 0x00D4,
+	0xF8FF, 0x00D2, 0x00DA, 0x00DB, 0x00D9, 0x0131, 0x02C6, 0x02DC,
+	0x00AF, 0x02D8, 0x02D9, 0x02DA, 0x00B8, 0x02DD, 0x02DB, 0x02C7,
+};
+
+/* other code points which are commonly used for the same characters */
+static const uint16_t aliases[][2] = {
+	{ 0x00A4, 0xDB },	/* currency sign, before Mac OS 8.5 */
+	{ 0x2126, 0xBD },	/* ohm sign */
+	{ 0x03BC, 0xB5 },	/* greek small letter mu */
+	{ 0x0394, 0xC6 },	/* greek capital letter delta */
+};
+
+/* canonical decompositions of MacRoman characters: composed, base, mark */
+static const uint16_t decomp[][3] = {
+	{ 0x00C4, 0x0041, 0x0308 },	{ 0x00C5, 0x0041, 0x030A },
+	{ 0x00C7, 0x0043, 0x0327 },	{ 0x00C9, 0x0045, 0x0301 },
+	{ 0x00D1, 0x004E, 0x0303 },	{ 0x00D6, 0x004F, 0x0308 },
+	{ 0x00DC, 0x0055, 0x0308 },	{ 0x00E1, 0x0061, 0x0301 },
+	{ 0x00E0, 0x0061, 0x0300 },	{ 0x00E2, 0x0061, 0x0302 },
+	{ 0x00E4, 0x0061, 0x0308 },	{ 0x00E3, 0x0061, 0x0303 },
+	{ 0x00E5, 0x0061, 0x030A },	{ 0x00E7, 0x0063, 0x0327 },
+	{ 0x00E9, 0x0065, 0x0301 },	{ 0x00E8, 0x0065, 0x0300 },
+	{ 0x00EA, 0x0065, 0x0302 },	{ 0x00EB, 0x0065, 0x0308 },
+	{ 0x00ED, 0x0069, 0x0301 },	{ 0x00EC, 0x0069, 0x0300 },
+	{ 0x00EE, 0x0069, 0x0302 },	{ 0x00EF, 0x0069, 0x0308 },
+	{ 0x00F1, 0x006E, 0x0303 },	{ 0x00F3, 0x006F, 0x0301 },
+	{ 0x00F2, 0x006F, 0x0300 },	{ 0x00F4, 0x006F, 0x0302 },
+	{ 0x00F6, 0x006F, 0x0308 },	{ 0x00F5, 0x006F, 0x0303 },
+	{ 0x00FA, 0x0075, 0x0301 },	{ 0x00F9, 0x0075, 0x0300 },
+	{ 0x00FB, 0x0075, 0x0302 },	{ 0x00FC, 0x0075, 0x0308 },
+	{ 0x2260, 0x003D, 0x0338 },	{ 0x00C0, 0x0041, 0x0300 },
+	{ 0x00C3, 0x0041, 0x0303 },	{ 0x00D5, 0x004F, 0x0303 },
+	{ 0x00FF, 0x0079, 0x0308 },	{ 0x0178, 0x0059, 0x0308 },
+	{ 0x00C2, 0x0041, 0x0302 },	{ 0x00CA, 0x0045, 0x0302 },
+	{ 0x00C1, 0x0041, 0x0301 },	{ 0x00CB, 0x0045, 0x0308 },
+	{ 0x00C8, 0x0045, 0x0300 },	{ 0x00CD, 0x0049, 0x0301 },
+	{ 0x00CE, 0x0049, 0x0302 },	{ 0x00CF, 0x0049, 0x0308 },
+	{ 0x00CC, 0x0049, 0x0300 },	{ 0x00D3, 0x004F, 0x0301 },
+	{ 0x00D4, 0x004F, 0x0302 },	{ 0x00D2, 0x004F, 0x0300 },
+	{ 0x00DA, 0x0055, 0x0301 },	{ 0x00DB, 0x0055, 0x0302 },
+	{ 0x00D9, 0x0055, 0x0300 },
+};
+
+#define NELEM(a)	(sizeof(a)/sizeof((a)[0]))
+#define MAXKEYS		(128 + NELEM(aliases) + NELEM(decomp))
+
+static uint32_t keys[MAXKEYS];
+static unsigned char values[MAXKEYS];
+static int nkeys;
+
+static uint32_t slotKey[NSLOTS];
+static unsigned char slotValue[NSLOTS];
+static unsigned char disp[NBUCKETS];
+
+static int mac_char(uint16_t u) {
+	int i;
+	for (i = 0; i < 128; i++) {
+		if (macRoman[i] == u) return 0x80 + i;
+	}
+	return -1;
+}
+
+static void add_key(uint32_t key, int value) {
+	keys[nkeys] = key;
+	values[nkeys] = value;
+	nkeys++;
+}
+
+/* try to build the hash with the given multipliers; returns 0 on success */
+static int build(uint32_t mult1, uint32_t mult2) {
+	int bucketSize[NBUCKETS], order[NBUCKETS];
+	int i, j, k, b;
+
+	memset(bucketSize, 0, sizeof(bucketSize));
+	memset(slotKey, 0, sizeof(slotKey));
+	memset(slotValue, 0, sizeof(slotValue));
+	for (i = 0; i < nkeys; i++) {
+		bucketSize[(keys[i] * mult1) >> 26]++;
+	}
+	/* place the largest buckets first */
+	for (i = 0; i < NBUCKETS; i++) order[i] = i;
+	for (i = 0; i < NBUCKETS; i++) {
+		for (j = i + 1; j < NBUCKETS; j++) {
+			if (bucketSize[order[j]] > bucketSize[order[i]]) {
+				k = order[i]; order[i] = order[j]; order[j] = k;
+			}
+		}
+	}
+	for (i = 0; i < NBUCKETS; i++) {
+		int d, placed = 0;
+		b = order[i];
+		disp[b] = 0;
+		if (bucketSize[b] == 0) continue;
+		for (d = 0; d < NSLOTS && !placed; d++) {
+			int used[NSLOTS] = {0}, ok = 1;
+			for (k = 0; k < nkeys && ok; k++) {
+				int slot;
+				if (((keys[k] * mult1) >> 26) != b) continue;
+				slot = (((keys[k] * mult2) >> 24) + d) & (NSLOTS-1);
+				if (slotKey[slot] || used[slot]) ok = 0;
+				used[slot] = 1;
+			}
+			if (!ok) continue;
+			for (k = 0; k < nkeys; k++) {
+				int slot;
+				if (((keys[k] * mult1) >> 26) != b) continue;
+				slot = (((keys[k] * mult2) >> 24) + d) & (NSLOTS-1);
+				slotKey[slot] = keys[k];
+				slotValue[slot] = values[k];
+			}
+			disp[b] = d;
+			placed = 1;
+		}
+		if (!placed) return -1;
+	}
+	return 0;
+}
+
+int main(void) {
+	uint32_t mult1 = 0x9E3779B1, mult2 = 0x85EBCA77;
+	int i, tries;
+
+	for (i = 0; i < 128; i++) {
+		add_key(macRoman[i], 0x80 + i);
+	}
+	for (i = 0; i < NELEM(aliases); i++) {
+		add_key(aliases[i][0], aliases[i][1]);
+	}
+	for (i = 0; i < NELEM(decomp); i++) {
+		/* a pair key can never collide with a code point, since marks are >= 0x300 */
+		add_key(((uint32_t)decomp[i][2] << 16) | decomp[i][1], mac_char(decomp[i][0]));
+	}
+	for (tries = 0; build(mult1, mult2) < 0; tries++) {
+		if (tries == 100000) {
+			fprintf(stderr, "mkromantab: unable to build perfect hash\n");
+			return 1;
+		}
+		mult1 = mult1 * 1664525 + 1013904223;
+		mult2 = mult2 * 22695477 + 1;
+		mult1 |= 1; mult2 |= 1;
+	}
+
+	printf("/* romantab.h - generated by mkromantab, do not edit */\n\n");
+	printf("#define ROMAN_MULT1\t0x%08Xu\n", mult1);
+	printf("#define ROMAN_MULT2\t0x%08Xu\n\n", mult2);
+
+	printf("/* first byte of a UTF-8 sequence: length, and MacRoman char if ASCII */\n");
+	printf("static const unsigned char romanLead[256][2] = {\n");
+	for (i = 0; i < 256; i++) {
+		int len, c = 0;
+		if (i < 0x80) { len = 1; c = (i == ':') ? '/' : i; }
+		else if (i < 0xC2) len = 0;	/* continuation byte, or overlong */
+		else if (i < 0xE0) len = 2;
+		else if (i < 0xF0) len = 3;
+		else if (i < 0xF5) len = 4;
+		else len = 0;
+		printf("%s{%d,0x%02X},%s", (i % 8) ? "" : "\t", len, c, (i % 8 == 7) ? "\n" : " ");
+	}
+	printf("};\n\n");
+
+	printf("static const unsigned char romanDisp[%d] = {\n", NBUCKETS);
+	for (i = 0; i < NBUCKETS; i++) {
+		printf("%s%3d,%s", (i % 16) ? "" : "\t", disp[i], (i % 16 == 15) ? "\n" : " ");
+	}
+	printf("};\n\n");
+
+	printf("static const struct { uint32_t key; unsigned char mac; } romanHash[%d] = {\n", NSLOTS);
+	for (i = 0; i < NSLOTS; i++) {
+		printf("%s{0x%08X,0x%02X},%s", (i % 4) ? "" : "\t", slotKey[i], slotValue[i],
+			(i % 4 == 3) ? "\n" : " ");
+	}
+	printf("};\n\n");
+
+	printf("static const uint16_t romanUnicode[128] = {\n");
+	for (i = 0; i < 128; i++) {
+		printf("%s0x%04X,%s", (i % 8) ? "" : "\t", macRoman[i], (i % 8 == 7) ? "\n" : " ");
+	}
+	printf("};\n");
+	return 0;
+}
@@ -0,0 +1,428 @@
+/*
+ * pipeline.c - reading, converting, compressing and writing a fork at once
+ *
+ * Buffers go round two fixed pools, one for the fork's bytes and one for
+ * the compressed output, each of depth buffers. An input buffer is filled
+ * by the reader, converted and added to the CRC, compressed, and returned
+ * to its pool; an output buffer is filled by the encoder, written, and
+ * returned to its pool. Each queue can hold the whole of its pool, so
+ * putting a buffer never waits; a stage which falls behind makes the ones
+ * before it wait for a free buffer instead, and memory use is fixed. With
+ * two or more output buffers, the encoder fills one while the writer
+ * writes another.
+ *
+ * A fork which fits in one buffer, as most do, is handled in the calling
+ * thread without starting any others. If a stage fails, the pipeline is
+ * stopped: waiting for a buffer then gives up, and every stage finishes.
+ */
+
+#if defined(__linux__) && !defined(_GNU_SOURCE)
+#define _GNU_SOURCE     /* for fopencookie */
+#endif
+
+#include "pipeline.h"
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+#include "throttle.h"
+
+#if defined(__linux__) || defined(__GLIBC__)
+#define USE_FOPENCOOKIE 1
+#endif
+
+extern unsigned short updcrc(unsigned short icrc, unsigned char *icp, int icnt);
+
+typedef struct {
+    char *data;
+    size_t len;
+    int last;                   /* the end of the fork */
+} Block;
+
+typedef struct {
+    Block *ring[PIPELINE_MAX_DEPTH];
+    int head, count;
+    pthread_cond_t notEmpty;
+} Queue;
+
+typedef struct {
+    const PipelineFork *pf;
+    int threaded;
+    pthread_mutex_t lock;
+    Queue freeIn, read, converted;      /* input buffers */
+    Queue freeOut, compressed;          /* output buffers */
+    int stopped;                        /* a stage failed, under the lock */
+    Block *out;                         /* being filled by the encoder */
+    unsigned short crc;
+    off_t clen;
+    int readError;
+} Pipeline;
+
+static int depth = PIPELINE_DEFAULT_DEPTH;
+static size_t blockSize = PIPELINE_DEFAULT_BLOCK;
+static Block *inBlocks, *outBlocks;     /* the pools, allocated on first use */
+
+void pipeline_set_depth(int d) {
+    if (!inBlocks) depth = d;
+}
+
+void pipeline_set_buffer(size_t size) {
+    if (!inBlocks) blockSize = size;
+}
+
+static void put(Pipeline *p, Queue *q, Block *b) {
+    pthread_mutex_lock(&p->lock);
+    q->ring[(q->head + q->count++) % depth] = b;
+    pthread_cond_signal(&q->notEmpty);
+    pthread_mutex_unlock(&p->lock);
+}
+
+/* Returns: the next buffer in the queue, or NULL once the pipeline has stopped */
+static Block *take(Pipeline *p, Queue *q) {
+    Block *b = NULL;
+
+    pthread_mutex_lock(&p->lock);
+    while (q->count == 0 && !p->stopped) {
+        pthread_cond_wait(&q->notEmpty, &p->lock);
+    }
+    if (!p->stopped) {
+        b = q->ring[q->head];
+        q->head = (q->head + 1) % depth;
+        q->count--;
+    }
+    pthread_mutex_unlock(&p->lock);
+    return b;
+}
+
+static void stop(Pipeline *p) {
+    pthread_mutex_lock(&p->lock);
+    p->stopped = 1;
+    if (p->threaded) {
+        pthread_cond_broadcast(&p->freeIn.notEmpty);
+        pthread_cond_broadcast(&p->read.notEmpty);
+        pthread_cond_broadcast(&p->converted.notEmpty);
+        pthread_cond_broadcast(&p->freeOut.notEmpty);
+        pthread_cond_broadcast(&p->compressed.notEmpty);
+    }
+    pthread_mutex_unlock(&p->lock);
+}
+
+static int stopped(Pipeline *p) {
+    int s;
+    pthread_mutex_lock(&p->lock);
+    s = p->stopped;
+    pthread_mutex_unlock(&p->lock);
+    return s;
+}
+
+/* fill a buffer from the fork, marking it the last at the end or on error */
+static void fill_block(Pipeline *p, Block *b) {
+    const PipelineFork *pf = p->pf;
+    ssize_t n = 0;
+
+    b->len = 0;
+    b->last = 0;
+    while (b->len < blockSize &&
+           (n = pf->read(pf->readCtx, b->data + b->len, blockSize - b->len)) > 0) {
+        b->len += n;
+    }
+    if (n < 0) p->readError = errno ? errno : EIO;
+    if (n <= 0) b->last = 1;
+}
+
+static void convert_block(Pipeline *p, Block *b) {
+    char *c;
+
+    if (p->pf->convert) {   /* convert '\n' to '\r' */
+        for (c = b->data; c < b->data + b->len; c++) {
+            if (*c == '\n') *c = '\r';
+        }
+    }
+    p->crc = updcrc(p->crc, (unsigned char *)b->data, b->len);
+}
+
+/* Returns: 0, or -1 on error */
+static int write_block(Pipeline *p, const Block *b) {
+    size_t done = 0;
+    ssize_t n;
+
+    throttle_write(b->len);
+    while (done < b->len) {
+        n = write(p->pf->fd, b->data + done, b->len - done);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) {
+            fprintf(stderr, "Error writing fork data: %s\n", strerror(n < 0 ? errno : EIO));
+            return -1;
+        }
+        done += n;
+    }
+    p->clen += b->len;
+    return 0;
+}
+
+/*
+ * Pass the encoder's output buffer on to be written, and take another
+ * unless it was the last.
+ *
+ * Returns: 0, or -1 on error
+ */
+static int emit(Pipeline *p, int last) {
+    p->out->last = last;
+    if (!p->threaded) {
+        if (write_block(p, p->out) != 0) {
+            stop(p);
+            return -1;
+        }
+        p->out->len = 0;
+        return 0;
+    }
+    put(p, &p->compressed, p->out);
+    if (last) {
+        p->out = NULL;
+        return 0;
+    }
+    if ((p->out = take(p, &p->freeOut)) == NULL) return -1;
+    p->out->len = 0;
+    return 0;
+}
+
+/* the stream the encoder writes to, collecting its output in buffers */
+#ifdef USE_FOPENCOOKIE
+static ssize_t sink_write(void *cookie, const char *data, size_t len)
+#else
+static int sink_write(void *cookie, const char *data, int len)
+#endif
+{
+    Pipeline *p = cookie;
+    size_t done = 0, n;
+
+    if (!p->out || stopped(p)) {
+#ifdef USE_FOPENCOOKIE
+        return 0;
+#else
+        return -1;
+#endif
+    }
+    while (done < (size_t)len) {
+        n = blockSize - p->out->len;
+        if (n > len - done) n = len - done;
+        memcpy(p->out->data + p->out->len, data + done, n);
+        p->out->len += n;
+        done += n;
+        if (p->out->len == blockSize && emit(p, 0) != 0) {
+#ifdef USE_FOPENCOOKIE
+            return 0;
+#else
+            return -1;
+#endif
+        }
+    }
+    return done;
+}
+
+static int sink_close(void *cookie) {
+    Pipeline *p = cookie;
+
+    if (!p->out || stopped(p)) return 0;
+    return emit(p, 1) == 0 ? 0 : EOF;
+}
+
+static FILE *open_sink(Pipeline *p) {
+#ifdef USE_FOPENCOOKIE
+    cookie_io_functions_t io;
+
+    memset(&io, 0, sizeof(io));
+    io.write = sink_write;
+    io.close = sink_close;
+    return fopencookie(p, "w", io);
+#else
+    return funopen(p, NULL, sink_write, NULL, sink_close);
+#endif
+}
+
+/* Returns: the encoder writing to the archive, or NULL on error, having stopped the pipeline */
+static FILE *open_encoder(Pipeline *p) {
+    FILE *out, *zfs;
+
+    if ((out = open_sink(p)) == NULL) {
+        perror("fork data");
+        stop(p);
+        return NULL;
+    }
+    if ((zfs = p->pf->encoder(out, p->pf->encoderCtx)) == NULL) {
+        perror("fork data");
+        stop(p);
+        fclose(out);
+    }
+    return zfs;
+}
+
+static void *reader(void *arg) {
+    Pipeline *p = arg;
+    Block *b;
+    int last;
+
+    do {
+        if ((b = take(p, &p->freeIn)) == NULL) break;
+        fill_block(p, b);
+        last = b->last;
+        put(p, &p->read, b);
+    } while (!last);
+    return NULL;
+}
+
+static void *converter(void *arg) {
+    Pipeline *p = arg;
+    Block *b;
+    int last;
+
+    do {
+        if ((b = take(p, &p->read)) == NULL) break;
+        convert_block(p, b);
+        last = b->last;
+        put(p, &p->converted, b);
+    } while (!last);
+    return NULL;
+}
+
+static void *writer(void *arg) {
+    Pipeline *p = arg;
+    Block *b;
+    int last;
+
+    do {
+        if ((b = take(p, &p->compressed)) == NULL) break;
+        if (write_block(p, b) != 0) {
+            stop(p);
+            break;
+        }
+        last = b->last;
+        put(p, &p->freeOut, b);
+    } while (!last);
+    return NULL;
+}
+
+/* Returns: 0, or -1 if the buffers can't be had */
+static int allocate_pools(void) {
+    int i;
+
+    if (inBlocks) return 0;
+    inBlocks = calloc(depth, sizeof(Block));
+    outBlocks = calloc(depth, sizeof(Block));
+    for (i = 0; inBlocks && outBlocks && i < depth; i++) {
+        if ((inBlocks[i].data = malloc(blockSize)) == NULL ||
+            (outBlocks[i].data = malloc(blockSize)) == NULL) break;
+    }
+    if (i < depth) {
+        fprintf(stderr, "Not enough memory for %d buffers of %zu bytes\n",
+                2 * depth, blockSize);
+        if (inBlocks && outBlocks) {
+            for (i = 0; i < depth; i++) {
+                free(inBlocks[i].data);
+                free(outBlocks[i].data);
+            }
+        }
+        free(inBlocks);
+        free(outBlocks);
+        inBlocks = outBlocks = NULL;
+        return -1;
+    }
+    return 0;
+}
+
+/* every stage in turn in the calling thread, starting from the first buffer b */
+static void run_inline(Pipeline *p, Block *b) {
+    FILE *zfs;
+
+    p->out = &outBlocks[0];
+    p->out->len = 0;
+    if ((zfs = open_encoder(p)) == NULL) return;
+    for (;;) {
+        convert_block(p, b);
+        if (fwrite(b->data, 1, b->len, zfs) != b->len) {
+            stop(p);
+            break;
+        }
+        if (b->last) break;
+        fill_block(p, b);
+    }
+    if (fclose(zfs) != 0) stop(p);
+}
+
+/* the stages in their own threads, the first buffer b having been read */
+static void run_threaded(Pipeline *p, Block *b) {
+    void *(*stages[3])(void *) = { writer, converter, reader };
+    pthread_t threads[3];
+    FILE *zfs = NULL;
+    int i, started;
+
+    p->threaded = 1;
+    pthread_cond_init(&p->freeIn.notEmpty, NULL);
+    pthread_cond_init(&p->read.notEmpty, NULL);
+    pthread_cond_init(&p->converted.notEmpty, NULL);
+    pthread_cond_init(&p->freeOut.notEmpty, NULL);
+    pthread_cond_init(&p->compressed.notEmpty, NULL);
+    for (i = 1; i < depth; i++) {
+        put(p, &p->freeIn, &inBlocks[i]);
+        put(p, &p->freeOut, &outBlocks[i]);
+    }
+    p->out = &outBlocks[0];
+    p->out->len = 0;
+    put(p, &p->read, b);
+
+    for (started = 0; started < 3; started++) {
+        if (pthread_create(&threads[started], NULL, stages[started], p) != 0) {
+            fprintf(stderr, "Can't start a thread to compress fork data\n");
+            stop(p);
+            break;
+        }
+    }
+    if (started == 3 && (zfs = open_encoder(p)) != NULL) {
+        while ((b = take(p, &p->converted)) != NULL) {
+            int last = b->last;
+            if (fwrite(b->data, 1, b->len, zfs) != b->len) {
+                stop(p);
+                break;
+            }
+            put(p, &p->freeIn, b);
+            if (last) break;
+        }
+    }
+    if (zfs && fclose(zfs) != 0) stop(p);
+    for (i = 0; i < started; i++) {
+        pthread_join(threads[i], NULL);
+    }
+
+    pthread_cond_destroy(&p->freeIn.notEmpty);
+    pthread_cond_destroy(&p->read.notEmpty);
+    pthread_cond_destroy(&p->converted.notEmpty);
+    pthread_cond_destroy(&p->freeOut.notEmpty);
+    pthread_cond_destroy(&p->compressed.notEmpty);
+}
+
+off_t pipeline_fork(const PipelineFork *pf, unsigned short *crc, int *readError) {
+    Pipeline p;
+    Block *b;
+
+    if (allocate_pools() != 0) return -1;
+    memset(&p, 0, sizeof(p));
+    p.pf = pf;
+    pthread_mutex_init(&p.lock, NULL);
+
+    b = &inBlocks[0];
+    fill_block(&p, b);
+    if (b->last || depth == 1) {
+        run_inline(&p, b);
+    } else {
+        run_threaded(&p, b);
+    }
+    pthread_mutex_destroy(&p.lock);
+
+    if (p.readError) {
+        fprintf(stderr, "fork data: %s\n", strerror(p.readError));
+    }
+    *crc = p.crc;
+    *readError = p.readError;
+    return p.stopped ? -1 : p.clen;
+}
@@ -0,0 +1,58 @@
+/*
+ * pipeline.h - reading, converting, compressing and writing a fork at once
+ *
+ * A fork passes through four stages: a reader thread fills large buffers
+ * from the fork, a second thread changes line endings if asked and keeps
+ * the CRC, the calling thread compresses, and a writer thread writes the
+ * compressed buffers to the archive. The stages are joined by bounded
+ * queues, so that reading and writing go on while the encoder works, even
+ * on a single core, and a stage which falls behind holds up the ones
+ * before it instead of letting buffers pile up.
+ */
+
+#pragma once
+
+#include <stdio.h>
+#include <sys/types.h>
+
+#define PIPELINE_DEFAULT_BLOCK  262144  /* bytes in each buffer */
+#define PIPELINE_MIN_BLOCK      65536
+#define PIPELINE_MAX_BLOCK      16777216
+#define PIPELINE_DEFAULT_DEPTH  4
+#define PIPELINE_MAX_DEPTH      256
+
+typedef struct {
+    /* supplies the fork's bytes, returning the number placed in buf, 0 at
+       the end of the fork or -1 on error */
+    ssize_t (*read)(void *ctx, char *buf, size_t len);
+    void *readCtx;
+    int convert;                /* change '\n' to '\r' */
+    /* opens the encoder on out, which it closes along with itself; it
+       may return out to store the fork as it is */
+    FILE *(*encoder)(FILE *out, void *ctx);
+    void *encoderCtx;
+    int fd;                     /* the archive, written at its offset */
+} PipelineFork;
+
+/*
+ * Set the number of buffers each stage may have queued. A depth of 1
+ * runs every stage in turn in the calling thread, using the least memory.
+ */
+void pipeline_set_depth(int depth);
+
+/*
+ * Set the size of each buffer, between PIPELINE_MIN_BLOCK and
+ * PIPELINE_MAX_BLOCK. A fork no bigger than one buffer is handled in the
+ * calling thread.
+ */
+void pipeline_set_buffer(size_t size);
+
+/*
+ * Compress a fork into the archive. If it can't all be read, what was
+ * read is compressed, the error reported, and its errno set in
+ * *readError, which is otherwise set to 0. The CRC of the fork, after
+ * any conversion, is set in *crc.
+ *
+ * Returns: the compressed length, or -1 on error
+ */
+off_t pipeline_fork(const PipelineFork *pf, unsigned short *crc, int *readError);
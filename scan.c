@@ -0,0 +1,362 @@
+/*
+ * scan.c - integrity sweeps over many archives
+ *
+ * The main thread finds the archives, walking folders and reading lists,
+ * and hands their names to a pool of worker threads through a small
+ * bounded queue, so that memory use doesn't grow with the size of the
+ * store. Each worker maps one archive at a time and walks its headers
+ * itself rather than through sit_open(), so that it can carry on past a
+ * bad fork and report every damaged member, not just the first. Reads are
+ * accounted to the read limit set with --max-read-rate.
+ */
+
+#include "scan.h"
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <stdarg.h>
+#include <dirent.h>
+#include <limits.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include "macroman.h"
+#include "sitread.h"
+#include "throttle.h"
+#include "util.h"
+
+#define QUEUE_PER_JOB   16
+#define MAX_DEPTH       256
+
+extern unsigned short updcrc(unsigned short icrc, unsigned char *icp, int icnt);
+
+typedef struct {
+    const ScanOptions *opts;
+    char **queue;               /* ring of archive names waiting to be checked */
+    int cap, head, count;
+    int closed;                 /* no more names are coming */
+    pthread_mutex_t lock;
+    pthread_cond_t notEmpty, notFull;
+    /* totals, under the lock */
+    long archives, corrupt, members, unchecked;
+    long long bytes;
+} Scanner;
+
+typedef struct {
+    Scanner *s;
+    const char *archive;
+    int problems;
+} Check;
+
+/* write a line about an archive, or about a member of it if member isn't NULL */
+static void vnote(Check *c, const char *member, const char *fmt, va_list ap) {
+    pthread_mutex_lock(&c->s->lock);
+    fprintf(c->s->opts->report, "%s: ", c->archive);
+    if (member) fprintf(c->s->opts->report, "%s: ", member);
+    vfprintf(c->s->opts->report, fmt, ap);
+    fputc('\n', c->s->opts->report);
+    pthread_mutex_unlock(&c->s->lock);
+}
+
+static void note(Check *c, const char *member, const char *fmt, ...) {
+    va_list ap;
+    va_start(ap, fmt);
+    vnote(c, member, fmt, ap);
+    va_end(ap);
+}
+
+static void report(Check *c, const char *member, const char *fmt, ...) {
+    va_list ap;
+    va_start(ap, fmt);
+    vnote(c, member, fmt, ap);
+    va_end(ap);
+    c->problems++;
+}
+
+static int discard(void *ctx, const unsigned char *buf, size_t len) {
+    return 0;
+}
+
+/* decode a fork to check its length and CRC; returns 1 if it's damaged */
+static int check_fork(Check *c, const SitArchive *arc, const SitFork *fork, const char *path,
+                      const char *which) {
+    int result;
+
+    if (fork->length == 0 && fork->compLength == 0) {
+        return 0;
+    }
+    throttle_read(fork->compLength);
+    result = sit_decode_fork(arc, fork, discard, NULL);
+    if (result == SIT_BADMETHOD) {
+        pthread_mutex_lock(&c->s->lock);
+        c->s->unchecked++;
+        pthread_mutex_unlock(&c->s->lock);
+        if (c->s->opts->verbose) {
+            note(c, path, "%s fork not checked (method %d)", which, fork->method);
+        }
+        return 0;
+    }
+    if (result != SIT_OK) {
+        report(c, path, "%s fork: %s", which, sit_strerror(result));
+        return 1;
+    }
+    return 0;
+}
+
+static void check_archive(Scanner *s, const char *archive) {
+    SitArchive arc;
+    Check c;
+    struct {
+        char *path;
+        off_t start;
+    } stack[MAX_DEPTH];
+    off_t pos = sizeof(sitHdr), end;
+    long top = 0, damaged = 0;
+    int depth = 0, complete = 0, i;
+
+    c.s = s;
+    c.archive = archive;
+    c.problems = 0;
+    if (sit_map(archive, &arc) < 0) {
+        report(&c, NULL, "can't be read as a StuffIt archive");
+        goto done;
+    }
+    throttle_read(sizeof(sitHdr));
+    if (arc.arcLen > arc.size) {
+        report(&c, NULL, "truncated: arcLen is %lld, but the file is %lld bytes",
+               (long long)arc.arcLen, (long long)arc.size);
+    }
+    end = arc.arcLen < arc.size ? arc.arcLen : arc.size;
+
+    for (;;) {
+        const fileHdr *h;
+        unsigned char pname[64];
+        char name[256], path[PATH_MAX];
+        SitFork rsrc, data;
+        int bad = 0;
+
+        if (pos + (off_t)sizeof(fileHdr) > end) {
+            complete = 1;
+            break;
+        }
+        h = (const fileHdr *)(arc.map + pos);
+
+        throttle_read(sizeof(fileHdr));
+        if (updcrc(0, (unsigned char *)h, sizeof(fileHdr) - 2) != get2(h->hdrCRC)) {
+            /* the lengths can't be trusted, so there's no finding the next header */
+            report(&c, NULL, "bad header CRC at offset %lld", (long long)pos);
+            damaged++;
+            break;
+        }
+        if (h->compRMethod == endFolder || h->compDMethod == endFolder) {
+            if (depth == 0) {
+                report(&c, NULL, "unmatched endFolder at offset %lld", (long long)pos);
+            } else {
+                depth--;
+                if (depth == 0 &&
+                    get4(((const fileHdr *)(arc.map + stack[0].start))->cDLen) !=
+                    pos - stack[0].start) {
+                    report(&c, stack[0].path, "folder length is wrong");
+                }
+                free(stack[depth].path);
+            }
+            pos += sizeof(fileHdr);
+            continue;
+        }
+        if (depth == 0) top++;
+        memcpy(pname, h->fName, sizeof(pname));
+        if (pname[0] > 63) pname[0] = 63;
+        convertMacRomanToFilesystemName(pname, name, sizeof(name));
+        snprintf(path, sizeof(path), "%s%s%s", depth ? stack[depth-1].path : "",
+                 depth ? "/" : "", name);
+        if (h->compRMethod == startFolder || h->compDMethod == startFolder) {
+            if (depth == MAX_DEPTH) {
+                report(&c, path, "folders nested too deeply");
+                break;
+            }
+            stack[depth].path = strdup(path);
+            stack[depth++].start = pos;
+            pos += sizeof(fileHdr);
+            continue;
+        }
+        sit_set_forks(&arc, pos, &rsrc, &data);
+        pos = data.offset + data.compLength;
+        if (pos > end) {
+            report(&c, path, "extends past the end of the archive");
+            damaged++;
+            break;
+        }
+        bad |= check_fork(&c, &arc, &rsrc, path, "resource");
+        bad |= check_fork(&c, &arc, &data, path, "data");
+        damaged += bad;
+    }
+    /* if the walk stopped early, these would only repeat the problem found */
+    if (complete && depth > 0) {
+        report(&c, NULL, "archive ends inside folder \"%s\"", stack[depth-1].path);
+    }
+    for (i = 0; i < depth; i++) free(stack[i].path);
+    if (complete && top != arc.numFiles) {
+        report(&c, NULL, "numFiles is %d, but there are %ld top-level entries",
+               arc.numFiles, top);
+    }
+    pthread_mutex_lock(&s->lock);
+    s->bytes += arc.size;
+    s->members += damaged;
+    pthread_mutex_unlock(&s->lock);
+    sit_close(&arc);
+
+done:
+    pthread_mutex_lock(&s->lock);
+    s->archives++;
+    if (c.problems) {
+        s->corrupt++;
+    } else if (s->opts->verbose) {
+        fprintf(s->opts->report, "%s: OK\n", archive);
+    }
+    pthread_mutex_unlock(&s->lock);
+}
+
+static void *worker(void *arg) {
+    Scanner *s = arg;
+
+    for (;;) {
+        char *archive;
+        pthread_mutex_lock(&s->lock);
+        while (s->count == 0 && !s->closed) {
+            pthread_cond_wait(&s->notEmpty, &s->lock);
+        }
+        if (s->count == 0) {
+            pthread_mutex_unlock(&s->lock);
+            break;
+        }
+        archive = s->queue[s->head];
+        s->head = (s->head + 1) % s->cap;
+        s->count--;
+        pthread_cond_signal(&s->notFull);
+        pthread_mutex_unlock(&s->lock);
+        check_archive(s, archive);
+        free(archive);
+    }
+    return NULL;
+}
+
+static void enqueue(void *ctx, const char *archive) {
+    Scanner *s = ctx;
+
+    pthread_mutex_lock(&s->lock);
+    while (s->count == s->cap) {
+        pthread_cond_wait(&s->notFull, &s->lock);
+    }
+    s->queue[(s->head + s->count++) % s->cap] = strdup(archive);
+    pthread_cond_signal(&s->notEmpty);
+    pthread_mutex_unlock(&s->lock);
+}
+
+static int has_sit_suffix(const char *name) {
+    size_t len = strlen(name);
+    return len > 4 && strcasecmp(name + len - 4, ".sit") == 0;
+}
+
+/* find a folder's ".sit" files, recursively */
+static void add_folder(const char *folder, scan_archive_fn fn, void *ctx) {
+    DIR *dir;
+    struct dirent *entry;
+    char path[PATH_MAX];
+
+    if ((dir = opendir(folder)) == NULL) {
+        perror(folder);
+        return;
+    }
+    while ((entry = readdir(dir)) != NULL) {
+        struct stat st;
+        if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0 ||
+            snprintf(path, sizeof(path), "%s/%s", folder, entry->d_name) >= sizeof(path) ||
+            lstat(path, &st) != 0) {
+            continue;
+        }
+        if (S_ISDIR(st.st_mode)) {
+            add_folder(path, fn, ctx);
+        } else if (S_ISREG(st.st_mode) && has_sit_suffix(entry->d_name)) {
+            fn(ctx, path);
+        }
+    }
+    closedir(dir);
+}
+
+/* find the archives and folders listed in a file, one per line */
+static void add_list(const char *list, scan_archive_fn fn, void *ctx) {
+    FILE *fs = strcmp(list, "-") == 0 ? stdin : fopen(list, "r");
+    char *line = NULL;
+    size_t cap = 0;
+    ssize_t len;
+
+    if (!fs) {
+        perror(list);
+        return;
+    }
+    while ((len = getline(&line, &cap, fs)) > 0) {
+        if (line[len-1] == '\n') line[--len] = 0;
+        if (len > 0) scan_find_archives(line, fn, ctx);
+    }
+    free(line);
+    if (fs != stdin) fclose(fs);
+}
+
+void scan_find_archives(const char *path, scan_archive_fn fn, void *ctx) {
+    struct stat st;
+
+    if (path[0] == '@') {
+        add_list(path + 1, fn, ctx);
+    } else if (stat(path, &st) == 0 && S_ISDIR(st.st_mode)) {
+        add_folder(path, fn, ctx);
+    } else {
+        fn(ctx, path);
+    }
+}
+
+int scan_archives(char **paths, int npaths, const ScanOptions *opts) {
+    Scanner s;
+    pthread_t *threads;
+    int i, nthreads = opts->jobs > 0 ? opts->jobs : 1;
+
+    memset(&s, 0, sizeof(s));
+    s.opts = opts;
+    s.cap = nthreads * QUEUE_PER_JOB;
+    s.queue = malloc(s.cap * sizeof(char *));
+    pthread_mutex_init(&s.lock, NULL);
+    pthread_cond_init(&s.notEmpty, NULL);
+    pthread_cond_init(&s.notFull, NULL);
+    threads = malloc(nthreads * sizeof(pthread_t));
+    for (i = 0; i < nthreads; i++) {
+        if (pthread_create(&threads[i], NULL, worker, &s) != 0) {
+            break;
+        }
+    }
+    if ((nthreads = i) == 0) {
+        fprintf(stderr, "Can't start scanning threads\n");
+        return 1;
+    }
+    for (i = 0; i < npaths; i++) {
+        scan_find_archives(paths[i], enqueue, &s);
+    }
+    pthread_mutex_lock(&s.lock);
+    s.closed = 1;
+    pthread_cond_broadcast(&s.notEmpty);
+    pthread_mutex_unlock(&s.lock);
+    for (i = 0; i < nthreads; i++) {
+        pthread_join(threads[i], NULL);
+    }
+
+    fprintf(opts->report, "Scanned %ld archives (%lld bytes): %ld intact, %ld damaged, "
+            "%ld damaged files", s.archives, s.bytes, s.archives - s.corrupt, s.corrupt,
+            s.members);
+    if (s.unchecked) {
+        fprintf(opts->report, ", %ld forks not checked", s.unchecked);
+    }
+    fputc('\n', opts->report);
+    free(threads);
+    free(s.queue);
+    pthread_cond_destroy(&s.notFull);
+    pthread_cond_destroy(&s.notEmpty);
+    pthread_mutex_destroy(&s.lock);
+    return s.corrupt ? 1 : 0;
+}
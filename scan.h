@@ -0,0 +1,38 @@
+/*
+ * scan.h - integrity sweeps over many archives
+ *
+ * Each archive is checked without extracting anything: its signature,
+ * arcLen and numFiles against what it contains, every header CRC, folder
+ * nesting and the lengths recorded in top-level folders, and the length
+ * and CRC of every fork after decoding it. Problems are written to a
+ * report, one line per problem, followed by a summary.
+ */
+
+#pragma once
+
+#include <stdio.h>
+
+typedef struct {
+    int jobs;                   /* archives checked at once */
+    int verbose;                /* also report archives which are fine */
+    FILE *report;
+} ScanOptions;
+
+/*
+ * Check the archives given. A folder is searched for ".sit" files, and a
+ * name starting with '@' is a file listing archives or folders to check,
+ * one per line ("@-" reads the list from stdin).
+ *
+ * Returns: 0 if everything checked is intact, 1 otherwise
+ */
+int scan_archives(char **paths, int npaths, const ScanOptions *opts);
+
+/* Called with the name of each archive found by scan_find_archives() */
+typedef void (*scan_archive_fn)(void *ctx, const char *archive);
+
+/*
+ * Find archives the way scan_archives() does: a folder is searched for
+ * ".sit" files, a name starting with '@' is a list, and any other name is
+ * taken to be an archive.
+ */
+void scan_find_archives(const char *path, scan_archive_fn fn, void *ctx);
@@ -15,6 +15,21 @@
    In general, you should avoid this option, especially if you are archiving
    other types of documents or applications.
 
+   Files with a .hqx extension are decoded from BinHex 4.0 as they are
+   archived, so the entry holds the original forks and Finder info.
+   Disk images (.dsk, .img, .image or .hfs) holding an HFS volume are
+   archived as a folder holding the volume's files.
+   A file given as "-" has its data fork read from stdin, named with --name.
+
+   If the files won't fit in one archive (at most 65535 top-level entries
+   and 4 GB), or in the volume size given with -V, they are split across
+   several archives named <dstfile>.partN.sit, which are built in parallel.
+   A manifest listing what each archive holds is written to <dstfile>.manifest.
+
+   With -x, the archives given as arguments are extracted instead, into
+   the current folder or the one given with -o. Resource forks and Finder
+   info are written to AppleDouble "._name" files.
+
    Examples:
      # create "archive.sit" containing three specified files
      sit file1 file2 file3
@@ -60,11 +75,34 @@
 #include <stdint.h>
 #include <limits.h>
 #include <errno.h>
+#include <getopt.h>
+#include <sys/wait.h>
 #ifdef BSD
 #include <sys/time.h>
 #endif
 #include "sit.h"
 #include "appledouble.h"
+#include "binhex.h"
+#include "calibrate.h"
+#include "catalog.h"
+#include "daemon.h"
+#include "diff.h"
+#include "estimate.h"
+#include "extract.h"
+#include "forkcache.h"
+#include "hfs.h"
+#include "interleave.h"
+#include "journal.h"
+#include "links.h"
+#include "macroman.h"
+#include "merge.h"
+#include "pipeline.h"
+#include "sitindex.h"
+#include "scan.h"
+#include "split.h"
+#include "transcode.h"
+#include "throttle.h"
+#include "watch.h"
 #include "zopen.h"
 
 /* Type compatibility for non-BSD systems */
@@ -119,7 +157,9 @@ static long get_timezone_offset(void) {
 
 /* Safe write that checks for errors and partial writes */
 static int safe_write(int fd, const void *buf, size_t count, const char *context) {
-    ssize_t written = write(fd, buf, count);
+    ssize_t written;
+    throttle_write(count);
+    written = write(fd, buf, count);
     if (written < 0) {
         fprintf(stderr, "Error writing %s: %s\n", context, strerror(errno));
         return -1;
@@ -139,20 +179,106 @@ char buf[BUFSIZ]; /* BUFSIZ is defined in <stdio.h> as 1024 */
 char *defoutfile = "archive.sit";
 int ofd;
 ushort crc;
+int readerror;	/* errno if the last fork couldn't all be read, else 0 */
+int unreadable;	/* files left out because they couldn't all be read */
 int rmfiles;
 int unixf;
 int verbose;
 char *Creator, *Type;
+char *journalfile;
+JournalTotals progress; /* archive totals, for the journal */
+off_t volsize;	/* -V volume size, 0 if not given */
+int jobs;		/* volumes built, or forks extracted, at once */
+int extracting;	/* -x: extract archives instead of creating one */
+int oflag;		/* -o was given */
+char *catpath;	/* --cat: member to write to stdout */
+off_t catstart, catlength = -1;	/* --range: part of it to write */
+int indexing;	/* --index: write an index sidecar */
+int transcoding;	/* --transcode: recompress archives */
+int merging;	/* --merge: combine archives */
+int nesting;	/* --nest: each in a folder of its own */
+char *subsetfile;	/* --subset: archive to take some members from */
+int scanning;	/* --scan: check archives for damage */
+int cataloguing;	/* --catalog: build a catalog of archives */
+char *lookupname;	/* --lookup: file to find in a catalog */
+int diffing;	/* --diff: compare two archives */
+int diffbytes;	/* --bytes: compare their forks byte by byte */
+int estimating;	/* --estimate: only estimate the archive's size */
+int watching;	/* --watch: keep the archive up to date */
+double watchdelay = 2;	/* seconds of quiet before rebuilding */
+int calibrating;	/* --calibrate: measure the host and report the settings */
+char *daemonsocket;	/* --daemon: build archives for clients on this socket */
+char *submitsocket;	/* --submit: have the daemon on this socket build the archive */
+Tuning tuning;	/* -j, --queue-depth, --buffer-size and --max-memory, 0 if not given */
+int stdinput;	/* "-" is one of the files: read its data fork from stdin */
+char *stdinname = "stdin";	/* --name: what to call it */
 
 static void usage(char *arg0) {
     fprintf(stderr, "Usage: %s ", arg0);
-    fprintf(stderr, "[-v] [-u] [-T type] [-C creator] [-o dstfile] file ...\n");
+    fprintf(stderr, "[-v] [-u] [-T type] [-C creator] [-o dstfile] [-J journal]\n"
+                    "       [-V size] [-j jobs] [--max-read-rate rate] [--max-write-rate rate]\n"
+                    "       [--idle-io] [--index] [--queue-depth n] [--buffer-size size]\n"
+                    "       [--max-memory size] [--interleave n] [--watch[=seconds]]\n"
+                    "       [--name name] file|- ...\n"
+                    "       %s --daemon socket [-v] [-j workers] [--max-memory size]\n"
+                    "       %s --submit socket [-v] [-u] [-T type] [-C creator] [-o dstfile] file ...\n"
+                    "       %s -x [-v] [-u] [-j jobs] [-o dstdir] archive ...\n"
+                    "       %s --cat path[:rsrc] [--range offset[+length]] archive\n"
+                    "       %s --transcode [-v] [-j jobs] [-o dstfile] archive ...\n"
+                    "       %s --merge [-v] [--nest] [-o dstfile] archive ...\n"
+                    "       %s --subset archive [-v] [-o dstfile] path ...\n"
+                    "       %s --scan [-v] [-j jobs] [-o report] archive|folder|@list ...\n"
+                    "       %s --catalog [-v] -o catalog archive|folder|@list ...\n"
+                    "       %s --lookup name catalog\n"
+                    "       %s --diff [-v] [--bytes] [-o report] old.sit new.sit\n"
+                    "       %s --estimate [-v] [-u] file ...\n"
+                    "       %s --calibrate [file ...]\n",
+                    arg0, arg0, arg0, arg0, arg0, arg0, arg0, arg0, arg0, arg0, arg0, arg0, arg0);
     fprintf(stderr, "Options:\n");
     fprintf(stderr, "  -v           Verbose output (can specify more than once for extra info)\n");
     fprintf(stderr, "  -u           Convert '\\n' chars to '\\r' in file's data while archiving\n");
     fprintf(stderr, "  -T type      Use this four-character type code if file doesn't have one\n");
     fprintf(stderr, "  -C creator   Use this four-character creator if file doesn't have one\n");
+    fprintf(stderr, "  --type type, --creator creator  The same as -T and -C\n");
     fprintf(stderr, "  -o dstfile   Create archive with this name (default is \"archive.sit\")\n");
+    fprintf(stderr, "  -x           Extract the archives given, into the folder given with -o if any\n");
+    fprintf(stderr, "  -J journal   Keep a checkpoint journal, and resume from it if it exists\n");
+    fprintf(stderr, "  -V size      Split into archives of at most this size (suffix K, M or G)\n");
+    fprintf(stderr, "  -j jobs      Build split archives, or extract or transcode forks, this many at once\n");
+    fprintf(stderr, "               (default: number of CPUs sit may use)\n");
+    fprintf(stderr, "  --max-read-rate rate   Read files at most this many bytes/sec (suffix K, M or G)\n");
+    fprintf(stderr, "  --max-write-rate rate  Write the archive at most this many bytes/sec\n");
+    fprintf(stderr, "  --idle-io    Only use the disk when no other process needs it\n");
+    fprintf(stderr, "  --name name  Name of the file whose data fork is read from stdin, given as -\n");
+    fprintf(stderr, "               (default: \"stdin\")\n");
+    fprintf(stderr, "  --cat path   Write the data fork (or with :rsrc, the resource fork)\n");
+    fprintf(stderr, "               of one file in the archive to stdout\n");
+    fprintf(stderr, "  --range offset[+length]  With --cat, write only this part of the fork\n");
+    fprintf(stderr, "  --index      Write an index for quick access to files and ranges\n");
+    fprintf(stderr, "  --queue-depth n  Buffers queued between reading, compressing and writing\n");
+    fprintf(stderr, "               each fork (default: calibrated; 1 does one thing at a time)\n");
+    fprintf(stderr, "  --buffer-size size  Size of those buffers, 64K to 16M (default: calibrated)\n");
+    fprintf(stderr, "  --max-memory size  Memory the buffers of all jobs may take together\n");
+    fprintf(stderr, "               (default: an eighth of the memory sit may use)\n");
+    fprintf(stderr, "  --calibrate  Measure this host afresh and show the settings it calls for\n");
+    fprintf(stderr, "  --daemon socket  Build archives for --submit clients, with -j workers\n");
+    fprintf(stderr, "               which keep the forks they compress, within --max-memory\n");
+    fprintf(stderr, "  --submit socket  Have the daemon listening on socket build the archive\n");
+    fprintf(stderr, "  --interleave n  Read small files ahead and compress n of them at once\n");
+    fprintf(stderr, "               on one thread, to overlap the encoder's cache misses\n");
+    fprintf(stderr, "  --estimate   Estimate the size of the archive, compressing only a sample\n");
+    fprintf(stderr, "  --watch[=seconds]  Keep rebuilding the archive as the files change, once\n");
+    fprintf(stderr, "               they have been left alone this long (default: 2 seconds)\n");
+    fprintf(stderr, "  --transcode  Recompress the archives given, in place or into dstfile\n");
+    fprintf(stderr, "  --merge      Combine the archives given into dstfile without recompressing\n");
+    fprintf(stderr, "  --nest       With --merge, put each archive's contents in a folder\n");
+    fprintf(stderr, "  --subset archive  Copy only the files and folders given from archive\n");
+    fprintf(stderr, "  --scan       Check archives, and the .sit files in folders, for damage\n");
+    fprintf(stderr, "  --catalog    Write a searchable catalog of the files in the archives given\n");
+    fprintf(stderr, "  --lookup name  List the files with this name, or path ending, in a catalog\n");
+    fprintf(stderr, "  --diff       List the files added, removed or changed between two archives,\n");
+    fprintf(stderr, "               from their headers (exit status 1 if there are any)\n");
+    fprintf(stderr, "  --bytes      With --diff, also decode and compare the forks\n");
     fprintf(stderr, "\n");
     fprintf(stderr, "Examples:\n");
     fprintf(stderr, "  # create \"archive.sit\" containing three specified files\n");
@@ -161,32 +287,136 @@ static void usage(char *arg0) {
     fprintf(stderr, "  %s -o FolderArchive.sit FolderToBeArchived\n", arg0);
     fprintf(stderr, "  # specify that untyped files are JPEG and open in GraphicConverter\n");
     fprintf(stderr, "  %s -o jpgArchive.sit -T JPEG -C GKON *.jpg\n", arg0);
+    fprintf(stderr, "  # split a big folder into archives of at most 650 MB\n");
+    fprintf(stderr, "  %s -V 650M -o Big.sit BigFolder\n", arg0);
+    fprintf(stderr, "  # extract \"archive.sit\" into the folder \"out\"\n");
+    fprintf(stderr, "  %s -x -o out archive.sit\n", arg0);
+    fprintf(stderr, "  # archive a report as it's generated, as a text file named \"Report\"\n");
+    fprintf(stderr, "  producer | %s -o out.sit --name Report --type TEXT -\n", arg0);
+    fprintf(stderr, "  # write one file in \"archive.sit\" to stdout\n");
+    fprintf(stderr, "  %s --cat Folder/ReadMe archive.sit\n", arg0);
 }
 extern char *optarg;
 extern int optind;
 
+/* long options, which have no single-letter equivalent */
+enum { OPT_MAX_READ_RATE = 256, OPT_MAX_WRITE_RATE, OPT_IDLE_IO, OPT_CAT, OPT_RANGE, OPT_INDEX,
+	OPT_TRANSCODE, OPT_MERGE, OPT_NEST, OPT_SUBSET, OPT_SCAN,
+	OPT_CATALOG, OPT_LOOKUP, OPT_WATCH, OPT_ESTIMATE,
+	OPT_QUEUE_DEPTH, OPT_INTERLEAVE, OPT_BUFFER_SIZE, OPT_MAX_MEMORY, OPT_CALIBRATE,
+	OPT_DAEMON, OPT_SUBMIT, OPT_DIFF, OPT_BYTES, OPT_NAME };
+static struct option longopts[] = {
+	{ "max-read-rate",	required_argument,	NULL,	OPT_MAX_READ_RATE },
+	{ "max-write-rate",	required_argument,	NULL,	OPT_MAX_WRITE_RATE },
+	{ "idle-io",		no_argument,		NULL,	OPT_IDLE_IO },
+	{ "cat",		required_argument,	NULL,	OPT_CAT },
+	{ "range",		required_argument,	NULL,	OPT_RANGE },
+	{ "index",		no_argument,		NULL,	OPT_INDEX },
+	{ "transcode",	no_argument,		NULL,	OPT_TRANSCODE },
+	{ "merge",		no_argument,		NULL,	OPT_MERGE },
+	{ "nest",		no_argument,		NULL,	OPT_NEST },
+	{ "subset",		required_argument,	NULL,	OPT_SUBSET },
+	{ "scan",		no_argument,		NULL,	OPT_SCAN },
+	{ "catalog",		no_argument,		NULL,	OPT_CATALOG },
+	{ "lookup",		required_argument,	NULL,	OPT_LOOKUP },
+	{ "watch",		optional_argument,	NULL,	OPT_WATCH },
+	{ "estimate",		no_argument,		NULL,	OPT_ESTIMATE },
+	{ "queue-depth",	required_argument,	NULL,	OPT_QUEUE_DEPTH },
+	{ "interleave",		required_argument,	NULL,	OPT_INTERLEAVE },
+	{ "buffer-size",	required_argument,	NULL,	OPT_BUFFER_SIZE },
+	{ "max-memory",		required_argument,	NULL,	OPT_MAX_MEMORY },
+	{ "calibrate",		no_argument,		NULL,	OPT_CALIBRATE },
+	{ "daemon",		required_argument,	NULL,	OPT_DAEMON },
+	{ "submit",		required_argument,	NULL,	OPT_SUBMIT },
+	{ "diff",		no_argument,		NULL,	OPT_DIFF },
+	{ "bytes",		no_argument,		NULL,	OPT_BYTES },
+	{ "name",		required_argument,	NULL,	OPT_NAME },
+	{ "type",		required_argument,	NULL,	'T' },
+	{ "creator",		required_argument,	NULL,	'C' },
+	{ NULL, 0, NULL, 0 }
+};
+
+/* Parses a number of bytes, optionally followed by K, M or G.
+ * Returns the number, or -1 if it isn't valid.
+ */
+static off_t parse_size(const char *arg) {
+	char *end;
+	off_t size = strtoll(arg,&end,10);
+
+	switch (*end) {
+		case 'G': case 'g': size *= 1024;	/* fall through */
+		case 'M': case 'm': size *= 1024;	/* fall through */
+		case 'K': case 'k': size *= 1024; end++; break;
+	}
+	return (end == arg || *end || size < 0) ? -1 : size;
+}
+
+/* A fork reader supplies the bytes of one fork to encode_fork(), returning
+ * the number of bytes placed in buf, 0 at the end of the fork, or -1 on error.
+ */
+typedef ssize_t (*fork_reader)(void *ctx, char *buf, size_t len);
+
+/* a fork read from a pipe, whose length is known only at the end */
+typedef struct {
+	int fd;
+	off_t len;
+} StreamFork;
+
+static ssize_t read_fd_fork(void *ctx, char *rbuf, size_t len) {
+	ssize_t n = read(*(int *)ctx, rbuf, len);
+	if (n > 0) throttle_read(n);
+	return n;
+}
+
+static ssize_t read_stream_fork(void *ctx, char *rbuf, size_t len) {
+	StreamFork *sf = ctx;
+	ssize_t n = read_fd_fork(&sf->fd, rbuf, len);
+	if (n > 0 && (sf->len += n) > UINT32_MAX) {
+		errno = EFBIG;	/* stop reading; it can't be archived */
+		return -1;
+	}
+	return n;
+}
+
 /* function declarations */
 extern ushort updcrc(ushort icrc, unsigned char *icp, int icnt);
 off_t put_item(char *name, off_t *uncompressed);
 off_t put_folder(char *name, off_t *uncompressed, int level);
 off_t put_folder_entry(char *name, off_t startPos, off_t *unCmpLen, int mtype, int level);
+off_t write_folder_entry(char *fname, u_char *macName, uint32_t cdate, uint32_t mdate,
+		off_t startPos, off_t *unCmpLen, int mtype, int level);
 off_t put_file(char *name, off_t *uncompressed, int level);
-off_t dofork(char *name, int convert);
+off_t put_binhex(char *name, BinHexFile *bh, off_t *uncompressed, int level);
+off_t put_volume(char *name, HfsVolume *vol, off_t *uncompressed, int level);
+off_t put_stdin(char *name, off_t *uncompressed, int level);
+off_t finish_file_entry(char *name, long fpos1, size_t rlen, size_t dlen,
+		size_t cRLen, size_t cDLen, int level);
+off_t dofork(char *name, int convert, int rsrc);
+off_t encode_fork(fork_reader reader, void *ctx, int convert, int rsrc);
 void cp2(uint16_t x, char *dest);
 void cp4(uint32_t x, char *dest);
-void convertFilesystemNameToMacRoman(char *fsName, char *macName, int maxLength);
 int create_file(char *path);
+void put_items(char **inputs, int ninputs, off_t *items, off_t *total, off_t *uncompressed);
+int write_archive_header(off_t items, off_t total);
+int build_volumes(char **inputs, int ninputs, SplitVolume *vols, int nvols, off_t budget);
+static int watch_build(char **inputs, int ninputs);
+static int daemon_build(const DaemonJob *job);
+static int estimate_archive(char **inputs, int ninputs);
+int get_fork_sizes(char *name, off_t *rlen, off_t *dlen);
+off_t planned_size(const char *path);
 
 int main(int argc, char **argv) {
 	int i;
 	off_t total=0, uncompressed=0, items=0;
-	int c;
+	int c, resuming=0, restarting=0, nvols=0;
+	SplitVolume *vols=NULL;
+	off_t budget, rate;
 
 	if (argc < 2) {
 		usage(argv[0]);
 		exit(1);
 	}
-	while ((c=getopt(argc, argv, "o:uvC:T:h")) != EOF)
+	while ((c=getopt_long(argc, argv, "o:uvxC:T:J:V:j:h",longopts,NULL)) != EOF)
 	switch (c) {
 		case 'r':		/* REMOVED! 'r' option is too easily confused with 'recursive' */
 			usage(argv[0]);
@@ -195,6 +425,7 @@ int main(int argc, char **argv) {
 			break;
 		case 'o':		/* specify output file */
 			defoutfile = optarg;
+			oflag++;
 			break;
 		case 'u':		/* unix file -- change '\n' to '\r' */
 			unixf++;
@@ -202,12 +433,157 @@ int main(int argc, char **argv) {
 		case 'v':		/* verbose output */
 			verbose++;
 			break;
+		case 'x':		/* extract archives */
+			extracting++;
+			break;
 		case 'C':		/* set Mac creator (as default for files without one) */
 			Creator = optarg;
 			break;
 		case 'T':		/* set Mac file type (as default for files without one) */
 			Type = optarg;
 			break;
+		case 'J':		/* keep a checkpoint journal so the build can be resumed */
+			journalfile = optarg;
+			break;
+		case 'V':		/* split into volumes of at most this size */
+			volsize = parse_size(optarg);
+			if (volsize < 1024 || volsize > SPLIT_MAX_ARCHIVE) {
+				fprintf(stderr, "Invalid volume size: %s\n", optarg);
+				exit(1);
+			}
+			break;
+		case 'j':		/* volumes, extraction, transcode or daemon workers at once */
+			{
+				char *end;
+				long n = strtol(optarg,&end,10);
+				if (end == optarg || *end || n < 1 || n > INT_MAX) {
+					fprintf(stderr, "Invalid number of jobs: %s\n", optarg);
+					exit(1);
+				}
+				tuning.jobs = n;
+			}
+			break;
+		case OPT_MAX_READ_RATE:
+		case OPT_MAX_WRITE_RATE:
+			if ((rate=parse_size(optarg)) <= 0) {
+				fprintf(stderr, "Invalid rate: %s\n", optarg);
+				exit(1);
+			}
+			throttle_set_rate((c==OPT_MAX_READ_RATE) ? THROTTLE_READ : THROTTLE_WRITE, rate);
+			break;
+		case OPT_IDLE_IO:		/* let other processes' I/O go first */
+			throttle_lower_priority();
+			break;
+		case OPT_CAT:			/* write one member to stdout */
+			catpath = optarg;
+			break;
+		case OPT_RANGE:			/* write only part of it */
+			{
+				char *plus = strchr(optarg,'+');
+				if (plus) {
+					*plus = 0;
+					catlength = parse_size(plus+1);
+				}
+				if ((catstart=parse_size(optarg)) < 0 || (plus && catlength < 0)) {
+					fprintf(stderr, "Invalid range\n");
+					exit(1);
+				}
+			}
+			break;
+		case OPT_INDEX:			/* write an index sidecar */
+			indexing++;
+			break;
+		case OPT_TRANSCODE:		/* recompress archives */
+			transcoding++;
+			break;
+		case OPT_MERGE:			/* combine archives */
+			merging++;
+			break;
+		case OPT_NEST:			/* each in a folder named after it */
+			nesting++;
+			break;
+		case OPT_SUBSET:		/* copy some members of an archive */
+			subsetfile = optarg;
+			break;
+		case OPT_SCAN:			/* check archives for damage */
+			scanning++;
+			break;
+		case OPT_CATALOG:		/* build a catalog of archives */
+			cataloguing++;
+			break;
+		case OPT_LOOKUP:		/* find a file in a catalog */
+			lookupname = optarg;
+			break;
+		case OPT_WATCH:			/* keep the archive up to date */
+			watching++;
+			if (optarg) {
+				char *end;
+				watchdelay = strtod(optarg,&end);
+				if (end == optarg || *end || watchdelay < 0 || watchdelay > 86400) {
+					fprintf(stderr, "Invalid delay: %s\n", optarg);
+					exit(1);
+				}
+			}
+			break;
+		case OPT_ESTIMATE:		/* estimate the archive's size */
+			estimating++;
+			break;
+		case OPT_QUEUE_DEPTH:	/* buffers between the stages of a fork */
+			{
+				char *end;
+				long depth = strtol(optarg,&end,10);
+				if (end == optarg || *end || depth < 1 || depth > PIPELINE_MAX_DEPTH) {
+					fprintf(stderr, "Invalid queue depth: %s\n", optarg);
+					exit(1);
+				}
+				tuning.depth = depth;
+			}
+			break;
+		case OPT_BUFFER_SIZE:	/* size of those buffers */
+			{
+				off_t size = parse_size(optarg);
+				if (size < PIPELINE_MIN_BLOCK || size > PIPELINE_MAX_BLOCK) {
+					fprintf(stderr, "Invalid buffer size: %s\n", optarg);
+					exit(1);
+				}
+				tuning.buffer = size;
+			}
+			break;
+		case OPT_MAX_MEMORY:	/* memory for the buffers of all the jobs */
+			if ((tuning.memory=parse_size(optarg)) <= 0) {
+				fprintf(stderr, "Invalid memory size: %s\n", optarg);
+				exit(1);
+			}
+			break;
+		case OPT_CALIBRATE:		/* measure the host */
+			calibrating++;
+			break;
+		case OPT_DAEMON:		/* build archives for clients */
+			daemonsocket = optarg;
+			break;
+		case OPT_SUBMIT:		/* have the daemon build the archive */
+			submitsocket = optarg;
+			break;
+		case OPT_DIFF:			/* compare two archives */
+			diffing++;
+			break;
+		case OPT_BYTES:			/* and their forks */
+			diffbytes++;
+			break;
+		case OPT_NAME:			/* name the file read from stdin */
+			stdinname = optarg;
+			break;
+		case OPT_INTERLEAVE:	/* compress small forks together */
+			{
+				char *end;
+				long width = strtol(optarg,&end,10);
+				if (end == optarg || *end || width < 1 || width > INTERLEAVE_MAX_WIDTH) {
+					fprintf(stderr, "Invalid number of forks to interleave: %s\n", optarg);
+					exit(1);
+				}
+				interleave_set_width(width);
+			}
+			break;
 		case 'h':
 		case '?':
 		default:
@@ -215,49 +591,328 @@ int main(int argc, char **argv) {
 			exit(1);
 	}
 
-	if ((ofd=create_file(defoutfile))<0) {
-		perror(defoutfile);
+	jobs = tuning.jobs ? tuning.jobs : calibrate_cpus();
+
+	if (calibrating) {
+		HostProfile hp;
+		calibrate_host(&hp,&argv[optind],argc-optind,1);
+		calibrate_tune(&hp,&tuning);
+		calibrate_report(stdout,&hp,&tuning);
+		exit(0);
+	}
+
+	if (catpath) {
+		if (optind != argc-1) {
+			usage(argv[0]);
+			exit(1);
+		}
+		exit(extract_member(argv[optind],catpath,unixf,catstart,catlength));
+	}
+	if (transcoding) {
+		int status = 0;
+		if (optind >= argc || (oflag && optind != argc-1)) {
+			usage(argv[0]);
+			exit(1);
+		}
+		for (i=optind; i<argc; i++) {
+			status |= transcode_archive(argv[i],oflag ? defoutfile : argv[i],jobs,verbose);
+		}
+		exit(status);
+	}
+	if (scanning) {
+		ScanOptions so;
+		int status;
+		if (optind >= argc) {
+			usage(argv[0]);
+			exit(1);
+		}
+		so.jobs = jobs;
+		so.verbose = verbose;
+		so.report = stdout;
+		if (oflag && (so.report=fopen(defoutfile,"w")) == NULL) {
+			perror(defoutfile);
+			exit(1);
+		}
+		status = scan_archives(&argv[optind],argc-optind,&so);
+		if (fclose(so.report) != 0) {
+			perror(defoutfile);
+			exit(1);
+		}
+		exit(status);
+	}
+	if (cataloguing) {
+		if (optind >= argc || !oflag) {
+			usage(argv[0]);
+			exit(1);
+		}
+		exit(catalog_build(defoutfile,&argv[optind],argc-optind,verbose));
+	}
+	if (lookupname) {
+		if (optind != argc-1) {
+			usage(argv[0]);
+			exit(1);
+		}
+		exit(catalog_lookup(argv[optind],lookupname,stdout));
+	}
+	if (diffing) {
+		DiffOptions dio;
+		int status;
+		if (optind != argc-2) {
+			usage(argv[0]);
+			exit(2);
+		}
+		dio.bytes = diffbytes;
+		dio.verbose = verbose;
+		dio.report = stdout;
+		if (oflag && (dio.report=fopen(defoutfile,"w")) == NULL) {
+			perror(defoutfile);
+			exit(2);
+		}
+		status = diff_archives(argv[optind],argv[optind+1],&dio);
+		if (fclose(dio.report) != 0) {
+			perror(defoutfile);
+			exit(2);
+		}
+		exit(status);
+	}
+	if (merging || subsetfile) {
+		MergeOptions mo;
+		mo.dst = defoutfile;
+		mo.nest = nesting;
+		mo.members = subsetfile ? &argv[optind] : NULL;
+		mo.nmembers = argc-optind;
+		mo.tdiff = TIMEDIFF + get_timezone_offset();
+		mo.verbose = verbose;
+		if (optind >= argc || (merging && subsetfile)) {
+			usage(argv[0]);
+			exit(1);
+		}
+		exit(subsetfile ? merge_archives(&subsetfile,1,&mo) :
+			merge_archives(&argv[optind],argc-optind,&mo));
+	}
+	if (extracting) {
+		ExtractOptions xo;
+		int status = 0;
+		xo.destdir = oflag ? defoutfile : ".";
+		xo.jobs = jobs;
+		xo.tdiff = TIMEDIFF + get_timezone_offset();
+		xo.convert = unixf;
+		xo.verbose = verbose;
+		for (i=optind; i<argc; i++) {
+			status |= extract_archive(argv[i],&xo);
+		}
+		exit(status);
+	}
+
+	for (i=optind; i<argc; i++) {
+		if (strcmp(argv[i],"-") == 0) stdinput++;
+	}
+	if (stdinput > 1) {
+		fprintf(stderr, "Only one file can be read from stdin\n");
 		exit(1);
 	}
-	if (verbose) {
-		fprintf(stdout, "Creating archive file \"%s\"\n", defoutfile);
+	if (stdinput && (volsize || journalfile || estimating || watching || submitsocket)) {
+		fprintf(stderr, "A file can't be read from stdin with -V, -J, --estimate, --watch or --submit\n");
+		exit(1);
 	}
-	/* empty header, will seek back and fill in later */
-	if (safe_write(ofd, &sh, sizeof(sh), "archive header") < 0) {
+	if (estimating) {
+		if (optind >= argc) {
+			usage(argv[0]);
+			exit(1);
+		}
+		exit(estimate_archive(&argv[optind],argc-optind));
+	}
+	if ((daemonsocket || submitsocket) && (volsize || journalfile || indexing || watching)) {
+		fprintf(stderr, "The --daemon and --submit options can't be used with -V, -J, --index or --watch\n");
 		exit(1);
 	}
-	if (verbose>2) {
-		fprintf(stdout, "* archive header (%lld bytes)\n",
-				(long long)sizeof(sh));
+	if (submitsocket) {
+		DaemonJob job;
+		int status;
+		if (optind >= argc || daemonsocket) {
+			usage(argv[0]);
+			exit(1);
+		}
+		if ((ofd=create_file(defoutfile))<0) {
+			perror(defoutfile);
+			exit(1);
+		}
+		if (verbose) {
+			fprintf(stdout, "Creating archive file \"%s\"\n", defoutfile);
+			fflush(stdout);
+		}
+		job.inputs = &argv[optind];
+		job.ninputs = argc-optind;
+		job.archive = defoutfile;
+		job.fd = ofd;
+		job.convert = unixf;
+		job.type = Type;
+		job.creator = Creator;
+		job.verbose = verbose;
+		status = daemon_submit(submitsocket,&job);
+		close(ofd);
+		if (status != 0) {
+			unlink(defoutfile);
+		}
+		exit(status);
+	}
+	if ((optind < argc && !(tuning.jobs && tuning.depth && tuning.buffer)) ||
+		(daemonsocket && !tuning.memory)) {
+		HostProfile hp;
+		calibrate_host(&hp,&argv[optind],argc-optind,0);
+		calibrate_tune(&hp,&tuning);
+		if (verbose > 2) calibrate_report(stderr,&hp,&tuning);
+	}
+	if (tuning.depth) pipeline_set_depth(tuning.depth);
+	if (tuning.buffer) pipeline_set_buffer(tuning.buffer);
+	if (daemonsocket) {
+		if (optind != argc) {
+			usage(argv[0]);
+			exit(1);
+		}
+		forkcache_set_budget(tuning.memory / jobs); /* each worker keeps its own */
+		exit(daemon_serve(daemonsocket,jobs,daemon_build,verbose));
+	}
+	if (watching) {
+		if (optind >= argc || volsize || journalfile || indexing || interleave_enabled()) {
+			fprintf(stderr, "The --watch option can't be used with -V, -J, --index or --interleave\n");
+			exit(1);
+		}
+		exit(watch_archive(defoutfile,&argv[optind],argc-optind,watchdelay,watch_build,verbose));
 	}
 
-	for (i=optind; i<argc; i++) {
-		off_t n, len;
-		n = put_item(argv[i],&len);
-		if (n) {
-			total += n;
-			items += 1;
-			uncompressed += len;
+	/* plan the archives, unless we're resuming one that was already started */
+	budget = volsize ? volsize : SPLIT_MAX_ARCHIVE;
+	if (!stdinput && (!journalfile || access(journalfile,F_OK) != 0)) {
+		nvols = split_plan(&argv[optind],argc-optind,budget-sizeof(sh),planned_size,&vols);
+		if (nvols > 1) {
+			if (journalfile) {
+				fprintf(stderr, "The -J option can't be used when the archive is split\n");
+				exit(1);
+			}
+			exit(build_volumes(&argv[optind],argc-optind,vols,nvols,budget));
+		}
+	}
+
+	if (journalfile && indexing) {
+		fprintf(stderr, "The -J and --index options can't be used together\n");
+		exit(1);
+	}
+	if (indexing && interleave_enabled()) {
+		fprintf(stderr, "The --index and --interleave options can't be used together\n");
+		exit(1);
+	}
+	if (journalfile) {
+		char *archive = NULL;
+		off_t end;
+		resuming = journal_open(journalfile,&archive,&end,&progress);
+		if (resuming < 0) {
+			exit(1);
+		}
+		if (resuming) {
+			const char *item = journal_resume_item();
+			for (i=optind; item && i<argc && strcmp(argv[i],item)!=0; i++)
+				;
+			if (i == argc) {
+				fprintf(stderr, "%s: journal doesn't match the files to archive\n", journalfile);
+				exit(1);
+			}
+			/* truncate the archive to the last checkpoint and carry on */
+			defoutfile = archive;
+			if ((ofd=open(defoutfile,O_RDWR))<0 || ftruncate(ofd,end)<0 ||
+				lseek(ofd,end,SEEK_SET)<0) {
+				perror(defoutfile);
+				exit(1);
+			}
+			journal_resume(ofd);
+			items = progress.items;
+			total = progress.total;
+			uncompressed = progress.uncompressed;
+			if (verbose) {
+				fprintf(stdout, "Resuming archive file \"%s\" at %lld bytes\n",
+						defoutfile, (long long)end);
+			}
+		} else if (archive) {
+			/* nothing in the journal's archive was completed, so start it again */
+			defoutfile = archive;
+			restarting = 1;
+		}
+	}
+	if (!resuming) {
+		if (restarting) {
+			ofd = open(defoutfile,O_RDWR|O_CREAT|O_TRUNC,0644);
+		} else {
+			ofd = create_file(defoutfile);
+		}
+		if (ofd<0) {
+			perror(defoutfile);
+			exit(1);
+		}
+		if (verbose) {
+			fprintf(stdout, "Creating archive file \"%s\"\n", defoutfile);
+		}
+		/* empty header, will seek back and fill in later */
+		if (safe_write(ofd, &sh, sizeof(sh), "archive header") < 0) {
+			exit(1);
+		}
+		if (verbose>2) {
+			fprintf(stdout, "* archive header (%lld bytes)\n",
+					(long long)sizeof(sh));
+		}
+		if (journalfile && journal_start(defoutfile,ofd) < 0) {
+			exit(1);
+		}
+		if (indexing && index_create(defoutfile) < 0) {
+			exit(1);
 		}
 	}
+
+	put_items(&argv[optind],argc-optind,&items,&total,&uncompressed);
 	total += sizeof(sh);
 	uncompressed += sizeof(sh);
 
-	/* header header */
-	strncpy((char*)sh.sig1,"SIT!",4);
-	cp2(items,(char*)sh.numFiles);
-	cp4(total,(char*)sh.arcLen);
-	strncpy((char*)sh.sig2,"rLau",4);
-	sh.version = 1;
-
-	lseek(ofd,0,0);
-	if (safe_write(ofd, &sh, sizeof(sh), "final archive header") < 0) {
+	if (total > budget && total <= SPLIT_MAX_ARCHIVE && items <= SPLIT_MAX_ITEMS &&
+		nvols == 1 && !split_can_divide(&vols[0])) {
+		fprintf(stderr, "Warning: %s doesn't fit in a volume of %lld bytes; its archive is %lld bytes\n",
+				vols[0].units[0],(long long)budget,(long long)total);
+	} else if (total > budget || items > SPLIT_MAX_ITEMS) {
+		/* compression made it bigger than planned, so split it after all */
+		close(ofd);
+		if (journalfile || stdinput) { /* can't go through the files again */
+			fprintf(stderr, "%s: archive exceeds the format's limits\n", defoutfile);
+			exit(1);
+		}
+		unlink(defoutfile);
+		index_abandon();
+		if (nvols > 0) {
+			split_free_volume(&vols[0]);
+		}
+		free(vols);
+		split_free_plan();
+		budget = (off_t)((double)budget * min(budget,total) / total * 0.95);
+		if (verbose) {
+			fprintf(stdout, "Archive is too big (%lld bytes, %lld items), splitting it\n",
+					(long long)total,(long long)items);
+		}
+		nvols = split_plan(&argv[optind],argc-optind,budget-sizeof(sh),planned_size,&vols);
+		exit(build_volumes(&argv[optind],argc-optind,vols,nvols,budget));
+	}
+	if (nvols > 0) {
+		split_free_volume(&vols[0]);
+	}
+	free(vols);
+	split_free_plan();
+	if (write_archive_header(items,total) < 0) {
 		exit(1);
 	}
 	if (close(ofd) < 0) {
 		fprintf(stderr, "Error closing archive: %s\n", strerror(errno));
 		exit(1);
 	}
+	journal_finish();
+	if (index_finish(total) < 0) {
+		exit(1);
+	}
 	if (verbose) {
 		fprintf(stdout, "Wrote %lld bytes to \"%s\"\n",(long long)total,defoutfile);
 		if (verbose>2) {
@@ -267,115 +922,521 @@ int main(int argc, char **argv) {
 		fprintf(stdout, "Savings: %lld%%\n",
 				(long long)100-((total*100)/uncompressed));
 	}
+	return unreadable ? 1 : 0; /* the rest is archived, but not everything */
 }
 
-off_t put_item(char *name, off_t *uncompressed) {
-	struct stat st;
-	off_t n = 0; /* total compressed bytes of item */
-	*uncompressed = 0; /* total uncompressed bytes of item */
-
-	if (lstat(name,&st)==0 && S_ISDIR(st.st_mode)) {
-		/* this is a directory. */
-		off_t startPos = lseek(ofd,0,1); /* remember where we are */
-		if (verbose>1) { fprintf(stdout, "+ %s (directory)\n", basename(name)); }
-		n += put_folder_entry(name,startPos,uncompressed,startFolder,0);
-		n += put_folder(name,uncompressed,1);
-		n += put_folder_entry(name,startPos,uncompressed,endFolder,0);
-	}
-	else {
-		if (verbose>1) { fprintf(stdout, "+ %s\n", name); }
-		n += put_file(name,uncompressed,0);
-	}
-	return n;
-}
-
-off_t put_folder(char *name, off_t *uncompressedLen, int level) {
-	DIR *dir;
-	struct dirent *entry;
-	char path[PATH_MAX];
-	int i, n = 0;
-
-	if (!(dir = opendir(name))) {
-		return 0;
-	}
-	while ((entry = readdir(dir)) != NULL) {
-		struct stat entry_st;
-		off_t uncompressedEntryLen = 0;
+/* Adds each of the inputs selected for this archive, updating the totals
+ * for the archive header.
+ */
+void put_items(char **inputs, int ninputs, off_t *items, off_t *total, off_t *uncompressed) {
+	int i;
 
-		/* Skip . and .. */
-		if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) {
-			continue;
-		}
-		if (snprintf(path, sizeof(path), "%s/%s", name, entry->d_name) >= sizeof(path)) {
-			fprintf(stderr, "Warning: path too long, skipping: %s/%s\n", name, entry->d_name);
+	for (i=0; i<ninputs; i++) {
+		off_t n, len;
+		if (!split_includes(inputs[i])) { /* belongs in another archive */
 			continue;
 		}
-		/* Use lstat to check if it's a directory (portable) */
-		if (lstat(path, &entry_st) != 0) {
-			perror(path);
+		if (journal_is_done(inputs[i])) {
+			if (verbose>1) { fprintf(stdout, "= %s (already archived)\n", inputs[i]); }
 			continue;
 		}
-		if (S_ISDIR(entry_st.st_mode)) { /* if it's a directory */
-			off_t startPos = lseek(ofd,0,1); /* remember where we are */
-			if (verbose>1) {
-				for (i=0;i<level;i++) { fprintf(stdout, "  "); }
-				fprintf(stdout, "+ %s (directory)\n", entry->d_name);
-			}
-			n += put_folder_entry(path,startPos,&uncompressedEntryLen,startFolder,level);
-			n += put_folder(path,&uncompressedEntryLen,level+1); /* recursion! */
-			n += put_folder_entry(path,startPos,&uncompressedEntryLen,endFolder,level);
-		} else {
-			if (strcmp(entry->d_name, ".DS_Store") == 0) { /* skip .DS_Store files */
-				if (verbose>1) {
-					for (i=0;i<level;i++) { fprintf(stdout, "  "); }
-					fprintf(stdout, "! %s (skipped)\n", entry->d_name);
-				}
-				continue;
-			}
-			if (verbose>1) {
-				for (i=0;i<level;i++) { fprintf(stdout, "  "); }
-				fprintf(stdout, "+ %s\n", entry->d_name);
-			}
-			n += put_file(path,&uncompressedEntryLen,level);
+		n = put_item(inputs[i],&len);
+		if (n) {
+			*total += n;
+			*items += 1;
+			*uncompressed += len;
+			progress.items = *items;
+			progress.total = *total;
+			progress.uncompressed = *uncompressed;
+			journal_entry_done(inputs[i],&progress,1);
 		}
-		*uncompressedLen += uncompressedEntryLen;
 	}
-	closedir(dir);
-	return n;
 }
 
-/* put_folder_entry returns the compressed length of this entry's contents.
- * The uncompressed length is added to the value in the output argument.
- */
-off_t put_folder_entry(char *name, off_t startPos, off_t *uncompressedLen, int mtype, int level) {
-	/* This function adds the special startFolder and endFolder entries
-	   that StuffIt uses to bracket the contents of a directory.
+/* Fills in the archive header at the start of the archive. */
+int write_archive_header(off_t items, off_t total) {
+	strncpy((char*)sh.sig1,"SIT!",4);
+	cp2(items,(char*)sh.numFiles);
+	cp4(total,(char*)sh.arcLen);
+	strncpy((char*)sh.sig2,"rLau",4);
+	sh.version = 1;
 
-	   When mtype is startFolder, the supplied startPos is our current
-	   position, where we are about to write the startFolder entry. The
-	   return and output values will simply be the constant length of the
-	   startFolder header.
+	lseek(ofd,0,0);
+	return safe_write(ofd, &sh, sizeof(sh), "final archive header");
+}
 
-	   When mtype is endFolder, startPos is the beginning of the matching
-	   startFolder entry. The difference between the end of that startFolder
-	   entry and the end of the endFolder entry gives us the total compressed
-	   bytes that we added with this folder. (We are supposed to exclude the
-	   startFolder entry itself, but include the endFolder.) Note that we
-	   actually use the beginning of the startFolder and the beginning of the
-	   endFolder, because we already have those offsets and their difference
-	   is the same number of bytes due to the headers being the same length.
+/* Builds one split archive of at most limit bytes, in a child process.
+ * Returns the exit status: 0 on success, 2 if the archive turned out too
+ * big, 1 on other errors. A single file bigger than the limit is kept, with
+ * a warning, since it can't be split any further.
+ */
+static int build_volume(SplitVolume *vol, char **inputs, int ninputs, off_t limit) {
+	off_t total=0, uncompressed=0, items=0;
+
+	split_select(vol);
+	if ((ofd=open(vol->archive,O_RDWR|O_CREAT|O_TRUNC,0644))<0) {
+		perror(vol->archive);
+		return 1;
+	}
+	memset(&sh, 0, sizeof(sh));
+	if (safe_write(ofd, &sh, sizeof(sh), "archive header") < 0) {
+		return 1;
+	}
+	if (indexing && index_create(vol->archive) < 0) {
+		return 1;
+	}
+	put_items(inputs,ninputs,&items,&total,&uncompressed);
+	total += sizeof(sh);
+	if (total > SPLIT_MAX_ARCHIVE || items > SPLIT_MAX_ITEMS ||
+		(total > limit && split_can_divide(vol))) {
+		index_abandon();
+		return 2;
+	}
+	if (total > limit) {
+		fprintf(stderr, "Warning: %s doesn't fit in a volume of %lld bytes; its archive is %lld bytes\n",
+				vol->units[0],(long long)limit,(long long)total);
+	}
+	if (write_archive_header(items,total) < 0) {
+		return 1;
+	}
+	if (close(ofd) < 0) {
+		fprintf(stderr, "Error closing archive: %s\n", strerror(errno));
+		return 1;
+	}
+	return index_finish(total) < 0 ? 1 : 0;
+}
+
+/* Writes an archive of the inputs to ofd, which must be empty, checking
+ * that it's within the format's limits. Returns the exit status.
+ */
+static int build_archive(char **inputs, int ninputs) {
+	off_t total=0, uncompressed=0, items=0;
+
+	links_reset();	/* links archived into an earlier archive don't count */
+	memset(&sh, 0, sizeof(sh));
+	if (safe_write(ofd, &sh, sizeof(sh), "archive header") != 0) {
+		return 1;
+	}
+	put_items(inputs,ninputs,&items,&total,&uncompressed);
+	total += sizeof(sh);
+	if (total > SPLIT_MAX_ARCHIVE || items > SPLIT_MAX_ITEMS) {
+		fprintf(stderr, "%s: archive exceeds the format's limits\n", defoutfile);
+		return 1;
+	}
+	return write_archive_header(items,total) == 0 ? 0 : 1;
+}
+
+/* Builds an archive for a --submit client, in a --daemon worker. The
+ * client has already created the archive.
+ */
+static int daemon_build(const DaemonJob *job) {
+	defoutfile = job->archive;
+	ofd = job->fd;
+	unixf = job->convert;
+	Type = job->type;
+	Creator = job->creator;
+	verbose = job->verbose;
+	return build_archive(job->inputs,job->ninputs);
+}
+
+/* Builds the archive for --watch, in a temporary file which is renamed
+ * over the old archive once it is complete, so the old one stays in place
+ * if anything goes wrong. Returns 0 on success, or 1.
+ */
+static int watch_build(char **inputs, int ninputs) {
+	size_t len = strlen(defoutfile) + 8;
+	char *tmpname = malloc(len);
+	int status;
+
+	snprintf(tmpname, len, "%s.XXXXXX", defoutfile);
+	if ((ofd=mkstemp(tmpname))<0) {
+		perror(tmpname);
+		free(tmpname);
+		return 1;
+	}
+	fchmod(ofd,0644);
+	status = build_archive(inputs,ninputs);
+	if (close(ofd) < 0) {
+		fprintf(stderr, "Error closing archive: %s\n", strerror(errno));
+		status = 1;
+	}
+	if (status == 0 && rename(tmpname,defoutfile) < 0) {
+		perror(defoutfile);
+		status = 1;
+	}
+	if (status != 0) {
+		unlink(tmpname);
+	}
+	free(tmpname);
+	return status;
+}
+
+/* Builds the planned archives, up to jobs at once, and writes the manifest.
+ * An archive which turns out too big is planned again with a smaller budget
+ * and rebuilt. Archives are built under temporary names, and renamed to
+ * <base>.partN.sit once they are all done. Returns the exit status.
+ */
+int build_volumes(char **inputs, int ninputs, SplitVolume *vols, int nvols, off_t budget) {
+	pid_t *pids = calloc(nvols, sizeof(pid_t)); /* 0 to build, -1 when done */
+	char *base = strdup(defoutfile), *name;
+	int i, k, status, running=0, failed=0, serial=0;
+	size_t len = strlen(base);
+	off_t limit = volsize ? volsize : SPLIT_MAX_ARCHIVE;
+
+	if (len > 4 && strcasecmp(base+len-4,".sit") == 0) {
+		base[len-4] = 0; /* chop off extension */
+	}
+	len = strlen(base) + 32;
+	for (k=0; k<nvols; k++) {
+		vols[k].archive = malloc(len);
+		snprintf(vols[k].archive, len, "%s.%d.tmp", base, serial++);
+	}
+	if (verbose) {
+		fprintf(stdout, "Splitting into %d archives\n", nvols);
+	}
+	throttle_scale(1.0 / min(jobs,nvols)); /* the limits are shared by all the jobs */
+	for (;;) {
+		pid_t pid;
+		for (k=0; k<nvols && running<jobs && !failed; k++) {
+			if (pids[k] != 0) continue;
+			fflush(stdout);
+			fflush(stderr);
+			if ((pid=fork()) == 0) {
+				exit(build_volume(&vols[k],inputs,ninputs,limit));
+			}
+			if (pid < 0) {
+				perror("fork");
+				failed = 1;
+				break;
+			}
+			pids[k] = pid;
+			running++;
+		}
+		if (!running) break;
+		if ((pid=wait(&status)) < 0) {
+			perror("wait");
+			return 1;
+		}
+		for (k=0; k<nvols && pids[k]!=pid; k++)
+			;
+		if (k == nvols) continue;
+		running--;
+		pids[k] = -1;
+		if (WIFEXITED(status) && WEXITSTATUS(status) == 2) {
+			/* too big: plan this one again with a budget scaled down to suit */
+			struct stat st;
+			SplitVolume *more;
+			int nmore;
+			off_t b = min(budget, vols[k].size + (off_t)sizeof(sh));
+
+			if (stat(vols[k].archive,&st) == 0 && st.st_size > limit) {
+				b = (off_t)((double)b * limit / st.st_size * 0.95);
+			}
+			unlink(vols[k].archive);
+			nmore = split_replan(&vols[k],b-sizeof(sh),&more);
+			if (nmore < 2) {
+				fprintf(stderr, "%s: can't be split to fit in an archive\n", vols[k].units[0]);
+				failed = 1;
+				continue;
+			}
+			if (verbose) {
+				fprintf(stdout, "Archive %d was too big, splitting it into %d\n", k+1, nmore);
+			}
+			split_free_volume(&vols[k]);
+			vols = realloc(vols, (nvols+nmore-1) * sizeof(SplitVolume));
+			pids = realloc(pids, (nvols+nmore-1) * sizeof(pid_t));
+			memmove(&vols[k+nmore], &vols[k+1], (nvols-k-1) * sizeof(SplitVolume));
+			memmove(&pids[k+nmore], &pids[k+1], (nvols-k-1) * sizeof(pid_t));
+			for (i=0; i<nmore; i++) {
+				vols[k+i] = more[i];
+				vols[k+i].archive = malloc(len);
+				snprintf(vols[k+i].archive, len, "%s.%d.tmp", base, serial++);
+				pids[k+i] = 0;
+			}
+			nvols += nmore-1;
+			free(more);
+		} else if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+			failed = 1;
+		}
+	}
+	if (failed) {
+		for (k=0; k<nvols; k++) {
+			char idx[PATH_MAX];
+			unlink(vols[k].archive);
+			snprintf(idx, sizeof(idx), "%s.idx", vols[k].archive);
+			unlink(idx);
+		}
+	}
+
+	/* everything fits, so give the archives their final names */
+	for (k=0; k<nvols && !failed; k++) {
+		struct stat st;
+		name = malloc(len);
+		snprintf(name, len, "%s.part%d.sit", base, k+1);
+		if (rename(vols[k].archive,name) < 0) {
+			perror(name);
+			free(name);
+			failed = 1;
+			break;
+		}
+		if (indexing) {
+			char from[PATH_MAX], to[PATH_MAX];
+			snprintf(from, sizeof(from), "%s.idx", vols[k].archive);
+			snprintf(to, sizeof(to), "%s.idx", name);
+			rename(from,to);
+		}
+		free(vols[k].archive);
+		vols[k].archive = name;
+		if (verbose && stat(name,&st) == 0) {
+			fprintf(stdout, "Wrote %lld bytes to \"%s\"\n",(long long)st.st_size,name);
+		}
+	}
+	if (!failed) {
+		name = malloc(len);
+		snprintf(name, len, "%s.manifest", base);
+		if (split_write_manifest(name,vols,nvols) < 0) {
+			failed = 1;
+		} else if (verbose) {
+			fprintf(stdout, "Wrote manifest to \"%s\"\n", name);
+		}
+		free(name);
+	}
+
+	for (k=0; k<nvols; k++) {
+		split_free_volume(&vols[k]);
+	}
+	split_free_plan();
+	free(vols);
+	free(pids);
+	free(base);
+	return failed;
+}
+
+off_t put_item(char *name, off_t *uncompressed) {
+	struct stat st;
+	off_t n = 0; /* total compressed bytes of item */
+	*uncompressed = 0; /* total uncompressed bytes of item */
+
+	if (stdinput && strcmp(name,"-")==0) {
+		if (verbose>1) { fprintf(stdout, "+ %s (from stdin)\n", stdinname); }
+		n += put_stdin(stdinname,uncompressed,0);
+	}
+	else if (lstat(name,&st)==0 && S_ISDIR(st.st_mode)) {
+		/* this is a directory. */
+		off_t startPos;
+		if (journal_resume_folder(name,0,&startPos,uncompressed)) {
+			if (verbose>1) { fprintf(stdout, "+ %s (directory, resumed)\n", basename(name)); }
+		} else {
+			startPos = lseek(ofd,0,1); /* remember where we are */
+			if (verbose>1) { fprintf(stdout, "+ %s (directory)\n", basename(name)); }
+			put_folder_entry(name,startPos,uncompressed,startFolder,0);
+		}
+		journal_push_folder(name,startPos,uncompressed);
+		put_folder(name,uncompressed,1);
+		journal_pop_folder();
+		put_folder_entry(name,startPos,uncompressed,endFolder,0);
+		n = lseek(ofd,0,SEEK_CUR) - startPos;
+	}
+	else {
+		if (verbose>1) { fprintf(stdout, "+ %s\n", name); }
+		n += put_file(name,uncompressed,0);
+	}
+	return n;
+}
+
+/* Reads the names in a folder, in the order readdir() gives them,
+ * leaving out . and .. Returns the number of names, or -1 on error.
+ */
+static int read_folder(char *name, char ***names) {
+	DIR *dir;
+	struct dirent *entry;
+	int n = 0, cap = 0;
+
+	*names = NULL;
+	if (!(dir = opendir(name))) {
+		return -1;
+	}
+	while ((entry = readdir(dir)) != NULL) {
+		if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) {
+			continue;
+		}
+		if (n == cap) {
+			cap = cap ? cap*2 : 64;
+			*names = realloc(*names, cap * sizeof(char *));
+		}
+		(*names)[n++] = strdup(entry->d_name);
+	}
+	closedir(dir);
+	return n;
+}
+
+/* Returns the path of an entry in a folder in path, or NULL if it is
+ * too long, already archived, or belongs in another archive.
+ */
+static char *entry_path(char *path, size_t size, char *name, char *entry, int partial) {
+	if (snprintf(path, size, "%s/%s", name, entry) >= size) {
+		fprintf(stderr, "Warning: path too long, skipping: %s/%s\n", name, entry);
+		return NULL;
+	}
+	if (journal_is_done(path)) { /* already archived by an earlier run */
+		return NULL;
+	}
+	if (partial && !split_includes(path)) { /* belongs in another archive */
+		return NULL;
+	}
+	return path;
+}
+
+/* With --interleave, reads ahead the small files among the entries from
+ * first on, up to the next folder. Returns the index of the entry after
+ * the last one considered.
+ */
+static int read_ahead(char *name, char **names, int first, int nnames, int partial) {
+	char *paths[INTERLEAVE_MAX_FILES], path[PATH_MAX];
+	struct stat st;
+	int j, n = 0;
+
+	for (j = first; j < nnames && n < INTERLEAVE_MAX_FILES; j++) {
+		if (!entry_path(path,sizeof(path),name,names[j],partial) || lstat(path,&st) != 0) {
+			continue;
+		}
+		if (S_ISDIR(st.st_mode)) {
+			break;
+		}
+		if (strcmp(names[j], ".DS_Store") != 0 && interleave_candidate(path)) {
+			paths[n++] = strdup(path);
+		}
+	}
+	interleave_prepare(paths,n,unixf);
+	while (n > 0) free(paths[--n]);
+	return (j > first) ? j : first+1;
+}
+
+off_t put_folder(char *name, off_t *uncompressedLen, int level) {
+	char path[PATH_MAX], **names;
+	int i, j, nnames, n = 0, ahead = 0;
+	int partial = split_is_partial(name); /* only some contents go in this archive */
+
+	if ((nnames = read_folder(name,&names)) < 0) {
+		return 0;
+	}
+	for (j = 0; j < nnames; j++) {
+		struct stat entry_st;
+		off_t uncompressedEntryLen = 0;
+		char *d_name = names[j];
+
+		if (!entry_path(path,sizeof(path),name,d_name,partial)) {
+			continue;
+		}
+		/* Use lstat to check if it's a directory (portable) */
+		if (lstat(path, &entry_st) != 0) {
+			perror(path);
+			continue;
+		}
+		if (S_ISDIR(entry_st.st_mode)) { /* if it's a directory */
+			off_t startPos;
+			if (journal_resume_folder(path,level,&startPos,&uncompressedEntryLen)) {
+				if (verbose>1) {
+					for (i=0;i<level;i++) { fprintf(stdout, "  "); }
+					fprintf(stdout, "+ %s (directory, resumed)\n", d_name);
+				}
+			} else {
+				startPos = lseek(ofd,0,1); /* remember where we are */
+				if (verbose>1) {
+					for (i=0;i<level;i++) { fprintf(stdout, "  "); }
+					fprintf(stdout, "+ %s (directory)\n", d_name);
+				}
+				n += put_folder_entry(path,startPos,&uncompressedEntryLen,startFolder,level);
+			}
+			journal_push_folder(path,startPos,&uncompressedEntryLen);
+			n += put_folder(path,&uncompressedEntryLen,level+1); /* recursion! */
+			journal_pop_folder();
+			n += put_folder_entry(path,startPos,&uncompressedEntryLen,endFolder,level);
+		} else {
+			if (strcmp(d_name, ".DS_Store") == 0) { /* skip .DS_Store files */
+				if (verbose>1) {
+					for (i=0;i<level;i++) { fprintf(stdout, "  "); }
+					fprintf(stdout, "! %s (skipped)\n", d_name);
+				}
+				continue;
+			}
+			if (verbose>1) {
+				for (i=0;i<level;i++) { fprintf(stdout, "  "); }
+				fprintf(stdout, "+ %s\n", d_name);
+			}
+			if (interleave_enabled() && j >= ahead) {
+				ahead = read_ahead(name,names,j,nnames,partial);
+			}
+			off_t fn = put_file(path,&uncompressedEntryLen,level);
+			if (fn == 0) {
+				continue;
+			}
+			n += fn;
+		}
+		*uncompressedLen += uncompressedEntryLen;
+		journal_entry_done(path,&progress,0);
+	}
+	for (j = 0; j < nnames; j++) free(names[j]);
+	free(names);
+	return n;
+}
+
+/* put_folder_entry returns the compressed length of this entry's contents.
+ * The uncompressed length is added to the value in the output argument.
+ */
+off_t put_folder_entry(char *name, off_t startPos, off_t *uncompressedLen, int mtype, int level) {
+	/* This function adds the special startFolder and endFolder entries
+	   that StuffIt uses to bracket the contents of a directory.
+
+	   When mtype is startFolder, the supplied startPos is our current
+	   position, where we are about to write the startFolder entry. The
+	   return and output values will simply be the constant length of the
+	   startFolder header.
+
+	   When mtype is endFolder, startPos is the beginning of the matching
+	   startFolder entry. The difference between the end of that startFolder
+	   entry and the end of the endFolder entry gives us the total compressed
+	   bytes that we added with this folder. (We are supposed to exclude the
+	   startFolder entry itself, but include the endFolder.) Note that we
+	   actually use the beginning of the startFolder and the beginning of the
+	   endFolder, because we already have those offsets and their difference
+	   is the same number of bytes due to the headers being the same length.
 
 	   The compressed total is then written to the startFolder entry's cDLen
 	   field. The uncompressed total is written to the dLen field.
 	 */
 	struct stat st;
-	int i;
-	long fpos1, fpos2;
 	char *fname;
+	char macName[64];
 	long tdiff;
-	struct tm *tp;
 	time_t ctime, mtime;
-	long bs;
+
+	if (!(stat(name,&st)==0)) { /* get folder times */
+		perror(name);
+		return 0;
+	}
+	fname = basename(name);
+	if (!fname) fname = name;
+	convertFilesystemNameToMacRoman(fname,macName,63);
+	ctime = st.st_ctime; /* ctime is really "time of last inode status change" */
+#ifdef HAVE_BIRTHTIME
+	ctime = st.st_birthtime; /* actual creation time is found in "birthtime" */
+#endif
+	mtime = st.st_mtime;
+	/* convert unix file time to mac time format */
+	tdiff = TIMEDIFF + get_timezone_offset();
+	return write_folder_entry(fname,(u_char*)macName,ctime + tdiff,mtime + tdiff,
+			startPos,uncompressedLen,mtype,level);
+}
+
+/* write_folder_entry writes a startFolder or endFolder entry for
+ * put_folder_entry, given the folder's name and Mac dates. fname is
+ * used in messages, and macName is a P string.
+ */
+off_t write_folder_entry(char *fname, u_char *macName, uint32_t cdate, uint32_t mdate,
+		off_t startPos, off_t *uncompressedLen, int mtype, int level) {
+	int i;
+	long fpos1, fpos2;
 
 	fpos1 = lseek(ofd,0,1); /* remember where we are (beginning of header) */
 	if (fpos1 < 0) {
@@ -388,28 +1449,20 @@ off_t put_folder_entry(char *name, off_t startPos, off_t *uncompressedLen, int m
 		return 0;
 	}
 
-	if (!(stat(name,&st)==0)) { /* get folder times */
-		perror(name);
-		return 0;
-	}
-	fname = basename(name);
-	if (!fname) fname = name;
 	if (verbose>2) {
 		for (i=0;i<level;i++) { fprintf(stdout, "  "); }
 		fprintf(stdout, "* %sFolder for %s (%lld bytes)\n",
 				(mtype==startFolder) ? "start" : "end", fname,
 				(long long)sizeof(fh));
 	}
-	convertFilesystemNameToMacRoman(fname,(char*)&fh.fName[0],63);
-	ctime = st.st_ctime; /* ctime is really "time of last inode status change" */
-#ifdef HAVE_BIRTHTIME
-	ctime = st.st_birthtime; /* actual creation time is found in "birthtime" */
-#endif
-	mtime = st.st_mtime;
-	/* convert unix file time to mac time format */
-	tdiff = TIMEDIFF + get_timezone_offset();
-	cp4(ctime + tdiff,(char*)fh.cDate);
-	cp4(mtime + tdiff,(char*)fh.mDate);
+	memcpy(fh.fName, macName, macName[0]+1);
+	if (mtype==startFolder) {
+		index_push_folder(fh.fName);
+	} else {
+		index_pop_folder();
+	}
+	cp4(cdate,(char*)fh.cDate);
+	cp4(mdate,(char*)fh.mDate);
 	fh.compRMethod = fh.compDMethod = mtype;
 	cp4(*uncompressedLen,(char*)fh.dLen);
 	cp4(fpos1-startPos,(char*)fh.cDLen); /* 0 if startFolder */
@@ -452,6 +1505,18 @@ off_t put_folder_entry(char *name, off_t startPos, off_t *uncompressedLen, int m
 	return (fpos2 - fpos1);
 }
 
+/* drop_entry removes a partly written entry starting at fpos1, leaving the
+ * archive as it was, and counts it as unreadable. Returns 0, the compressed
+ * length of nothing.
+ */
+static off_t drop_entry(long fpos1) {
+	unreadable++;
+	if (ftruncate(ofd,fpos1) < 0 || lseek(ofd,fpos1,SEEK_SET) < 0) {
+		fprintf(stderr, "Error truncating archive: %s\n", strerror(errno));
+	}
+	return 0;
+}
+
 /* put_file returns the compressed length in the function result,
  * and uncompressed length in output argument.
  */
@@ -460,7 +1525,7 @@ off_t put_file(char *name, off_t *uncompressedLen, int level) {
 	struct infoHdr ih;
 	struct resHdr rh;
 	int i,n,fd;
-	long fpos1, fpos2;
+	long fpos1;
 	char nbuf[PATH_MAX], *p;
 	int fork=0;
 	long tdiff;
@@ -470,6 +1535,60 @@ off_t put_file(char *name, off_t *uncompressedLen, int level) {
 	time_t ctime, mtime;
 	long bs;
 
+	{
+		off_t reused = watch_reuse(name,ofd,uncompressedLen);
+		if (reused) { /* unchanged since the last build */
+			if (verbose>1) {
+				for (i=0;i<level;i++) { fprintf(stdout, "  "); }
+				fprintf(stdout, "= %s (unchanged)\n", name);
+			}
+			links_record(name,lseek(ofd,0,SEEK_CUR)-reused,reused);
+			return reused;
+		}
+	}
+	if (is_binhex_name(name)) {
+		BinHexFile bh;
+		if (open_binhex_file(name, &bh) == 0) {
+			off_t n = put_binhex(name, &bh, uncompressedLen, level);
+			close_binhex_file(&bh);
+			if (n >= 0) return n;
+		}
+		fprintf(stderr, "Warning: %s is not valid BinHex 4.0, archiving it as-is\n", name);
+	}
+	if (is_hfs_image_name(name)) {
+		HfsVolume *vol;
+		int r = hfs_open(name, &vol);
+		if (r == 0) {
+			off_t n = put_volume(name, vol, uncompressedLen, level);
+			hfs_close(vol);
+			return n;
+		}
+		if (r < -1) {
+			fprintf(stderr, "Warning: archiving %s as-is\n", name);
+		}
+	}
+	{
+		const char *first;
+		off_t start = lseek(ofd,0,SEEK_CUR);
+		off_t linked = links_reuse(name,ofd,uncompressedLen,&first);
+		if (linked) { /* another link to a file already archived */
+			if (verbose) {
+				if (verbose>1) { for (i=0;i<level;i++) { fprintf(stdout, "  "); } }
+				fprintf(stdout, "%s (same file as %s)\n", name, first);
+			}
+			watch_record(name,start,linked);
+			return linked;
+		}
+	}
+	{
+		off_t rsize, dsize;
+		if (get_fork_sizes(name,&rsize,&dsize) == 0 &&
+			(rsize > UINT32_MAX || dsize > UINT32_MAX)) {
+			fprintf(stderr, "%s: forks larger than 4 GB can't be archived\n", name);
+			return 0;
+		}
+	}
+
 	fpos1 = lseek(ofd,0,SEEK_CUR); /* remember where we are */
 	if (fpos1 < 0) {
 		fprintf(stderr, "Error seeking in archive: %s\n", strerror(errno));
@@ -511,7 +1630,11 @@ off_t put_file(char *name, off_t *uncompressedLen, int level) {
 		}
 		if (stat(nbuf,&st)==0 && st.st_size) {
 			rlen = st.st_size;
-			cRLen = dofork(nbuf,0);
+			cRLen = dofork(nbuf,0,1);
+			if (readerror) {
+				fprintf(stderr, "%s: not archived, its resource fork couldn't be read\n", name);
+				return drop_entry(fpos1);
+			}
 			cp4(st.st_size,(char*)fh.rLen);
 			cp4(cRLen,(char*)fh.cRLen);
 			cp2(crc,(char*)fh.rsrcCRC);
@@ -530,7 +1653,11 @@ off_t put_file(char *name, off_t *uncompressedLen, int level) {
 		}
 		if (stat(nbuf,&st)==0 && st.st_size) {
 			rlen = st.st_size;
-			cRLen = dofork(nbuf,0);
+			cRLen = dofork(nbuf,0,1);
+			if (readerror) {
+				fprintf(stderr, "%s: not archived, its resource fork couldn't be read\n", name);
+				return drop_entry(fpos1);
+			}
 			cp4(st.st_size,(char*)fh.rLen);
 			cp4(cRLen,(char*)fh.cRLen);
 			cp2(crc,(char*)fh.rsrcCRC);
@@ -550,11 +1677,17 @@ off_t put_file(char *name, off_t *uncompressedLen, int level) {
 			fprintf(stderr, "Error: path too long: %s.data\n", name);
 			return 0;
 		}
-		stat(nbuf,&st);
+		if (stat(nbuf,&st)<0) {
+			st.st_size = 0;	/* neither exists */
+		}
 	}
 	dlen = cDLen = st.st_size;
 	if (st.st_size) {		/* data fork exists */
-		cDLen = dofork(nbuf,unixf);
+		cDLen = dofork(nbuf,unixf,0);
+		if (readerror) {
+			fprintf(stderr, "%s: not archived, its data fork couldn't be read\n", name);
+			return drop_entry(fpos1);
+		}
 		cp4(st.st_size,(char*)fh.dLen);
 		cp4(cDLen,(char*)fh.cDLen);
 		cp2(crc,(char*)fh.dataCRC);
@@ -641,13 +1774,491 @@ off_t put_file(char *name, off_t *uncompressedLen, int level) {
 	if (snprintf(nbuf, sizeof(nbuf), "%s.info", name) < sizeof(nbuf)) {
 		if (rmfiles) unlink(nbuf);	/* ignore errors */
 	}
+	*uncompressedLen += rlen + dlen + sizeof(fh);
+	{
+		off_t len = finish_file_entry(name,fpos1,rlen,dlen,cRLen,cDLen,level);
+		links_record(name,fpos1,len);
+		return len;
+	}
+}
+
+/* Finds the sizes of a file's forks the same way put_file does, without
+ * reading them. Returns 0, or -1 if the file has neither fork.
+ */
+int get_fork_sizes(char *name, off_t *rlen, off_t *dlen) {
+	struct stat st;
+	char nbuf[PATH_MAX];
+
+	*rlen = get_appledouble_rsrc_size(name);
+	if (*rlen == 0 && snprintf(nbuf, sizeof(nbuf), "%s.rsrc", name) < sizeof(nbuf) &&
+		stat(nbuf,&st)==0) {
+		*rlen = st.st_size;
+	}
+#ifdef HAVE_NAMEDFORK
+	if (*rlen == 0 && snprintf(nbuf, sizeof(nbuf), "%s/..namedfork/rsrc", name) < sizeof(nbuf) &&
+		stat(nbuf,&st)==0) {
+		*rlen = st.st_size;
+	}
+#endif
+	*dlen = 0;
+	if (stat(name,&st)==0 ||
+		(snprintf(nbuf, sizeof(nbuf), "%s.data", name) < sizeof(nbuf) && stat(nbuf,&st)==0)) {
+		*dlen = st.st_size;
+	}
+	return (*rlen || *dlen) ? 0 : -1;
+}
+
+/* Returns the space a file will take in an archive if it doesn't compress,
+ * for planning how to split the inputs.
+ */
+off_t planned_size(const char *path) {
+	off_t rlen, dlen;
+
+	if (get_fork_sizes((char *)path,&rlen,&dlen) < 0) {
+		return -1;
+	}
+	return sizeof(fh) + rlen + dlen;
+}
+
+/* Adds a file to the --estimate totals, finding its forks the way
+ * put_file() does. Returns 0, or -1 if put_file() would skip it.
+ */
+static int estimate_file(char *name, off_t *uncompressedLen) {
+	struct stat st;
+	char nbuf[PATH_MAX];
+	off_t rlen, dlen;
+
+	if (is_binhex_name(name)) {
+		BinHexFile bh;
+		off_t cDLen, cRLen = -1, dlen, rlen;
+		if (open_binhex_file(name, &bh) == 0) {
+			/* the data fork first, so that each fork is decoded once */
+			if (start_binhex_fork(&bh,0) == 0 &&
+				(cDLen = estimate_compress_stream(read_binhex_fork,&bh,&dlen)) >= 0 &&
+				start_binhex_fork(&bh,1) == 0) {
+				cRLen = estimate_compress_stream(read_binhex_fork,&bh,&rlen);
+			}
+			close_binhex_file(&bh);
+			if (cRLen >= 0) {
+				estimate_compressed(rlen, cRLen);
+				estimate_compressed(dlen, cDLen);
+				estimate_exact(sizeof(fh));
+				*uncompressedLen += rlen + dlen + sizeof(fh);
+				return 0;
+			}
+		}
+	}
+	if (get_fork_sizes(name,&rlen,&dlen) < 0) {
+		fprintf(stderr,"%s: no data or resource files\n",name);
+		return -1;
+	}
+	if (rlen > UINT32_MAX || dlen > UINT32_MAX) {
+		fprintf(stderr, "%s: forks larger than 4 GB can't be archived\n", name);
+		return -1;
+	}
+	if (get_appledouble_rsrc_size(name) > 0) {
+		estimate_exact(rlen);	/* copied without compressing */
+	} else if (rlen) {
+		snprintf(nbuf, sizeof(nbuf), "%s.rsrc", name);
+#ifdef HAVE_NAMEDFORK
+		if (stat(nbuf,&st)!=0 || st.st_size==0) {
+			snprintf(nbuf, sizeof(nbuf), "%s/..namedfork/rsrc", name);
+		}
+#endif
+		estimate_fork(nbuf,0,rlen,0);
+	}
+	if (dlen) {
+		snprintf(nbuf, sizeof(nbuf), "%s", name);
+		if (stat(nbuf,&st)<0) {
+			snprintf(nbuf, sizeof(nbuf), "%s.data", name);
+		}
+		estimate_fork(nbuf,0,dlen,unixf);
+	}
+	estimate_exact(sizeof(fh));
+	*uncompressedLen += rlen + dlen + sizeof(fh);
+	return 0;
+}
+
+/* Adds a folder from an HFS volume to the --estimate totals, walking it
+ * the way put_volume() does. The forks are sampled from the image.
+ */
+static void estimate_volume(char *name, HfsVolume *vol, const HfsEntry *folder,
+		long *files, long *folders, off_t *uncompressedLen) {
+	const HfsEntry *children;
+	HfsFork f;
+	int j, k, r, n;
+
+	estimate_exact(2*sizeof(fh));	/* start and end of folder */
+	*uncompressedLen += 2*sizeof(fh);
+	(*folders)++;
+	n = hfs_children(vol,folder,&children);
+	for (j = 0; j < n; j++) {
+		const HfsEntry *e = &children[j];
+		if (e->isFolder) {
+			estimate_volume(name,vol,e,files,folders,uncompressedLen);
+			continue;
+		}
+		for (r = 0; r < 2; r++) {
+			if (hfs_open_fork(vol,e,r,&f) < 0) {
+				continue;
+			}
+			for (k = 0; k < f.nranges; k++) {
+				estimate_fork(name,f.ranges[k].offset,f.ranges[k].length,r ? 0 : unixf);
+			}
+			hfs_close_fork(&f);
+		}
+		estimate_exact(sizeof(fh));
+		*uncompressedLen += e->rsrcLen + e->dataLen + sizeof(fh);
+		(*files)++;
+	}
+}
+
+/* Adds an input to the --estimate totals, walking folders the way
+ * put_item() and put_folder() do.
+ */
+static void estimate_item(char *name, long *files, long *folders, off_t *uncompressedLen) {
+	struct stat st;
+	struct dirent *entry;
+	char path[PATH_MAX];
+	DIR *dir;
+
+	if (lstat(name,&st)!=0 || !S_ISDIR(st.st_mode)) {
+		HfsVolume *vol;
+		if (is_hfs_image_name(name) && hfs_open(name,&vol) == 0) {
+			estimate_volume(name,vol,hfs_root(vol),files,folders,uncompressedLen);
+			hfs_close(vol);
+			return;
+		}
+		if (estimate_file(name,uncompressedLen) == 0) {
+			(*files)++;
+		}
+		return;
+	}
+	estimate_exact(2*sizeof(fh));	/* start and end of folder */
+	*uncompressedLen += 2*sizeof(fh);
+	(*folders)++;
+	if (!(dir = opendir(name))) {
+		return;
+	}
+	while ((entry = readdir(dir)) != NULL) {
+		if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0 ||
+			strcmp(entry->d_name, ".DS_Store") == 0) {
+			continue;
+		}
+		if (snprintf(path, sizeof(path), "%s/%s", name, entry->d_name) >= sizeof(path)) {
+			fprintf(stderr, "Warning: path too long, skipping: %s/%s\n", name, entry->d_name);
+			continue;
+		}
+		estimate_item(path,files,folders,uncompressedLen);
+	}
+	closedir(dir);
+}
+
+/* Estimates the size of the archive the inputs would make, for --estimate.
+ * Returns the exit status.
+ */
+static int estimate_archive(char **inputs, int ninputs) {
+	off_t uncompressed = sizeof(sh);
+	long files = 0, folders = 0;
+	int i;
+
+	estimate_exact(sizeof(sh));
+	for (i=0; i<ninputs; i++) {
+		estimate_item(inputs[i],&files,&folders,&uncompressed);
+	}
+	return estimate_report(stdout,files,folders,uncompressed,verbose);
+}
+
+/* Takes back the partly written entry of a damaged BinHex file. Returns -1,
+ * so that the file is archived as-is, or 0 if the archive can't be truncated.
+ */
+static off_t undo_binhex(long fpos1) {
+	if (ftruncate(ofd,fpos1) < 0 || lseek(ofd,fpos1,SEEK_SET) < 0) {
+		fprintf(stderr, "Error truncating archive: %s\n", strerror(errno));
+		return 0;
+	}
+	return -1;
+}
+
+/* put_binhex adds a file decoded from a BinHex 4.0 file, decoding each
+ * fork as it is compressed. Like put_file, it returns the compressed
+ * length in the function result, and uncompressed length in output
+ * argument. If the file turns out to be damaged, the entry is taken back
+ * out and -1 returned, so that the file can be archived as-is.
+ */
+off_t put_binhex(char *name, BinHexFile *bh, off_t *uncompressedLen, int level) {
+	struct stat st;
+	int i;
+	long fpos1;
+	long tdiff;
+	size_t cRLen = 0, cDLen = 0;
+	time_t ctime, mtime;
+
+	fpos1 = lseek(ofd,0,SEEK_CUR); /* remember where we are */
+	if (fpos1 < 0) {
+		fprintf(stderr, "Error seeking in archive: %s\n", strerror(errno));
+		return 0;
+	}
+	/* write empty header, will seek back and fill in later */
+	memset(&fh, 0, sizeof(fh));
+	if (safe_write(ofd, &fh, sizeof(fh), "file header") < 0) {
+		return 0;
+	}
+	if (verbose>2) {
+		for (i=0;i<level;i++) { fprintf(stdout, "  "); }
+		fprintf(stdout, "* file header (%lld bytes), decoding BinHex\n",
+				(long long)sizeof(fh));
+	}
+	/* the resource fork comes first in the archive, but last in the file */
+	if (bh->rsrcLen) {
+		if (start_binhex_fork(bh,1) < 0) {
+			return undo_binhex(fpos1);
+		}
+		cRLen = encode_fork(read_binhex_fork,bh,0,1);
+		if (readerror) {
+			return undo_binhex(fpos1);
+		}
+		cp4(bh->rsrcLen,(char*)fh.rLen);
+		cp4(cRLen,(char*)fh.cRLen);
+		cp2(crc,(char*)fh.rsrcCRC);
+		fh.compRMethod = (cRLen==bh->rsrcLen) ? noComp : lzwComp;
+	}
+	if (start_binhex_fork(bh,0) < 0) {
+		return undo_binhex(fpos1);
+	}
+	if (bh->dataLen) {
+		cDLen = encode_fork(read_binhex_fork,bh,unixf,0);
+		if (readerror) {
+			return undo_binhex(fpos1);
+		}
+		cp4(bh->dataLen,(char*)fh.dLen);
+		cp4(cDLen,(char*)fh.cDLen);
+		cp2(crc,(char*)fh.dataCRC);
+		fh.compDMethod = (cDLen==bh->dataLen) ? noComp : lzwComp;
+	}
+	/* an empty fork still has a CRC to check */
+	if (skip_binhex_fork(bh) < 0 ||
+		(!bh->rsrcLen && (start_binhex_fork(bh,1) < 0 || skip_binhex_fork(bh) < 0))) {
+		return undo_binhex(fpos1);
+	}
+	memcpy(fh.fName, bh->name, bh->name[0]+1);
+	memcpy(fh.fType, bh->type, 4);
+	memcpy(fh.fCreator, bh->creator, 4);
+	memcpy(fh.FndrFlags, bh->flags, 2);
+
+	/* BinHex doesn't carry dates, so use those of the .hqx file */
+	if (stat(name,&st)==0) {
+		ctime = st.st_ctime;
+#ifdef HAVE_BIRTHTIME
+		ctime = st.st_birthtime;
+#endif
+		mtime = st.st_mtime;
+		tdiff = TIMEDIFF + get_timezone_offset();
+		cp4(ctime + tdiff, (char*)fh.cDate);
+		cp4(mtime + tdiff, (char*)fh.mDate);
+	}
+	*uncompressedLen += bh->rsrcLen + bh->dataLen + sizeof(fh);
+	return finish_file_entry(name,fpos1,bh->rsrcLen,bh->dataLen,cRLen,cDLen,level);
+}
+
+/* Appends a name from an HFS volume, as a filesystem name, to the path
+ * used for it in messages. Returns the length of the path before.
+ */
+static size_t volume_path(char *path, size_t size, const unsigned char *macName) {
+	size_t len = strlen(path);
+	char fsName[256];
+
+	convertMacRomanToFilesystemName(macName,fsName,sizeof(fsName));
+	snprintf(path+len, size-len, "/%s", fsName);
+	return len;
+}
+
+/* put_volume_file adds a file from an HFS volume, reading its forks from
+ * the image. Like put_file, it returns the compressed length in the
+ * function result, and uncompressed length in output argument.
+ */
+static off_t put_volume_file(char *path, HfsVolume *vol, const HfsEntry *e,
+		off_t *uncompressedLen, int level) {
+	HfsFork rf, df;
+	int i;
+	long fpos1;
+	size_t cRLen = 0, cDLen = 0;
+
+	if (hfs_open_fork(vol,e,1,&rf) < 0) {
+		return 0;
+	}
+	if (hfs_open_fork(vol,e,0,&df) < 0) {
+		hfs_close_fork(&rf);
+		return 0;
+	}
+	fpos1 = lseek(ofd,0,SEEK_CUR); /* remember where we are */
+	if (fpos1 < 0) {
+		fprintf(stderr, "Error seeking in archive: %s\n", strerror(errno));
+		hfs_close_fork(&rf);
+		hfs_close_fork(&df);
+		return 0;
+	}
+	/* write empty header, will seek back and fill in later */
+	memset(&fh, 0, sizeof(fh));
+	if (safe_write(ofd, &fh, sizeof(fh), "file header") < 0) {
+		hfs_close_fork(&rf);
+		hfs_close_fork(&df);
+		return 0;
+	}
+	if (verbose>2) {
+		for (i=0;i<level;i++) { fprintf(stdout, "  "); }
+		fprintf(stdout, "* file header (%lld bytes)\n", (long long)sizeof(fh));
+	}
+	if (e->rsrcLen) {
+		cRLen = encode_fork(hfs_read_fork,&rf,0,1);
+		cp4(e->rsrcLen,(char*)fh.rLen);
+		cp4(cRLen,(char*)fh.cRLen);
+		cp2(crc,(char*)fh.rsrcCRC);
+		fh.compRMethod = (cRLen==e->rsrcLen) ? noComp : lzwComp;
+	}
+	if (e->dataLen) {
+		cDLen = encode_fork(hfs_read_fork,&df,unixf,0);
+		cp4(e->dataLen,(char*)fh.dLen);
+		cp4(cDLen,(char*)fh.cDLen);
+		cp2(crc,(char*)fh.dataCRC);
+		fh.compDMethod = (cDLen==e->dataLen) ? noComp : lzwComp;
+	}
+	hfs_close_fork(&rf);
+	hfs_close_fork(&df);
+	memcpy(fh.fName, e->name, e->name[0]+1);
+	memcpy(fh.fType, e->type, 4);
+	memcpy(fh.fCreator, e->creator, 4);
+	memcpy(fh.FndrFlags, e->flags, 2);
+	cp4(e->cDate,(char*)fh.cDate);	/* already Mac times */
+	cp4(e->mDate,(char*)fh.mDate);
+	*uncompressedLen += e->rsrcLen + e->dataLen + sizeof(fh);
+	return finish_file_entry(path,fpos1,e->rsrcLen,e->dataLen,cRLen,cDLen,level);
+}
+
+/* put_volume_folder adds a folder from an HFS volume and everything in
+ * it, returning the compressed length and adding the uncompressed length
+ * to the output argument, as put_item does for a directory.
+ */
+static off_t put_volume_folder(char *path, HfsVolume *vol, const HfsEntry *folder,
+		off_t *uncompressedLen, int level) {
+	const HfsEntry *children;
+	off_t startPos, uncompressedEntryLen;
+	char *fname;
+	size_t len;
+	int i, j, n;
+
+	fname = strrchr(path,'/') ? strrchr(path,'/')+1 : path;
+	startPos = lseek(ofd,0,SEEK_CUR); /* remember where we are */
+	write_folder_entry(fname,(u_char*)folder->name,folder->cDate,folder->mDate,
+			startPos,uncompressedLen,startFolder,level);
+	n = hfs_children(vol,folder,&children);
+	for (j = 0; j < n; j++) {
+		const HfsEntry *e = &children[j];
+		len = volume_path(path,PATH_MAX,e->name);
+		if (verbose>1) {
+			for (i=0;i<level+1;i++) { fprintf(stdout, "  "); }
+			fprintf(stdout, "+ %s%s\n", path+len+1, e->isFolder ? " (directory)" : "");
+		}
+		uncompressedEntryLen = 0;
+		if (e->isFolder) {
+			put_volume_folder(path,vol,e,&uncompressedEntryLen,level+1);
+		} else {
+			put_volume_file(path,vol,e,&uncompressedEntryLen,level+1);
+		}
+		*uncompressedLen += uncompressedEntryLen;
+		path[len] = '\0';
+	}
+	write_folder_entry(fname,(u_char*)folder->name,folder->cDate,folder->mDate,
+			startPos,uncompressedLen,endFolder,level);
+	return lseek(ofd,0,SEEK_CUR) - startPos;
+}
+
+/* put_volume adds the HFS volume in the disk image name as a folder
+ * named for the volume, holding its files and folders. Like put_file,
+ * it returns the compressed length in the function result, and
+ * uncompressed length in output argument.
+ */
+off_t put_volume(char *name, HfsVolume *vol, off_t *uncompressedLen, int level) {
+	char path[PATH_MAX];
+	off_t start = lseek(ofd,0,SEEK_CUR), len;
+
+	snprintf(path, sizeof(path), "%s", name);
+	len = put_volume_folder(path,vol,hfs_root(vol),uncompressedLen,level);
+	watch_record(name,start,len);
+	return len;
+}
+
+/* put_stdin adds a file named name whose data fork is read from stdin,
+ * compressing it as it arrives. Like put_file, it returns the compressed
+ * length in the function result, and uncompressed length in output argument.
+ */
+off_t put_stdin(char *name, off_t *uncompressedLen, int level) {
+	StreamFork sf;
+	int i;
+	long fpos1;
+	long tdiff;
+	off_t cDLen;
+	time_t now;
+
+	fpos1 = lseek(ofd,0,SEEK_CUR); /* remember where we are */
+	if (fpos1 < 0) {
+		fprintf(stderr, "Error seeking in archive: %s\n", strerror(errno));
+		return 0;
+	}
+	/* write empty header, will seek back and fill in later */
+	memset(&fh, 0, sizeof(fh));
+	if (safe_write(ofd, &fh, sizeof(fh), "file header") < 0) {
+		return 0;
+	}
+	if (verbose>2) {
+		for (i=0;i<level;i++) { fprintf(stdout, "  "); }
+		fprintf(stdout, "* file header (%lld bytes)\n", (long long)sizeof(fh));
+	}
+	sf.fd = 0;
+	sf.len = 0;
+	cDLen = encode_fork(read_stream_fork,&sf,unixf,0);
+	if (sf.len > UINT32_MAX || readerror || (cDLen == 0 && sf.len > 0)) {
+		if (sf.len > UINT32_MAX) {
+			fprintf(stderr, "%s: forks larger than 4 GB can't be archived\n", name);
+		} else {
+			fprintf(stderr, "%s: error reading stdin\n", name);
+		}
+		return drop_entry(fpos1);
+	}
+	if (sf.len) {
+		cp4(sf.len,(char*)fh.dLen);
+		cp4(cDLen,(char*)fh.cDLen);
+		cp2(crc,(char*)fh.dataCRC);
+		fh.compDMethod = (cDLen==sf.len) ? noComp : lzwComp;
+	}
+	convertFilesystemNameToMacRoman(name,(char*)&fh.fName[0],63);
+	strncpy((char*)fh.fType, Type ? Type : "TEXT", 4);
+	strncpy((char*)fh.fCreator, Creator ? Creator : "KAHL", 4);
+
+	/* a stream has no dates of its own, so it was created just now */
+	now = time(NULL);
+	tdiff = TIMEDIFF + get_timezone_offset();
+	cp4(now + tdiff, (char*)fh.cDate);
+	cp4(now + tdiff, (char*)fh.mDate);
+	*uncompressedLen += sf.len + sizeof(fh);
+	return finish_file_entry(name,fpos1,0,sf.len,0,cDLen,level);
+}
+
+/* finish_file_entry reports on a file entry whose forks have been written,
+ * then fills in its header at fpos1. Returns the entry's compressed length.
+ */
+off_t finish_file_entry(char *name, long fpos1, size_t rlen, size_t dlen,
+		size_t cRLen, size_t cDLen, int level) {
+	int i;
+	long fpos2;
+
 	if (verbose) {
 		char typecreator[10];
 		snprintf(typecreator, sizeof(typecreator), "%.4s/%.4s", fh.fType, fh.fCreator);
 		if (verbose>1) { for (i=0;i<level;i++) { fprintf(stdout, "  "); } }
 		fprintf(stdout, "%s (%lld bytes) Data:%lld Rsrc:%lld [%s]\n",
 				name,(long long)dlen+rlen,(long long)dlen,(long long)rlen,typecreator);
-		if (verbose>2) {
+		if (verbose>2 && dlen+rlen) {
 			for (i=0;i<level;i++) { fprintf(stdout, "  "); }
 			fprintf(stdout, "Savings: %lld%% (%lld/%lld bytes) Data:%lld/%lld Rsrc:%lld/%lld\n",
 					(long long)100-(((cDLen+cRLen)*100)/(dlen+rlen)),
@@ -658,6 +2269,7 @@ off_t put_file(char *name, off_t *uncompressedLen, int level) {
 	}
 	crc = updcrc(0,(unsigned char*)&fh,(sizeof fh)-2);
 	cp2(crc,(char*)fh.hdrCRC);
+	index_add_file(fh.fName,fpos1);
 
 	fpos2 = lseek(ofd,0,SEEK_CUR);		/* remember where we are */
 	if (fpos2 < 0 || lseek(ofd,fpos1,SEEK_SET) < 0) {
@@ -671,116 +2283,81 @@ off_t put_file(char *name, off_t *uncompressedLen, int level) {
 		fprintf(stderr, "Error seeking in archive: %s\n", strerror(errno));
 		return 0;
 	}
-	*uncompressedLen += rlen + dlen + sizeof(fh);
-
+	watch_record(name,fpos1,fpos2-fpos1);
 	return (fpos2 - fpos1);
 }
 
 /* Processes contents of given file, writing compressed data
  * to the output archive and returning the compressed length.
+ * rsrc is set for a resource fork.
  */
-off_t dofork(char *name, int convert) {
-	FILE *fs, *cfs;
-	int fd, ufd;
-	size_t n, clen;
-	char *p;
-	char cvtfilename[] = "/tmp/sit+cvt-XXXXXX";
-	char cmpfilename[] = "/tmp/sit+cmp-XXXXXX";
-
-	if ((fd=mkstemp(cmpfilename))<0) {
-		perror(cmpfilename);
-		return 0;
-	}
-	close(fd);
+off_t dofork(char *name, int convert, int rsrc) {
+	struct stat st;
+	int fd, keep;
+	off_t clen, start=0;
 
+	readerror = 0;
 	if ((fd=open(name,O_RDONLY))<0) {
+		readerror = errno;
 		perror(name);
 		return 0;
 	}
-	if (convert) {	/* build conversion file */
-		if ((ufd=mkstemp(cvtfilename))<0) {
-			perror(cvtfilename);
+	if (!rsrc && interleave_enabled()) { /* compressed already? */
+		clen = interleave_take(name,convert,ofd,&crc);
+		if (clen != -1) {
 			close(fd);
-			return 0;
+			return (clen < 0) ? 0 : clen;
 		}
 	}
-	/* do crc of file: */
-	crc = 0;
-	while ((n=read(fd,buf,BUFSIZ))>0) {
-		if (convert) {	/* convert '\n' to '\r' */
-			for (p=buf; p<&buf[n]; p++)
-				if (*p == '\n') *p = '\r';
-			if (safe_write(ufd, buf, n, "conversion temp file") < 0) {
-				close(fd);
-				if (convert) close(ufd);
-				return 0;
-			}
+	if ((keep = forkcache_enabled() && fstat(fd,&st) == 0)) { /* compressed for an earlier archive? */
+		clen = forkcache_take(&st,convert,ofd,&crc);
+		if (clen != -1) {
+			close(fd);
+			return (clen < 0) ? 0 : clen;
 		}
-		crc = updcrc(crc,(unsigned char*)buf,n);
+		start = lseek(ofd,0,SEEK_CUR);
+	}
+	clen = encode_fork(read_fd_fork,&fd,convert,rsrc);
+	if (keep && start >= 0 && !readerror) {
+		forkcache_store(&st,fd,convert,ofd,start,clen,crc);
 	}
 	close(fd);
-	if (convert) { close(ufd); }
+	return clen;
+}
 
+/* Opens the encoder for a fork on the stream out, which the pipeline
+ * writes to the archive. ctx points to rsrc, for index checkpoints.
+ */
+static FILE *open_fork_encoder(FILE *out, void *ctx) {
 #if ENABLE_LZW_COMPRESSION
-	/* open file stream for compressed output */
-	if ((cfs=zopen(cmpfilename,"w",14))==NULL) { /* always 14 bits */
+	/* always 14 bits, with no compress header (1f 9d 8e) */
+	return indexing ? zopen_stream_hook(out,14,index_checkpoint,ctx) :
+		zopen_stream(out,"w",14,1);
 #else
-	/* open file stream for uncompressed output */
-	if ((cfs=fopen(cmpfilename,"w"))==NULL) {
+	return out;
 #endif
-		perror(cmpfilename);
-		return 0;
-	}
-	if (convert) { /* use conversion file as input */
-		if ((fs=fopen(cvtfilename,"r"))==NULL) {
-			perror(cvtfilename);
-			return 0;
-		}
-	}
-	else { /* use original file as input */
-		if ((fs=fopen(name,"r"))==NULL) {
-			perror(name);
-			return 0;
-		}
-	}
-	/* write compressed data to temp file */
-	while ((n=fread(buf,1,BUFSIZ,fs))>0) {
-		if (fwrite(buf, 1, n, cfs) != n) {
-			perror("fork data");
-			fclose(fs);
-			fclose(cfs);
-			return 0;
-		}
-	}
-	fclose(fs);
-	fclose(cfs);
-	unlink(cvtfilename); /* ignore error */
+}
 
-	/* reopen temp file */
-	if ((fd=open(cmpfilename,O_RDONLY))<0) {
-		perror(cmpfilename);
-		return 0;
-	}
-	/* write temp file to output archive */
-	clen = 0;
-#if ENABLE_LZW_COMPRESSION
-	/* skip past initial 3-byte compress header (1f 9d 8e) */
-	if (lseek(fd,3L,SEEK_SET) < 0) {
-		fprintf(stderr, "Error seeking in compressed data: %s\n", strerror(errno));
-		close(fd);
-		return 0;
-	}
-#endif
-	while ((n=read(fd,buf,BUFSIZ))>0) {
-		if (safe_write(ofd, buf, n, "fork data") < 0) {
-			close(fd);
-			return 0;
-		}
-		clen += n;
-	}
-	close(fd);
-	unlink(cmpfilename); /* ignore error */
-	return clen;
+/* Reads a fork from the given reader, writing compressed data to the
+ * output archive and returning the compressed length. The fork is read
+ * only once: conversion, CRC and compression all happen in the same pass,
+ * so the reader may be a stream. The stages run at once, in a pipeline
+ * (see pipeline.h). The CRC is left in the global crc, and the errno of a
+ * read error, if the fork couldn't all be read, in readerror.
+ * With --index, the encoder's restart points are recorded for the fork.
+ */
+off_t encode_fork(fork_reader reader, void *ctx, int convert, int rsrc) {
+	PipelineFork pf;
+	off_t clen;
+
+	pf.read = reader;
+	pf.readCtx = ctx;
+	pf.convert = convert;
+	pf.encoder = open_fork_encoder;
+	pf.encoderCtx = &rsrc;
+	pf.fd = ofd;
+	clen = pipeline_fork(&pf,&crc,&readerror);
+	return (clen < 0) ? 0 : clen;
 }
 
 void cp2(uint16_t x, char *dest) {
@@ -795,88 +2372,13 @@ void cp4(uint32_t x, char *dest) {
 	dest[3] = x;
 }
 
-/* each entry is 4 bytes: first 2 (or 3) are UTF-8, 4th byte is matching Mac char.
- * obviously this could be made more space-efficient. */
-static u_char hiBitCharMap[] = {
-	0xC3,0x84,0x00,0x80,0xC3,0x85,0x00,0x81,0xC3,0x87,0x00,0x82,0xC3,0x89,0x00,0x83,
-	0xC3,0x91,0x00,0x84,0xC3,0x96,0x00,0x85,0xC3,0x9C,0x00,0x86,0xC3,0xA1,0x00,0x87,
-	0xC3,0xA0,0x00,0x88,0xC3,0xA2,0x00,0x89,0xC3,0xA4,0x00,0x8A,0xC3,0xA3,0x00,0x8B,
-	0xC3,0xA5,0x00,0x8C,0xC3,0xA7,0x00,0x8D,0xC3,0xA9,0x00,0x8E,0xC3,0xA8,0x00,0x8F,
-	0xC3,0xAA,0x00,0x90,0xC3,0xAB,0x00,0x91,0xC3,0xAD,0x00,0x92,0xC3,0xAC,0x00,0x93,
-	0xC3,0xAE,0x00,0x94,0xC3,0xAF,0x00,0x95,0xC3,0xB1,0x00,0x96,0xC3,0xB3,0x00,0x97,
-	0xC3,0xB2,0x00,0x98,0xC3,0xB4,0x00,0x99,0xC3,0xB6,0x00,0x9A,0xC3,0xB5,0x00,0x9B,
-	0xC3,0xBA,0x00,0x9C,0xC3,0xB9,0x00,0x9D,0xC3,0xBB,0x00,0x9E,0xC3,0xBC,0x00,0x9F,
-	0xE2,0x80,0xA0,0xA0,0xC2,0xB0,0x00,0xA1,0xC2,0xA2,0x00,0xA2,0xC2,0xA3,0x00,0xA3,
-	0xC2,0xA7,0x00,0xA4,0xE2,0x80,0xA2,0xA5,0xC2,0xB6,0x00,0xA6,0xC3,0x9F,0x00,0xA7,
-	0xC2,0xAE,0x00,0xA8,0xC2,0xA9,0x00,0xA9,0xE2,0x84,0xA2,0xAA,0xC2,0xB4,0x00,0xAB,
-	0xC2,0xA8,0x00,0xAC,0xE2,0x89,0xA0,0xAD,0xC3,0x86,0x00,0xAE,0xC3,0x98,0x00,0xAF,
-	0xE2,0x88,0x9E,0xB0,0xC2,0xB1,0x00,0xB1,0xE2,0x89,0xA4,0xB2,0xE2,0x89,0xA5,0xB3,
-	0xC2,0xA5,0x00,0xB4,0xC2,0xB5,0x00,0xB5,0xE2,0x88,0x82,0xB6,0xE2,0x88,0x91,0xB7,
-	0xE2,0x88,0x8F,0xB8,0xCF,0x80,0x00,0xB9,0xE2,0x88,0xAB,0xBA,0xC2,0xAA,0x00,0xBB,
-	0xC2,0xBA,0x00,0xBC,0xCE,0xA9,0x00,0xBD,0xC3,0xA6,0x00,0xBE,0xC3,0xB8,0x00,0xBF,
-	0xC2,0xBF,0x00,0xC0,0xC2,0xA1,0x00,0xC1,0xC2,0xAC,0x00,0xC2,0xE2,0x88,0x9A,0xC3,
-	0xC6,0x92,0x00,0xC4,0xE2,0x89,0x88,0xC5,0xE2,0x88,0x86,0xC6,0xC2,0xAB,0x00,0xC7,
-	0xC2,0xBB,0x00,0xC8,0xE2,0x80,0xA6,0xC9,0xC2,0xA0,0x00,0xCA,0xC3,0x80,0x00,0xCB,
-	0xC3,0x83,0x00,0xCC,0xC3,0x95,0x00,0xCD,0xC5,0x92,0x00,0xCE,0xC5,0x93,0x00,0xCF,
-	0xE2,0x80,0x93,0xD0,0xE2,0x80,0x94,0xD1,0xE2,0x80,0x9C,0xD2,0xE2,0x80,0x9D,0xD3,
-	0xE2,0x80,0x98,0xD4,0xE2,0x80,0x99,0xD5,0xC3,0xB7,0x00,0xD6,0xE2,0x97,0x8A,0xD7,
-	0xC3,0xBF,0x00,0xD8
-};
-
-/* Try to convert filesystem name (assumes UTF-8) to a MacRoman string for StuffIt.
- * Currently, this just means converting the extended ascii characters.
- * Also convert colon characters to slashes, since they are path delimiters and
- * the item will not be extractable with StuffIt Expander unless we do.
- * Input is a C string, in UTF-8 encoding.
- * Output is a P string, in MacRoman encoding if possible.
- * Note: this doesn't use CFString, since the characters we can convert are known
- * and can be mapped to their MacRoman equivalent, and we want to remain portable.
- */
-void convertFilesystemNameToMacRoman(char *fsName, char *macName, int maxLength) {
-	u_char tmp[maxLength+1];
-	u_char *p = (u_char*)fsName;
-	int i, remaining = min(strlen((char*)fsName),maxLength);
-	tmp[0] = 0;
-	while (remaining > 0) {
-		u_char c = *p;
-		if (c >= 0x80 && remaining > 1) {
-			for (i=0; i<sizeof(hiBitCharMap); i=i+4) {
-				if (c == hiBitCharMap[i]) {
-					if (*(p+1) == hiBitCharMap[i+1]) {
-						if (0x00 == hiBitCharMap[i+2]) {
-							/* matched 2-byte UTF-8 character */
-							c = hiBitCharMap[i+3];
-							p = p+1;
-							remaining -= 1;
-							break;
-						} else if (remaining > 2 && *(p+2) == hiBitCharMap[i+2]) {
-							/* matched 3-byte UTF-8 character */
-							c = hiBitCharMap[i+3];
-							p = p+2;
-							remaining -= 2;
-							break;
-						}
-					}
-				}
-			}
-		} else {
-			if (c == 0x3A) { c = 0x2F; } /* convert colon to slash */
-		}
-		tmp[tmp[0]+1] = c;
-		tmp[0] = tmp[0]+1;
-		p = p+1;
-		remaining -= 1;
-	}
-	memcpy(macName,tmp,tmp[0]+1);
-}
-
 /* Create a unique file path based on the input path, incrementing the
  * suffix number until we get a name that doesn't already exist.
  */
 int create_file(char *path) {
 	struct stat st;
 	if (stat(path,&st)!=0) {
-		return creat(path,0644); /* normal case */
+		return open(path,O_RDWR|O_CREAT|O_TRUNC,0644); /* normal case; readable for links_reuse() */
 	}
 	int startlen = strlen(path);
 	char *name = malloc(startlen);
@@ -895,7 +2397,7 @@ int create_file(char *path) {
 		if (stat(buf,&st)!=0) {
 			defoutfile = buf; /* keep it allocated */
 			free(name);
-			return creat(buf,0644);
+			return open(buf,O_RDWR|O_CREAT|O_TRUNC,0644);
 		}
 	}
 	free(name);
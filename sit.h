@@ -1,3 +1,4 @@
+#pragma once
 
 /* sit.h: contains declarations for SIT headers */
 /* These come from the StuffIt 1.5 documentation by Raymond Lau. */
@@ -11,7 +12,7 @@ typedef struct __attribute__((aligned(2), packed)) sitHdr {		/* 22 bytes */
 	char reserved[7];
 } sitHdr;
 
-typedef struct __attribute__((aligned(2), packed)) fileHdr {	/* 112 bytes */
+typedef struct __attribute__((packed)) fileHdr {	/* 112 bytes, read in place at any offset */
 	u_char	compRMethod;		/* rsrc fork compression method */
 	u_char	compDMethod;		/* data fork compression method */
 	u_char	fName[64];			/* a STR63 */
@@ -96,6 +97,7 @@ typedef struct __attribute__((aligned(2), packed)) fileHdr {	/* 112 bytes */
 #define repComp 1	/* RLE compression */
 #define lzwComp 2	/* LZW compression */
 #define hufComp 3	/* Huffman compression */
+#define lzhufComp 13	/* LZ77 and Huffman compression, from later versions of StuffIt */
 
 #define encrypted 16	/* bit set if encrypted.  ex: encrypted+lpzComp */
 
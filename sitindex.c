@@ -0,0 +1,192 @@
+/*
+ * sitindex.c - index sidecar for random access into an archive
+ *
+ * The index is a text file. The first line identifies it:
+ *   sit-index 1
+ * then each file in the archive has a line
+ *   F <header offset> <path>
+ * followed by a line for each restart point in its forks
+ *   R <compressed> <uncompressed>     (resource fork)
+ *   D <compressed> <uncompressed>     (data fork)
+ * with offsets counted from the start of the fork. The last line gives
+ * the length of the archive the index was written for:
+ *   L <archive length>
+ * Paths are as given by sitread, which never contain newlines.
+ */
+
+#include "sitindex.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "macroman.h"
+
+#define INDEX_MAGIC     "sit-index 1"
+
+static FILE *ifs;
+static char *indexPath;
+
+/* paths of the enclosing folders */
+static char **folders;
+static int depth, foldersCap;
+
+/* restart points since the last file, for each fork */
+static SitCheckpoint *pending[2];
+static int npending[2], pendingCap[2];
+
+static char *index_name(const char *archive) {
+    char *name = malloc(strlen(archive) + 5);
+    sprintf(name, "%s.idx", archive);
+    return name;
+}
+
+int index_create(const char *archive) {
+    indexPath = index_name(archive);
+    if ((ifs = fopen(indexPath, "w")) == NULL) {
+        perror(indexPath);
+        return -1;
+    }
+    fputs(INDEX_MAGIC "\n", ifs);
+    return 0;
+}
+
+void index_checkpoint(void *ctx, long compressed, long uncompressed) {
+    int f = *(int *)ctx ? 1 : 0;
+
+    if (!ifs) return;
+    if (npending[f] == pendingCap[f]) {
+        pendingCap[f] = pendingCap[f] ? pendingCap[f] * 2 : 64;
+        pending[f] = realloc(pending[f], pendingCap[f] * sizeof(SitCheckpoint));
+    }
+    pending[f][npending[f]].compressed = compressed;
+    pending[f][npending[f]].uncompressed = uncompressed;
+    npending[f]++;
+}
+
+/* the path sitread will give an entry in the current folder */
+static char *entry_path(const u_char *fName) {
+    unsigned char pname[64];
+    char name[256], *path;
+
+    memcpy(pname, fName, sizeof(pname));
+    if (pname[0] > 63) pname[0] = 63;
+    convertMacRomanToFilesystemName(pname, name, sizeof(name));
+    if (depth == 0) return strdup(name);
+    path = malloc(strlen(folders[depth-1]) + strlen(name) + 2);
+    sprintf(path, "%s/%s", folders[depth-1], name);
+    return path;
+}
+
+void index_push_folder(const u_char *fName) {
+    if (!ifs) return;
+    if (depth == foldersCap) {
+        foldersCap = foldersCap ? foldersCap * 2 : 16;
+        folders = realloc(folders, foldersCap * sizeof(char *));
+    }
+    folders[depth] = entry_path(fName);
+    depth++;
+}
+
+void index_pop_folder(void) {
+    if (!ifs || depth == 0) return;
+    free(folders[--depth]);
+}
+
+void index_add_file(const u_char *fName, off_t offset) {
+    char *path;
+    int f, i;
+
+    if (!ifs) return;
+    path = entry_path(fName);
+    fprintf(ifs, "F %lld %s\n", (long long)offset, path);
+    free(path);
+    for (f = 0; f < 2; f++) {
+        for (i = 0; i < npending[f]; i++) {
+            fprintf(ifs, "%c %lu %lu\n", f ? 'R' : 'D',
+                    (unsigned long)pending[f][i].compressed,
+                    (unsigned long)pending[f][i].uncompressed);
+        }
+        npending[f] = 0;
+    }
+}
+
+int index_finish(off_t arcLen) {
+    int result = 0;
+
+    if (!ifs) return 0;
+    fprintf(ifs, "L %lld\n", (long long)arcLen);
+    if (fclose(ifs) != 0) {
+        perror(indexPath);
+        result = -1;
+    }
+    ifs = NULL;
+    return result;
+}
+
+void index_abandon(void) {
+    if (!ifs) return;
+    fclose(ifs);
+    ifs = NULL;
+    unlink(indexPath);
+}
+
+static void add_checkpoint(SitFork *fork, unsigned long c, unsigned long u) {
+    SitCheckpoint *ck = (SitCheckpoint *)fork->checkpoints;
+    ck = realloc(ck, (fork->ncheckpoints + 1) * sizeof(SitCheckpoint));
+    ck[fork->ncheckpoints].compressed = c;
+    ck[fork->ncheckpoints].uncompressed = u;
+    fork->checkpoints = ck;
+    fork->ncheckpoints++;
+}
+
+int index_find(const char *archive, off_t arcLen, const char *path, off_t *offset,
+               SitFork *rsrc, SitFork *data) {
+    char *name = index_name(archive), *line = NULL;
+    size_t cap = 0;
+    ssize_t len;
+    FILE *fs;
+    int found = 0, current = 0, valid = 0;
+
+    fs = fopen(name, "r");
+    free(name);
+    if (!fs) return -1;
+    rsrc->checkpoints = data->checkpoints = NULL;
+    rsrc->ncheckpoints = data->ncheckpoints = 0;
+    if ((len = getline(&line, &cap, fs)) > 0 && strcmp(line, INDEX_MAGIC "\n") == 0) {
+        while ((len = getline(&line, &cap, fs)) > 0 && line[len-1] == '\n') {
+            unsigned long c, u;
+            long long n;
+            line[len-1] = 0;
+            if (line[0] == 'F' && sscanf(line, "F %lld", &n) == 1) {
+                char *p = strchr(line + 2, ' ');
+                current = !found && p && strcmp(p + 1, path) == 0;
+                if (current) {
+                    found = 1;
+                    *offset = n;
+                }
+            } else if ((line[0] == 'R' || line[0] == 'D') &&
+                       sscanf(line + 1, "%lu %lu", &c, &u) == 2) {
+                if (current) add_checkpoint(line[0] == 'R' ? rsrc : data, c, u);
+            } else if (line[0] == 'L' && sscanf(line, "L %lld", &n) == 1) {
+                valid = (n == arcLen);
+                break;
+            } else {
+                break;
+            }
+        }
+    }
+    free(line);
+    fclose(fs);
+    if (!found || !valid) {
+        index_free_checkpoints(rsrc);
+        index_free_checkpoints(data);
+        return -1;
+    }
+    return 0;
+}
+
+void index_free_checkpoints(SitFork *fork) {
+    free((void *)fork->checkpoints);
+    fork->checkpoints = NULL;
+    fork->ncheckpoints = 0;
+}
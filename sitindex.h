@@ -0,0 +1,66 @@
+/*
+ * sitindex.h - index sidecar for random access into an archive
+ *
+ * With --index, an index is written alongside the archive, named
+ * "<archive>.idx". It lists the header offset of every file in the
+ * archive by path, so one can be found without scanning the headers, and
+ * the points in each LZW fork at which the encoder cleared its code table.
+ * Decoding can start afresh at any of those points, so a range of bytes
+ * deep inside a large fork can be read without decoding everything
+ * before it.
+ */
+
+#pragma once
+
+#include <sys/types.h>
+#include "sitread.h"
+
+/*
+ * Start writing an index for the given archive.
+ *
+ * Returns: 0 on success, -1 on error
+ */
+int index_create(const char *archive);
+
+/*
+ * Record a restart point in the fork being encoded; a zclear_hook for
+ * zopen_hook(). ctx points to an int which is 1 for a resource fork.
+ */
+void index_checkpoint(void *ctx, long compressed, long uncompressed);
+
+/*
+ * Track the folders enclosing the entries being written.
+ */
+void index_push_folder(const u_char *fName);
+void index_pop_folder(void);
+
+/*
+ * Record a file whose header is at the given offset, along with the
+ * restart points recorded since the previous file.
+ */
+void index_add_file(const u_char *fName, off_t offset);
+
+/*
+ * Finish the index, recording the archive's final length so that a stale
+ * index can be recognised.
+ *
+ * Returns: 0 on success, -1 on error
+ */
+int index_finish(off_t arcLen);
+
+/*
+ * Remove an unfinished index.
+ */
+void index_abandon(void);
+
+/*
+ * Look up a file in an archive's index. If found, the offset of its
+ * header is returned, and its restart points are attached to the forks,
+ * which the caller should free with index_free_checkpoints().
+ *
+ * Returns: 0 if found, -1 if there's no valid index or no such file
+ */
+int index_find(const char *archive, off_t arcLen, const char *path, off_t *offset,
+               SitFork *rsrc, SitFork *data);
+
+void index_free_checkpoints(SitFork *fork);
@@ -0,0 +1,420 @@
+/*
+ * sitread.c - reading StuffIt 1.5 archives
+ */
+
+#include "sitread.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "decode.h"
+#include "macroman.h"
+#include "util.h"
+#include "zopen.h"
+
+#define DECODE_BUFSIZE  65536
+
+extern unsigned short updcrc(unsigned short icrc, unsigned char *icp, int icnt);
+
+static void set_fork(SitFork *fork, off_t offset, int method, const u_char *len,
+                     const u_char *clen, const u_char *crc) {
+    fork->offset = offset;
+    fork->method = method;
+    fork->length = get4(len);
+    fork->compLength = get4(clen);
+    fork->crc = get2(crc);
+}
+
+static SitEntry *add_entry(SitArchive *arc, int *cap) {
+    if (arc->nentries == *cap) {
+        *cap = *cap ? *cap * 2 : 256;
+        arc->entries = realloc(arc->entries, *cap * sizeof(SitEntry));
+    }
+    memset(&arc->entries[arc->nentries], 0, sizeof(SitEntry));
+    return &arc->entries[arc->nentries++];
+}
+
+static int scan(SitArchive *arc, const char *path) {
+    int stack[256], depth = 0, cap = 0;
+    off_t pos = sizeof(sitHdr);
+    off_t end = arc->arcLen < arc->size ? arc->arcLen : arc->size;
+
+    while (pos + (off_t)sizeof(fileHdr) <= end) {
+        const fileHdr *h = (const fileHdr *)(arc->map + pos);
+        char name[256];
+        SitEntry *e;
+
+        if (updcrc(0, (unsigned char *)h, sizeof(fileHdr) - 2) != get2(h->hdrCRC)) {
+            fprintf(stderr, "%s: bad header CRC at offset %lld\n", path, (long long)pos);
+            return -1;
+        }
+        if (h->compRMethod == endFolder || h->compDMethod == endFolder) {
+            if (depth == 0) {
+                fprintf(stderr, "%s: unmatched endFolder at offset %lld\n", path, (long long)pos);
+                return -1;
+            }
+            arc->entries[stack[--depth]].next = arc->nentries;
+            arc->entries[stack[depth]].endOffset = pos;
+            pos += sizeof(fileHdr);
+            continue;
+        }
+        e = add_entry(arc, &cap);
+        e->hdr = h;
+        e->offset = pos;
+        e->depth = depth;
+        e->parent = depth ? stack[depth-1] : -1;
+        {
+            unsigned char pname[64];
+            memcpy(pname, h->fName, sizeof(pname));
+            if (pname[0] > 63) pname[0] = 63;
+            convertMacRomanToFilesystemName(pname, name, sizeof(name));
+        }
+        if (e->parent >= 0) {
+            const char *pp = arc->entries[e->parent].path;
+            e->path = malloc(strlen(pp) + strlen(name) + 2);
+            sprintf(e->path, "%s/%s", pp, name);
+        } else {
+            e->path = strdup(name);
+        }
+        e->name = strrchr(e->path, '/') ? strrchr(e->path, '/') + 1 : e->path;
+
+        if (h->compRMethod == startFolder || h->compDMethod == startFolder) {
+            if (depth == sizeof(stack)/sizeof(stack[0])) {
+                fprintf(stderr, "%s: folders nested too deeply\n", path);
+                return -1;
+            }
+            e->isFolder = 1;
+            stack[depth++] = arc->nentries - 1;
+            pos += sizeof(fileHdr);
+            continue;
+        }
+        pos += sizeof(fileHdr);
+        set_fork(&e->rsrc, pos, h->compRMethod, h->rLen, h->cRLen, h->rsrcCRC);
+        pos += e->rsrc.compLength;
+        set_fork(&e->data, pos, h->compDMethod, h->dLen, h->cDLen, h->dataCRC);
+        pos += e->data.compLength;
+        if (pos > end) {
+            fprintf(stderr, "%s: %s extends past the end of the archive\n", path, e->path);
+            return -1;
+        }
+    }
+    if (depth) {
+        fprintf(stderr, "%s: archive ends inside a folder\n", path);
+        return -1;
+    }
+    return 0;
+}
+
+int sit_map(const char *path, SitArchive *arc) {
+    struct stat st;
+    const sitHdr *sh;
+    int fd;
+
+    memset(arc, 0, sizeof(*arc));
+    if ((fd = open(path, O_RDONLY)) < 0 || fstat(fd, &st) < 0) {
+        perror(path);
+        if (fd >= 0) close(fd);
+        return -1;
+    }
+    arc->size = st.st_size;
+    if (arc->size < (off_t)sizeof(sitHdr) ||
+        (arc->map = mmap(NULL, arc->size, PROT_READ, MAP_SHARED, fd, 0)) == MAP_FAILED) {
+        fprintf(stderr, "%s: not a StuffIt archive\n", path);
+        arc->map = NULL;
+        close(fd);
+        return -1;
+    }
+    close(fd);
+    sh = (const sitHdr *)arc->map;
+    if (memcmp(sh->sig1, "SIT!", 4) != 0 || memcmp(sh->sig2, "rLau", 4) != 0) {
+        fprintf(stderr, "%s: not a StuffIt 1.5 archive\n", path);
+        sit_close(arc);
+        return -1;
+    }
+    arc->numFiles = get2(sh->numFiles);
+    arc->arcLen = get4(sh->arcLen);
+    return 0;
+}
+
+int sit_open(const char *path, SitArchive *arc) {
+    if (sit_map(path, arc) < 0) {
+        return -1;
+    }
+    if (scan(arc, path) < 0) {
+        sit_close(arc);
+        return -1;
+    }
+    return 0;
+}
+
+int sit_add_entry(SitArchive *arc, off_t offset, const char *path) {
+    const fileHdr *h;
+    unsigned char pname[64];
+    char name[256];
+    const char *base = strrchr(path, '/') ? strrchr(path, '/') + 1 : path;
+    SitEntry *e;
+    int cap = arc->nentries;    /* the capacity isn't kept, so let add_entry() grow it */
+
+    if (offset < (off_t)sizeof(sitHdr) || offset + (off_t)sizeof(fileHdr) > arc->size) {
+        return -1;
+    }
+    h = (const fileHdr *)(arc->map + offset);
+    memcpy(pname, h->fName, sizeof(pname));
+    if (pname[0] > 63) pname[0] = 63;
+    convertMacRomanToFilesystemName(pname, name, sizeof(name));
+    if (updcrc(0, (unsigned char *)h, sizeof(fileHdr) - 2) != get2(h->hdrCRC) ||
+        h->compRMethod == startFolder || h->compRMethod == endFolder ||
+        strcmp(name, base) != 0) {
+        return -1;
+    }
+    e = add_entry(arc, &cap);
+    e->hdr = h;
+    e->offset = offset;
+    e->parent = -1;
+    e->path = strdup(path);
+    e->name = e->path + (base - path);
+    sit_set_forks(arc, offset, &e->rsrc, &e->data);
+    if (e->data.offset + e->data.compLength > arc->size) {
+        free(e->path);
+        arc->nentries--;
+        return -1;
+    }
+    return arc->nentries - 1;
+}
+
+void sit_set_forks(const SitArchive *arc, off_t offset, SitFork *rsrc, SitFork *data) {
+    const fileHdr *h = (const fileHdr *)(arc->map + offset);
+
+    memset(rsrc, 0, sizeof(*rsrc));
+    memset(data, 0, sizeof(*data));
+    set_fork(rsrc, offset + sizeof(fileHdr), h->compRMethod, h->rLen, h->cRLen, h->rsrcCRC);
+    set_fork(data, rsrc->offset + rsrc->compLength, h->compDMethod, h->dLen, h->cDLen,
+             h->dataCRC);
+}
+
+void sit_close(SitArchive *arc) {
+    int i;
+
+    for (i = 0; i < arc->nentries; i++) free(arc->entries[i].path);
+    free(arc->entries);
+    if (arc->map) munmap((void *)arc->map, arc->size);
+    memset(arc, 0, sizeof(*arc));
+}
+
+int sit_find(const SitArchive *arc, const char *path) {
+    int i;
+
+    for (i = 0; i < arc->nentries; i++) {
+        if (strcmp(arc->entries[i].path, path) == 0) return i;
+    }
+    return -1;
+}
+
+/* LZW: decode through zopen, reading the fork from memory */
+static int decode_lzw(const SitArchive *arc, const SitFork *fork, sit_sink sink, void *ctx,
+                      uint16_t *crc, uint32_t *total) {
+    unsigned char *buf;
+    FILE *mfs, *zfs;
+    size_t n;
+    int result = SIT_OK;
+
+    if ((mfs = fmemopen((void *)(arc->map + fork->offset), fork->compLength, "r")) == NULL) {
+        return SIT_BADDATA;
+    }
+    if ((zfs = zopen_stream(mfs, "r", 14, 1)) == NULL) {
+        fclose(mfs);
+        return SIT_BADDATA;
+    }
+    buf = malloc(DECODE_BUFSIZE);
+    while ((n = fread(buf, 1, DECODE_BUFSIZE, zfs)) > 0) {
+        if (*total + n > fork->length) {
+            result = SIT_BADDATA;
+            break;
+        }
+        *crc = updcrc(*crc, buf, n);
+        *total += n;
+        if (sink(ctx, buf, n) < 0) {
+            result = SIT_ABORTED;
+            break;
+        }
+    }
+    if (ferror(zfs)) result = SIT_BADDATA;
+    fclose(zfs);
+    free(buf);
+    return result;
+}
+
+/* sink state for counting what decode.c's decoders produce */
+typedef struct {
+    sit_sink sink;
+    void *ctx;
+    uint16_t crc;
+    uint32_t total;
+} Tally;
+
+static int tally_sink(void *ctx, const unsigned char *buf, size_t len) {
+    Tally *t = ctx;
+
+    t->crc = updcrc(t->crc, (unsigned char *)buf, len);
+    t->total += len;
+    return t->sink(t->ctx, buf, len);
+}
+
+/* RLE, Huffman and method 13: decode straight from the mapped archive */
+static int decode_table(const SitArchive *arc, const SitFork *fork, sit_sink sink, void *ctx,
+                        uint16_t *crc, uint32_t *total) {
+    const unsigned char *in = arc->map + fork->offset;
+    Tally t = { sink, ctx, *crc, *total };
+    int result;
+
+    switch (fork->method) {
+    case repComp:
+        result = decode_rle(in, fork->compLength, fork->length, tally_sink, &t);
+        break;
+    case hufComp:
+        result = decode_huffman(in, fork->compLength, fork->length, tally_sink, &t);
+        break;
+    default:
+        result = decode_lzhuf(in, fork->compLength, fork->length, tally_sink, &t);
+        break;
+    }
+    *crc = t.crc;
+    *total = t.total;
+    return result;
+}
+
+int sit_decode_fork(const SitArchive *arc, const SitFork *fork, sit_sink sink, void *ctx) {
+    uint16_t crc = 0;
+    uint32_t total = 0;
+    int result;
+
+    if (fork->length == 0) {
+        return SIT_OK;
+    }
+    switch (fork->method) {
+    case noComp:
+        if (fork->compLength != fork->length) return SIT_BADDATA;
+        for (total = 0; total < fork->length; ) {
+            size_t n = fork->length - total;
+            const unsigned char *p = arc->map + fork->offset + total;
+            if (n > DECODE_BUFSIZE) n = DECODE_BUFSIZE;
+            crc = updcrc(crc, (unsigned char *)p, n);
+            total += n;
+            if (sink(ctx, p, n) < 0) return SIT_ABORTED;
+        }
+        break;
+    case lzwComp:
+        if ((result = decode_lzw(arc, fork, sink, ctx, &crc, &total)) != SIT_OK) {
+            return result;
+        }
+        break;
+    case repComp:
+    case hufComp:
+    case lzhufComp:
+        if ((result = decode_table(arc, fork, sink, ctx, &crc, &total)) != SIT_OK) {
+            return result;
+        }
+        break;
+    default:
+        return SIT_BADMETHOD;
+    }
+    if (total != fork->length || crc != fork->crc) {
+        return SIT_BADDATA;
+    }
+    return SIT_OK;
+}
+
+/* sink state for sit_decode_range(): bytes to skip, then bytes to pass on */
+typedef struct {
+    off_t skip;
+    off_t left;
+    int failed;                 /* the sink returned an error */
+    sit_sink sink;
+    void *ctx;
+} Range;
+
+static int range_sink(void *ctx, const unsigned char *buf, size_t len) {
+    Range *r = ctx;
+
+    if (r->skip >= (off_t)len) {
+        r->skip -= len;
+        return 0;
+    }
+    buf += r->skip;
+    len -= r->skip;
+    r->skip = 0;
+    if ((off_t)len > r->left) len = r->left;
+    if (len && r->sink(r->ctx, buf, len) < 0) {
+        r->failed = 1;
+        return -1;
+    }
+    r->left -= len;
+    return r->left ? 0 : -1;    /* stop decoding once the range is done */
+}
+
+int sit_decode_range(const SitArchive *arc, const SitFork *fork, off_t start, off_t length,
+                     sit_sink sink, void *ctx) {
+    SitFork part = *fork;
+    Range r;
+    uint16_t crc = 0;
+    uint32_t total = 0;
+    int i, result;
+
+    if (start >= fork->length || length == 0) {
+        return SIT_OK;
+    }
+    if (length < 0 || length > fork->length - start) {
+        length = fork->length - start;
+    }
+    r.sink = sink;
+    r.ctx = ctx;
+    r.left = length;
+    r.failed = 0;
+    switch (fork->method) {
+    case noComp:
+        if (fork->compLength != fork->length) return SIT_BADDATA;
+        return sink(ctx, arc->map + fork->offset + start, length) < 0 ? SIT_ABORTED : SIT_OK;
+    case lzwComp:
+        /* start from the last restart point before the range */
+        r.skip = start;
+        for (i = 0; i < fork->ncheckpoints && fork->checkpoints[i].uncompressed <= start; i++) {
+            if (fork->checkpoints[i].compressed < fork->compLength) {
+                part.offset = fork->offset + fork->checkpoints[i].compressed;
+                part.compLength = fork->compLength - fork->checkpoints[i].compressed;
+                part.length = fork->length - fork->checkpoints[i].uncompressed;
+                r.skip = start - fork->checkpoints[i].uncompressed;
+            }
+        }
+        result = decode_lzw(arc, &part, range_sink, &r, &crc, &total);
+        break;
+    case repComp:
+    case hufComp:
+    case lzhufComp:
+        /* these have no restart points, so decode from the start */
+        r.skip = start;
+        result = decode_table(arc, fork, range_sink, &r, &crc, &total);
+        break;
+    default:
+        return SIT_BADMETHOD;
+    }
+    if (result == SIT_ABORTED && !r.failed) {
+        result = SIT_OK;        /* stopped once the range was done */
+    }
+    if (result == SIT_OK && r.left) {
+        result = SIT_BADDATA;
+    }
+    return result;
+}
+
+const char *sit_strerror(int result) {
+    switch (result) {
+    case SIT_OK:        return "OK";
+    case SIT_BADDATA:   return "data is corrupt";
+    case SIT_BADMETHOD: return "unsupported compression method";
+    case SIT_ABORTED:   return "write error";
+    }
+    return "unknown error";
+}
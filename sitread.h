@@ -0,0 +1,126 @@
+/*
+ * sitread.h - reading StuffIt 1.5 archives
+ *
+ * An archive is mapped into memory and its headers are scanned once,
+ * giving a list of entries in archive order with their paths and the
+ * locations of their forks. Forks can then be decoded independently,
+ * from any thread, since each decode keeps its own state.
+ */
+
+#pragma once
+
+#include <sys/types.h>
+#include <stdint.h>
+#include "sit.h"
+
+/* results of sit_decode_fork() */
+#define SIT_OK          0
+#define SIT_BADDATA     -1      /* corrupt data, wrong length or CRC mismatch */
+#define SIT_BADMETHOD   -2      /* unsupported or encrypted compression method */
+#define SIT_ABORTED     -3      /* the sink returned an error */
+
+/* A point in an LZW fork at which decoding can start afresh */
+typedef struct {
+    uint32_t compressed;        /* offsets from the start of the fork */
+    uint32_t uncompressed;
+} SitCheckpoint;
+
+typedef struct {
+    off_t offset;               /* of the compressed fork in the archive */
+    uint32_t length;            /* uncompressed length */
+    uint32_t compLength;
+    int method;
+    uint16_t crc;               /* of the uncompressed fork */
+    const SitCheckpoint *checkpoints; /* from an index, in order, if any */
+    int ncheckpoints;
+} SitFork;
+
+typedef struct {
+    char *path;                 /* UTF-8 path within the archive, '/'-separated */
+    const char *name;           /* last component of path */
+    const fileHdr *hdr;         /* header, in the mapped archive */
+    off_t offset;               /* of the header */
+    int isFolder;
+    int depth;                  /* 0 for top-level entries */
+    int parent;                 /* index of the enclosing folder, or -1 */
+    int next;                   /* for folders: index of the entry after its contents */
+    off_t endOffset;            /* for folders: of the matching endFolder header */
+    SitFork rsrc, data;
+} SitEntry;
+
+typedef struct {
+    const unsigned char *map;
+    off_t size;
+    SitEntry *entries;
+    int nentries;
+    int numFiles;               /* top-level entries, from the archive header */
+    off_t arcLen;               /* from the archive header */
+} SitArchive;
+
+/*
+ * Open an archive and scan its headers.
+ *
+ * Returns: 0 on success, -1 on error (with a message on stderr)
+ */
+int sit_open(const char *path, SitArchive *arc);
+
+/*
+ * Open an archive without scanning its headers, for use with
+ * sit_add_entry() when the offset of an entry is already known.
+ *
+ * Returns: 0 on success, -1 on error (with a message on stderr)
+ */
+int sit_map(const char *path, SitArchive *arc);
+
+/*
+ * Add the file whose header is at the given offset to the entries,
+ * checking its header CRC, and that its name matches the last
+ * component of path.
+ *
+ * Returns: its index, or -1 if there's no such file there
+ */
+int sit_add_entry(SitArchive *arc, off_t offset, const char *path);
+
+/*
+ * Fill in the forks of the file whose header is at the given offset in
+ * the archive, without checking them.
+ */
+void sit_set_forks(const SitArchive *arc, off_t offset, SitFork *rsrc, SitFork *data);
+
+/*
+ * Unmap an archive and free its entries.
+ */
+void sit_close(SitArchive *arc);
+
+/*
+ * Find an entry by its path within the archive.
+ *
+ * Returns: its index, or -1 if there is none
+ */
+int sit_find(const SitArchive *arc, const char *path);
+
+/* A sink receives decoded fork data, returning 0 to carry on or -1 to stop. */
+typedef int (*sit_sink)(void *ctx, const unsigned char *buf, size_t len);
+
+/*
+ * Decode a fork, passing its data to the sink, and check its length and CRC.
+ *
+ * Returns: SIT_OK, or one of the errors above
+ */
+int sit_decode_fork(const SitArchive *arc, const SitFork *fork, sit_sink sink, void *ctx);
+
+/*
+ * Decode length bytes of a fork starting at the given offset, or the rest
+ * of the fork if length is -1, passing them to the sink. Decoding starts
+ * from the fork's last checkpoint at or before the offset. The CRC can't
+ * be checked, since the fork isn't decoded from the start.
+ *
+ * Returns: SIT_OK, or one of the errors above
+ */
+int sit_decode_range(const SitArchive *arc, const SitFork *fork, off_t start, off_t length,
+                     sit_sink sink, void *ctx);
+
+/*
+ * Describe a result of sit_decode_fork().
+ */
+const char *sit_strerror(int result);
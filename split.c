@@ -0,0 +1,303 @@
+/*
+ * split.c - splitting a set of inputs across several archives
+ *
+ * The inputs are first walked to build a tree of their planned sizes, the
+ * same way put_folder() walks them. The tree is then cut into "units":
+ * files and folders small enough to go into an archive whole. Folders that
+ * are too big are replaced by their contents, recursively. Units are packed
+ * into archives in order, and the folders enclosing a unit are repeated in
+ * every archive holding part of them, costing a startFolder and endFolder
+ * header each time.
+ */
+
+#include "split.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <dirent.h>
+#include <limits.h>
+#include <sys/stat.h>
+
+#define FOLDER_OVERHEAD 224     /* startFolder and endFolder headers */
+
+typedef struct PlanNode {
+    char *path;
+    off_t size;                 /* planned size of the whole subtree */
+    int isFolder;
+    int depth;
+    struct PlanNode *parent;
+    struct PlanNode **children;
+    int nchildren;
+} PlanNode;
+
+static SplitVolume *selected;
+static char **sortedUnits;
+static PlanNode **roots;        /* plan trees, freed by split_free_plan() */
+static int nroots;
+
+/* Build the plan tree for a file or folder. Returns NULL if it can't be archived. */
+static PlanNode *plan_node(const char *path, PlanNode *parent, split_size_fn size_fn) {
+    struct stat st;
+    PlanNode *node;
+
+    if (lstat(path, &st) != 0) {
+        perror(path);
+        return NULL;
+    }
+    node = calloc(1, sizeof(PlanNode));
+    node->path = strdup(path);
+    node->parent = parent;
+    node->depth = parent ? parent->depth + 1 : 0;
+    if (S_ISDIR(st.st_mode)) {
+        DIR *dir;
+        struct dirent *entry;
+        char child[PATH_MAX];
+        int cap = 0;
+
+        node->isFolder = 1;
+        node->size = FOLDER_OVERHEAD;
+        if ((dir = opendir(path)) == NULL) {
+            return node;
+        }
+        /* same order and exclusions as put_folder() */
+        while ((entry = readdir(dir)) != NULL) {
+            PlanNode *c;
+            if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0 ||
+                strcmp(entry->d_name, ".DS_Store") == 0) {
+                continue;
+            }
+            if (snprintf(child, sizeof(child), "%s/%s", path, entry->d_name) >= sizeof(child)) {
+                continue;
+            }
+            if ((c = plan_node(child, node, size_fn)) == NULL) {
+                continue;
+            }
+            if (node->nchildren == cap) {
+                cap = cap ? cap * 2 : 16;
+                node->children = realloc(node->children, cap * sizeof(PlanNode *));
+            }
+            node->children[node->nchildren++] = c;
+            node->size += c->size;
+        }
+        closedir(dir);
+    } else {
+        if ((node->size = size_fn(path)) < 0) {
+            free(node->path);
+            free(node);
+            return NULL;
+        }
+    }
+    return node;
+}
+
+/* Cut a subtree into units which fit within the budget, including the
+ * headers of the folders enclosing them.
+ */
+static void make_units(PlanNode *node, off_t budget, PlanNode ***units, int *nunits, int *cap) {
+    int i;
+
+    if (!node->isFolder || node->size + (off_t)node->depth * FOLDER_OVERHEAD <= budget ||
+        node->nchildren == 0) {
+        if (*nunits == *cap) {
+            *cap = *cap ? *cap * 2 : 64;
+            *units = realloc(*units, *cap * sizeof(PlanNode *));
+        }
+        (*units)[(*nunits)++] = node;
+        return;
+    }
+    for (i = 0; i < node->nchildren; i++) {
+        make_units(node->children[i], budget, units, nunits, cap);
+    }
+}
+
+/* ancestor of a node at the given depth */
+static PlanNode *ancestor(PlanNode *node, int depth) {
+    while (node && node->depth > depth) node = node->parent;
+    return node;
+}
+
+static void add_string(char ***list, int *n, const char *s) {
+    *list = realloc(*list, (*n + 1) * sizeof(char *));
+    (*list)[(*n)++] = strdup(s);
+}
+
+static int compare_strings(const void *a, const void *b) {
+    return strcmp(*(char * const *)a, *(char * const *)b);
+}
+
+/* Fill in a volume's path lists from its units, sorted for lookups. */
+static void finish_volume(SplitVolume *vol, PlanNode **units, int first, int last) {
+    PlanNode *prev = NULL;
+    int i, d;
+
+    vol->nodes = malloc((last - first) * sizeof(PlanNode *));
+    for (i = first; i < last; i++) {
+        PlanNode *u = units[i];
+        vol->nodes[vol->nunits] = u;
+        add_string(&vol->units, &vol->nunits, u->path);
+        for (d = 0; d < u->depth; d++) {
+            PlanNode *a = ancestor(u, d);
+            if (!prev || ancestor(prev, d) != a) {
+                add_string(&vol->partial, &vol->npartial, a->path);
+            }
+        }
+        prev = u;
+    }
+    if (vol->npartial) qsort(vol->partial, vol->npartial, sizeof(char *), compare_strings);
+}
+
+/* Pack units into volumes, in order. */
+static int pack_units(PlanNode **units, int nunits, off_t budget, SplitVolume **vols) {
+    SplitVolume *v = NULL;
+    PlanNode *prev = NULL;
+    int nvols = 0, first = 0, i, d;
+
+    for (i = 0; i < nunits; i++) {
+        PlanNode *u = units[i];
+        off_t cost = u->size;
+        int newItem = 1;
+
+        /* enclosing folders already open in this volume cost nothing more */
+        for (d = 0; d < u->depth; d++) {
+            if (prev && ancestor(prev, d) == ancestor(u, d)) {
+                if (d == 0) newItem = 0;
+            } else {
+                cost += FOLDER_OVERHEAD;
+            }
+        }
+        if (!v || (i > first && (v->size + cost > budget ||
+                                 v->items + newItem > SPLIT_MAX_ITEMS))) {
+            if (v) finish_volume(v, units, first, i);
+            *vols = realloc(*vols, (nvols + 1) * sizeof(SplitVolume));
+            v = &(*vols)[nvols++];
+            memset(v, 0, sizeof(*v));
+            first = i;
+            prev = NULL;
+            cost = u->size + (off_t)u->depth * FOLDER_OVERHEAD;
+            newItem = 1;
+        }
+        v->size += cost;
+        v->items += newItem;
+        prev = u;
+    }
+    if (v) finish_volume(v, units, first, nunits);
+    return nvols;
+}
+
+int split_plan(char **inputs, int ninputs, off_t budget, split_size_fn size_fn,
+               SplitVolume **vols) {
+    PlanNode **units = NULL;
+    int nunits = 0, cap = 0, i, n;
+
+    *vols = NULL;
+    for (i = 0; i < ninputs; i++) {
+        PlanNode *node = plan_node(inputs[i], NULL, size_fn);
+        if (node) {
+            roots = realloc(roots, (nroots + 1) * sizeof(PlanNode *));
+            roots[nroots++] = node;
+            make_units(node, budget, &units, &nunits, &cap);
+        }
+    }
+    n = pack_units(units, nunits, budget, vols);
+    free(units);
+    return n;
+}
+
+int split_replan(SplitVolume *vol, off_t budget, SplitVolume **vols) {
+    PlanNode **units = NULL;
+    int nunits = 0, cap = 0, i, n;
+
+    *vols = NULL;
+    for (i = 0; i < vol->nunits; i++) {
+        make_units(vol->nodes[i], budget, &units, &nunits, &cap);
+    }
+    n = pack_units(units, nunits, budget, vols);
+    free(units);
+    return n;
+}
+
+int split_can_divide(const SplitVolume *vol) {
+    return vol->nunits > 1 || (vol->nunits == 1 && vol->nodes[0]->nchildren > 0);
+}
+
+void split_select(SplitVolume *vol) {
+    selected = vol;
+    free(sortedUnits);
+    sortedUnits = NULL;
+    if (vol) {
+        /* units are listed in archive order; keep a sorted copy for lookups */
+        sortedUnits = malloc(vol->nunits * sizeof(char *));
+        memcpy(sortedUnits, vol->units, vol->nunits * sizeof(char *));
+        qsort(sortedUnits, vol->nunits, sizeof(char *), compare_strings);
+    }
+}
+
+static int in_list(char **list, int n, const char *path) {
+    return n && bsearch(&path, list, n, sizeof(char *), compare_strings) != NULL;
+}
+
+int split_includes(const char *path) {
+    if (!selected) return 1;
+    return in_list(sortedUnits, selected->nunits, path) ||
+           in_list(selected->partial, selected->npartial, path);
+}
+
+int split_is_partial(const char *path) {
+    if (!selected) return 0;
+    return in_list(selected->partial, selected->npartial, path);
+}
+
+static void free_strings(char **list, int n) {
+    int i;
+
+    for (i = 0; i < n; i++) free(list[i]);
+    free(list);
+}
+
+void split_free_volume(SplitVolume *vol) {
+    if (vol == selected) split_select(NULL);
+    free(vol->nodes);
+    free_strings(vol->units, vol->nunits);
+    free_strings(vol->partial, vol->npartial);
+    free(vol->archive);
+    memset(vol, 0, sizeof(*vol));
+}
+
+static void free_node(PlanNode *node) {
+    int i;
+
+    for (i = 0; i < node->nchildren; i++) free_node(node->children[i]);
+    free(node->children);
+    free(node->path);
+    free(node);
+}
+
+void split_free_plan(void) {
+    int i;
+
+    for (i = 0; i < nroots; i++) free_node(roots[i]);
+    free(roots);
+    roots = NULL;
+    nroots = 0;
+}
+
+int split_write_manifest(const char *manifest, SplitVolume *vols, int nvols) {
+    FILE *fs;
+    int i, j;
+
+    if ((fs = fopen(manifest, "w")) == NULL) {
+        perror(manifest);
+        return -1;
+    }
+    for (i = 0; i < nvols; i++) {
+        for (j = 0; j < vols[i].nunits; j++) {
+            PlanNode *u = vols[i].nodes[j];
+            fprintf(fs, "%s\t%s%s\n", vols[i].archive, u->path, u->isFolder ? "/" : "");
+        }
+    }
+    if (fclose(fs) != 0) {
+        perror(manifest);
+        return -1;
+    }
+    return 0;
+}
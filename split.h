@@ -0,0 +1,107 @@
+/*
+ * split.h - splitting a set of inputs across several archives
+ *
+ * A StuffIt 1.5 archive can hold at most 65535 top-level entries
+ * (sitHdr.numFiles is 16 bits), and can be at most 4 GB long (arcLen is
+ * 32 bits). When the inputs won't fit within those limits, or within a
+ * volume size given by the user, they are split into several archives.
+ * Inputs are split at top-level boundaries where possible, otherwise at
+ * folder boundaries: a folder too big for one archive appears in several,
+ * each holding some of its contents.
+ */
+
+#pragma once
+
+#include <sys/types.h>
+
+/* largest archive and number of top-level entries the format allows */
+#define SPLIT_MAX_ARCHIVE   0xFFFFFFFFLL
+#define SPLIT_MAX_ITEMS     65535
+
+/* Returns the bytes a file will occupy in an archive, including its header,
+ * assuming its forks don't compress. Returns -1 if the file can't be archived.
+ */
+typedef off_t (*split_size_fn)(const char *path);
+
+struct PlanNode;
+
+/* One planned archive */
+typedef struct {
+    struct PlanNode **nodes; /* planned entries, for re-planning */
+    char **units;       /* files and folders included whole, in archive order */
+    int nunits;
+    char **partial;     /* folders of which only some contents are included */
+    int npartial;
+    off_t size;         /* planned size, assuming nothing compresses */
+    long items;         /* top-level entries */
+    char *archive;      /* file name of the archive */
+} SplitVolume;
+
+/*
+ * Plan how to split the inputs into archives of at most budget bytes.
+ *
+ * Returns: the number of archives planned (1 if everything fits in one).
+ * *vols is set to a malloc'd array of volumes.
+ */
+int split_plan(char **inputs, int ninputs, off_t budget, split_size_fn size_fn,
+               SplitVolume **vols);
+
+/*
+ * Re-plan a single volume which turned out too big, using a smaller budget.
+ *
+ * Returns: the number of volumes replacing it
+ */
+int split_replan(SplitVolume *vol, off_t budget, SplitVolume **vols);
+
+/*
+ * Check whether a volume could be re-planned into smaller ones: it holds
+ * more than one unit, or a folder with contents.
+ *
+ * Returns: 1 if so, 0 if it is a single file or empty folder
+ */
+int split_can_divide(const SplitVolume *vol);
+
+/*
+ * Select the volume being built. Until another volume is selected,
+ * split_includes() and split_is_partial() answer for this volume.
+ * Selecting NULL includes everything.
+ */
+void split_select(SplitVolume *vol);
+
+/*
+ * Check whether a path belongs in the selected volume, either whole or
+ * as a partial folder.
+ *
+ * Returns: 1 if it does (or no volume is selected), 0 otherwise
+ */
+int split_includes(const char *path);
+
+/*
+ * Check whether a folder is only partially included in the selected
+ * volume, in which case each of its contents must be checked with
+ * split_includes().
+ *
+ * Returns: 1 if so, 0 otherwise
+ */
+int split_is_partial(const char *path);
+
+/*
+ * Free a volume's path lists and archive name. The volume can't be
+ * re-planned afterwards.
+ */
+void split_free_volume(SplitVolume *vol);
+
+/*
+ * Free the plan trees built by split_plan(), once no volume planned from
+ * them will be re-planned or written to a manifest.
+ */
+void split_free_plan(void);
+
+/*
+ * Write a manifest listing the contents of each archive: one line per
+ * whole file or folder, as "<archive> TAB <path>", with folders given
+ * a trailing '/'.
+ *
+ * Returns: 0 on success, -1 on error
+ */
+int split_write_manifest(const char *manifest, SplitVolume *vols, int nvols);
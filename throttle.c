@@ -0,0 +1,102 @@
+/*
+ * throttle.c - I/O bandwidth limits and priority
+ */
+
+#include "throttle.h"
+#include <stdio.h>
+#include <time.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+#ifdef __linux__
+#include <sys/syscall.h>
+#endif
+#ifdef __APPLE__
+#include <sys/resource.h>
+#endif
+
+#define BURST_SECONDS   0.1
+
+typedef struct {
+    double rate;        /* bytes per second, 0 if unlimited */
+    double tokens;      /* may go negative, to be paid back by sleeping */
+    double last;        /* time tokens were last added */
+} Bucket;
+
+static Bucket buckets[2];
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+void throttle_set_rate(int which, double rate) {
+    Bucket *b = &buckets[which];
+    b->rate = rate;
+    b->tokens = rate * BURST_SECONDS;
+    b->last = now();
+}
+
+void throttle_scale(double factor) {
+    int i;
+    for (i = 0; i < 2; i++) {
+        if (buckets[i].rate) throttle_set_rate(i, buckets[i].rate * factor);
+    }
+}
+
+static void spend(Bucket *b, size_t n) {
+    double t, wait = 0;
+
+    if (!b->rate) return;
+    /* threads share the bucket: each one sleeps off the debt up to its own spending */
+    pthread_mutex_lock(&lock);
+    t = now();
+    b->tokens += (t - b->last) * b->rate;
+    if (b->tokens > b->rate * BURST_SECONDS) {
+        b->tokens = b->rate * BURST_SECONDS;
+    }
+    b->last = t;
+    b->tokens -= n;
+    if (b->tokens < 0) {
+        wait = -b->tokens / b->rate;
+    }
+    pthread_mutex_unlock(&lock);
+    if (wait > 0) {
+        /* sleep until the debt is paid; the tokens accrue meanwhile */
+        struct timespec ts;
+        ts.tv_sec = (time_t)wait;
+        ts.tv_nsec = (long)((wait - ts.tv_sec) * 1e9);
+        while (nanosleep(&ts, &ts) < 0 && errno == EINTR)
+            ;
+    }
+}
+
+void throttle_read(size_t n) {
+    spend(&buckets[THROTTLE_READ], n);
+}
+
+void throttle_write(size_t n) {
+    spend(&buckets[THROTTLE_WRITE], n);
+}
+
+int throttle_lower_priority(void) {
+#if defined(__linux__) && defined(SYS_ioprio_set)
+    /* ioprio_set(IOPRIO_WHO_PROCESS, self, IOPRIO_PRIO_VALUE(IOPRIO_CLASS_IDLE, 0)) */
+    if (syscall(SYS_ioprio_set, 1, 0, 3 << 13) < 0) {
+        perror("ioprio_set");
+        return -1;
+    }
+    return 0;
+#elif defined(__APPLE__) && defined(IOPOL_TYPE_DISK)
+    if (setiopolicy_np(IOPOL_TYPE_DISK, IOPOL_SCOPE_PROCESS, IOPOL_THROTTLE) < 0) {
+        perror("setiopolicy_np");
+        return -1;
+    }
+    return 0;
+#else
+    fprintf(stderr, "Lowering I/O priority isn't supported on this system\n");
+    return -1;
+#endif
+}
@@ -0,0 +1,44 @@
+/*
+ * throttle.h - I/O bandwidth limits and priority
+ *
+ * Reads of the input files and writes to the archive can each be limited
+ * to a number of bytes per second, so that archiving on a shared host
+ * doesn't starve other processes of disk bandwidth. Each limit is a token
+ * bucket: tokens accrue at the given rate, up to a burst of a tenth of a
+ * second's worth, and each read or write spends them. When there aren't
+ * enough, the caller sleeps until there are. Time spent compressing earns
+ * tokens too, so reads and compression overlap within the limit rather
+ * than the limit being applied on top of the compression time.
+ */
+
+#pragma once
+
+#include <sys/types.h>
+
+#define THROTTLE_READ   0
+#define THROTTLE_WRITE  1
+
+/*
+ * Set the limit for reads or writes, in bytes per second. A rate of 0
+ * removes the limit.
+ */
+void throttle_set_rate(int which, double rate);
+
+/*
+ * Scale both limits by a factor, e.g. to share them between processes.
+ */
+void throttle_scale(double factor);
+
+/*
+ * Account for bytes read or written, sleeping if over the limit.
+ */
+void throttle_read(size_t n);
+void throttle_write(size_t n);
+
+/*
+ * Lower the process's I/O priority to the idle class (Linux) or the
+ * throttled policy (macOS), so that other processes' I/O goes first.
+ *
+ * Returns: 0 on success, -1 if not supported or on error
+ */
+int throttle_lower_priority(void);
@@ -0,0 +1,352 @@
+/*
+ * transcode.c - recompressing existing StuffIt archives
+ *
+ * Workers take the files in archive order and leave each new fork in an
+ * unlinked temporary file, while the main thread writes the new archive
+ * in order as they finish. Workers only run a few files ahead of the
+ * writer, so that a slow fork doesn't leave a pile of temporary files
+ * behind it. Folder headers are copied, with their compressed lengths
+ * updated once their contents have been written.
+ */
+
+#include "transcode.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include "sitread.h"
+#include "zopen.h"
+
+#define COPY_BUFSIZE    65536
+#define MAX_DEPTH       256
+
+extern unsigned short updcrc(unsigned short icrc, unsigned char *icp, int icnt);
+
+/* a fork of the new archive */
+typedef struct {
+    int fd;                     /* temporary file holding it, or -1 to copy the old one */
+    uint32_t compLength;
+    int method;
+} Result;
+
+typedef struct {
+    int entry;
+    Result rsrc, data;
+    int done;
+} Task;
+
+typedef struct {
+    const SitArchive *arc;
+    Task *tasks;
+    int ntasks;
+    int next;                   /* next task to start */
+    int written;                /* tasks written to the new archive */
+    int window;                 /* how far the workers may run ahead */
+    pthread_mutex_t lock;
+    pthread_cond_t ready;       /* a task is done */
+    pthread_cond_t room;        /* the writer has moved on */
+} Job;
+
+static void put4(u_char *p, uint32_t x) {
+    p[0] = x >> 24;
+    p[1] = x >> 16;
+    p[2] = x >> 8;
+    p[3] = x;
+}
+
+static void set_hdr_crc(fileHdr *h) {
+    uint16_t crc = updcrc(0, (unsigned char *)h, sizeof(fileHdr) - 2);
+    h->hdrCRC[0] = crc >> 8;
+    h->hdrCRC[1] = crc;
+}
+
+static int write_stream(void *ctx, const unsigned char *buf, size_t len) {
+    return fwrite(buf, 1, len, ctx) == len ? 0 : -1;
+}
+
+static int write_all(int fd, const void *buf, size_t len) {
+    const char *p = buf;
+    while (len > 0) {
+        ssize_t n = write(fd, p, len);
+        if (n <= 0) return -1;
+        p += n;
+        len -= n;
+    }
+    return 0;
+}
+
+/* Decode a fork into an unlinked temporary file, through the LZW encoder
+ * if lzw is set. Returns the file descriptor, or -1 with *result set.
+ */
+static int recode_fork(const SitArchive *arc, const SitFork *fork, int lzw, int *result,
+                       off_t *len) {
+    char name[] = "/tmp/sit+tc-XXXXXX";
+    FILE *fs = NULL, *zfs;
+    int fd, dfd;
+
+    *result = SIT_ABORTED;
+    if ((fd = mkstemp(name)) < 0) {
+        perror(name);
+        return -1;
+    }
+    unlink(name);
+    if ((dfd = dup(fd)) < 0 || (fs = fdopen(dfd, "w")) == NULL) {
+        if (dfd >= 0) close(dfd);
+        close(fd);
+        return -1;
+    }
+    if ((zfs = lzw ? zopen_stream(fs, "w", 14, 1) : fs) == NULL) {
+        fclose(fs);
+        close(fd);
+        return -1;
+    }
+    *result = sit_decode_fork(arc, fork, write_stream, zfs);
+    if (fclose(zfs) != 0 && *result == SIT_OK) {
+        *result = SIT_ABORTED;
+    }
+    if (*result != SIT_OK || (*len = lseek(fd, 0, SEEK_END)) < 0) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+/* encode one fork again, keeping the old one unless the new one is smaller */
+static void transcode_fork(const SitArchive *arc, const SitEntry *e, const SitFork *fork,
+                           Result *r, const char *which) {
+    off_t len;
+    int fd, result;
+
+    r->fd = -1;
+    r->compLength = fork->compLength;
+    r->method = fork->method;
+    if (fork->length == 0) {
+        return;
+    }
+    if ((fd = recode_fork(arc, fork, 1, &result, &len)) < 0) {
+        if (result != SIT_BADMETHOD) {
+            fprintf(stderr, "%s%s: %s, copied as is\n", e->path, which, sit_strerror(result));
+        }
+        return;
+    }
+    r->method = lzwComp;
+    if (len >= fork->length && fork->length < fork->compLength) {
+        /* it doesn't compress, but storing it beats the old encoding */
+        close(fd);
+        if ((fd = recode_fork(arc, fork, 0, &result, &len)) < 0) {
+            return;
+        }
+        r->method = noComp;
+    }
+    if (len < fork->compLength) {
+        r->fd = fd;
+        r->compLength = len;
+    } else {
+        r->method = fork->method;
+        close(fd);
+    }
+}
+
+static void *worker(void *arg) {
+    Job *job = arg;
+
+    for (;;) {
+        Task *t;
+        const SitEntry *e;
+
+        pthread_mutex_lock(&job->lock);
+        while (job->next < job->ntasks && job->next >= job->written + job->window) {
+            pthread_cond_wait(&job->room, &job->lock);
+        }
+        t = (job->next < job->ntasks) ? &job->tasks[job->next++] : NULL;
+        pthread_mutex_unlock(&job->lock);
+        if (!t) break;
+        e = &job->arc->entries[t->entry];
+        transcode_fork(job->arc, e, &e->rsrc, &t->rsrc, " (resource fork)");
+        transcode_fork(job->arc, e, &e->data, &t->data, "");
+        pthread_mutex_lock(&job->lock);
+        t->done = 1;
+        pthread_cond_broadcast(&job->ready);
+        pthread_mutex_unlock(&job->lock);
+    }
+    return NULL;
+}
+
+/* write a fork of the new archive, from its temporary file or the old archive */
+static int write_fork(int ofd, const SitArchive *arc, const SitFork *fork, Result *r) {
+    char buf[COPY_BUFSIZE];
+    off_t pos = 0;
+    ssize_t n;
+
+    if (r->fd < 0) {
+        return write_all(ofd, arc->map + fork->offset, fork->compLength);
+    }
+    while ((n = pread(r->fd, buf, sizeof(buf), pos)) > 0) {
+        if (write_all(ofd, buf, n) < 0) return -1;
+        pos += n;
+    }
+    return (n < 0 || pos != r->compLength) ? -1 : 0;
+}
+
+/* Write a folder's endFolder header, and update its startFolder header
+ * with the compressed length of its contents.
+ */
+static int close_folder(int ofd, const SitArchive *arc, const SitEntry *e, off_t start,
+                        off_t pos) {
+    fileHdr h;
+
+    memcpy(&h, arc->map + e->endOffset, sizeof(h));
+    put4(h.cDLen, pos - start);
+    set_hdr_crc(&h);
+    if (write_all(ofd, &h, sizeof(h)) < 0) return -1;
+    memcpy(&h, e->hdr, sizeof(h));
+    put4(h.cDLen, pos - start);
+    set_hdr_crc(&h);
+    return pwrite(ofd, &h, sizeof(h), start) == sizeof(h) ? 0 : -1;
+}
+
+int transcode_archive(const char *src, const char *dst, int jobs, int verbose) {
+    SitArchive arc;
+    Job job;
+    pthread_t *threads;
+    char tmp[PATH_MAX];
+    sitHdr sh;
+    int stack[MAX_DEPTH];
+    off_t starts[MAX_DEPTH];
+    off_t pos;
+    int i, k, depth = 0, nthreads, ofd, failed = 0;
+
+    if (sit_open(src, &arc) < 0) {
+        return 1;
+    }
+    if (snprintf(tmp, sizeof(tmp), "%s.XXXXXX", dst) >= sizeof(tmp) ||
+        (ofd = mkstemp(tmp)) < 0) {
+        perror(dst);
+        sit_close(&arc);
+        return 1;
+    }
+    fchmod(ofd, 0644);
+
+    memset(&job, 0, sizeof(job));
+    job.arc = &arc;
+    job.tasks = calloc(arc.nentries + 1, sizeof(Task));
+    for (i = 0; i < arc.nentries; i++) {
+        if (!arc.entries[i].isFolder) {
+            job.tasks[job.ntasks++].entry = i;
+        }
+    }
+    nthreads = jobs < job.ntasks ? jobs : job.ntasks;
+    if (nthreads < 1) nthreads = 1;
+    job.window = nthreads * 4;
+    pthread_mutex_init(&job.lock, NULL);
+    pthread_cond_init(&job.ready, NULL);
+    pthread_cond_init(&job.room, NULL);
+    threads = malloc(nthreads * sizeof(pthread_t));
+    for (k = 0; k < nthreads; k++) {
+        if (pthread_create(&threads[k], NULL, worker, &job) != 0) {
+            break;
+        }
+    }
+    nthreads = k;
+    if (nthreads == 0) {
+        job.window = job.ntasks;
+        worker(&job);           /* no threads, so do it all here */
+    }
+
+    /* write the new archive in order as the files are done */
+    memcpy(&sh, arc.map, sizeof(sh));
+    failed = write_all(ofd, &sh, sizeof(sh)) < 0;
+    pos = sizeof(sh);
+    for (i = 0, k = 0; i < arc.nentries; i++) {
+        const SitEntry *e = &arc.entries[i];
+        Task *t;
+        fileHdr h;
+
+        while (depth > e->depth) {
+            depth--;
+            if (!failed && close_folder(ofd, &arc, &arc.entries[stack[depth]], starts[depth],
+                                        pos) < 0) {
+                failed = 1;
+            }
+            pos += sizeof(fileHdr);
+        }
+        if (e->isFolder) {
+            stack[depth] = i;
+            starts[depth++] = pos;
+            if (!failed && write_all(ofd, e->hdr, sizeof(fileHdr)) < 0) {
+                failed = 1;
+            }
+            pos += sizeof(fileHdr);
+            continue;
+        }
+        t = &job.tasks[k];
+        pthread_mutex_lock(&job.lock);
+        while (!t->done) {
+            pthread_cond_wait(&job.ready, &job.lock);
+        }
+        pthread_mutex_unlock(&job.lock);
+
+        memcpy(&h, e->hdr, sizeof(h));
+        h.compRMethod = t->rsrc.method;
+        h.compDMethod = t->data.method;
+        put4(h.cRLen, t->rsrc.compLength);
+        put4(h.cDLen, t->data.compLength);
+        set_hdr_crc(&h);
+        if (!failed && (write_all(ofd, &h, sizeof(h)) < 0 ||
+                        write_fork(ofd, &arc, &e->rsrc, &t->rsrc) < 0 ||
+                        write_fork(ofd, &arc, &e->data, &t->data) < 0)) {
+            failed = 1;
+        }
+        pos += sizeof(h) + t->rsrc.compLength + t->data.compLength;
+        if (verbose > 1) {
+            fprintf(stdout, "%s: %lu -> %lu bytes\n", e->path,
+                    (unsigned long)e->rsrc.compLength + e->data.compLength,
+                    (unsigned long)t->rsrc.compLength + t->data.compLength);
+        }
+        if (t->rsrc.fd >= 0) close(t->rsrc.fd);
+        if (t->data.fd >= 0) close(t->data.fd);
+
+        pthread_mutex_lock(&job.lock);
+        job.written = ++k;
+        pthread_cond_broadcast(&job.room);
+        pthread_mutex_unlock(&job.lock);
+    }
+    while (depth > 0) {
+        depth--;
+        if (!failed && close_folder(ofd, &arc, &arc.entries[stack[depth]], starts[depth],
+                                    pos) < 0) {
+            failed = 1;
+        }
+        pos += sizeof(fileHdr);
+    }
+    while (nthreads-- > 0) {
+        pthread_join(threads[nthreads], NULL);
+    }
+
+    put4(sh.arcLen, pos);
+    if (!failed && (pwrite(ofd, &sh, sizeof(sh), 0) != sizeof(sh) || fsync(ofd) < 0)) {
+        failed = 1;
+    }
+    if (close(ofd) < 0 || failed) {
+        fprintf(stderr, "%s: error writing archive\n", dst);
+        unlink(tmp);
+        failed = 1;
+    } else if (rename(tmp, dst) < 0) {
+        perror(dst);
+        unlink(tmp);
+        failed = 1;
+    } else if (verbose) {
+        fprintf(stdout, "Transcoded \"%s\" to \"%s\" (%lld -> %lld bytes)\n", src, dst,
+                (long long)arc.arcLen, (long long)pos);
+    }
+    free(threads);
+    free(job.tasks);
+    pthread_cond_destroy(&job.room);
+    pthread_cond_destroy(&job.ready);
+    pthread_mutex_destroy(&job.lock);
+    sit_close(&arc);
+    return failed;
+}
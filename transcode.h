@@ -0,0 +1,19 @@
+/*
+ * transcode.h - recompressing existing StuffIt archives
+ *
+ * An archive is rewritten with the same folders and headers, each fork
+ * being decoded and encoded again with the current encoder by a pool of
+ * worker threads. A fork is copied byte for byte whenever encoding it
+ * again doesn't make it smaller, or it can't be decoded. Nothing is
+ * extracted: forks go straight from the old archive to the new one.
+ */
+
+#pragma once
+
+/*
+ * Transcode an archive into dst, which may be the same file: the new
+ * archive is written to a temporary file and renamed over dst when done.
+ *
+ * Returns: 0 on success, 1 on error
+ */
+int transcode_archive(const char *src, const char *dst, int jobs, int verbose);
@@ -0,0 +1,71 @@
+/*
+ * util.c - small helpers shared by the modules
+ */
+
+#if defined(__linux__) && !defined(_GNU_SOURCE)
+#define _GNU_SOURCE     /* for copy_file_range */
+#endif
+
+#include "util.h"
+#include <unistd.h>
+
+uint32_t get4(const void *v) {
+    const unsigned char *p = v;
+    return (uint32_t)p[0] << 24 | p[1] << 16 | p[2] << 8 | p[3];
+}
+
+uint16_t get2(const void *v) {
+    const unsigned char *p = v;
+    return p[0] << 8 | p[1];
+}
+
+size_t hash_bytes(const void *v, size_t len) {
+    const unsigned char *p = v;
+    size_t i, h = 2166136261u;
+
+    for (i = 0; i < len; i++) {
+        h = (h ^ p[i]) * 16777619u;
+    }
+    return h;
+}
+
+size_t hash_string(const char *s) {
+    size_t h = 2166136261u;
+
+    while (*s) {
+        h = (h ^ (unsigned char)*s++) * 16777619u;
+    }
+    return h;
+}
+
+int copy_range(int dst, int src, off_t offset, off_t length) {
+    char buf[65536];
+
+#if defined(__linux__)
+    while (length > 0) {
+        ssize_t n = copy_file_range(src, &offset, dst, NULL, length, 0);
+        if (n <= 0) break;
+        length -= n;
+    }
+#endif
+    while (length > 0) {
+        ssize_t n = pread(src, buf, length < (off_t)sizeof(buf) ? (size_t)length : sizeof(buf),
+                          offset);
+        if (n <= 0 || write(dst, buf, n) != n) return -1;
+        offset += n;
+        length -= n;
+    }
+    return 0;
+}
+
+int same_times(const struct stat *a, const struct stat *b) {
+    if (a->st_mtime != b->st_mtime || a->st_ctime != b->st_ctime) return 0;
+#if defined(__APPLE__)
+    return a->st_mtimespec.tv_nsec == b->st_mtimespec.tv_nsec &&
+           a->st_ctimespec.tv_nsec == b->st_ctimespec.tv_nsec;
+#elif defined(__linux__)
+    return a->st_mtim.tv_nsec == b->st_mtim.tv_nsec && a->st_ctim.tv_nsec == b->st_ctim.tv_nsec;
+#else
+    return 1;
+#endif
+}
@@ -0,0 +1,47 @@
+/*
+ * util.h - small helpers shared by the modules
+ *
+ * Reading the big-endian numbers in archive and disk image headers,
+ * hashing keys for the open-addressed tables, copying a stretch of one
+ * archive into another, and telling whether a file has changed.
+ */
+
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+/*
+ * Returns: the big-endian number at p
+ */
+uint32_t get4(const void *p);
+uint16_t get2(const void *p);
+
+/*
+ * Returns: the FNV-1a hash of len bytes at p
+ */
+size_t hash_bytes(const void *p, size_t len);
+
+/*
+ * Returns: the FNV-1a hash of a string
+ */
+size_t hash_string(const char *s);
+
+/*
+ * Append length bytes at offset in src to dst, at its current position,
+ * with copy_file_range() where there is one. src and dst may be the same
+ * file.
+ *
+ * Returns: 0, or -1 on error
+ */
+int copy_range(int dst, int src, off_t offset, off_t length);
+
+/*
+ * Check whether two stats of a file have the same modification and
+ * status change times, to the nanosecond where the system keeps them.
+ *
+ * Returns: 1 if they do, 0 otherwise
+ */
+int same_times(const struct stat *a, const struct stat *b);
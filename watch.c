@@ -0,0 +1,510 @@
+/*
+ * watch.c - keeping an archive up to date as the files in it change
+ *
+ * Each build records where every file's entry went in the archive, along
+ * with a signature of the file and its sidecars. While the next build
+ * runs, a file whose signature is unchanged, and which no event has
+ * named, has its entry copied from the previous archive as it stands.
+ * Folder entries are always written afresh, as they are cheap and their
+ * lengths change with their contents.
+ */
+
+#include "watch.h"
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <limits.h>
+#include <libgen.h>
+#include "sit.h"
+#include "throttle.h"
+#include "util.h"
+
+#if defined(__linux__)
+#include <sys/inotify.h>
+#include <dirent.h>
+#include <errno.h>
+#include <poll.h>
+#include <signal.h>
+#endif
+
+/* the file itself, then its .data, .rsrc and .info files and its ._ file */
+#define NSIDECARS 5
+
+typedef struct {
+    int exists;
+    dev_t dev;
+    ino_t ino;
+    off_t size;
+    time_t mtime, ctime;
+    long mtimeNs, ctimeNs;
+} FileSig;
+
+typedef struct {
+    FileSig f[NSIDECARS];
+} Sig;
+
+typedef struct {
+    char *path;
+    off_t offset, length;
+    Sig sig;
+} Entry;
+
+/* entries by path, in an open-addressed hash table */
+typedef struct {
+    Entry **slots;
+    size_t cap, count;
+} Table;
+
+static int active;                  /* a watch is running */
+static Table previous, current;     /* entries of the last archive, and of this one */
+static Table dirty, building;       /* paths changed since the last build, and before this one */
+static int lost, buildLost;         /* events were dropped, so nothing can be trusted */
+static int oldFd = -1;              /* the last archive, while building the next */
+static char *pendingName;           /* the file being archived, and its signature */
+static Sig pendingSig;
+static long copied, compressed;
+
+static Entry *table_find(const Table *t, const char *path) {
+    size_t i;
+
+    if (!t->cap) return NULL;
+    for (i = hash_string(path) & (t->cap-1); t->slots[i]; i = (i+1) & (t->cap-1)) {
+        if (strcmp(t->slots[i]->path, path) == 0) return t->slots[i];
+    }
+    return NULL;
+}
+
+/* Takes ownership of e, replacing any entry with the same path */
+static void table_add(Table *t, Entry *e) {
+    size_t i;
+
+    if (t->count * 2 >= t->cap) {
+        Entry **old = t->slots;
+        size_t oldCap = t->cap;
+        t->cap = t->cap ? t->cap * 2 : 1024;
+        t->slots = calloc(t->cap, sizeof(Entry *));
+        t->count = 0;
+        for (i = 0; i < oldCap; i++) {
+            if (old[i]) table_add(t, old[i]);
+        }
+        free(old);
+    }
+    for (i = hash_string(e->path) & (t->cap-1); t->slots[i]; i = (i+1) & (t->cap-1)) {
+        if (strcmp(t->slots[i]->path, e->path) == 0) {
+            free(t->slots[i]->path);
+            free(t->slots[i]);
+            t->slots[i] = e;
+            return;
+        }
+    }
+    t->slots[i] = e;
+    t->count++;
+}
+
+static void table_add_path(Table *t, const char *path) {
+    Entry *e = calloc(1, sizeof(Entry));
+    e->path = strdup(path);
+    table_add(t, e);
+}
+
+static void table_free(Table *t) {
+    size_t i;
+
+    for (i = 0; i < t->cap; i++) {
+        if (t->slots[i]) {
+            free(t->slots[i]->path);
+            free(t->slots[i]);
+        }
+    }
+    free(t->slots);
+    memset(t, 0, sizeof(*t));
+}
+
+/* The fields are set one by one over zeroes, so signatures can be compared with memcmp */
+static void sig_file(FileSig *f, const char *path) {
+    struct stat st;
+
+    if (stat(path, &st) != 0) return;
+    f->exists = 1;
+    f->dev = st.st_dev;
+    f->ino = st.st_ino;
+    f->size = st.st_size;
+    f->mtime = st.st_mtime;
+    f->ctime = st.st_ctime;
+#if defined(__linux__)
+    f->mtimeNs = st.st_mtim.tv_nsec;
+    f->ctimeNs = st.st_ctim.tv_nsec;
+#endif
+}
+
+static void make_sig(Sig *s, const char *name) {
+    static const char *suffixes[] = { ".data", ".rsrc", ".info" };
+    char path[PATH_MAX], dir[PATH_MAX], base[PATH_MAX];
+    int i;
+
+    memset(s, 0, sizeof(*s));
+    sig_file(&s->f[0], name);
+    for (i = 0; i < 3; i++) {
+        snprintf(path, sizeof(path), "%s%s", name, suffixes[i]);
+        sig_file(&s->f[i+1], path);
+    }
+    snprintf(dir, sizeof(dir), "%s", name);
+    snprintf(base, sizeof(base), "%s", name);
+    snprintf(path, sizeof(path), "%s/._%s", dirname(dir), basename(base));
+    sig_file(&s->f[4], path);
+}
+
+/*
+ * The key events are recorded under: the real path of the file's folder,
+ * then its name, so that a file named by a relative path or through a
+ * symbolic link to its folder still matches.
+ *
+ * Returns: 0, or -1 if the folder can't be found or the key is too long
+ */
+static int dirty_key(const char *name, char *key, size_t size) {
+    static char lastDir[PATH_MAX], lastReal[PATH_MAX];
+    char dir[PATH_MAX], base[PATH_MAX], tmp[PATH_MAX];
+
+    snprintf(tmp, sizeof(tmp), "%s", name);
+    snprintf(base, sizeof(base), "%s", name);
+    snprintf(dir, sizeof(dir), "%s", dirname(tmp));
+    if (strcmp(dir, lastDir) != 0) {
+        if (realpath(dir, lastReal) == NULL) {
+            lastDir[0] = '\0';
+            return -1;
+        }
+        snprintf(lastDir, sizeof(lastDir), "%s", dir);
+    }
+    if (snprintf(key, size, "%s/%s", lastReal, basename(base)) >= (int)size) {
+        errno = ENAMETOOLONG;       /* too long to match anything */
+        return -1;
+    }
+    return 0;
+}
+
+off_t watch_reuse(const char *name, int fd, off_t *uncompressed) {
+    char key[PATH_MAX];
+    fileHdr fh;
+    Entry *e, *copy;
+    off_t start;
+
+    if (!active) return 0;
+    make_sig(&pendingSig, name);
+    free(pendingName);
+    pendingName = strdup(name);
+    if (oldFd < 0 || buildLost || (e = table_find(&previous, name)) == NULL) return 0;
+    if (memcmp(&e->sig, &pendingSig, sizeof(Sig)) != 0) return 0;
+    if (dirty_key(name, key, sizeof(key)) != 0 || table_find(&building, key)) return 0;
+    if (pread(oldFd, &fh, sizeof(fh), e->offset) != (ssize_t)sizeof(fh)) return 0;
+
+    throttle_write(e->length);
+    start = lseek(fd, 0, SEEK_CUR);
+    if (copy_range(fd, oldFd, e->offset, e->length) != 0) {
+        /* leave the archive as it was, and compress the file instead */
+        if (ftruncate(fd, start) != 0 || lseek(fd, start, SEEK_SET) != start) {
+            perror("watch");
+        }
+        return 0;
+    }
+    *uncompressed += get4(fh.rLen) + get4(fh.dLen) + sizeof(fh);
+
+    copy = calloc(1, sizeof(Entry));
+    copy->path = strdup(name);
+    copy->offset = start;
+    copy->length = e->length;
+    copy->sig = e->sig;
+    table_add(&current, copy);
+    copied++;
+    return e->length;
+}
+
+void watch_record(const char *name, off_t offset, off_t length) {
+    Entry *e;
+
+    if (!active || length <= 0) return;
+    e = calloc(1, sizeof(Entry));
+    e->path = strdup(name);
+    e->offset = offset;
+    e->length = length;
+    if (pendingName && strcmp(pendingName, name) == 0) {
+        e->sig = pendingSig;
+    } else {
+        make_sig(&e->sig, name);
+    }
+    table_add(&current, e);
+    compressed++;
+}
+
+#if defined(__linux__)
+
+#define WATCH_MASK (IN_CREATE | IN_DELETE | IN_CLOSE_WRITE | IN_MODIFY | IN_MOVED_FROM | \
+                    IN_MOVED_TO | IN_ATTRIB | IN_DELETE_SELF)
+
+typedef struct {
+    char *path;     /* real path of the folder */
+    int whole;      /* everything in it is archived, not just some named files */
+} Watch;
+
+static int ifd = -1;
+static Watch *watches;
+static int nwatches;
+static Table inputs;                /* keys of files given by name */
+static char archiveKey[PATH_MAX];
+static volatile sig_atomic_t stopping;
+
+static void stop(int sig) {
+    (void)sig;
+    stopping = 1;
+}
+
+static void add_watch(const char *path, int whole) {
+    char real[PATH_MAX];
+    int wd;
+
+    if (realpath(path, real) == NULL || (wd = inotify_add_watch(ifd, real, WATCH_MASK)) < 0) {
+        perror(path);
+        return;
+    }
+    if (wd >= nwatches) {
+        watches = realloc(watches, (wd+1) * sizeof(Watch));
+        memset(watches + nwatches, 0, (wd+1-nwatches) * sizeof(Watch));
+        nwatches = wd+1;
+    }
+    if (!watches[wd].path) watches[wd].path = strdup(real);
+    watches[wd].whole |= whole;
+}
+
+/* Watch a folder and all the folders in it */
+static int add_tree(const char *path) {
+    char sub[PATH_MAX];
+    struct dirent *de;
+    struct stat st;
+    DIR *dir;
+    int n = 1;
+
+    add_watch(path, 1);
+    if ((dir = opendir(path)) == NULL) return n;
+    while ((de = readdir(dir)) != NULL) {
+        if (strcmp(de->d_name, ".") == 0 || strcmp(de->d_name, "..") == 0) continue;
+        snprintf(sub, sizeof(sub), "%s/%s", path, de->d_name);
+        if (lstat(sub, &st) == 0 && S_ISDIR(st.st_mode)) n += add_tree(sub);
+    }
+    closedir(dir);
+    return n;
+}
+
+/* Mark a file changed, along with the file a sidecar belongs to */
+static void mark_dirty(const char *dir, const char *name) {
+    static const char *suffixes[] = { ".data", ".rsrc", ".info" };
+    char key[PATH_MAX];
+    size_t len = strlen(name);
+    int i;
+
+    snprintf(key, sizeof(key), "%s/%s", dir, name);
+    table_add_path(&dirty, key);
+    if (strncmp(name, "._", 2) == 0 && name[2]) {
+        snprintf(key, sizeof(key), "%s/%s", dir, name+2);
+        table_add_path(&dirty, key);
+    }
+    for (i = 0; i < 3; i++) {
+        if (len > 5 && strcmp(name+len-5, suffixes[i]) == 0) {
+            snprintf(key, sizeof(key), "%s/%.*s", dir, (int)(len-5), name);
+            table_add_path(&dirty, key);
+        }
+    }
+}
+
+/* The archive, and the temporary files it is built in, aren't inputs */
+static int is_archive(const char *path) {
+    size_t len = strlen(archiveKey);
+    return strncmp(path, archiveKey, len) == 0 && (path[len] == '\0' || path[len] == '.');
+}
+
+/* Returns: the number of events which might change the archive */
+static int read_events(void) {
+    char buf[65536] __attribute__((aligned(__alignof__(struct inotify_event))));
+    char path[PATH_MAX];
+    ssize_t n;
+    char *p;
+    int changes = 0;
+
+    if ((n = read(ifd, buf, sizeof(buf))) <= 0) return 0;
+    for (p = buf; p < buf + n; p += sizeof(struct inotify_event) + ((struct inotify_event *)p)->len) {
+        struct inotify_event *ev = (struct inotify_event *)p;
+        Watch *w = ev->wd >= 0 && ev->wd < nwatches ? &watches[ev->wd] : NULL;
+
+        if (ev->mask & IN_Q_OVERFLOW) {
+            lost = 1;
+            changes++;
+            continue;
+        }
+        if (!w || !w->path) continue;
+        if (ev->mask & IN_IGNORED) {
+            free(w->path);
+            w->path = NULL;
+            w->whole = 0;
+            continue;
+        }
+        if (ev->mask & IN_DELETE_SELF) {
+            changes++;
+            continue;
+        }
+        if (!ev->len) continue;
+        snprintf(path, sizeof(path), "%s/%s", w->path, ev->name);
+        if (is_archive(path)) continue;
+        if (!w->whole) {
+            /* a folder holding files named on the command line; ignore the rest */
+            char base[PATH_MAX];
+            size_t len = strlen(path);
+            snprintf(base, sizeof(base), "%s", path);
+            if (strncmp(ev->name, "._", 2) == 0) {
+                snprintf(base, sizeof(base), "%s/%s", w->path, ev->name+2);
+            } else if (len > 5 && (strcmp(path+len-5, ".rsrc") == 0 ||
+                                   strcmp(path+len-5, ".info") == 0 ||
+                                   strcmp(path+len-5, ".data") == 0)) {
+                base[len-5] = '\0';
+            }
+            if (!table_find(&inputs, path) && !table_find(&inputs, base)) continue;
+        }
+        mark_dirty(w->path, ev->name);
+        changes++;
+        if (w->whole && (ev->mask & IN_ISDIR) && (ev->mask & (IN_CREATE | IN_MOVED_TO))) {
+            add_tree(path);
+        }
+    }
+    return changes;
+}
+
+/* Returns: the build's status */
+static int rebuild(const char *archive, char **names, int nnames, watch_build_fn build,
+                   int verbose) {
+    size_t i;
+    int status;
+
+    /* events from now on belong to the next build */
+    table_free(&building);
+    building = dirty;
+    memset(&dirty, 0, sizeof(dirty));
+    buildLost = lost;
+    lost = 0;
+
+    oldFd = open(archive, O_RDONLY);
+    copied = compressed = 0;
+    status = build(names, nnames);
+    if (oldFd >= 0) close(oldFd);
+    oldFd = -1;
+
+    if (status == 0) {
+        table_free(&previous);
+        previous = current;
+        if (verbose) {
+            printf("Updated \"%s\": %ld files copied, %ld compressed\n", archive, copied,
+                   compressed);
+            fflush(stdout);
+        }
+    } else {
+        /* try those files again next time */
+        table_free(&current);
+        for (i = 0; i < building.cap; i++) {
+            if (building.slots[i]) table_add_path(&dirty, building.slots[i]->path);
+        }
+        lost |= buildLost;
+    }
+    memset(&current, 0, sizeof(current));
+    table_free(&building);
+    return status;
+}
+
+int watch_archive(const char *archive, char **names, int nnames, double delay,
+                  watch_build_fn build, int verbose) {
+    struct sigaction sa;
+    struct pollfd pfd;
+    struct stat st;
+    char key[PATH_MAX];
+    int i, folders = 0, status;
+
+    if ((ifd = inotify_init1(IN_CLOEXEC)) < 0) {
+        perror("inotify");
+        return 1;
+    }
+    if (dirty_key(archive, archiveKey, sizeof(archiveKey)) != 0) {
+        perror(archive);
+        return 1;
+    }
+    for (i = 0; i < nnames; i++) {
+        if (stat(names[i], &st) != 0) {
+            perror(names[i]);
+            return 1;
+        }
+        if (S_ISDIR(st.st_mode)) {
+            folders += add_tree(names[i]);
+        } else if (dirty_key(names[i], key, sizeof(key)) == 0) {
+            char dir[PATH_MAX];
+            snprintf(dir, sizeof(dir), "%s", names[i]);
+            table_add_path(&inputs, key);
+            add_watch(dirname(dir), 0);
+            folders++;
+        }
+    }
+
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = stop;
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+
+    active = 1;
+    if ((status = rebuild(archive, names, nnames, build, verbose)) != 0) return status;
+    if (verbose) {
+        printf("Watching %d folder%s for changes\n", folders, folders == 1 ? "" : "s");
+        fflush(stdout);
+    }
+
+    pfd.fd = ifd;
+    pfd.events = POLLIN;
+    while (!stopping) {
+        int r;
+
+        /* wait for something to change */
+        if (poll(&pfd, 1, -1) < 0) {
+            if (errno == EINTR) continue;
+            perror("poll");
+            break;
+        }
+        if (!read_events()) continue;
+
+        /* then for things to settle down */
+        while (!stopping && (r = poll(&pfd, 1, (int)(delay * 1000))) != 0) {
+            if (r < 0 && errno != EINTR) break;
+            if (r > 0) read_events();
+        }
+        if (stopping) break;
+        rebuild(archive, names, nnames, build, verbose);
+    }
+
+    close(ifd);
+    table_free(&previous);
+    table_free(&dirty);
+    table_free(&inputs);
+    for (i = 0; i < nwatches; i++) free(watches[i].path);
+    free(watches);
+    free(pendingName);
+    active = 0;
+    return 0;
+}
+
+#else
+
+int watch_archive(const char *archive, char **names, int nnames, double delay,
+                  watch_build_fn build, int verbose) {
+    (void)archive; (void)names; (void)nnames; (void)delay; (void)build; (void)verbose;
+    fprintf(stderr, "--watch needs inotify, which this system doesn't have\n");
+    return 1;
+}
+
+#endif
@@ -0,0 +1,44 @@
+/*
+ * watch.h - keeping an archive up to date as the files in it change
+ *
+ * With --watch, the archive is built once, then the folders it was built
+ * from are watched with inotify. Changes are collected until things have
+ * been quiet for a while, and then the archive is built again. Files
+ * which haven't changed since the previous build, judged by the events
+ * seen and by stat() of the file and its sidecars (.rsrc, .info, .data
+ * and AppleDouble ._ files), have their entries copied from the previous
+ * archive rather than being compressed again. Each build is written to a
+ * temporary file and renamed over the archive, so anyone reading it sees
+ * either the old archive or the new one.
+ */
+
+#pragma once
+
+#include <sys/types.h>
+
+/* Builds the archive; called for the first build and for each rebuild */
+typedef int (*watch_build_fn)(char **inputs, int ninputs);
+
+/*
+ * Build the archive, then rebuild it each time the inputs change, once
+ * they have been left alone for delay seconds. Runs until interrupted.
+ *
+ * Returns: the exit status
+ */
+int watch_archive(const char *archive, char **inputs, int ninputs, double delay,
+                  watch_build_fn build, int verbose);
+
+/*
+ * If the previous build archived this file and neither it nor its sidecar
+ * files have changed since, copy its entry from the previous archive to
+ * fd, adding its uncompressed length to *uncompressed.
+ *
+ * Returns: the length copied, or 0 if the file must be archived afresh
+ */
+off_t watch_reuse(const char *name, int fd, off_t *uncompressed);
+
+/*
+ * Note that the entry for a file was written at offset in the archive
+ * being built, taking length bytes.
+ */
+void watch_record(const char *name, off_t offset, off_t length);
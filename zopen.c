@@ -33,6 +33,10 @@
  * SUCH DAMAGE.
  */
 
+#if defined(__linux__) && !defined(_GNU_SOURCE)
+#define _GNU_SOURCE		/* for fopencookie() */
+#endif
+
 #if defined(LIBC_SCCS) && !defined(lint)
 static char sccsid[] = "@(#)zopen.c	8.1 (Berkeley) 6/27/93";
 #endif /* LIBC_SCCS and not lint */
@@ -74,7 +78,9 @@ __FBSDID("$FreeBSD$");
 #ifndef EFTYPE
 #define EFTYPE EINVAL
 #endif
+#include <pthread.h>
 #include <signal.h>
+#include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -122,6 +128,9 @@ static char_type magic_header[] =
 struct s_zstate {
 	FILE *zs_fp;			/* File stream for I/O */
 	char zs_mode;			/* r or w */
+	int zs_raw;			/* no 3-byte header */
+	zclear_hook zs_hook;		/* called when the table is cleared */
+	void *zs_hookctx;
 	enum {
 		S_START, S_MIDDLE, S_EOF
 	} zs_state;			/* State of computation */
@@ -222,6 +231,48 @@ struct s_zstate {
 #define	FIRST	257		/* First free entry. */
 #define	CLEAR	256		/* Table clear output code. */
 
+/*
+ * States of closed streams are kept for the next ones, up to ZPOOL_MAX,
+ * so a long-running process doesn't allocate and clear the code tables
+ * for every fork.  Both directions set up the tables they read before
+ * reading them, so only the fields around the tables are cleared.
+ */
+#define	ZPOOL_MAX	8
+
+static struct s_zstate *zpool[ZPOOL_MAX];
+static int nzpool;
+static pthread_mutex_t zpoolLock = PTHREAD_MUTEX_INITIALIZER;
+
+static struct s_zstate *
+zstate_alloc(void)
+{
+	struct s_zstate *zs;
+
+	zs = NULL;
+	pthread_mutex_lock(&zpoolLock);
+	if (nzpool > 0)
+		zs = zpool[--nzpool];
+	pthread_mutex_unlock(&zpoolLock);
+	if (zs == NULL)
+		return (calloc(1, sizeof(struct s_zstate)));
+	memset(zs, 0, offsetof(struct s_zstate, zs_htab));
+	memset(&zs->zs_hsize, 0,
+	    sizeof(struct s_zstate) - offsetof(struct s_zstate, zs_hsize));
+	return (zs);
+}
+
+static void
+zstate_free(struct s_zstate *zs)
+{
+	pthread_mutex_lock(&zpoolLock);
+	if (nzpool < ZPOOL_MAX) {
+		zpool[nzpool++] = zs;
+		zs = NULL;
+	}
+	pthread_mutex_unlock(&zpoolLock);
+	free(zs);
+}
+
 static int	cl_block(struct s_zstate *);
 static void	cl_hash(struct s_zstate *, count_int);
 static code_int	getcode(struct s_zstate *);
@@ -238,6 +289,7 @@ static int	zclose(void *);
 static int	zread(void *, char *, int);
 static int	zwrite(void *, const char *, int);
 #endif
+static FILE	*zopen_state(FILE *, const char *, int, int, zclear_hook, void *);
 
 /*-
  * Algorithm from "A Technique for High Performance Data Compression",
@@ -291,12 +343,14 @@ zwrite(void *cookie, const char *wbp, int num)
 	state = S_MIDDLE;
 
 	maxmaxcode = 1L << maxbits;
-	if (fwrite(magic_header,
-	    sizeof(char), sizeof(magic_header), fp) != sizeof(magic_header))
-		return (-1);
-	tmp = (u_char)((maxbits) | block_compress);
-	if (fwrite(&tmp, sizeof(char), sizeof(tmp), fp) != sizeof(tmp))
-		return (-1);
+	if (!zs->zs_raw) {
+		if (fwrite(magic_header, sizeof(char),
+		    sizeof(magic_header), fp) != sizeof(magic_header))
+			return (-1);
+		tmp = (u_char)((maxbits) | block_compress);
+		if (fwrite(&tmp, sizeof(char), sizeof(tmp), fp) != sizeof(tmp))
+			return (-1);
+	}
 
 	offset = 0;
 	bytes_out = 3;		/* Includes 3-byte header mojo. */
@@ -368,18 +422,18 @@ zclose(void *cookie)
 	if (zmode == 'w') {		/* Put out the final code. */
 		if (output(zs, (code_int) ent) == -1) {
 			(void)fclose(fp);
-			free(zs);
+			zstate_free(zs);
 			return (-1);
 		}
 		out_count++;
 		if (output(zs, (code_int) - 1) == -1) {
 			(void)fclose(fp);
-			free(zs);
+			zstate_free(zs);
 			return (-1);
 		}
 	}
 	rval = fclose(fp) == EOF ? -1 : 0;
-	free(zs);
+	zstate_free(zs);
 	return (rval);
 }
 
@@ -464,6 +518,13 @@ output(struct s_zstate *zs, code_int ocode)
 			if (clear_flg) {
 				maxcode = MAXCODE(n_bits = INIT_BITS);
 				clear_flg = 0;
+				/*
+				 * Decoding can start afresh here, with the
+				 * character which is pending in ent.
+				 */
+				if (zs->zs_hook)
+					zs->zs_hook(zs->zs_hookctx,
+					    bytes_out - 3, in_count - 1);
 			} else {
 				n_bits++;
 				if (n_bits == maxbits)
@@ -520,7 +581,10 @@ zread(void *cookie, char *rbp, int num)
 	}
 
 	/* Check the magic number */
-	if (fread(header,
+	if (zs->zs_raw) {
+		/* StuffIt strips the header; maxbits was given to zopen_stream() */
+		header[2] = maxbits | BLOCK_MASK;
+	} else if (fread(header,
 	    sizeof(char), sizeof(header), fp) != sizeof(header) ||
 	    memcmp(header, magic_header, sizeof(magic_header)) != 0) {
 		errno = EFTYPE;
@@ -547,6 +611,10 @@ zread(void *cookie, char *rbp, int num)
 		return (0);	/* Get out of here */
 
 	/* First code must be 8 bits = char. */
+	if (oldcode > 255) {
+		errno = EINVAL;
+		return (-1);
+	}
 	*bp++ = (u_char)finchar;
 	count--;
 	stackp = de_stack;
@@ -735,6 +803,263 @@ cl_hash(struct s_zstate *zs, count_int cl_hsize)	/* Reset code table. */
 
 FILE *
 zopen(const char *fname, const char *mode, int bits)
+{
+	FILE *stream, *zfp;
+
+	if ((mode[0] != 'r' && mode[0] != 'w') || mode[1] != '\0' ||
+	    bits < 0 || bits > BITS) {
+		errno = EINVAL;
+		return (NULL);
+	}
+	if ((stream = fopen(fname, mode)) == NULL)
+		return (NULL);
+	if ((zfp = zopen_stream(stream, mode, bits, 0)) == NULL)
+		(void)fclose(stream);
+	return (zfp);
+}
+
+/*
+ * zopen_hook(fname, bits, hook, ctx)
+ *	As zopen(fname, "w", bits), but calls hook(ctx, compressed,
+ *	uncompressed) each time the code table is cleared, with the
+ *	offsets at which decoding can start afresh.  The compressed
+ *	offset doesn't count the 3-byte header.
+ */
+FILE *
+zopen_hook(const char *fname, int bits, zclear_hook hook, void *ctx)
+{
+	FILE *stream, *zfp;
+
+	if ((stream = fopen(fname, "w")) == NULL)
+		return (NULL);
+	if ((zfp = zopen_state(stream, "w", bits, 0, hook, ctx)) == NULL)
+		(void)fclose(stream);
+	return (zfp);
+}
+
+/*
+ * zopen_stream(stream, mode, bits, raw)
+ *	As zopen(), but on a stream which is already open, and which is
+ *	closed along with the returned one.  If raw is set, the stream
+ *	has no 3-byte header, as in a StuffIt archive, and is read as
+ *	block compressed with the given number of bits.
+ */
+FILE *
+zopen_stream(FILE *stream, const char *mode, int bits, int raw)
+{
+	return (zopen_state(stream, mode, bits, raw, NULL, NULL));
+}
+
+/*
+ * zopen_stream_hook(stream, bits, hook, ctx)
+ *	As zopen_stream(stream, "w", bits, 1), but calls hook as
+ *	zopen_hook() does.  With no header, the compressed offsets
+ *	are from the start of the stream.
+ */
+FILE *
+zopen_stream_hook(FILE *stream, int bits, zclear_hook hook, void *ctx)
+{
+	return (zopen_state(stream, "w", bits, 1, hook, ctx));
+}
+
+#if defined(__GNUC__) || defined(__clang__)
+#define	prefetch(p)	__builtin_prefetch(p)
+#else
+#define	prefetch(p)	((void)(p))
+#endif
+
+/*
+ * zcompress_lockstep(in, len, out, n, bits)
+ *	Compresses n buffers, in[k] holding len[k] bytes, each just as
+ *	zopen_stream(out[k], "w", bits, 1) would, and closes each out[k].
+ *	Rather than one after another, the streams take a character each
+ *	in turn.  Once a stream's character has been looked up, the hash
+ *	table slot for its next one is prefetched, and isn't probed until
+ *	the other streams have had their turns, so that the cache misses
+ *	of one stream are overlapped with the work on the others.  This
+ *	pays only where the code tables of all n streams don't stay in
+ *	cache.  The tables are kept between calls.  Returns 0, or -1 if
+ *	any stream couldn't be written.
+ */
+int
+zcompress_lockstep(const u_char **in, const size_t *len, FILE **out,
+    int n, int bits)
+{
+	static struct s_zstate *pool;	/* code tables, kept for reuse */
+	static int npool;
+	struct lane {
+		/* copies of the stream's state, for the inner loop */
+		count_int *htab_p;
+		u_short *codetab_p;
+		long fcode_l;
+		code_int ent_l;
+		long in_count_l;
+		int hshift_l, maxbits_l;
+		const u_char *bp;	/* the character after c */
+		const u_char *end;
+		int c;			/* to be looked up, or -1 at the end */
+		code_int i;		/* the slot to probe first for it */
+		int failed;
+		struct s_zstate *zs;
+	} *lanes, *l;
+	struct s_zstate *zs;
+	code_int i;
+	int c, disp, k, active, rval;
+
+	lanes = NULL;
+	if (n > npool) {
+		free(pool);
+		npool = 0;
+		if ((pool = malloc(n * sizeof(*pool))) != NULL)
+			npool = n;
+	}
+	if (npool < n || (lanes = malloc(n * sizeof(*lanes))) == NULL) {
+		for (k = 0; k < n; k++)
+			(void)fclose(out[k]);
+		return (-1);
+	}
+
+	/* Start each stream as zopen_stream() and the first zwrite() do. */
+	rval = 0;
+	for (k = 0, active = 0; k < n; k++) {
+		if (len[k] == 0) {	/* nothing is written */
+			if (fclose(out[k]) == EOF)
+				rval = -1;
+			continue;
+		}
+		zs = &pool[k];
+		fp = out[k];
+		zmode = 'w';
+		zs->zs_raw = 1;
+		zs->zs_hook = NULL;
+		state = S_MIDDLE;
+		maxbits = bits ? bits : BITS;
+		maxmaxcode = 1L << maxbits;
+		hsize = HSIZE;
+		block_compress = BLOCK_MASK;
+		memset(buf, 0, sizeof(buf));
+		offset = 0;
+		bytes_out = 3;
+		out_count = 0;
+		clear_flg = 0;
+		ratio = 0;
+		in_count = 1;
+		checkpoint = CHECK_GAP;
+		maxcode = MAXCODE(n_bits = INIT_BITS);
+		free_ent = FIRST;
+		ent = in[k][0];
+		hshift = 0;
+		for (fcode = (long)hsize; fcode < 65536L; fcode *= 2L)
+			hshift++;
+		hshift = 8 - hshift;
+		hsize_reg = hsize;
+		cl_hash(zs, (count_int)hsize_reg);
+
+		l = &lanes[active++];
+		l->zs = zs;
+		l->htab_p = htab;
+		l->codetab_p = codetab;
+		l->ent_l = ent;
+		l->in_count_l = in_count;
+		l->hshift_l = hshift;
+		l->maxbits_l = maxbits;
+		l->bp = in[k] + 1;
+		l->end = in[k] + len[k];
+		l->c = -1;
+		l->failed = 0;
+	}
+
+	/* Hash each stream's next character, and fetch its slot. */
+	for (l = lanes; l < lanes + active; l++) {
+		if (l->bp == l->end)
+			continue;
+		l->c = c = *l->bp++;
+		l->in_count_l++;
+		l->fcode_l = (long)(((long)c << l->maxbits_l) + l->ent_l);
+		l->i = i = ((c << l->hshift_l) ^ l->ent_l);
+		prefetch(&l->htab_p[i]);
+	}
+	/*
+	 * Probe for each in turn, as zwrite() does, then hash its next
+	 * character and fetch that slot, to be probed when its turn
+	 * comes round again.
+	 */
+	while (active > 0) {
+		for (l = lanes; l < lanes + active; l++) {
+			count_int *ht = l->htab_p;
+			long fc = l->fcode_l;
+			code_int e;
+
+			if (l->c < 0) {
+				/* Finished: put out the final code, as zclose(). */
+				zs = l->zs;
+				ent = l->ent_l;
+				in_count = l->in_count_l;
+				if (!l->failed && (output(zs, (code_int) ent) == -1 ||
+				    (out_count++, output(zs, (code_int) - 1)) == -1))
+					rval = -1;
+				if (fclose(fp) == EOF)
+					rval = -1;
+				*l-- = lanes[--active];
+				continue;
+			}
+			c = l->c;
+			i = l->i;
+
+			if (ht[i] == fc) {
+				e = l->codetab_p[i];
+				goto next;
+			} else if ((long)ht[i] < 0)	/* Empty slot. */
+				goto nomatch;
+			disp = HSIZE - i;	/* hsize is always HSIZE */
+			if (i == 0)
+				disp = 1;
+probe:			if ((i -= disp) < 0)
+				i += HSIZE;
+
+			if (ht[i] == fc) {
+				e = l->codetab_p[i];
+				goto next;
+			}
+			if ((long)ht[i] >= 0)
+				goto probe;
+nomatch:		zs = l->zs;
+			in_count = l->in_count_l;
+			if (output(zs, (code_int) l->ent_l) == -1)
+				goto failed;
+			out_count++;
+			e = c;
+			if (free_ent < maxmaxcode) {
+				l->codetab_p[i] = free_ent++;	/* code -> hashtable */
+				ht[i] = fc;
+			} else if ((count_int)in_count >=
+			    checkpoint && block_compress) {
+				if (cl_block(zs) == -1)
+					goto failed;
+			}
+next:			l->ent_l = e;
+			if (l->bp == l->end) {
+				l->c = -1;
+				continue;
+			}
+			l->c = c = *l->bp++;
+			l->in_count_l++;
+			l->fcode_l = (long)(((long)c << l->maxbits_l) + e);
+			l->i = i = ((c << l->hshift_l) ^ e);
+			prefetch(&ht[i]);
+			continue;
+failed:			rval = -1;
+			l->failed = 1;
+			l->c = -1;
+		}
+	}
+	free(lanes);
+	return (rval);
+}
+
+static FILE *
+zopen_state(FILE *stream, const char *mode, int bits, int raw,
+    zclear_hook hook, void *ctx)
 {
 	struct s_zstate *zs;
 #ifdef USE_FOPENCOOKIE
@@ -742,13 +1067,16 @@ zopen(const char *fname, const char *mode, int bits)
 #endif
 
 	if ((mode[0] != 'r' && mode[0] != 'w') || mode[1] != '\0' ||
-	    bits < 0 || bits > BITS) {
+	    bits < 0 || bits > BITS || (raw && bits < 12 && *mode == 'r')) {
 		errno = EINVAL;
 		return (NULL);
 	}
 
-	if ((zs = calloc(1, sizeof(struct s_zstate))) == NULL)
+	if ((zs = zstate_alloc()) == NULL)
 		return (NULL);
+	zs->zs_raw = raw;
+	zs->zs_hook = hook;
+	zs->zs_hookctx = ctx;
 
 	maxbits = bits ? bits : BITS;	/* User settable max # bits/code. */
 	maxmaxcode = 1L << maxbits;	/* Should NEVER generate this code. */
@@ -768,10 +1096,7 @@ zopen(const char *fname, const char *mode, int bits)
 	 * Layering compress on top of stdio in order to provide buffering,
 	 * and ensure that reads and write work with the data specified.
 	 */
-	if ((fp = fopen(fname, mode)) == NULL) {
-		free(zs);
-		return (NULL);
-	}
+	fp = stream;
 #ifdef USE_FOPENCOOKIE
 	memset(&io_funcs, 0, sizeof(io_funcs));
 	io_funcs.close = zclose;
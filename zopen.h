@@ -31,6 +31,13 @@
 #ifndef _ZOPEN_H_
 #define _ZOPEN_H_
 
+typedef void (*zclear_hook)(void *ctx, long compressed, long uncompressed);
+
 FILE  *zopen(const char *fname, const char *mode, int bits);
+FILE  *zopen_hook(const char *fname, int bits, zclear_hook hook, void *ctx);
+FILE  *zopen_stream(FILE *stream, const char *mode, int bits, int raw);
+FILE  *zopen_stream_hook(FILE *stream, int bits, zclear_hook hook, void *ctx);
+int    zcompress_lockstep(const unsigned char **in, const size_t *len, FILE **out,
+	    int n, int bits);
 
 #endif /* _ZOPEN_H_ */